@@ -0,0 +1,421 @@
+/*
+ *      avi.c  --  streaming AVI/OpenDML muxer for MJPEG recordings
+ *
+ *      Layout written:
+ *
+ *      RIFF AVI  { LIST hdrl { avih, LIST strl { strh, strf, indx }, LIST odml { dmlh } }
+ *                  LIST movi { 00dc ... ix00 } idx1 }
+ *      RIFF AVIX { LIST movi { 00dc ... ix00 } }
+ *      ...
+ *
+ *      All integers are little endian, targets are little endian as well.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "avi.h"
+#include "record.h"
+
+#define FCC(a, b, c, d)		((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define AVIF_HASINDEX		0x00000010
+#define AVIF_TRUSTCKTYPE	0x00000800
+#define AVIIF_KEYFRAME		0x00000010
+#define AVI_INDEX_OF_INDEXES	0x00
+#define AVI_INDEX_OF_CHUNKS	0x01
+
+#define AVI_SUPERINDEX_SIZE	(24 + 16 * AVI_MAX_SEGMENTS)
+#define AVI_DMLH_SIZE		248
+
+struct avi_segment {
+	uint64_t riff_offset;
+	uint64_t movi_offset;			/* of LIST movi header */
+	uint64_t movi_end;
+	uint64_t end;
+	uint64_t ix_offset;
+	uint32_t ix_size;
+	uint32_t frames;
+};
+
+struct avi_index_entry {
+	uint32_t offset;			/* chunk data, relative to segment RIFF */
+	uint32_t size;
+};
+
+struct avi_writer {
+	struct record_writer *rec;
+
+	uint32_t width, height;
+	int fps;
+	uint32_t max_frame;
+	uint64_t total_frames;
+	uint64_t first_ts, last_ts;
+
+	struct avi_segment seg[AVI_MAX_SEGMENTS];
+	int nseg;
+
+	struct avi_index_entry *ix;		/* current segment, AVI_SEGMENT_FRAMES */
+	uint32_t header_size;			/* offset of first LIST movi */
+};
+
+static const unsigned char avi_zero[2];
+
+static unsigned char *put32(unsigned char *p, uint32_t v) {
+
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+
+	return p + 4;
+}
+
+static unsigned char *put16(unsigned char *p, uint16_t v) {
+
+	p[0] = v;
+	p[1] = v >> 8;
+
+	return p + 2;
+}
+
+static unsigned char *put64(unsigned char *p, uint64_t v) {
+
+	return put32(put32(p, v), v >> 32);
+}
+
+/* Build everything from RIFF up to (not including) first LIST movi */
+static uint32_t avi_build_header(struct avi_writer *a, unsigned char *buf) {
+
+	unsigned char *p = buf, *hdrl, *strl;
+	uint32_t usec = a->fps > 0 ? 1000000 / a->fps : 33333;
+	uint32_t seg0_frames = a->nseg ? a->seg[0].frames : 0;
+	int i;
+
+	if(a->total_frames > 1 && a->last_ts > a->first_ts)
+		usec = (a->last_ts - a->first_ts) / (a->total_frames - 1);
+
+	p = put32(p, FCC('R','I','F','F'));
+	p = put32(p, a->nseg ? a->seg[0].end - 8 : 0);
+	p = put32(p, FCC('A','V','I',' '));
+
+	hdrl = p;
+	p = put32(p, FCC('L','I','S','T'));
+	p = put32(p, 0);
+	p = put32(p, FCC('h','d','r','l'));
+
+	p = put32(p, FCC('a','v','i','h'));
+	p = put32(p, 56);
+	p = put32(p, usec);					// dwMicroSecPerFrame
+	p = put32(p, usec ? (uint64_t) a->max_frame * 1000000 / usec : 0);	// dwMaxBytesPerSec
+	p = put32(p, 0);					// dwPaddingGranularity
+	p = put32(p, AVIF_HASINDEX | AVIF_TRUSTCKTYPE);
+	p = put32(p, seg0_frames);				// dwTotalFrames, first RIFF only
+	p = put32(p, 0);					// dwInitialFrames
+	p = put32(p, 1);					// dwStreams
+	p = put32(p, a->max_frame);				// dwSuggestedBufferSize
+	p = put32(p, a->width);
+	p = put32(p, a->height);
+	memset(p, 0, 16);
+	p += 16;
+
+	strl = p;
+	p = put32(p, FCC('L','I','S','T'));
+	p = put32(p, 0);
+	p = put32(p, FCC('s','t','r','l'));
+
+	p = put32(p, FCC('s','t','r','h'));
+	p = put32(p, 56);
+	p = put32(p, FCC('v','i','d','s'));
+	p = put32(p, FCC('M','J','P','G'));
+	p = put32(p, 0);					// dwFlags
+	p = put16(p, 0);					// wPriority
+	p = put16(p, 0);					// wLanguage
+	p = put32(p, 0);					// dwInitialFrames
+	p = put32(p, usec);					// dwScale
+	p = put32(p, 1000000);					// dwRate
+	p = put32(p, 0);					// dwStart
+	p = put32(p, a->total_frames);				// dwLength
+	p = put32(p, a->max_frame);				// dwSuggestedBufferSize
+	p = put32(p, 0xffffffff);				// dwQuality
+	p = put32(p, 0);					// dwSampleSize
+	p = put16(p, 0);
+	p = put16(p, 0);
+	p = put16(p, a->width);
+	p = put16(p, a->height);
+
+	p = put32(p, FCC('s','t','r','f'));
+	p = put32(p, 40);
+	p = put32(p, 40);					// biSize
+	p = put32(p, a->width);
+	p = put32(p, a->height);
+	p = put16(p, 1);					// biPlanes
+	p = put16(p, 24);					// biBitCount
+	p = put32(p, FCC('M','J','P','G'));
+	p = put32(p, a->width * a->height * 3);
+	p = put32(p, 0);
+	p = put32(p, 0);
+	p = put32(p, 0);
+	p = put32(p, 0);
+
+	p = put32(p, FCC('i','n','d','x'));
+	p = put32(p, AVI_SUPERINDEX_SIZE);
+	p = put16(p, 4);					// wLongsPerEntry
+	*p++ = 0;						// bIndexSubType
+	*p++ = AVI_INDEX_OF_INDEXES;
+	p = put32(p, a->nseg);
+	p = put32(p, FCC('0','0','d','c'));
+	memset(p, 0, 12);
+	p += 12;
+	for(i = 0; i < AVI_MAX_SEGMENTS; i++) {
+		p = put64(p, i < a->nseg ? a->seg[i].ix_offset : 0);
+		p = put32(p, i < a->nseg ? a->seg[i].ix_size + 8 : 0);
+		p = put32(p, i < a->nseg ? a->seg[i].frames : 0);
+	}
+
+	put32(strl + 4, p - strl - 8);
+
+	p = put32(p, FCC('L','I','S','T'));
+	p = put32(p, 4 + 8 + AVI_DMLH_SIZE);
+	p = put32(p, FCC('o','d','m','l'));
+	p = put32(p, FCC('d','m','l','h'));
+	p = put32(p, AVI_DMLH_SIZE);
+	p = put32(p, a->total_frames);
+	memset(p, 0, AVI_DMLH_SIZE - 4);
+	p += AVI_DMLH_SIZE - 4;
+
+	put32(hdrl + 4, p - hdrl - 8);
+
+	return p - buf;
+}
+
+static int avi_begin_segment(struct avi_writer *a) {
+
+	unsigned char hdr[24], *p = hdr;
+	struct avi_segment *s;
+
+	if(a->nseg == AVI_MAX_SEGMENTS) {
+		printf("avi: recording exceeds %d segments\n", AVI_MAX_SEGMENTS);
+		return -1;
+	}
+
+	s = &a->seg[a->nseg++];
+	memset(s, 0, sizeof(*s));
+
+	if(a->nseg == 1) {
+		/* RIFF AVI and hdrl were written by avi_create() */
+		s->riff_offset = 0;
+	} else {
+		s->riff_offset = record_offset(a->rec);
+		p = put32(p, FCC('R','I','F','F'));
+		p = put32(p, 0);
+		p = put32(p, FCC('A','V','I','X'));
+	}
+
+	s->movi_offset = record_offset(a->rec) + (p - hdr);
+	p = put32(p, FCC('L','I','S','T'));
+	p = put32(p, 0);
+	p = put32(p, FCC('m','o','v','i'));
+
+	return record_write(a->rec, hdr, p - hdr);
+}
+
+static int avi_end_segment(struct avi_writer *a) {
+
+	struct avi_segment *s = &a->seg[a->nseg - 1];
+	unsigned char hdr[32], *p = hdr;
+	uint32_t i;
+
+	/* ix00 standard index, part of movi list */
+
+	s->ix_offset = record_offset(a->rec);
+	s->ix_size = 24 + 8 * s->frames;
+
+	p = put32(p, FCC('i','x','0','0'));
+	p = put32(p, s->ix_size);
+	p = put16(p, 2);					// wLongsPerEntry
+	*p++ = 0;
+	*p++ = AVI_INDEX_OF_CHUNKS;
+	p = put32(p, s->frames);
+	p = put32(p, FCC('0','0','d','c'));
+	p = put64(p, s->riff_offset);				// qwBaseOffset
+	p = put32(p, 0);
+
+	if(record_write(a->rec, hdr, p - hdr) < 0 ||
+	   record_write(a->rec, a->ix, 8 * s->frames) < 0)
+		return -1;
+
+	s->movi_end = record_offset(a->rec);
+
+	/* Legacy idx1 for players without OpenDML support, first RIFF only.
+	 * Offsets are relative to the movi fourcc. */
+
+	if(a->nseg == 1) {
+		uint32_t movi = s->movi_offset + 8;
+		unsigned char idx1[16 * 256];
+
+		p = hdr;
+		p = put32(p, FCC('i','d','x','1'));
+		p = put32(p, 16 * s->frames);
+		if(record_write(a->rec, hdr, p - hdr) < 0)
+			return -1;
+
+		for(i = 0, p = idx1; i < s->frames; i++) {
+			p = put32(p, FCC('0','0','d','c'));
+			p = put32(p, AVIIF_KEYFRAME);
+			p = put32(p, s->riff_offset + a->ix[i].offset - 8 - movi);
+			p = put32(p, a->ix[i].size);
+
+			if(p == idx1 + sizeof(idx1) || i == s->frames - 1) {
+				if(record_write(a->rec, idx1, p - idx1) < 0)
+					return -1;
+				p = idx1;
+			}
+		}
+	}
+
+	s->end = record_offset(a->rec);
+
+	return 0;
+}
+
+struct avi_writer *avi_create(const char *path, uint32_t width, uint32_t height, int fps,
+	int record_flags, int record_chunks) {
+
+	struct avi_writer *a;
+	unsigned char *hdr;
+
+	a = (struct avi_writer *) calloc(1, sizeof(*a));
+	if(!a)
+		return NULL;
+
+	a->width = width;
+	a->height = height;
+	a->fps = fps;
+
+	a->ix = (struct avi_index_entry *) malloc(AVI_SEGMENT_FRAMES * sizeof(*a->ix));
+	hdr = (unsigned char *) malloc(8192);
+
+	if(!a->ix || !hdr) {
+		printf("avi: out of memory\n");
+		goto fail;
+	}
+
+	a->rec = record_open(path, record_flags & ~RECORD_APPEND, RECORD_CHUNK_SIZE, record_chunks);
+	if(!a->rec)
+		goto fail;
+
+	a->header_size = avi_build_header(a, hdr);
+
+	if(record_write(a->rec, hdr, a->header_size) < 0 || avi_begin_segment(a) < 0) {
+		record_close(a->rec);
+		goto fail;
+	}
+
+	free(hdr);
+
+	return a;
+
+fail:
+	free(hdr);
+	free(a->ix);
+	free(a);
+	return NULL;
+}
+
+int avi_append(struct avi_writer *a, const struct iovec *iov, int iovcnt, const struct timeval *timestamp) {
+
+	struct avi_segment *s = &a->seg[a->nseg - 1];
+	struct iovec v[8];
+	unsigned char hdr[8];
+	uint32_t len = 0;
+	uint64_t ts;
+	int i, n = 0, rc;
+
+	if(iovcnt > 6)
+		return -1;
+
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if(s->frames == AVI_SEGMENT_FRAMES ||
+	   record_offset(a->rec) - s->riff_offset + len + 16 + 8 * (s->frames + 1) + 16 * (s->frames + 1) > AVI_SEGMENT_SIZE) {
+		if(avi_end_segment(a) < 0 || avi_begin_segment(a) < 0)
+			return -1;
+		s = &a->seg[a->nseg - 1];
+	}
+
+	put32(put32(hdr, FCC('0','0','d','c')), len);
+
+	v[n].iov_base = hdr;
+	v[n++].iov_len = 8;
+	for(i = 0; i < iovcnt; i++)
+		v[n++] = iov[i];
+	if(len & 1) {
+		v[n].iov_base = (void *) avi_zero;
+		v[n++].iov_len = 1;
+	}
+
+	a->ix[s->frames].offset = record_offset(a->rec) + 8 - s->riff_offset;
+	a->ix[s->frames].size = len;
+
+	rc = record_framev(a->rec, v, n);
+	if(rc <= 0)
+		return rc;
+
+	s->frames++;
+	a->total_frames++;
+
+	if(len > a->max_frame)
+		a->max_frame = len;
+
+	ts = timestamp->tv_sec * 1000000ULL + timestamp->tv_usec;
+	if(a->total_frames == 1)
+		a->first_ts = ts;
+	a->last_ts = ts;
+
+	return rc;
+}
+
+int avi_close(struct avi_writer *a) {
+
+	unsigned char hdr[8192], sz[4];
+	int i, rc = 0;
+
+	if(avi_end_segment(a) < 0)
+		rc = -1;
+
+	if(avi_build_header(a, hdr) != a->header_size ||
+	   record_pwrite(a->rec, hdr, a->header_size, 0) < 0)
+		rc = -1;
+
+	for(i = 0; i < a->nseg && rc == 0; i++) {
+		struct avi_segment *s = &a->seg[i];
+
+		put32(sz, s->movi_end - s->movi_offset - 8);
+		if(record_pwrite(a->rec, sz, 4, s->movi_offset + 4) < 0)
+			rc = -1;
+
+		put32(sz, s->end - s->riff_offset - 8);
+		if(i > 0 && record_pwrite(a->rec, sz, 4, s->riff_offset + 4) < 0)
+			rc = -1;
+	}
+
+	if(rc == 0)
+		printf("avi: %llu frames in %d RIFF segments\n", (unsigned long long) a->total_frames, a->nseg);
+
+	if(record_close(a->rec) < 0)
+		rc = -1;
+
+	free(a->ix);
+	free(a);
+
+	return rc;
+}
+
+struct record_writer *avi_recorder(struct avi_writer *a) {
+
+	return a->rec;
+}
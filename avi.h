@@ -0,0 +1,33 @@
+#ifndef _AVI_H_
+#define _AVI_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+/*
+ * Streaming AVI (RIFF/OpenDML) muxer for MJPEG. Frames are appended as 00dc
+ * chunks through the recording writer. The file is split in RIFF segments
+ * (RIFF AVI, then RIFF AVIX) of at most AVI_SEGMENT_SIZE bytes or
+ * AVI_SEGMENT_FRAMES frames; index entries of the current segment are
+ * batched in memory and written as an ix00 standard index (plus idx1 for
+ * the first segment) when the segment is closed. Headers, the indx super
+ * index and segment sizes are patched once in avi_close(), so memory use
+ * and per-frame work stay constant however long the recording is.
+ */
+
+#ifndef AVI_SEGMENT_SIZE
+#define AVI_SEGMENT_SIZE	(1024 * 1024 * 1024)
+#endif
+#define AVI_SEGMENT_FRAMES	32768
+#define AVI_MAX_SEGMENTS	256	/* super index slots, 256 GB */
+
+struct avi_writer;
+
+struct avi_writer *avi_create(const char *path, uint32_t width, uint32_t height, int fps,
+	int record_flags, int record_chunks);
+int avi_append(struct avi_writer *a, const struct iovec *iov, int iovcnt, const struct timeval *timestamp);
+int avi_close(struct avi_writer *a);
+struct record_writer *avi_recorder(struct avi_writer *a);
+
+#endif // _AVI_H_
@@ -0,0 +1,563 @@
+/*
+ *      bench.c  --  conversion and JPEG decode microbenchmarks
+ *
+ *      Runs every kernel of convert.c, and jpeg_decompress() from
+ *      jpeg_mem.c, over synthetic frames at several resolutions and
+ *      prints throughput. No camera or framebuffer needed; with -f the
+ *      copy kernels write the mapped framebuffer instead of cached memory,
+ *      which is what matters for the write-combined screen.
+ *
+ *      bench [-t seconds] [-m MHz] [-s WxH] [-f /dev/fbN] [kernel...]
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fb.h>
+
+#include <jpeglib.h>
+
+#include "convert.h"
+#include "jpeg_mem.h"
+
+struct bench_frame {
+	int width, height;
+	uint8_t *src;
+	int src_stride;
+	size_t src_len;
+	uint32_t *dst;
+	int dst_stride;
+};
+
+struct bench_kernel {
+	const char *name;
+	int bytes_per_pixel;			/* source */
+	void (*make)(struct bench_frame *f, const uint32_t *rgb);
+	void (*run)(struct bench_frame *f);
+	int simd;				/* has variants per instruction set */
+	int screen;				/* writes the framebuffer with -f */
+};
+
+static volatile uint32_t bench_sink;
+
+/* Mapped with -f */
+static uint8_t *bench_fb;
+static int bench_fb_stride, bench_fb_width, bench_fb_height;
+
+
+/* Synthetic frames: color bars with a vertical ramp and some noise, so
+ * nothing compresses or predicts unrealistically well */
+
+static uint32_t *make_rgb(int width, int height) {
+
+	static const uint32_t bars[8] = {
+		0xffffff, 0xffff00, 0x00ffff, 0x00ff00, 0xff00ff, 0xff0000, 0x0000ff, 0x000000 };
+	uint32_t *rgb, seed = 12345;
+	int x, y;
+
+	rgb = (uint32_t *) malloc((size_t) width * height * 4);
+	if(!rgb)
+		return NULL;
+
+	for(y = 0; y < height; y++)
+		for(x = 0; x < width; x++) {
+			uint32_t c = bars[x * 8 / width];
+			int ramp = 64 + y * 191 / height, r, g, b;
+
+			seed = seed * 1103515245 + 12345;
+			r = ((c >> 16) & 0xff) * ramp / 255 + ((seed >> 16) & 7);
+			g = ((c >> 8) & 0xff) * ramp / 255 + ((seed >> 19) & 7);
+			b = (c & 0xff) * ramp / 255 + ((seed >> 22) & 7);
+
+			rgb[(size_t) y * width + x] = ((r > 255 ? 255 : r) << 16) | ((g > 255 ? 255 : g) << 8) | (b > 255 ? 255 : b);
+		}
+
+	return rgb;
+}
+
+#define R(c)	(((c) >> 16) & 0xff)
+#define G(c)	(((c) >> 8) & 0xff)
+#define B(c)	((c) & 0xff)
+
+static void make_rgb565(struct bench_frame *f, const uint32_t *rgb) {
+
+	uint16_t *p = (uint16_t *) f->src;
+	size_t i;
+
+	for(i = 0; i < (size_t) f->width * f->height; i++)
+		p[i] = ((R(rgb[i]) >> 3) << 11) | ((G(rgb[i]) >> 2) << 5) | (B(rgb[i]) >> 3);
+}
+
+static void make_422(struct bench_frame *f, const uint32_t *rgb, int y0, int u0, int y1, int v0) {
+
+	size_t i;
+
+	for(i = 0; i < (size_t) f->width * f->height; i += 2) {
+		uint8_t *p = f->src + i * 2;
+		uint32_t a = rgb[i], b = rgb[i + 1];
+
+		p[y0] = ((66 * R(a) + 129 * G(a) + 25 * B(a) + 128) >> 8) + 16;
+		p[y1] = ((66 * R(b) + 129 * G(b) + 25 * B(b) + 128) >> 8) + 16;
+		p[u0] = ((-38 * (int) R(a) - 74 * (int) G(a) + 112 * (int) B(a) + 128) >> 8) + 128;
+		p[v0] = ((112 * (int) R(a) - 94 * (int) G(a) - 18 * (int) B(a) + 128) >> 8) + 128;
+	}
+}
+
+static void make_yuyv(struct bench_frame *f, const uint32_t *rgb) {
+
+	make_422(f, rgb, 0, 1, 2, 3);
+}
+
+static void make_uyvy(struct bench_frame *f, const uint32_t *rgb) {
+
+	make_422(f, rgb, 1, 0, 3, 2);
+}
+
+static void make_bggr(struct bench_frame *f, const uint32_t *rgb) {
+
+	int x, y;
+
+	for(y = 0; y < f->height; y++)
+		for(x = 0; x < f->width; x++) {
+			uint32_t c = rgb[(size_t) y * f->width + x];
+
+			f->src[(size_t) y * f->width + x] = (y & 1) ? ((x & 1) ? R(c) : G(c)) : ((x & 1) ? G(c) : B(c));
+		}
+}
+
+/* libjpeg 6b has no jpeg_mem_dest, the frame buffer is big enough anyway */
+static void jpeg_dest_init(j_compress_ptr cinfo) {
+}
+
+static boolean jpeg_dest_empty(j_compress_ptr cinfo) {
+
+	return FALSE;
+}
+
+static void jpeg_dest_term(j_compress_ptr cinfo) {
+}
+
+static void make_jpeg(struct bench_frame *f, const uint32_t *rgb) {
+
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_destination_mgr dest;
+	JSAMPROW row;
+	uint8_t *line;
+	int x;
+
+	line = (uint8_t *) malloc(f->width * 3);
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	dest.init_destination = jpeg_dest_init;
+	dest.empty_output_buffer = jpeg_dest_empty;
+	dest.term_destination = jpeg_dest_term;
+	dest.next_output_byte = f->src;
+	dest.free_in_buffer = f->src_len;
+	cinfo.dest = &dest;
+
+	cinfo.image_width = f->width;
+	cinfo.image_height = f->height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 85, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	while(cinfo.next_scanline < cinfo.image_height) {
+		const uint32_t *s = rgb + (size_t) cinfo.next_scanline * f->width;
+
+		for(x = 0; x < f->width; x++) {
+			line[x * 3] = R(s[x]);
+			line[x * 3 + 1] = G(s[x]);
+			line[x * 3 + 2] = B(s[x]);
+		}
+		row = line;
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	f->src_len -= dest.free_in_buffer;
+	jpeg_destroy_compress(&cinfo);
+	free(line);
+}
+
+static void make_copy(struct bench_frame *f, const uint32_t *rgb) {
+
+	memcpy(f->src, rgb, (size_t) f->width * f->height * 4);
+}
+
+
+static void run_rgb565(struct bench_frame *f) {
+
+	convert_rgb565(f->src, f->src_stride, f->dst, f->dst_stride, f->width, f->height);
+}
+
+static void run_yuyv(struct bench_frame *f) {
+
+	convert_yuyv(f->src, f->src_stride, f->dst, f->dst_stride, f->width, f->height);
+}
+
+static void run_uyvy(struct bench_frame *f) {
+
+	convert_uyvy(f->src, f->src_stride, f->dst, f->dst_stride, f->width, f->height);
+}
+
+static void run_sbggr8_blocks(struct bench_frame *f) {
+
+	convert_sbggr8_blocks(f->src, f->src_stride, f->dst, f->dst_stride, f->width, f->height, NULL);
+}
+
+static void run_bayer_bilinear(struct bench_frame *f) {
+
+	static const struct convert_gains gains = { 384, 346, 461 };
+
+	convert_bayer_bilinear(f->src, f->src_stride, f->dst, f->dst_stride, f->width, f->height, 1, 0, &gains);
+}
+
+static void run_jpeg(struct bench_frame *f) {
+
+	int width, height;
+
+	jpeg_decompress((char *) f->src, f->src_len, (char *) f->dst, &width, &height);
+}
+
+static void run_memcpy(struct bench_frame *f) {
+
+	memcpy(f->dst, f->src, (size_t) f->width * f->height * 4);
+}
+
+static void run_copy(struct bench_frame *f) {
+
+	convert_copy(f->dst, f->src, (size_t) f->width * f->height * 4);
+}
+
+/* Row by row into the screen stride */
+static void run_blit(struct bench_frame *f) {
+
+	convert_blit(f->dst, f->dst_stride, f->src, f->src_stride, f->width * 4, f->height);
+}
+
+/* Changed tiles only, as render.c shows them: every other tile of 64x16
+ * pixels, so half the frame is written in short rows */
+static void run_blit_rect(struct bench_frame *f) {
+
+	int x, y, w, h;
+
+	for(y = 0; y < f->height; y += 16) {
+		h = f->height - y < 16 ? f->height - y : 16;
+		for(x = (y / 16 & 1) * 64; x < f->width; x += 128) {
+			w = f->width - x < 64 ? f->width - x : 64;
+			convert_blit_rect(f->dst, f->dst_stride, (const uint32_t *) f->src, f->src_stride, x, y, w, h);
+		}
+	}
+}
+
+/* Change detection against a previous frame, here the output buffer */
+static void run_sad(struct bench_frame *f) {
+
+	bench_sink += convert_sad(f->src, f->src_stride, (const uint8_t *) f->dst, f->src_stride, f->src_stride, f->height);
+}
+
+/* Exposure and white balance statistics of every row pair, luma into the output */
+static void run_bggr8_quads(struct bench_frame *f) {
+
+	uint32_t sums[3] = { 0, 0, 0 };
+	int y;
+
+	for(y = 0; y + 1 < f->height; y += 2)
+		convert_bggr8_quads(f->src + (size_t) y * f->src_stride, f->src + (size_t) (y + 1) * f->src_stride,
+			(uint8_t *) f->dst + (size_t) y / 2 * f->dst_stride, f->width / 2, sums);
+
+	bench_sink += sums[0] + sums[1] + sums[2];
+}
+
+static const struct bench_kernel kernels[] = {
+	{ "memcpy",		4, make_copy,	run_memcpy,	0, 1 },
+	{ "copy",		4, make_copy,	run_copy,	1, 1 },
+	{ "blit",		4, make_copy,	run_blit,	1, 1 },
+	{ "blit-rect",		4, make_copy,	run_blit_rect,	1, 1 },
+	{ "sad",		2, make_yuyv,	run_sad,	1, 0 },
+	{ "rgb565",		2, make_rgb565,	run_rgb565,	1, 0 },
+	{ "yuyv",		2, make_yuyv,	run_yuyv,	1, 0 },
+	{ "uyvy",		2, make_uyvy,	run_uyvy,	1, 0 },
+	{ "sbggr8-blocks",	1, make_bggr,	run_sbggr8_blocks,	0, 0 },
+	{ "bayer-bilinear",	1, make_bggr,	run_bayer_bilinear,	0, 0 },
+	{ "bggr8-quads",	1, make_bggr,	run_bggr8_quads,	1, 0 },
+	{ "jpeg-decode",	0, make_jpeg,	run_jpeg,	0, 0 },
+};
+
+static const int sizes[][2] = {
+	{ 320, 240 },
+	{ 640, 480 },
+	{ 800, 480 },
+	{ 1024, 600 },
+	{ 1280, 720 },
+	{ 1920, 1080 },
+};
+
+
+static double bench_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Nominal clock for bytes/cycle, 0 if unknown */
+static double bench_mhz(void) {
+
+	char line[256];
+	double mhz = 0;
+	FILE *fp;
+
+	fp = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "r");
+	if(fp) {
+		if(fscanf(fp, "%lf", &mhz) == 1)
+			mhz /= 1000;
+		fclose(fp);
+		if(mhz > 0)
+			return mhz;
+	}
+
+	fp = fopen("/proc/cpuinfo", "r");
+	if(!fp)
+		return 0;
+
+	while(fgets(line, sizeof(line), fp))
+		if(sscanf(line, "cpu MHz : %lf", &mhz) == 1)
+			break;
+
+	fclose(fp);
+
+	return mhz;
+}
+
+static int bench_one(const struct bench_kernel *k, int width, int height, double seconds, double mhz) {
+
+	struct bench_frame f;
+	uint32_t *rgb;
+	size_t in_bytes, out_bytes;
+	double t0, t;
+	long n = 0;
+
+	memset(&f, 0, sizeof(f));
+	f.width = width;
+	f.height = height;
+	f.src_stride = width * (k->bytes_per_pixel ? k->bytes_per_pixel : 3);
+	f.src_len = (size_t) f.src_stride * height;
+	f.dst_stride = width * 4;
+
+	if(bench_fb && k->screen) {
+		if(width > bench_fb_width || height > bench_fb_height)
+			return 0;
+		f.dst_stride = bench_fb_stride;
+	}
+
+	rgb = make_rgb(width, height);
+	f.src = (uint8_t *) malloc(f.src_len);
+	f.dst = bench_fb && k->screen ? (uint32_t *) bench_fb : (uint32_t *) malloc((size_t) f.dst_stride * height);
+	if(!rgb || !f.src || !f.dst) {
+		printf("%-16s %-6s %5dx%-5d out of memory\n", k->name, convert_isa_name(convert_isa()), width, height);
+		free(rgb);
+		free(f.src);
+		if(f.dst != (uint32_t *) bench_fb)
+			free(f.dst);
+		return -1;
+	}
+
+	k->make(&f, rgb);
+	in_bytes = f.src_len;
+	out_bytes = (size_t) f.dst_stride * height;
+
+	/* Warm up caches and page tables */
+	k->run(&f);
+
+	t0 = bench_now();
+	do {
+		k->run(&f);
+		n++;
+		t = bench_now() - t0;
+	} while(t < seconds);
+
+	bench_sink += f.dst[(size_t) (height / 2) * (f.dst_stride / 4) + width / 2];
+
+	printf("%-16s %-6s %5dx%-5d %8.1f MPix/s %8.2f ns/pix %7.1f fps", k->name,
+		convert_isa_name(convert_isa()), width, height,
+		(double) n * width * height / t / 1e6, t * 1e9 / ((double) n * width * height), n / t);
+
+	if(mhz > 0)
+		printf(" %6.2f bytes/cycle\n", (double) n * (in_bytes + out_bytes) / (t * mhz * 1e6));
+	else
+		printf("      - bytes/cycle\n");
+
+	free(rgb);
+	free(f.src);
+	if(f.dst != (uint32_t *) bench_fb)
+		free(f.dst);
+
+	return 0;
+}
+
+/* Only 32 bpp screens, what the kernels write */
+static int bench_open_fb(const char *path) {
+
+	struct fb_fix_screeninfo finfo;
+	struct fb_var_screeninfo vinfo;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if(fd < 0) {
+		printf("Cannot open %s\n", path);
+		return -1;
+	}
+
+	if(ioctl(fd, FBIOGET_FSCREENINFO, &finfo) < 0 || ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) < 0 ||
+		vinfo.bits_per_pixel != 32) {
+		printf("%s is not a 32 bpp framebuffer\n", path);
+		close(fd);
+		return -1;
+	}
+
+	p = mmap(NULL, finfo.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED) {
+		printf("Cannot map %s\n", path);
+		return -1;
+	}
+
+	bench_fb = (uint8_t *) p;
+	bench_fb_stride = finfo.line_length;
+	bench_fb_width = vinfo.xres;
+	bench_fb_height = vinfo.yres;
+	printf("bench: copies go to %s, %dx%d, %d byte lines\n", path, bench_fb_width, bench_fb_height,
+		bench_fb_stride);
+
+	return 0;
+}
+
+static void usage(const char *argv0) {
+
+	unsigned int i;
+
+	printf("Usage: %s [options] [kernel...]\n", argv0);
+	printf("-t, --time seconds	Run each case this long (default 0.5)\n");
+	printf("-m, --mhz MHz		CPU clock for bytes/cycle, read from the system by default\n");
+	printf("-s, --size WxH		Only this size\n");
+	printf("-i, --isa name		Instruction set: auto (default), all, scalar, neon, sse4, avx2\n");
+	printf("-f, --fb device		Copy kernels write this framebuffer, sizes up to the screen\n");
+	printf("Kernels:");
+	for(i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+		printf(" %s", kernels[i].name);
+	printf("\n");
+}
+
+static struct option opts[] = {
+	{"time", 1, 0, 't'},
+	{"mhz", 1, 0, 'm'},
+	{"size", 1, 0, 's'},
+	{"isa", 1, 0, 'i'},
+	{"fb", 1, 0, 'f'},
+	{"help", 0, 0, 'h'},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char *argv[]) {
+
+	double seconds = 0.5, mhz = 0;
+	int width = 0, height = 0, c, i, isa;
+	unsigned int k, s, isas;
+	char *isa_name = NULL;
+
+	while((c = getopt_long(argc, argv, "t:m:s:i:f:h", opts, NULL)) != -1) {
+		switch(c) {
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'm':
+			mhz = atof(optarg);
+			break;
+		case 's':
+			if(sscanf(optarg, "%dx%d", &width, &height) != 2 || width < 4 || height < 4) {
+				printf("Invalid size %s\n", optarg);
+				return 1;
+			}
+			width &= ~1;
+			height &= ~1;
+			break;
+		case 'i':
+			isa_name = optarg;
+			break;
+		case 'f':
+			if(bench_open_fb(optarg) < 0)
+				return 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(!mhz)
+		mhz = bench_mhz();
+
+	/* Every instruction set this CPU has, or just the one asked for */
+	if(isa_name && !strcmp(isa_name, "all")) {
+		isas = convert_isas();
+	} else {
+		if(convert_init(isa_name) < 0)
+			return 1;
+		isas = 1 << convert_isa();
+	}
+
+	printf("bench: %.1f s per case, %s%.0f MHz\n", seconds, mhz > 0 ? "" : "unknown clock, ", mhz);
+
+	for(k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		int wanted = optind == argc;
+
+		for(i = optind; i < argc; i++)
+			if(!strcmp(argv[i], kernels[k].name))
+				wanted = 1;
+		if(!wanted)
+			continue;
+
+		for(isa = 0; isa < CONVERT_ISAS; isa++) {
+			if(!(isas & (1 << isa)))
+				continue;
+
+			/* Scalar only kernels run once */
+			if(!kernels[k].simd) {
+				if(isa != __builtin_ctz(isas))
+					continue;
+				convert_use(CONVERT_SCALAR);
+			} else {
+				convert_use(isa);
+			}
+
+			if(width) {
+				bench_one(&kernels[k], width, height, seconds, mhz);
+				continue;
+			}
+
+			for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+				bench_one(&kernels[k], sizes[s][0], sizes[s][1], seconds, mhz);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,333 @@
+/*
+ *      capfile.c  --  indexed raw capture container
+ *
+ *      See capfile.h for the layout. Writing goes through the asynchronous
+ *      recording writer, the index is kept in memory (32 bytes per frame)
+ *      and appended when the file is closed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capfile.h"
+#include "record.h"
+
+#define CAPFILE_INDEX_GROW	4096
+#define CAPFILE_WINDOW		(64 * 1024 * 1024)
+
+struct capfile_writer {
+	struct record_writer *rec;
+	struct capfile_header hdr;
+	struct capfile_index_entry *index;
+	uint64_t count;
+	uint64_t alloc;
+};
+
+static const unsigned char capfile_zero[8];
+
+struct capfile_writer *capfile_create(const char *path, uint32_t fourcc, uint32_t width, uint32_t height,
+	uint32_t bytesperline, uint32_t flags, int record_flags, int record_chunks) {
+
+	struct capfile_writer *cf;
+
+	cf = (struct capfile_writer *) calloc(1, sizeof(*cf));
+	if(!cf)
+		return NULL;
+
+	/* Container is always started from scratch */
+	cf->rec = record_open(path, record_flags & ~RECORD_APPEND, RECORD_CHUNK_SIZE, record_chunks);
+	if(!cf->rec) {
+		free(cf);
+		return NULL;
+	}
+
+	cf->hdr.magic = CAPFILE_MAGIC;
+	cf->hdr.version = CAPFILE_VERSION;
+	cf->hdr.fourcc = fourcc;
+	cf->hdr.width = width;
+	cf->hdr.height = height;
+	cf->hdr.bytesperline = bytesperline;
+	cf->hdr.flags = flags;
+	cf->hdr.header_size = sizeof(cf->hdr);
+
+	if(record_write(cf->rec, &cf->hdr, sizeof(cf->hdr)) < 0) {
+		record_close(cf->rec);
+		free(cf);
+		return NULL;
+	}
+
+	return cf;
+}
+
+int capfile_append(struct capfile_writer *cf, const struct iovec *iov, int iovcnt,
+	uint32_t sequence, uint32_t flags, const struct timeval *timestamp) {
+
+	struct iovec v[8];
+	struct capfile_frame fr;
+	struct capfile_index_entry *e;
+	size_t len = 0;
+	int i, n = 0, rc;
+
+	if(iovcnt > 6)
+		return -1;
+
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if(cf->count == cf->alloc) {
+		e = (struct capfile_index_entry *) realloc(cf->index, (cf->alloc + CAPFILE_INDEX_GROW) * sizeof(*e));
+		if(!e) {
+			fprintf(stderr, "capfile: out of memory for index\n");
+			return -1;
+		}
+		cf->index = e;
+		cf->alloc += CAPFILE_INDEX_GROW;
+	}
+
+	memset(&fr, 0, sizeof(fr));
+	fr.magic = CAPFILE_FRAME_MAGIC;
+	fr.bytesused = len;
+	fr.sequence = sequence;
+	fr.flags = flags;
+	fr.timestamp = timestamp->tv_sec * 1000000ULL + timestamp->tv_usec;
+
+	e = &cf->index[cf->count];
+	e->offset = record_offset(cf->rec) + sizeof(fr);
+	e->bytesused = len;
+	e->sequence = sequence;
+	e->timestamp = fr.timestamp;
+	e->flags = flags;
+	e->reserved = 0;
+
+	v[n].iov_base = &fr;
+	v[n++].iov_len = sizeof(fr);
+
+	for(i = 0; i < iovcnt; i++)
+		v[n++] = iov[i];
+
+	if(CAPFILE_PAD(len) != len) {
+		v[n].iov_base = (void *) capfile_zero;
+		v[n++].iov_len = CAPFILE_PAD(len) - len;
+	}
+
+	rc = record_framev(cf->rec, v, n);
+
+	if(rc > 0)
+		cf->count++;
+
+	return rc;
+}
+
+int capfile_close(struct capfile_writer *cf) {
+
+	int rc = 0;
+
+	cf->hdr.index_offset = record_offset(cf->rec);
+	cf->hdr.frame_count = cf->count;
+
+	if(record_write(cf->rec, cf->index, cf->count * sizeof(*cf->index)) < 0 ||
+	   record_pwrite(cf->rec, &cf->hdr, sizeof(cf->hdr), 0) < 0)
+		rc = -1;
+
+	if(record_close(cf->rec) < 0)
+		rc = -1;
+
+	free(cf->index);
+	free(cf);
+
+	return rc;
+}
+
+struct record_writer *capfile_recorder(struct capfile_writer *cf) {
+
+	return cf->rec;
+}
+
+
+/* Rebuild index of a file that was not closed, walks frame records only */
+
+static int capfile_scan(struct capfile_reader *r) {
+
+	uint64_t off = r->hdr.header_size, alloc = 0;
+	struct capfile_frame fr;
+
+	r->count = 0;
+
+	while(off + sizeof(fr) <= r->size) {
+		struct capfile_index_entry *e;
+
+		if(pread(r->fd, &fr, sizeof(fr), off) != sizeof(fr) || fr.magic != CAPFILE_FRAME_MAGIC)
+			break;
+
+		if(off + sizeof(fr) + fr.bytesused > r->size)
+			break; // truncated last frame
+
+		if(r->count == alloc) {
+			e = (struct capfile_index_entry *) realloc(r->index, (alloc + CAPFILE_INDEX_GROW) * sizeof(*e));
+			if(!e)
+				return -1;
+			r->index = e;
+			alloc += CAPFILE_INDEX_GROW;
+		}
+
+		e = &r->index[r->count++];
+		e->offset = off + sizeof(fr);
+		e->bytesused = fr.bytesused;
+		e->sequence = fr.sequence;
+		e->timestamp = fr.timestamp;
+		e->flags = fr.flags;
+		e->reserved = 0;
+
+		off += sizeof(fr) + CAPFILE_PAD(fr.bytesused);
+	}
+
+	fprintf(stderr, "capfile: no index, recovered %llu frames by scanning\n", (unsigned long long) r->count);
+
+	return 0;
+}
+
+/* Every entry of an index that was read from the file lies inside it */
+static int capfile_check_index(struct capfile_reader *r) {
+
+	uint64_t i;
+
+	for(i = 0; i < r->count; i++) {
+		const struct capfile_index_entry *e = &r->index[i];
+
+		if(e->offset > r->size || e->bytesused > r->size - e->offset) {
+			fprintf(stderr, "capfile: index entry %llu is outside the file\n", (unsigned long long) i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int capfile_open(struct capfile_reader *r, const char *path) {
+
+	struct stat st;
+	int indexed = 0;
+
+	memset(r, 0, sizeof(*r));
+
+	r->fd = open(path, O_RDONLY);
+	if(r->fd < 0) {
+		fprintf(stderr, "capfile: cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if(fstat(r->fd, &st) < 0 ||
+	   pread(r->fd, &r->hdr, sizeof(r->hdr), 0) != sizeof(r->hdr) ||
+	   r->hdr.magic != CAPFILE_MAGIC || r->hdr.version != CAPFILE_VERSION) {
+		fprintf(stderr, "capfile: %s is not a capture file\n", path);
+		close(r->fd);
+		return -1;
+	}
+
+	r->size = st.st_size;
+
+	/* frame_count of a corrupt header would overflow a multiplication */
+	if(r->hdr.index_offset && r->hdr.index_offset <= r->size &&
+	   r->hdr.frame_count <= (r->size - r->hdr.index_offset) / sizeof(*r->index)) {
+		long page = sysconf(_SC_PAGESIZE);
+		uint64_t start = r->hdr.index_offset & ~(uint64_t)(page - 1);
+
+		r->count = r->hdr.frame_count;
+		r->index_map_len = r->hdr.index_offset - start + r->count * sizeof(*r->index);
+
+		if(r->count) {
+			r->index_map = mmap(NULL, r->index_map_len, PROT_READ, MAP_SHARED, r->fd, start);
+			if(r->index_map == MAP_FAILED) {
+				fprintf(stderr, "capfile: cannot map index: %s\n", strerror(errno));
+				close(r->fd);
+				return -1;
+			}
+			r->index = (struct capfile_index_entry *) ((unsigned char *) r->index_map + (r->hdr.index_offset - start));
+			r->index_mapped = 1;
+		}
+
+		indexed = 1;
+		if(capfile_check_index(r) < 0) {
+			munmap(r->index_map, r->index_map_len);
+			r->index_map = NULL;
+			r->index_mapped = 0;
+			r->index = NULL;
+			r->count = 0;
+			indexed = 0;
+		}
+	}
+
+	if(!indexed && capfile_scan(r) < 0) {
+		fprintf(stderr, "capfile: out of memory for index\n");
+		capfile_close_reader(r);
+		return -1;
+	}
+
+	return 0;
+}
+
+const unsigned char *capfile_frame(struct capfile_reader *r, uint64_t n, struct capfile_index_entry *info) {
+
+	struct capfile_index_entry *e;
+
+	if(n >= r->count)
+		return NULL;
+
+	e = &r->index[n];
+
+	if(e->offset > r->size || e->bytesused > r->size - e->offset)
+		return NULL;
+
+	if(info)
+		*info = *e;
+
+	if(!r->window || e->offset < r->window_offset ||
+	   e->offset + e->bytesused > r->window_offset + r->window_len) {
+
+		long page = sysconf(_SC_PAGESIZE);
+		uint64_t start = e->offset & ~(uint64_t)(page - 1);
+		uint64_t len = e->offset - start + e->bytesused;
+
+		if(len < CAPFILE_WINDOW)
+			len = CAPFILE_WINDOW;
+		if(start + len > r->size)
+			len = r->size - start;
+
+		if(r->window)
+			munmap(r->window, r->window_len);
+
+		r->window = (unsigned char *) mmap(NULL, len, PROT_READ, MAP_SHARED, r->fd, start);
+		if(r->window == MAP_FAILED) {
+			fprintf(stderr, "capfile: cannot map frame %llu: %s\n", (unsigned long long) n, strerror(errno));
+			r->window = NULL;
+			return NULL;
+		}
+
+		r->window_offset = start;
+		r->window_len = len;
+	}
+
+	return r->window + (e->offset - r->window_offset);
+}
+
+void capfile_close_reader(struct capfile_reader *r) {
+
+	if(r->window)
+		munmap(r->window, r->window_len);
+
+	if(r->index_mapped)
+		munmap(r->index_map, r->index_map_len);
+	else
+		free(r->index);
+
+	close(r->fd);
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
@@ -0,0 +1,98 @@
+#ifndef _CAPFILE_H_
+#define _CAPFILE_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+/*
+ * Indexed raw capture container (.vcap), all fields little endian:
+ *
+ *	capfile_header				at offset 0, 64 bytes
+ *	{ capfile_frame, payload, pad to 8 }	per frame, append only
+ *	capfile_index_entry[frame_count]	trailing index
+ *
+ * index_offset and frame_count in the header are filled in when the file
+ * is closed. A file that was not closed properly (index_offset == 0) is
+ * still readable, the reader rebuilds the index from the frame records.
+ */
+
+#define CAPFILE_MAGIC		0x50414356	/* "VCAP" */
+#define CAPFILE_FRAME_MAGIC	0x4d524656	/* "VFRM" */
+#define CAPFILE_VERSION		1
+
+#define CAPFILE_COMPRESSED	0x01	/* payloads are compress_frame() output */
+
+struct capfile_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint32_t bytesperline;
+	uint32_t flags;			/* CAPFILE_* */
+	uint32_t header_size;		/* offset of first frame record */
+	uint64_t index_offset;		/* 0 until index is written */
+	uint64_t frame_count;
+	uint8_t reserved[16];
+};
+
+struct capfile_frame {
+	uint32_t magic;
+	uint32_t bytesused;
+	uint32_t sequence;
+	uint32_t flags;			/* V4L2_BUF_FLAG_* of the captured buffer */
+	uint64_t timestamp;		/* V4L2 buffer timestamp, usec */
+	uint64_t reserved;
+};
+
+struct capfile_index_entry {
+	uint64_t offset;		/* of payload, frame record precedes it */
+	uint32_t bytesused;
+	uint32_t sequence;
+	uint64_t timestamp;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+#define CAPFILE_PAD(x)		(((x) + 7) & ~7ULL)
+
+
+/* Writer */
+
+struct capfile_writer;
+
+struct capfile_writer *capfile_create(const char *path, uint32_t fourcc, uint32_t width, uint32_t height,
+	uint32_t bytesperline, uint32_t flags, int record_flags, int record_chunks);
+int capfile_append(struct capfile_writer *cf, const struct iovec *iov, int iovcnt,
+	uint32_t sequence, uint32_t flags, const struct timeval *timestamp);
+int capfile_close(struct capfile_writer *cf);
+struct record_writer *capfile_recorder(struct capfile_writer *cf);
+
+
+/* Reader, frames are mapped on demand so multi-GB files work on 32-bit too */
+
+struct capfile_reader {
+	int fd;
+	uint64_t size;
+	struct capfile_header hdr;
+	struct capfile_index_entry *index;
+	uint64_t count;
+	int index_mapped;		/* index points into index_map */
+	void *index_map;
+	size_t index_map_len;
+	unsigned char *window;		/* currently mapped part of the file */
+	uint64_t window_offset;
+	size_t window_len;
+};
+
+int capfile_open(struct capfile_reader *r, const char *path);
+
+/* Returns pointer to payload of frame n, valid until the next call. NULL
+ * if it is not in the file. A mapped index with entries outside the file
+ * is thrown away by capfile_open(), which then scans the frame records */
+const unsigned char *capfile_frame(struct capfile_reader *r, uint64_t n, struct capfile_index_entry *info);
+
+void capfile_close_reader(struct capfile_reader *r);
+
+#endif // _CAPFILE_H_
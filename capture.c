@@ -31,6 +31,10 @@
 
 
 #include "jpeg_mem.h"
+#include "source.h"
+#include "convert.h"
+#include "trace.h"
+#include "roi.h"
 
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 
@@ -48,8 +52,19 @@ static char *defaultconsoledevice = "/dev/tty";
 static char *fbdevice = NULL;
 static char *consoledevice = NULL;
 
+/* No framebuffer: frames are dropped, or only read with touch */
+static int headless = 0;
+static int touch = 0;
+static volatile unsigned int touch_sum;
+
 struct v4l2_format fmt;
 
+/* Region of interest, from --crop, and the part of the frames shown */
+static int roi_mode = 0;
+static struct roi roi;
+static long view_offset;
+static unsigned int view_width, view_height, view_stride;
+
 union multiptr {
         unsigned char *p8;
         unsigned short *p16;
@@ -210,43 +225,61 @@ int xioctl (int fd, int request, void *arg) {
 
 void process_image_SBGGR8(unsigned char* p, int len)
 {
-	int max_width = 352;
-	int max_height = 288;
-	int dX = 0, dY = 0;
-	unsigned int x,y,c,r,g,b;
-	for(y=0;y<max_height-1;y++)
-		for(x=0;x<max_width-1;x++) {
-			if((y % 2) == dY) { // second line
-				if((x % 2) == dX) {
-					g = p[y*max_width+x];// Green
-					r = (p[(y-1)*max_width+x] + p[(y+1)*max_width+x])/2;
-					b = (p[y*max_width+x-1] + p[y*max_width+x+1])/2;
-				} else {
-					b = p[y*max_width+x];; // Blue
-					g = (p[y*max_width+x-1] + p[y*max_width+x+1] + p[(y-1)*max_width+x] + p[(y+1)*max_width+x]) / 4;
-					r = (p[(y+1)*max_width+x+1] + p[(y+1)*max_width+x-1] + p[(y-1)*max_width+x-1] + p[(y-1)*max_width+x+1]) / 4;
-				}
-			} else { // first line
-				if((x % 2) == dX) {
-					r = p[y*max_width+x];; // Red
-					b = (p[(y+1)*max_width+x+1] + p[(y+1)*max_width+x-1] + p[(y-1)*max_width+x-1] + p[(y-1)*max_width+x+1]) / 4;
-					g = (p[(y+1)*max_width+x] + p[(y-1)*max_width+x] + p[y*max_width+x-1] + p[y*max_width+x+1]) / 4;
-				} else {
-					g = p[y*max_width+x]; // Green
-					r = (p[y*max_width+x-1] + p[y*max_width+x+1]) / 2;
-					b = (p[(y-1)*max_width+x] + p[(y+1)*max_width+x])/2;
-				}
-			}
+	/* Gains this sensor always needed: 1.5, 1.5 * 0.9, 1.5 * 1.2 */
+	static const struct convert_gains gains = { 384, 346, 461 };
+	int width = view_width, height = view_height;
 
-			r = ((int)(r * 1.5));
-			g = ((int)(g * 1.5 * 0.9));
-			b = ((int)(b * 1.5 * 1.2));
+	if (width > xres)
+		width = xres;
+	if (height > yres)
+		height = yres;
 
-			#define SATURATE8(x) (x > 255 ? 255 : x)
+	convert_bayer_bilinear(p + view_offset, view_stride, (uint32_t *) fbuffer, fix.line_length, width, height, 0, 0, &gains);
+}
 
-			pixel32(x, y, (SATURATE8(r) << 16) | (SATURATE8(g) << 8) | SATURATE8(b));
-		}
+/* Whole frames, or the region cut out of them in place */
+int set_view(unsigned int format, unsigned int width, unsigned int height, unsigned int bytesperline)
+{
+	view_offset = 0;
+	view_width = width;
+	view_height = height;
+	view_stride = bytesperline;
+
+	if (!roi_mode) {
+		if (!view_stride)
+			view_stride = width;
+		return 0;
+	}
 
+	view_offset = roi_offset(&roi, format, width, height, &view_stride);
+	if (view_offset < 0) {
+		fprintf(stderr, "Can't crop these frames\n");
+		return -1;
+	}
+	view_width = roi.width;
+	view_height = roi.height;
+
+	return 0;
+}
+
+/* Read one byte per cache line, so headless runs still pull frames into the cache */
+void touch_frame(const unsigned char *p, int len)
+{
+	unsigned int acc = 0;
+	int i;
+
+	for (i = 0; i < len; i += 64)
+		acc += p[i];
+
+	touch_sum += acc;
+}
+
+void show_frame(unsigned char *p, int len)
+{
+	if (!headless)
+		process_image_SBGGR8(p, len);
+	else if (touch)
+		touch_frame(p, len);
 }
 
 int read_frame(int fd)
@@ -255,6 +288,7 @@ int read_frame(int fd)
 	unsigned int i;
 
 	struct timeval t1, t2;
+	uint64_t tr;
 
 	gettimeofday(&t1, NULL);
 
@@ -263,12 +297,15 @@ int read_frame(int fd)
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	buf.memory = V4L2_MEMORY_MMAP;
 
+	tr = trace_begin("dequeue");
 
 	if (xioctl (fd, VIDIOC_DQBUF, &buf) == -1) {
 		fprintf(stderr, "ioctl error (VIDIOC_DQBUF)\n");
 		return -1;
 	}
 
+	trace_end("dequeue", tr, buf.sequence);
+
 
 	if(buf.index >= capture_n_buffers) {
 		fprintf(stderr, "Weird buffer index: %d, capture_n_buffers: %d\n", buf.index, capture_n_buffers);
@@ -276,13 +313,17 @@ int read_frame(int fd)
 	}
 
 
+	tr = trace_begin("process");
 	if(fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_SBGGR8)
-    			process_image_SBGGR8 (capture_buffers[0].start, 0);
+    			show_frame (capture_buffers[0].start, buf.bytesused);
+	trace_end("process", tr, buf.sequence);
 
+	tr = trace_begin("requeue");
 	if (xioctl (fd, VIDIOC_QBUF, &buf) == -1) {
 		fprintf(stderr, "Failed to enqueue capture buffer, index: %d\n", buf.index);
 		return -1;
 	}
+	trace_end("requeue", tr, buf.sequence);
 
 
 	gettimeofday(&t2, NULL);
@@ -446,7 +487,20 @@ int capture_init_device(char *dev_name, int format, int width, int height) {
 
         cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-        if (0 == xioctl (fd, VIDIOC_CROPCAP, &cropcap)) {
+	if (roi_mode) {
+		struct roi sel = roi;
+
+		/* The sensor sends only the region, or whole frames are cropped here */
+		if (roi_select(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, &sel)) {
+			fprintf(stderr, "Sensor crops %dx%d+%d+%d\n", sel.width, sel.height, sel.left, sel.top);
+			width = sel.width;
+			height = sel.height;
+			roi.left = roi.left > sel.left ? roi.left - sel.left : 0;
+			roi.top = roi.top > sel.top ? roi.top - sel.top : 0;
+		} else {
+			fprintf(stderr, "%s can't crop, cropping whole frames\n", dev_name);
+		}
+	} else if (0 == xioctl (fd, VIDIOC_CROPCAP, &cropcap)) {
                 crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
                 crop.c = cropcap.defrect; /* reset to default */
 
@@ -476,6 +530,9 @@ int capture_init_device(char *dev_name, int format, int width, int height) {
 
         /* Note VIDIOC_S_FMT may change width and height. */
 
+	if (set_view(format, fmt.fmt.pix.width, fmt.fmt.pix.height, fmt.fmt.pix.bytesperline) < 0)
+		return -1;
+
 	/* Buggy driver paranoia. */
 	min = fmt.fmt.pix.width * 2;
 	if (fmt.fmt.pix.bytesperline < min)
@@ -556,6 +613,41 @@ int capture_init_device(char *dev_name, int format, int width, int height) {
 
 
 
+/* Show frames of a recording instead of the sensor */
+int replay_mainloop(const char *path) {
+
+	struct frame_source src;
+	struct frame frame;
+	int ret;
+
+	if (source_file_open(&src, path, 1, V4L2_PIX_FMT_SBGGR8, 352, 288, 15) < 0)
+		return -1;
+
+	if (src.pixelformat != V4L2_PIX_FMT_SBGGR8) {
+		fprintf(stderr, "Replay supports SBGGR8 recordings only\n");
+		source_close(&src);
+		return -1;
+	}
+
+	if (set_view(src.pixelformat, src.width, src.height, src.bytesperline) < 0) {
+		source_close(&src);
+		return -1;
+	}
+
+	while ((ret = source_dequeue(&src, &frame)) > 0) {
+		uint64_t tr = trace_begin("process");
+
+		show_frame(frame.data, frame.bytesused);
+		trace_end("process", tr, frame.sequence);
+	}
+
+	printf("Replayed %llu frames\n", src.frames);
+
+	source_close(&src);
+
+	return ret;
+}
+
 static void
 usage                           (FILE *                 fp,
                                  int                    argc,
@@ -569,11 +661,16 @@ usage                           (FILE *                 fp,
                  "-m | --mmap          Use memory mapped buffers\n"
                  "-r | --read          Use read() calls\n"
                  "-u | --userp         Use application allocated buffers\n"
+                 "-R | --replay file   Replay a recording instead of capturing\n"
+                 "-n | --headless      Don't use the framebuffer\n"
+                 "-t | --touch         Headless, still read every frame\n"
+                 "-T | --trace file    Write stage trace events to file as Chrome trace JSON\n"
+                 "-C | --crop WxH+X+Y  Only show this region, cropped by the sensor if it can\n"
                  "",
 		 argv[0]);
 }
 
-static const char short_options [] = "d:hmru";
+static const char short_options [] = "d:hmruR:ntT:C:";
 
 static const struct option
 long_options [] = {
@@ -582,6 +679,11 @@ long_options [] = {
         { "mmap",       no_argument,            NULL,           'm' },
         { "read",       no_argument,            NULL,           'r' },
         { "userp",      no_argument,            NULL,           'u' },
+        { "replay",     required_argument,      NULL,           'R' },
+        { "headless",   no_argument,            NULL,           'n' },
+        { "touch",      no_argument,            NULL,           't' },
+        { "trace",      required_argument,      NULL,           'T' },
+        { "crop",       required_argument,      NULL,           'C' },
         { 0, 0, 0, 0 }
 };
 
@@ -627,7 +729,9 @@ int set_framerate(int dev, int rate) {
 int main (int argc, char ** argv)
 {
         char *dev_name = "/dev/video";
-	int fd = -1;
+        char *replay_file = NULL;
+        char *trace_file = NULL;
+	int fd = -1, ret;
 
         for (;;) {
                 int index;
@@ -648,6 +752,29 @@ int main (int argc, char ** argv)
                         dev_name = optarg;
                         break;
 
+                case 'R':
+                        replay_file = optarg;
+                        break;
+
+                case 'n':
+                        headless = 1;
+                        break;
+
+                case 't':
+                        headless = 1;
+                        touch = 1;
+                        break;
+
+                case 'T':
+                        trace_file = optarg;
+                        break;
+
+                case 'C':
+                        if (roi_parse(optarg, &roi) < 0)
+                                exit (EXIT_FAILURE);
+                        roi_mode = 1;
+                        break;
+
                 case 'h':
                         usage (stdout, argc, argv);
                         exit (EXIT_SUCCESS);
@@ -658,7 +785,22 @@ int main (int argc, char ** argv)
                 }
         }
 
-	open_framebuffer();
+	convert_init(NULL);
+
+	if (!headless && open_framebuffer() < 0) {
+		fprintf(stderr, "No framebuffer, running headless\n");
+		headless = 1;
+	}
+
+	if (trace_file && trace_init(trace_file, 0) < 0)
+		return -1;
+
+	if (replay_file) {
+		ret = replay_mainloop(replay_file);
+		if (trace_file)
+			trace_stop();
+		return ret < 0 ? -1 : 0;
+	}
 
 	if((fd = capture_init_device(dev_name, V4L2_PIX_FMT_SBGGR8, 352, 288)) < 0)
 	//if((fd = capture_init_device(dev_name, V4L2_PIX_FMT_MJPEG, 320, 240)) < 0)
@@ -675,5 +817,8 @@ int main (int argc, char ** argv)
 
         capture_uninit_device(fd);
 
+	if (trace_file)
+		trace_stop();
+
         return 0;
 }
@@ -0,0 +1,527 @@
+/*
+ *      compress.c  --  lossless delta + Rice frame compression
+ *
+ *      Bits are written MSB first through a 64 bit accumulator. A block
+ *      starts with its 3 bit Rice parameter k; a residual v is coded as
+ *      v >> k in unary (ones, terminated by a zero) followed by the low k
+ *      bits. Quotients of 16 or more are escaped: 16 ones and 8 raw bits.
+ *
+ *      The pool copies each frame into a slot, workers compress slots in
+ *      parallel and whoever finishes the oldest outstanding slot appends
+ *      the finished run to the capfile, so frames are written in order.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/videodev2.h>
+
+#include "compress.h"
+#include "rtsched.h"
+
+#define COMPRESS_ESCAPE		16
+
+/* Prediction distance for byte positions 0..3 of every 4 */
+static void compress_distance(uint32_t fourcc, int d[4]) {
+
+	switch(fourcc) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+		d[0] = 2; d[1] = 4; d[2] = 2; d[3] = 4;
+		break;
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_VYUY:
+		d[0] = 4; d[1] = 2; d[2] = 4; d[3] = 2;
+		break;
+	case V4L2_PIX_FMT_SBGGR8:
+	case V4L2_PIX_FMT_SGBRG8:
+	case V4L2_PIX_FMT_SGRBG8:
+	case V4L2_PIX_FMT_SRGGB8:
+	case V4L2_PIX_FMT_RGB565:
+		d[0] = d[1] = d[2] = d[3] = 2;
+		break;
+	default:
+		d[0] = d[1] = d[2] = d[3] = 1;
+		break;
+	}
+}
+
+struct bitwriter {
+	uint64_t acc;
+	int nbits;
+	unsigned char *p;
+};
+
+static inline void put_bits(struct bitwriter *bw, uint32_t v, int n) {
+
+	bw->acc = (bw->acc << n) | v;
+	bw->nbits += n;
+
+	if(bw->nbits >= 32) {
+		uint32_t w;
+
+		bw->nbits -= 32;
+		w = bw->acc >> bw->nbits;
+		bw->p[0] = w >> 24;
+		bw->p[1] = w >> 16;
+		bw->p[2] = w >> 8;
+		bw->p[3] = w;
+		bw->p += 4;
+	}
+}
+
+static inline void flush_bits(struct bitwriter *bw) {
+
+	while(bw->nbits > 0) {
+		int n = bw->nbits >= 8 ? 8 : bw->nbits;
+
+		*bw->p++ = (bw->acc << (8 - n)) >> (bw->nbits - n);
+		bw->nbits -= n;
+	}
+}
+
+size_t compress_frame(uint32_t fourcc, const unsigned char *src, size_t len, unsigned char *dst) {
+
+	struct compress_header *h = (struct compress_header *) dst;
+	unsigned char *limit = dst + sizeof(*h) + len;
+	struct bitwriter bw;
+	uint8_t res[COMPRESS_BLOCK];
+	size_t i, j, n;
+	int d[4];
+
+	compress_distance(fourcc, d);
+
+	h->magic = COMPRESS_MAGIC;
+	h->raw_len = len;
+	h->fourcc = fourcc;
+	h->method = COMPRESS_DELTA_RICE;
+	h->reserved = 0;
+
+	bw.acc = 0;
+	bw.nbits = 0;
+	bw.p = dst + sizeof(*h);
+
+	for(i = 0; i < len; i += n) {
+		unsigned int sum = 0, k = 0;
+
+		n = len - i < COMPRESS_BLOCK ? len - i : COMPRESS_BLOCK;
+
+		for(j = 0; j < n; j++) {
+			size_t pos = i + j;
+			int dist = d[pos & 3];
+			int8_t r = src[pos] - (pos >= (size_t) dist ? src[pos - dist] : 0);
+
+			res[j] = (r << 1) ^ (r >> 7);	/* zigzag */
+			sum += res[j];
+		}
+
+		while(k < 7 && (n << (k + 1)) <= sum)
+			k++;
+
+		put_bits(&bw, k, 3);
+
+		for(j = 0; j < n; j++) {
+			uint32_t v = res[j], q = v >> k;
+
+			/* Incompressible, store instead. A residual takes at most 4
+			 * bytes, 4 more are left for the final flush */
+			if(bw.p + 8 >= limit) {
+				h->method = COMPRESS_STORED;
+				memcpy(dst + sizeof(*h), src, len);
+				return sizeof(*h) + len;
+			}
+
+			if(q >= COMPRESS_ESCAPE)
+				put_bits(&bw, (0xffff << 8) | v, COMPRESS_ESCAPE + 8);
+			else
+				put_bits(&bw, ((((1 << q) - 1) << 1) << k) | (v & ((1 << k) - 1)), q + 1 + k);
+		}
+	}
+
+	flush_bits(&bw);
+
+	return bw.p - dst;
+}
+
+long compressed_raw_size(const unsigned char *src, size_t len) {
+
+	const struct compress_header *h = (const struct compress_header *) src;
+
+	if(len < sizeof(*h) || h->magic != COMPRESS_MAGIC)
+		return -1;
+
+	return h->raw_len;
+}
+
+long decompress_frame(const unsigned char *src, size_t len, unsigned char *dst, size_t dst_size) {
+
+	const struct compress_header *h = (const struct compress_header *) src;
+	const unsigned char *p, *end = src + len;
+	uint64_t acc = 0;
+	int nbits = 0, d[4];
+	size_t i, j, n, raw_len;
+
+	if(compressed_raw_size(src, len) < 0 || h->raw_len > dst_size)
+		return -1;
+
+	raw_len = h->raw_len;
+	p = src + sizeof(*h);
+
+	if(h->method == COMPRESS_STORED) {
+		if(len - sizeof(*h) < raw_len)
+			return -1;
+		memcpy(dst, p, raw_len);
+		return raw_len;
+	}
+
+	if(h->method != COMPRESS_DELTA_RICE)
+		return -1;
+
+	compress_distance(h->fourcc, d);
+
+	for(i = 0; i < raw_len; i += n) {
+		unsigned int k;
+
+		n = raw_len - i < COMPRESS_BLOCK ? raw_len - i : COMPRESS_BLOCK;
+
+		for(j = 0; j < n; j++) {
+			size_t pos = i + j;
+			int dist = d[pos & 3];
+			unsigned int ones, v;
+
+			/* Keep at least 3 + 24 bits, reading past the end yields zeros */
+			if(nbits < 32) {
+				if(p + 4 <= end) {
+					acc |= (uint64_t) ((uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) << (32 - nbits);
+					p += 4;
+					nbits += 32;
+				} else {
+					while(nbits <= 56) {
+						acc |= (uint64_t) (p < end ? *p : 0) << (56 - nbits);
+						p++;
+						nbits += 8;
+					}
+				}
+			}
+
+			if(j == 0) {
+				k = acc >> 61;
+				acc <<= 3;
+				nbits -= 3;
+			}
+
+			/* Sentinel bit bounds the count at the escape length */
+			ones = __builtin_clzll(~acc | (1ULL << (63 - COMPRESS_ESCAPE)));
+
+			if(ones >= COMPRESS_ESCAPE) {
+				v = (acc << COMPRESS_ESCAPE) >> 56;
+				acc <<= COMPRESS_ESCAPE + 8;
+				nbits -= COMPRESS_ESCAPE + 8;
+			} else {
+				acc <<= ones + 1;
+				v = (ones << k) | (k ? (uint32_t) (acc >> (64 - k)) : 0);
+				acc <<= k;
+				nbits -= ones + 1 + k;
+			}
+
+			/* unzigzag */
+			dst[pos] = (uint8_t) ((v >> 1) ^ -(v & 1)) + (pos >= (size_t) dist ? dst[pos - dist] : 0);
+		}
+	}
+
+	if(p - end > 8)
+		return -1;
+
+	return raw_len;
+}
+
+
+/* Worker pool */
+
+enum {
+	SLOT_FREE = 0,
+	SLOT_QUEUED,
+	SLOT_BUSY,
+	SLOT_DONE,
+};
+
+struct compress_slot {
+	unsigned char *in;
+	unsigned char *out;
+	size_t in_len;
+	size_t out_len;
+	uint32_t sequence;
+	uint32_t flags;
+	struct timeval timestamp;
+	int state;
+};
+
+struct compressor {
+	struct capfile_writer *cf;
+	uint32_t fourcc;
+	size_t frame_size;
+
+	int nworkers;
+	pthread_t *threads;
+	int nslots;
+	struct compress_slot *slots;
+
+	/* Slot n is slots[n % nslots], all three only grow */
+	unsigned long long submitted;
+	unsigned long long next_job;
+	unsigned long long committed;
+	int committing;
+	int stop;
+	int error;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond_job;
+	pthread_cond_t cond_free;
+
+	struct compress_stats stats;
+};
+
+static unsigned long long compress_usec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Called with lock held, appends finished slots in submission order */
+static void compressor_commit(struct compressor *c) {
+
+	if(c->committing)
+		return;
+
+	c->committing = 1;
+
+	while(c->committed < c->submitted && c->slots[c->committed % c->nslots].state == SLOT_DONE) {
+		struct compress_slot *s = &c->slots[c->committed % c->nslots];
+		struct iovec iov = { s->out, s->out_len };
+		int rc;
+
+		pthread_mutex_unlock(&c->lock);
+		rc = capfile_append(c->cf, &iov, 1, s->sequence, s->flags, &s->timestamp);
+		pthread_mutex_lock(&c->lock);
+
+		if(rc < 0)
+			c->error = 1;
+
+		s->state = SLOT_FREE;
+		c->committed++;
+		pthread_cond_broadcast(&c->cond_free);
+	}
+
+	c->committing = 0;
+}
+
+static void *compressor_thread(void *arg) {
+
+	struct compressor *c = (struct compressor *) arg;
+
+	rt_thread("io");
+
+	pthread_mutex_lock(&c->lock);
+
+	for(;;) {
+		struct compress_slot *s;
+		unsigned long long t0, t;
+
+		while(!c->stop && c->next_job == c->submitted)
+			pthread_cond_wait(&c->cond_job, &c->lock);
+
+		if(c->next_job == c->submitted)
+			break;
+
+		s = &c->slots[c->next_job % c->nslots];
+		c->next_job++;
+		s->state = SLOT_BUSY;
+
+		pthread_mutex_unlock(&c->lock);
+
+		t0 = compress_usec();
+		s->out_len = compress_frame(c->fourcc, s->in, s->in_len, s->out);
+		t = compress_usec() - t0;
+
+		pthread_mutex_lock(&c->lock);
+
+		s->state = SLOT_DONE;
+		c->stats.frames++;
+		c->stats.raw_bytes += s->in_len;
+		c->stats.bytes += s->out_len;
+		c->stats.usec += t;
+		if(((struct compress_header *) s->out)->method == COMPRESS_STORED)
+			c->stats.stored++;
+
+		compressor_commit(c);
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+struct compressor *compressor_create(struct capfile_writer *cf, uint32_t fourcc, size_t frame_size, int nworkers) {
+
+	struct compressor *c;
+	int i;
+
+	if(nworkers < 1)
+		nworkers = 1;
+
+	c = (struct compressor *) calloc(1, sizeof(*c));
+	if(!c)
+		return NULL;
+
+	c->cf = cf;
+	c->fourcc = fourcc;
+	c->frame_size = frame_size;
+	c->nworkers = nworkers;
+	c->nslots = nworkers + 2;
+
+	c->threads = (pthread_t *) calloc(nworkers, sizeof(pthread_t));
+	c->slots = (struct compress_slot *) calloc(c->nslots, sizeof(struct compress_slot));
+	if(!c->threads || !c->slots)
+		goto fail;
+
+	for(i = 0; i < c->nslots; i++) {
+		c->slots[i].in = (unsigned char *) malloc(frame_size);
+		c->slots[i].out = (unsigned char *) malloc(COMPRESS_BOUND(frame_size));
+		if(!c->slots[i].in || !c->slots[i].out) {
+			printf("compress: out of memory for %d slots of %zu bytes\n", c->nslots, frame_size);
+			goto fail;
+		}
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond_job, NULL);
+	pthread_cond_init(&c->cond_free, NULL);
+
+	for(i = 0; i < nworkers; i++) {
+		if(pthread_create(&c->threads[i], NULL, compressor_thread, c)) {
+			printf("compress: cannot start worker thread\n");
+			c->nworkers = i;
+			compressor_close(c);
+			return NULL;
+		}
+	}
+
+	printf("compress: %d worker threads, %d slots of %zu KB\n", nworkers, c->nslots, frame_size >> 10);
+
+	return c;
+
+fail:
+	if(c->slots)
+		for(i = 0; i < c->nslots; i++) {
+			free(c->slots[i].in);
+			free(c->slots[i].out);
+		}
+	free(c->slots);
+	free(c->threads);
+	free(c);
+	return NULL;
+}
+
+int compressor_submit(struct compressor *c, const unsigned char *data, size_t len,
+	uint32_t sequence, uint32_t flags, const struct timeval *timestamp) {
+
+	struct compress_slot *s = &c->slots[c->submitted % c->nslots];
+
+	if(len > c->frame_size) {
+		printf("compress: frame of %zu bytes exceeds slot size %zu\n", len, c->frame_size);
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+
+	if(s->state != SLOT_FREE) {
+		unsigned long long t0 = compress_usec();
+
+		c->stats.stalls++;
+		while(s->state != SLOT_FREE)
+			pthread_cond_wait(&c->cond_free, &c->lock);
+		c->stats.stall_usec += compress_usec() - t0;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	memcpy(s->in, data, len);
+	s->in_len = len;
+	s->sequence = sequence;
+	s->flags = flags;
+	s->timestamp = *timestamp;
+
+	pthread_mutex_lock(&c->lock);
+	s->state = SLOT_QUEUED;
+	c->submitted++;
+	pthread_cond_signal(&c->cond_job);
+	pthread_mutex_unlock(&c->lock);
+
+	return c->error ? -1 : 0;
+}
+
+int compressor_flush(struct compressor *c) {
+
+	pthread_mutex_lock(&c->lock);
+	while(c->committed < c->submitted)
+		pthread_cond_wait(&c->cond_free, &c->lock);
+	pthread_mutex_unlock(&c->lock);
+
+	return c->error ? -1 : 0;
+}
+
+int compressor_close(struct compressor *c) {
+
+	int i, rc;
+
+	pthread_mutex_lock(&c->lock);
+	c->stop = 1;
+	pthread_cond_broadcast(&c->cond_job);
+	pthread_mutex_unlock(&c->lock);
+
+	for(i = 0; i < c->nworkers; i++)
+		pthread_join(c->threads[i], NULL);
+
+	rc = c->error ? -1 : 0;
+
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond_job);
+	pthread_cond_destroy(&c->cond_free);
+
+	for(i = 0; i < c->nslots; i++) {
+		free(c->slots[i].in);
+		free(c->slots[i].out);
+	}
+	free(c->slots);
+	free(c->threads);
+	free(c);
+
+	return rc;
+}
+
+void compressor_get_stats(struct compressor *c, struct compress_stats *stats) {
+
+	pthread_mutex_lock(&c->lock);
+	*stats = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void compressor_print_stats(struct compressor *c, FILE *fp) {
+
+	struct compress_stats st;
+
+	compressor_get_stats(c, &st);
+
+	fprintf(fp, "Compression: %llu frames (%llu stored), %.1f MB -> %.1f MB, ratio %.2f, "
+		"%.1f MB/s per core on %d threads, %llu stalls (%llu ms)\n",
+		st.frames, st.stored, st.raw_bytes / 1048576.0, st.bytes / 1048576.0,
+		st.bytes ? (double) st.raw_bytes / st.bytes : 0.0,
+		st.usec ? st.raw_bytes / 1048576.0 / (st.usec / 1000000.0) : 0.0,
+		c->nworkers, st.stalls, st.stall_usec / 1000);
+}
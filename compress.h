@@ -0,0 +1,76 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+#include "capfile.h"
+
+/*
+ * Lossless frame compression for raw recordings. Each byte is predicted
+ * from the previous sample of the same component (2 or 4 bytes back for
+ * YUYV/UYVY, 2 for Bayer and RGB565, 1 otherwise), residuals are Rice
+ * coded with the parameter chosen per block of COMPRESS_BLOCK samples.
+ * Every frame carries its own header and decodes on its own; frames that
+ * don't shrink are stored.
+ */
+
+#define COMPRESS_MAGIC		0x315a4356	/* "VCZ1" */
+#define COMPRESS_STORED		0
+#define COMPRESS_DELTA_RICE	1
+
+#define COMPRESS_BLOCK		64
+
+struct compress_header {
+	uint32_t magic;
+	uint32_t raw_len;
+	uint32_t fourcc;
+	uint16_t method;
+	uint16_t reserved;
+};
+
+/* Worst case output size for len bytes of input */
+#define COMPRESS_BOUND(len)	((len) + sizeof(struct compress_header) + 64)
+
+/* Return compressed length, dst must hold COMPRESS_BOUND(len) bytes */
+size_t compress_frame(uint32_t fourcc, const unsigned char *src, size_t len, unsigned char *dst);
+
+/* Return decompressed length, or -1 if the data is broken or does not fit */
+long decompress_frame(const unsigned char *src, size_t len, unsigned char *dst, size_t dst_size);
+
+/* Raw size of a compressed frame, or -1 if it isn't one */
+long compressed_raw_size(const unsigned char *src, size_t len);
+
+
+/* Worker pool compressing frames into a .vcap file, frames stay in order */
+
+struct compress_stats {
+	unsigned long long frames;
+	unsigned long long stored;		/* incompressible, written as is */
+	unsigned long long raw_bytes;
+	unsigned long long bytes;		/* after compression, with headers */
+	unsigned long long usec;		/* summed over all workers */
+	unsigned long long stalls;		/* producer waited for a free slot */
+	unsigned long long stall_usec;
+};
+
+struct compressor;
+
+struct compressor *compressor_create(struct capfile_writer *cf, uint32_t fourcc, size_t frame_size, int nworkers);
+
+/* Copies the frame, returns once it is queued. 0 on success, -1 on error */
+int compressor_submit(struct compressor *c, const unsigned char *data, size_t len,
+	uint32_t sequence, uint32_t flags, const struct timeval *timestamp);
+
+/* Wait until all submitted frames are compressed and appended */
+int compressor_flush(struct compressor *c);
+
+/* Flushes, returns -1 if any frame failed */
+int compressor_close(struct compressor *c);
+
+void compressor_get_stats(struct compressor *c, struct compress_stats *stats);
+void compressor_print_stats(struct compressor *c, FILE *fp);
+
+#endif // _COMPRESS_H_
@@ -0,0 +1,101 @@
+/*
+ *      compress_test.c  --  round trips of compress_frame()
+ *
+ *      Frames of every length up to a few pages, compressible and not,
+ *      into buffers of exactly COMPRESS_BOUND(len) followed by guard
+ *      bytes, which must come back untouched. Run by make test.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <linux/videodev2.h>
+
+#include "compress.h"
+
+#define GUARD		64
+#define MAX_LEN		8192
+
+/* Steps of 191: every residual zigzags to 129, the worst Rice block */
+static void make_ramp(unsigned char *p, size_t len) {
+
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		p[i] = i * 191;
+}
+
+static void make_noise(unsigned char *p, size_t len) {
+
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		p[i] = rand();
+}
+
+static void make_smooth(unsigned char *p, size_t len) {
+
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		p[i] = 128 + (i / 64) % 8;
+}
+
+static const struct {
+	const char *name;
+	void (*make)(unsigned char *p, size_t len);
+	uint32_t fourcc;
+} cases[] = {
+	{ "ramp",	make_ramp,	V4L2_PIX_FMT_GREY },
+	{ "noise",	make_noise,	V4L2_PIX_FMT_YUYV },
+	{ "smooth",	make_smooth,	V4L2_PIX_FMT_SBGGR8 },
+};
+
+int main(void) {
+
+	unsigned char *src, *dst, *out;
+	size_t len, bound, n, g;
+	unsigned int c;
+	int failed = 0;
+	long ret;
+
+	src = (unsigned char *) malloc(MAX_LEN);
+	out = (unsigned char *) malloc(MAX_LEN);
+	dst = (unsigned char *) malloc(COMPRESS_BOUND(MAX_LEN) + GUARD);
+	if(!src || !out || !dst) {
+		printf("Out of memory\n");
+		return 1;
+	}
+
+	for(c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		int bad = 0;
+
+		for(len = 1; len <= MAX_LEN && bad < 5; len++) {
+			cases[c].make(src, len);
+			bound = COMPRESS_BOUND(len);
+			memset(dst + bound, 0xa5, GUARD);
+
+			n = compress_frame(cases[c].fourcc, src, len, dst);
+			g = 0;
+			while(g < GUARD && dst[bound + g] == 0xa5)
+				g++;
+
+			ret = decompress_frame(dst, n, out, len);
+			if(n > bound || g < GUARD || ret != (long) len || memcmp(src, out, len)) {
+				printf("%s: %zu bytes, %zu compressed, bound %zu, %s\n", cases[c].name, len, n, bound,
+					g < GUARD ? "wrote past the bound" : "round trip differs");
+				bad++;
+			}
+		}
+
+		printf("%s: %s\n", cases[c].name, bad ? "FAILED" : "ok");
+		failed += bad;
+	}
+
+	free(src);
+	free(out);
+	free(dst);
+
+	return failed ? 1 : 0;
+}
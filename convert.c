@@ -0,0 +1,395 @@
+/*
+ *      convert.c  --  pixel conversion kernels to XRGB8888
+ *
+ *      YUV uses the integer BT.601 video range formulas the display code
+ *      always had: C = Y - 16, D = U - 128, E = V - 128,
+ *      R = (298C + 409E + 128) >> 8, G = (298C - 100D - 208E + 128) >> 8,
+ *      B = (298C + 516D) >> 8.
+ *
+ *      Kernels with SIMD variants are called through pointers set by
+ *      convert_init(); the variants are exact, they give the same pixels
+ *      as the scalar code here, which convert_test.c checks.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/auxv.h>
+
+#include "convert.h"
+#include "convert_simd.h"
+#include "memcpy_neon.h"
+
+#if defined(__aarch64__) && !defined(HWCAP_ASIMD)
+#define HWCAP_ASIMD		(1 << 1)
+#endif
+#if defined(__arm__) && !defined(HWCAP_NEON)
+#define HWCAP_NEON		(1 << 12)
+#endif
+
+#define CLAMP8(x)	((unsigned int) (x) <= 255 ? (unsigned int) (x) : ((x) < 0 ? 0 : 255))
+
+static inline uint32_t yuv_pixel(int y, int r_prod, int g_prod, int b_prod) {
+
+	int r, g, b;
+
+	y = (y - 16) * 298;
+	r = (y + r_prod) >> 8;
+	g = (y - g_prod) >> 8;
+	b = (y + b_prod) >> 8;
+
+	return (CLAMP8(r) << 16) | (CLAMP8(g) << 8) | CLAMP8(b);
+}
+
+void convert_rgb565_c(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height) {
+
+	int x, y;
+
+	for(y = 0; y < height; y++) {
+		const uint16_t *s = (const uint16_t *) (src + (size_t) y * src_stride);
+		uint32_t *p = (uint32_t *) ((uint8_t *) dst + (size_t) y * dst_stride);
+
+		for(x = 0; x < width; x++) {
+			unsigned int c = s[x];
+
+			p[x] = ((c >> 11) << 19) | (((c >> 5) & 0x3f) << 10) | ((c & 0x1f) << 3);
+		}
+	}
+}
+
+/* Both pixels of a pair use the U and V of that pair */
+void convert_422_c(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	int uyvy) {
+
+	int y0 = uyvy, u0 = !uyvy, y1 = 2 + uyvy, v0 = 3 - uyvy;
+	int x, y;
+
+	for(y = 0; y < height; y++) {
+		const uint8_t *s = src + (size_t) y * src_stride;
+		uint32_t *p = (uint32_t *) ((uint8_t *) dst + (size_t) y * dst_stride);
+
+		for(x = 0; x + 1 < width; x += 2, s += 4) {
+			int u = s[u0] - 128, v = s[v0] - 128;
+			int r_prod = 409 * v + 128;
+			int g_prod = 100 * u + 208 * v - 128;
+			int b_prod = 516 * u;
+
+			*p++ = yuv_pixel(s[y0], r_prod, g_prod, b_prod);
+			*p++ = yuv_pixel(s[y1], r_prod, g_prod, b_prod);
+		}
+	}
+}
+
+static void convert_copy_c(void *dst, const void *src, size_t len) {
+
+	memcpy(dst, src, len);
+}
+
+void convert_blit_c(void *dst, int dst_stride, const void *src, int src_stride, int width, int height) {
+
+	int y;
+
+	if(dst_stride == width && src_stride == width) {
+		memcpy(dst, src, (size_t) width * height);
+		return;
+	}
+
+	for(y = 0; y < height; y++)
+		memcpy((uint8_t *) dst + (size_t) y * dst_stride, (const uint8_t *) src + (size_t) y * src_stride, width);
+}
+
+uint32_t convert_sad_c(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height) {
+
+	uint32_t sad = 0;
+	int x, y;
+
+	for(y = 0; y < height; y++) {
+		const uint8_t *p = a + (size_t) y * a_stride, *q = b + (size_t) y * b_stride;
+
+		for(x = 0; x < width; x++)
+			sad += p[x] > q[x] ? p[x] - q[x] : q[x] - p[x];
+	}
+
+	return sad;
+}
+
+void convert_bggr8_quads_c(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums) {
+
+	uint32_t r = 0, g = 0, b = 0;
+	int i;
+
+	for(i = 0; i < quads; i++, s0 += 2, s1 += 2) {
+		b += s0[0];
+		g += s0[1] + s1[0];
+		r += s1[1];
+		luma[i] = (s0[0] + s0[1] + s1[0] + s1[1] + 2) >> 2;
+	}
+
+	sums[0] += r;
+	sums[1] += g;
+	sums[2] += b;
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void convert_copy_neon(void *dst, const void *src, size_t len) {
+
+	memcpy_neon(dst, (void *) src, len);
+}
+#endif
+
+
+/* Dispatch */
+
+struct convert_kernels {
+	void (*rgb565)(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height);
+	void (*yuv422)(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+		int uyvy);
+	void (*copy)(void *dst, const void *src, size_t len);
+	void (*blit)(void *dst, int dst_stride, const void *src, int src_stride, int width, int height);
+	uint32_t (*sad)(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+	void (*bggr8_quads)(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums);
+};
+
+static const struct convert_kernels convert_variants[CONVERT_ISAS] = {
+	[CONVERT_SCALAR] = { convert_rgb565_c, convert_422_c, convert_copy_c, convert_blit_c, convert_sad_c,
+		convert_bggr8_quads_c },
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	[CONVERT_NEON] = { convert_rgb565_neon, convert_422_neon, convert_copy_neon, convert_blit_neon, convert_sad_neon,
+		convert_bggr8_quads_neon },
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	/* libc memcpy already picks its best variant */
+	[CONVERT_SSE4] = { convert_rgb565_sse4, convert_422_sse4, convert_copy_c, convert_blit_sse4, convert_sad_sse4,
+		convert_bggr8_quads_sse4 },
+	[CONVERT_AVX2] = { convert_rgb565_avx2, convert_422_avx2, convert_copy_c, convert_blit_avx2, convert_sad_avx2,
+		convert_bggr8_quads_avx2 },
+#endif
+};
+
+static const char *convert_isa_names[CONVERT_ISAS] = { "scalar", "neon", "sse4", "avx2" };
+
+static int convert_selected = CONVERT_SCALAR;
+static const struct convert_kernels *convert_k = &convert_variants[CONVERT_SCALAR];
+
+unsigned int convert_isas(void) {
+
+	unsigned int isas = 1 << CONVERT_SCALAR;
+
+#if defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+	if(getauxval(AT_HWCAP) & HWCAP_ASIMD)
+		isas |= 1 << CONVERT_NEON;
+#elif defined(__arm__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+	if(getauxval(AT_HWCAP) & HWCAP_NEON)
+		isas |= 1 << CONVERT_NEON;
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.1"))
+		isas |= 1 << CONVERT_SSE4;
+	if(__builtin_cpu_supports("avx2"))
+		isas |= 1 << CONVERT_AVX2;
+#endif
+
+	return isas;
+}
+
+const char *convert_isa_name(int isa) {
+
+	return isa >= 0 && isa < CONVERT_ISAS ? convert_isa_names[isa] : "?";
+}
+
+int convert_isa(void) {
+
+	return convert_selected;
+}
+
+int convert_use(int isa) {
+
+	if(isa < 0 || isa >= CONVERT_ISAS || !(convert_isas() & (1 << isa)))
+		return -1;
+
+	convert_selected = isa;
+	convert_k = &convert_variants[isa];
+
+	return 0;
+}
+
+int convert_init(const char *name) {
+
+	unsigned int isas = convert_isas();
+	int isa;
+
+	if(!name || !strcmp(name, "auto")) {
+		/* Later entries are the faster ones */
+		for(isa = CONVERT_ISAS - 1; isa > CONVERT_SCALAR; isa--)
+			if(isas & (1 << isa))
+				break;
+		return convert_use(isa);
+	}
+
+	for(isa = 0; isa < CONVERT_ISAS; isa++)
+		if(!strcasecmp(name, convert_isa_names[isa]))
+			break;
+
+	if(isa == CONVERT_ISAS) {
+		printf("Unknown instruction set %s\n", name);
+		return -1;
+	}
+
+	if(convert_use(isa) < 0) {
+		printf("This CPU or build has no %s\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+void convert_rgb565(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height) {
+
+	convert_k->rgb565(src, src_stride, dst, dst_stride, width, height);
+}
+
+void convert_yuyv(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height) {
+
+	convert_k->yuv422(src, src_stride, dst, dst_stride, width, height, 0);
+}
+
+void convert_uyvy(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height) {
+
+	convert_k->yuv422(src, src_stride, dst, dst_stride, width, height, 1);
+}
+
+void convert_copy(void *dst, const void *src, size_t len) {
+
+	convert_k->copy(dst, src, len);
+}
+
+void convert_blit(void *dst, int dst_stride, const void *src, int src_stride, int width, int height) {
+
+	convert_k->blit(dst, dst_stride, src, src_stride, width, height);
+}
+
+void convert_blit_rect(uint32_t *dst, int dst_stride, const uint32_t *src, int src_stride,
+	int x, int y, int width, int height) {
+
+	convert_k->blit((uint8_t *) dst + (size_t) y * dst_stride + x * 4, dst_stride,
+		(const uint8_t *) src + (size_t) y * src_stride + x * 4, src_stride, width * 4, height);
+}
+
+uint32_t convert_sad(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height) {
+
+	return convert_k->sad(a, a_stride, b, b_stride, width, height);
+}
+
+void convert_bggr8_quads(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums) {
+
+	convert_k->bggr8_quads(s0, s1, luma, quads, sums);
+}
+
+void convert_copy_prefetch(void *dst, const void *src, size_t len, int lines) {
+
+	const uint8_t *s = (const uint8_t *) src;
+	uint8_t *d = (uint8_t *) dst;
+	size_t ahead = (size_t) lines * 64;
+
+	for(; len >= 64; len -= 64, s += 64, d += 64) {
+		__builtin_prefetch(s + ahead);
+		memcpy(d, s, 64);
+	}
+
+	memcpy(d, s, len);
+}
+
+void convert_sbggr8_blocks(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	const struct convert_gains *gains) {
+
+	unsigned int gr = gains ? gains->r : 256, gg = gains ? gains->g : 256, gb = gains ? gains->b : 256;
+	int x, y;
+
+	for(y = 0; y + 1 < height; y += 2) {
+		const uint8_t *s0 = src + (size_t) y * src_stride;
+		const uint8_t *s1 = s0 + src_stride;
+		uint32_t *p0 = (uint32_t *) ((uint8_t *) dst + (size_t) y * dst_stride);
+		uint32_t *p1 = (uint32_t *) ((uint8_t *) p0 + dst_stride);
+
+		for(x = 0; x + 1 < width; x += 2) {
+			unsigned int b = s0[x];
+			unsigned int g = (s0[x + 1] + s1[x]) / 2;
+			unsigned int r = s1[x + 1];
+			uint32_t c;
+
+			/* White balance, 1.0 leaves the pixels as they were */
+			r = (r * gr) >> 8;
+			g = (g * gg) >> 8;
+			b = (b * gb) >> 8;
+			c = 0xff000000 | ((r > 255 ? 255 : r) << 16) | ((g > 255 ? 255 : g) << 8) | (b > 255 ? 255 : b);
+
+			p0[x] = c;
+			p0[x + 1] = c;
+			p1[x] = c;
+			p1[x + 1] = c;
+		}
+	}
+}
+
+void convert_bayer_bilinear(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	int dx, int dy, const struct convert_gains *gains) {
+
+	unsigned int gr = gains ? gains->r : 256, gg = gains ? gains->g : 256, gb = gains ? gains->b : 256;
+	int x, y;
+
+	if(width < 3 || height < 3)
+		return;
+
+	/* Interior only, every pixel has all four neighbours */
+	for(y = 1; y < height - 1; y++) {
+		const uint8_t *s = src + (size_t) y * src_stride;
+		const uint8_t *up = s - src_stride, *down = s + src_stride;
+		uint32_t *p = (uint32_t *) ((uint8_t *) dst + (size_t) y * dst_stride);
+
+		for(x = 1; x < width - 1; x++) {
+			unsigned int r, g, b, hor = s[x - 1] + s[x + 1], ver = up[x] + down[x],
+				diag = up[x - 1] + up[x + 1] + down[x - 1] + down[x + 1];
+
+			if((y & 1) == dy) {
+				if((x & 1) == dx) {
+					g = s[x];
+					r = ver / 2;
+					b = hor / 2;
+				} else {
+					b = s[x];
+					g = (hor + ver) / 4;
+					r = diag / 4;
+				}
+			} else {
+				if((x & 1) == dx) {
+					r = s[x];
+					b = diag / 4;
+					g = (hor + ver) / 4;
+				} else {
+					g = s[x];
+					r = hor / 2;
+					b = ver / 2;
+				}
+			}
+
+			r = (r * gr) >> 8;
+			g = (g * gg) >> 8;
+			b = (b * gb) >> 8;
+
+			p[x] = ((r > 255 ? 255 : r) << 16) | ((g > 255 ? 255 : g) << 8) | (b > 255 ? 255 : b);
+		}
+
+		p[0] = p[1];
+		p[width - 1] = p[width - 2];
+	}
+
+	/* Border rows repeat their neighbours */
+	for(x = 0; x < width; x++) {
+		((uint32_t *) dst)[x] = ((uint32_t *) ((uint8_t *) dst + dst_stride))[x];
+		((uint32_t *) ((uint8_t *) dst + (size_t) (height - 1) * dst_stride))[x] =
+			((uint32_t *) ((uint8_t *) dst + (size_t) (height - 2) * dst_stride))[x];
+	}
+}
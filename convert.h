@@ -0,0 +1,80 @@
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Pixel conversion kernels to XRGB8888, as shown on the framebuffer.
+ * Strides are in bytes, width and height are what gets written: callers
+ * clip to the smaller of frame and screen.
+ */
+
+/* Instruction sets, in order of preference. rgb565, yuyv, uyvy, copy,
+ * blit and sad have variants for each, the Bayer kernels are scalar everywhere */
+enum convert_isa {
+	CONVERT_SCALAR = 0,
+	CONVERT_NEON,
+	CONVERT_SSE4,
+	CONVERT_AVX2,
+	CONVERT_ISAS,
+};
+
+/* Pick the variants to run: NULL or "auto" for the best this CPU has,
+ * else scalar, neon, sse4 or avx2. Until called, everything is scalar */
+int convert_init(const char *name);
+
+/* Bit 1 << isa for every instruction set both built in and on this CPU */
+unsigned int convert_isas(void);
+
+int convert_use(int isa);
+int convert_isa(void);
+const char *convert_isa_name(int isa);
+
+/* White balance in 8.8 fixed point, 256 is 1.0 */
+struct convert_gains {
+	unsigned int r, g, b;
+};
+
+void convert_rgb565(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height);
+
+/* Packed 4:2:2, two pixels share U and V; width is rounded down to even */
+void convert_yuyv(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height);
+void convert_uyvy(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height);
+
+/* Each BGGR quad becomes a 2x2 block of one color, cheap preview.
+ * gains may be NULL */
+void convert_sbggr8_blocks(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	const struct convert_gains *gains);
+
+/* Bilinear demosaic. Rows with y % 2 == dy hold green at x % 2 == dx and
+ * blue in between, other rows red at x % 2 == dx and green in between.
+ * gains may be NULL */
+void convert_bayer_bilinear(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	int dx, int dy, const struct convert_gains *gains);
+
+/* Frame sized copy, memcpy_neon on ARM */
+void convert_copy(void *dst, const void *src, size_t len);
+
+/* Copy in cache lines, prefetching lines ahead; not dispatched */
+void convert_copy_prefetch(void *dst, const void *src, size_t len, int lines);
+
+/* Rows of width bytes from cached memory to write-combined memory, the
+ * framebuffer: whole aligned 64 byte bursts, non-temporal where the ISA
+ * has such stores, so no line of the screen is ever read back */
+void convert_blit(void *dst, int dst_stride, const void *src, int src_stride, int width, int height);
+
+/* The same rectangle of XRGB pixels, at x, y in both */
+void convert_blit_rect(uint32_t *dst, int dst_stride, const uint32_t *src, int src_stride,
+	int x, int y, int width, int height);
+
+/* Sum of absolute differences of height rows of width bytes, to tell
+ * changed parts of a frame. Up to 16 MB at a time */
+uint32_t convert_sad(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+
+/* Statistics of two BGGR rows s0, s1, in quads of 2x2 pixels: the rounded
+ * mean of each quad goes to luma, its red, both greens and blue are added
+ * to sums[0], sums[1] and sums[2]. Up to 1M quads at a time */
+void convert_bggr8_quads(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums);
+
+#endif // _CONVERT_H_
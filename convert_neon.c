@@ -0,0 +1,210 @@
+/*
+ *      convert_neon.c  --  NEON conversion kernels, ARMv7 and AArch64
+ *
+ *      Intrinsics only, so the same source builds for both, apart from the
+ *      AArch64 non-temporal stores of the blit. YUV math is done in 32 bit
+ *      lanes to stay bit exact with the scalar code.
+ */
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <arm_neon.h>
+
+#include "convert_simd.h"
+
+static inline uint32x4_t rgb565_neon(uint16x4_t c16) {
+
+	uint32x4_t c = vmovl_u16(c16);
+	uint32x4_t r = vshlq_n_u32(vshrq_n_u32(c, 11), 19);
+	uint32x4_t g = vshlq_n_u32(vandq_u32(vshrq_n_u32(c, 5), vdupq_n_u32(0x3f)), 10);
+	uint32x4_t b = vshlq_n_u32(vandq_u32(c, vdupq_n_u32(0x1f)), 3);
+
+	return vorrq_u32(vorrq_u32(r, g), b);
+}
+
+void convert_rgb565_neon(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height) {
+
+	int x, y;
+
+	for(y = 0; y < height; y++) {
+		const uint16_t *s = (const uint16_t *) (src + (size_t) y * src_stride);
+		uint32_t *p = (uint32_t *) ((uint8_t *) dst + (size_t) y * dst_stride);
+
+		for(x = 0; x + 8 <= width; x += 8) {
+			uint16x8_t c = vld1q_u16(s + x);
+
+			vst1q_u32(p + x, rgb565_neon(vget_low_u16(c)));
+			vst1q_u32(p + x + 4, rgb565_neon(vget_high_u16(c)));
+		}
+
+		if(x < width)
+			convert_rgb565_c((const uint8_t *) (s + x), 0, p + x, 0, width - x, 1);
+	}
+}
+
+/* One color channel of four pairs: (l + prod) >> 8 for both pixels, clamped */
+static inline uint8x8_t yuv_channel(int32x4_t l0, int32x4_t l1, int32x4_t prod) {
+
+	int16x4_t even = vqmovn_s32(vshrq_n_s32(vaddq_s32(l0, prod), 8));
+	int16x4_t odd = vqmovn_s32(vshrq_n_s32(vaddq_s32(l1, prod), 8));
+	int16x4x2_t px = vzip_s16(even, odd);
+
+	return vqmovun_s16(vcombine_s16(px.val[0], px.val[1]));
+}
+
+void convert_422_neon(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	int uyvy) {
+
+	const int32x4_t c16 = vdupq_n_s32(16), c128 = vdupq_n_s32(128);
+	int x, y, i;
+
+	width &= ~1;
+
+	for(y = 0; y < height; y++) {
+		const uint8_t *s = src + (size_t) y * src_stride;
+		uint32_t *p = (uint32_t *) ((uint8_t *) dst + (size_t) y * dst_stride);
+
+		/* Eight pairs, de-interleaved into Y0 U Y1 V (or U Y0 V Y1) */
+		for(x = 0; x + 16 <= width; x += 16) {
+			uint8x8x4_t in = vld4_u8(s + x * 2);
+			uint8x8_t ya = uyvy ? in.val[1] : in.val[0], yb = uyvy ? in.val[3] : in.val[2];
+			uint8x8_t ub = uyvy ? in.val[0] : in.val[1], vb = uyvy ? in.val[2] : in.val[3];
+			int16x8_t y0 = vreinterpretq_s16_u16(vmovl_u8(ya)), y1 = vreinterpretq_s16_u16(vmovl_u8(yb));
+			int16x8_t u = vreinterpretq_s16_u16(vmovl_u8(ub)), v = vreinterpretq_s16_u16(vmovl_u8(vb));
+			uint8x8x4_t out[2];
+
+			/* Low and high four pairs */
+			for(i = 0; i < 2; i++) {
+				int32x4_t l0 = vmovl_s16(i ? vget_high_s16(y0) : vget_low_s16(y0));
+				int32x4_t l1 = vmovl_s16(i ? vget_high_s16(y1) : vget_low_s16(y1));
+				int32x4_t uu = vsubq_s32(vmovl_s16(i ? vget_high_s16(u) : vget_low_s16(u)), c128);
+				int32x4_t vv = vsubq_s32(vmovl_s16(i ? vget_high_s16(v) : vget_low_s16(v)), c128);
+				int32x4_t r_prod = vmlaq_n_s32(c128, vv, 409);
+				int32x4_t g_prod = vsubq_s32(c128, vmlaq_n_s32(vmulq_n_s32(uu, 100), vv, 208));
+				int32x4_t b_prod = vmulq_n_s32(uu, 516);
+
+				l0 = vmulq_n_s32(vsubq_s32(l0, c16), 298);
+				l1 = vmulq_n_s32(vsubq_s32(l1, c16), 298);
+
+				out[i].val[0] = yuv_channel(l0, l1, b_prod);
+				out[i].val[1] = yuv_channel(l0, l1, g_prod);
+				out[i].val[2] = yuv_channel(l0, l1, r_prod);
+				out[i].val[3] = vdup_n_u8(0);
+
+				vst4_u8((uint8_t *) (p + x + i * 8), out[i]);
+			}
+		}
+
+		if(x < width)
+			convert_422_c(s + x * 2, 0, p + x, 0, width - x, 1, uyvy);
+	}
+}
+
+/* ARMv7 has no non-temporal stores; aligned 64 byte runs of vst1 still
+ * fill whole write-combining bursts. AArch64 uses stnp */
+void convert_blit_neon(void *dst, int dst_stride, const void *src, int src_stride, int width, int height) {
+
+	int y;
+
+	for(y = 0; y < height; y++) {
+		uint8_t *d = (uint8_t *) dst + (size_t) y * dst_stride;
+		const uint8_t *s = (const uint8_t *) src + (size_t) y * src_stride;
+		size_t n = width, head = -(uintptr_t) d & 63;
+
+		/* Partial lines at the edges of a rectangle are plain stores */
+		if(head > n)
+			head = n;
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		n -= head;
+
+		for(; n >= 64; n -= 64, d += 64, s += 64) {
+			uint8x16_t a = vld1q_u8(s), b = vld1q_u8(s + 16), c = vld1q_u8(s + 32), e = vld1q_u8(s + 48);
+
+			__builtin_prefetch(s + 256);
+#if defined(__aarch64__)
+			__asm__ volatile("stnp %q1, %q2, [%0]\n\tstnp %q3, %q4, [%0, #32]"
+				: : "r" (d), "w" (a), "w" (b), "w" (c), "w" (e) : "memory");
+#else
+			vst1q_u8((uint8_t *) __builtin_assume_aligned(d, 64), a);
+			vst1q_u8((uint8_t *) __builtin_assume_aligned(d + 16, 16), b);
+			vst1q_u8((uint8_t *) __builtin_assume_aligned(d + 32, 32), c);
+			vst1q_u8((uint8_t *) __builtin_assume_aligned(d + 48, 16), e);
+#endif
+		}
+
+		memcpy(d, s, n);
+	}
+}
+
+uint32_t convert_sad_neon(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height) {
+
+	uint32x4_t acc = vdupq_n_u32(0);
+	uint32x2_t sum;
+	uint32_t sad = 0;
+	int x, y, n;
+
+	for(y = 0; y < height; y++) {
+		const uint8_t *p = a + (size_t) y * a_stride, *q = b + (size_t) y * b_stride;
+
+		/* 16 bit lanes take 128 steps of two differences before they are widened */
+		for(x = 0; x + 16 <= width; ) {
+			uint16x8_t row = vdupq_n_u16(0);
+
+			for(n = 0; n < 128 && x + 16 <= width; n++, x += 16)
+				row = vpadalq_u8(row, vabdq_u8(vld1q_u8(p + x), vld1q_u8(q + x)));
+
+			acc = vpadalq_u16(acc, row);
+		}
+
+		if(x < width)
+			sad += convert_sad_c(p + x, 0, q + x, 0, width - x, 1);
+	}
+
+	sum = vadd_u32(vget_low_u32(acc), vget_high_u32(acc));
+
+	return sad + vget_lane_u32(vpadd_u32(sum, sum), 0);
+}
+
+static inline uint32_t sum32_neon(uint32x4_t v) {
+
+	uint32x2_t sum = vadd_u32(vget_low_u32(v), vget_high_u32(v));
+
+	return vget_lane_u32(vpadd_u32(sum, sum), 0);
+}
+
+/* vld2 splits the rows into even and odd bytes: blue and green of the
+ * first, green and red of the second */
+void convert_bggr8_quads_neon(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums) {
+
+	uint32x4_t r = vdupq_n_u32(0), g = r, b = r;
+	int i;
+
+	for(i = 0; i + 16 <= quads; i += 16) {
+		uint8x16x2_t a = vld2q_u8(s0 + i * 2), c = vld2q_u8(s1 + i * 2);
+		uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(a.val[0]), vget_low_u8(a.val[1])),
+			vaddl_u8(vget_low_u8(c.val[0]), vget_low_u8(c.val[1])));
+		uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(a.val[0]), vget_high_u8(a.val[1])),
+			vaddl_u8(vget_high_u8(c.val[0]), vget_high_u8(c.val[1])));
+
+		b = vpadalq_u16(b, vpaddlq_u8(a.val[0]));
+		g = vpadalq_u16(g, vaddq_u16(vpaddlq_u8(a.val[1]), vpaddlq_u8(c.val[0])));
+		r = vpadalq_u16(r, vpaddlq_u8(c.val[1]));
+
+		/* Rounding narrow, (sum + 2) >> 2 */
+		vst1q_u8(luma + i, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+	}
+
+	if(i < quads)
+		convert_bggr8_quads_c(s0 + i * 2, s1 + i * 2, luma + i, quads - i, sums);
+
+	sums[0] += sum32_neon(r);
+	sums[1] += sum32_neon(g);
+	sums[2] += sum32_neon(b);
+}
+
+#endif
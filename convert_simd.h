@@ -0,0 +1,43 @@
+#ifndef _CONVERT_SIMD_H_
+#define _CONVERT_SIMD_H_
+
+#include <stdint.h>
+
+/*
+ * Variants behind the convert_* dispatch, call those instead. Vector
+ * loops leave the last pixels of a row that don't fill a vector to the
+ * scalar code.
+ */
+
+void convert_rgb565_c(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height);
+void convert_422_c(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	int uyvy);
+void convert_blit_c(void *dst, int dst_stride, const void *src, int src_stride, int width, int height);
+uint32_t convert_sad_c(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+void convert_bggr8_quads_c(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums);
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+void convert_rgb565_neon(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height);
+void convert_422_neon(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	int uyvy);
+void convert_blit_neon(void *dst, int dst_stride, const void *src, int src_stride, int width, int height);
+uint32_t convert_sad_neon(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+void convert_bggr8_quads_neon(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums);
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+void convert_rgb565_sse4(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height);
+void convert_422_sse4(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	int uyvy);
+void convert_rgb565_avx2(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height);
+void convert_422_avx2(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	int uyvy);
+void convert_blit_sse4(void *dst, int dst_stride, const void *src, int src_stride, int width, int height);
+void convert_blit_avx2(void *dst, int dst_stride, const void *src, int src_stride, int width, int height);
+uint32_t convert_sad_sse4(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+uint32_t convert_sad_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+void convert_bggr8_quads_sse4(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums);
+void convert_bggr8_quads_avx2(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums);
+#endif
+
+#endif // _CONVERT_SIMD_H_
@@ -0,0 +1,188 @@
+/*
+ *      convert_test.c  --  every instruction set against the scalar kernels
+ *
+ *      The variants must give the same pixels as the scalar code. Random
+ *      contents, widths, strides and alignments; whole destination buffers
+ *      are compared, so writing past the rectangle fails too. Only the
+ *      instruction sets of the machine it runs on are tried, NEON on the
+ *      board. Run by make test.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "convert.h"
+
+#define ROUNDS		300
+#define MAX_WIDTH	700
+#define MAX_HEIGHT	9
+#define BUF_SIZE	((MAX_WIDTH * 4 + 192) * (MAX_HEIGHT + 1) + 64)
+
+static uint8_t src[BUF_SIZE], src2[BUF_SIZE];
+static uint8_t want[BUF_SIZE], got[BUF_SIZE];
+
+static int rnd(int n) {
+
+	return rand() % n;
+}
+
+static void fill(uint8_t *p, size_t len) {
+
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		p[i] = rand();
+}
+
+/* The same case on the scalar kernels and on isa */
+struct convert_case {
+	int width, height, src_stride, dst_stride, src_off, dst_off, x, y;
+};
+
+static void random_case(struct convert_case *c, int bytes_per_pixel) {
+
+	c->width = 1 + rnd(MAX_WIDTH);
+	c->height = 1 + rnd(MAX_HEIGHT);
+	c->src_off = rnd(64);
+	c->dst_off = rnd(16) * 4;
+	c->src_stride = c->width * bytes_per_pixel + rnd(3) * rnd(64);
+	c->dst_stride = c->width * 4 + rnd(3) * 4 * rnd(48);
+	c->x = 0;
+	c->y = 0;
+}
+
+static void run_rgb565(const struct convert_case *c, uint8_t *dst) {
+
+	convert_rgb565(src + (c->src_off & ~1), c->src_stride & ~1, (uint32_t *) (dst + c->dst_off), c->dst_stride,
+		c->width, c->height);
+}
+
+static void run_yuyv(const struct convert_case *c, uint8_t *dst) {
+
+	convert_yuyv(src + c->src_off, c->src_stride, (uint32_t *) (dst + c->dst_off), c->dst_stride,
+		c->width, c->height);
+}
+
+static void run_uyvy(const struct convert_case *c, uint8_t *dst) {
+
+	convert_uyvy(src + c->src_off, c->src_stride, (uint32_t *) (dst + c->dst_off), c->dst_stride,
+		c->width, c->height);
+}
+
+/* Widths in bytes, not whole pixels: x moves the start, y trims the end */
+static void run_blit(const struct convert_case *c, uint8_t *dst) {
+
+	convert_blit(dst + c->dst_off + c->x, c->dst_stride, src + c->src_off, c->src_stride,
+		c->width * 4 - c->y, c->height);
+}
+
+static void run_blit_rect(const struct convert_case *c, uint8_t *dst) {
+
+	convert_blit_rect((uint32_t *) (dst + c->dst_off), c->dst_stride, (const uint32_t *) (src + (c->src_off & ~3)),
+		c->src_stride & ~3, c->x, c->y, c->width - c->x, c->height - c->y);
+}
+
+static void run_sad(const struct convert_case *c, uint8_t *dst) {
+
+	uint32_t sad;
+
+	sad = convert_sad(src + c->src_off, c->src_stride, src2 + c->dst_off, c->dst_stride,
+		c->width * 4, c->height);
+	memcpy(dst, &sad, sizeof(sad));
+}
+
+static void run_bggr8_quads(const struct convert_case *c, uint8_t *dst) {
+
+	uint32_t sums[3] = { 1, 2, 3 };
+
+	convert_bggr8_quads(src + c->src_off, src + c->src_off + c->src_stride, dst + c->dst_off + 12,
+		c->width / 2, sums);
+	memcpy(dst, sums, sizeof(sums));
+}
+
+static const struct {
+	const char *name;
+	int bytes_per_pixel;
+	void (*run)(const struct convert_case *c, uint8_t *dst);
+} kernels[] = {
+	{ "rgb565",		2, run_rgb565 },
+	{ "yuyv",		2, run_yuyv },
+	{ "uyvy",		2, run_uyvy },
+	{ "blit",		4, run_blit },
+	{ "blit-rect",		4, run_blit_rect },
+	{ "sad",		4, run_sad },
+	{ "bggr8-quads",	1, run_bggr8_quads },
+};
+
+static int test_kernel(int k, int isa) {
+
+	struct convert_case c;
+	int round, bad = 0;
+	size_t i;
+
+	for(round = 0; round < ROUNDS && bad < 5; round++) {
+		random_case(&c, kernels[k].bytes_per_pixel);
+		if(kernels[k].run == run_blit) {
+			c.x = rnd(4);
+			c.y = rnd(4);
+		}
+		if(kernels[k].run == run_blit_rect) {
+			c.x = rnd(c.width);
+			c.y = rnd(c.height);
+		}
+
+		fill(src, sizeof(src));
+		/* For sad, as close as frames are or as far apart as can be */
+		memcpy(src2, src, sizeof(src2));
+		for(i = 0; i < sizeof(src2); i++)
+			if(rnd(8) == 0)
+				src2[i] = round % 2 ? src2[i] + rnd(5) - 2 : ~src2[i];
+
+		fill(want, sizeof(want));
+		memcpy(got, want, sizeof(got));
+
+		convert_use(CONVERT_SCALAR);
+		kernels[k].run(&c, want);
+		convert_use(isa);
+		kernels[k].run(&c, got);
+
+		if(memcmp(want, got, sizeof(want))) {
+			i = 0;
+			while(want[i] == got[i])
+				i++;
+			printf("%s %s: %dx%d, strides %d %d, offsets %d %d, at %d,%d: differs at byte %zu\n",
+				kernels[k].name, convert_isa_name(isa), c.width, c.height, c.src_stride, c.dst_stride,
+				c.src_off, c.dst_off, c.x, c.y, i);
+			bad++;
+		}
+	}
+
+	return bad;
+}
+
+int main(void) {
+
+	unsigned int isas = convert_isas();
+	int isa, failed = 0, bad;
+	unsigned int k;
+
+	srand(1);
+
+	for(isa = CONVERT_SCALAR + 1; isa < CONVERT_ISAS; isa++) {
+		if(!(isas & (1 << isa)))
+			continue;
+
+		for(k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+			bad = test_kernel(k, isa);
+			printf("%s %s: %s\n", kernels[k].name, convert_isa_name(isa), bad ? "FAILED" : "ok");
+			failed += bad;
+		}
+	}
+
+	if(isas == 1 << CONVERT_SCALAR)
+		printf("scalar only, nothing to compare\n");
+
+	return failed ? 1 : 0;
+}
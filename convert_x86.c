@@ -0,0 +1,371 @@
+/*
+ *      convert_x86.c  --  SSE4.1 and AVX2 conversion kernels
+ *
+ *      Every function is built for its own target, so the file needs no
+ *      -m flags and the binary still runs on CPUs without AVX2; callers
+ *      check the CPU first. YUV math is done in 32 bit lanes to stay
+ *      bit exact with the scalar code. Blits write the screen with
+ *      streaming stores, a full write-combining buffer at a time.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "convert_simd.h"
+
+#define SSE4		__attribute__((target("sse4.1")))
+#define AVX2		__attribute__((target("avx2")))
+
+/* Packed b, r, g of 4 pixels in a lane: b0-3, four zeros, r0-3, g0-3. To XRGB */
+#define XRGB_ORDER	0, 12, 8, 4, 1, 13, 9, 4, 2, 14, 10, 4, 3, 15, 11, 4
+
+SSE4 static inline __m128i rgb565_sse4(__m128i c) {
+
+	__m128i r = _mm_slli_epi32(_mm_srli_epi32(c, 11), 19);
+	__m128i g = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(c, 5), _mm_set1_epi32(0x3f)), 10);
+	__m128i b = _mm_slli_epi32(_mm_and_si128(c, _mm_set1_epi32(0x1f)), 3);
+
+	return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+SSE4 void convert_rgb565_sse4(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height) {
+
+	int x, y;
+
+	for(y = 0; y < height; y++) {
+		const uint16_t *s = (const uint16_t *) (src + (size_t) y * src_stride);
+		uint32_t *p = (uint32_t *) ((uint8_t *) dst + (size_t) y * dst_stride);
+
+		for(x = 0; x + 8 <= width; x += 8) {
+			__m128i c = _mm_loadu_si128((const __m128i *) (s + x));
+
+			_mm_storeu_si128((__m128i *) (p + x), rgb565_sse4(_mm_cvtepu16_epi32(c)));
+			_mm_storeu_si128((__m128i *) (p + x + 4), rgb565_sse4(_mm_cvtepu16_epi32(_mm_srli_si128(c, 8))));
+		}
+
+		if(x < width)
+			convert_rgb565_c((const uint8_t *) (s + x), 0, p + x, 0, width - x, 1);
+	}
+}
+
+SSE4 void convert_422_sse4(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	int uyvy) {
+
+	int y0 = uyvy, u0 = !uyvy, y1 = 2 + uyvy, v0 = 3 - uyvy;
+	/* Two pairs, every pixel gets its Y, U and V in a 32 bit lane */
+	const __m128i ymask = _mm_setr_epi8(y0, -1, -1, -1, y1, -1, -1, -1, 4 + y0, -1, -1, -1, 4 + y1, -1, -1, -1);
+	const __m128i umask = _mm_setr_epi8(u0, -1, -1, -1, u0, -1, -1, -1, 4 + u0, -1, -1, -1, 4 + u0, -1, -1, -1);
+	const __m128i vmask = _mm_setr_epi8(v0, -1, -1, -1, v0, -1, -1, -1, 4 + v0, -1, -1, -1, 4 + v0, -1, -1, -1);
+	const __m128i order = _mm_setr_epi8(XRGB_ORDER);
+	const __m128i c16 = _mm_set1_epi32(16), c128 = _mm_set1_epi32(128);
+	const __m128i k298 = _mm_set1_epi32(298), k409 = _mm_set1_epi32(409), k100 = _mm_set1_epi32(100);
+	const __m128i k208 = _mm_set1_epi32(208), k516 = _mm_set1_epi32(516);
+	int x, y;
+
+	width &= ~1;
+
+	for(y = 0; y < height; y++) {
+		const uint8_t *s = src + (size_t) y * src_stride;
+		uint32_t *p = (uint32_t *) ((uint8_t *) dst + (size_t) y * dst_stride);
+
+		for(x = 0; x + 4 <= width; x += 4) {
+			__m128i in = _mm_loadl_epi64((const __m128i *) (s + x * 2));
+			__m128i l = _mm_mullo_epi32(_mm_sub_epi32(_mm_shuffle_epi8(in, ymask), c16), k298);
+			__m128i u = _mm_sub_epi32(_mm_shuffle_epi8(in, umask), c128);
+			__m128i v = _mm_sub_epi32(_mm_shuffle_epi8(in, vmask), c128);
+			__m128i r, g, b;
+
+			r = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(l, _mm_mullo_epi32(v, k409)), c128), 8);
+			g = _mm_srai_epi32(_mm_sub_epi32(l, _mm_sub_epi32(_mm_add_epi32(_mm_mullo_epi32(u, k100),
+				_mm_mullo_epi32(v, k208)), c128)), 8);
+			b = _mm_srai_epi32(_mm_add_epi32(l, _mm_mullo_epi32(u, k516)), 8);
+
+			/* Saturating packs clamp to 0..255 like the scalar code */
+			r = _mm_packus_epi16(_mm_packs_epi32(b, _mm_setzero_si128()), _mm_packs_epi32(r, g));
+			_mm_storeu_si128((__m128i *) (p + x), _mm_shuffle_epi8(r, order));
+		}
+
+		if(x < width)
+			convert_422_c(s + x * 2, 0, p + x, 0, width - x, 1, uyvy);
+	}
+}
+
+SSE4 void convert_blit_sse4(void *dst, int dst_stride, const void *src, int src_stride, int width, int height) {
+
+	int y;
+
+	for(y = 0; y < height; y++) {
+		uint8_t *d = (uint8_t *) dst + (size_t) y * dst_stride;
+		const uint8_t *s = (const uint8_t *) src + (size_t) y * src_stride;
+		size_t n = width, head = -(uintptr_t) d & 63;
+
+		/* Partial lines at the edges of a rectangle are plain stores */
+		if(head > n)
+			head = n;
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		n -= head;
+
+		for(; n >= 64; n -= 64, d += 64, s += 64) {
+			__m128i a = _mm_loadu_si128((const __m128i *) s);
+			__m128i b = _mm_loadu_si128((const __m128i *) (s + 16));
+			__m128i c = _mm_loadu_si128((const __m128i *) (s + 32));
+			__m128i e = _mm_loadu_si128((const __m128i *) (s + 48));
+
+			_mm_stream_si128((__m128i *) d, a);
+			_mm_stream_si128((__m128i *) (d + 16), b);
+			_mm_stream_si128((__m128i *) (d + 32), c);
+			_mm_stream_si128((__m128i *) (d + 48), e);
+		}
+
+		memcpy(d, s, n);
+	}
+
+	/* Streaming stores are weakly ordered, drain them before returning */
+	_mm_sfence();
+}
+
+/* psadbw sums eight byte differences into each 64 bit half */
+SSE4 uint32_t convert_sad_sse4(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height) {
+
+	__m128i acc = _mm_setzero_si128();
+	uint32_t sad = 0;
+	int x, y;
+
+	for(y = 0; y < height; y++) {
+		const uint8_t *p = a + (size_t) y * a_stride, *q = b + (size_t) y * b_stride;
+
+		for(x = 0; x + 16 <= width; x += 16)
+			acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (p + x)),
+				_mm_loadu_si128((const __m128i *) (q + x))));
+
+		if(x < width)
+			sad += convert_sad_c(p + x, 0, q + x, 0, width - x, 1);
+	}
+
+	acc = _mm_add_epi64(acc, _mm_srli_si128(acc, 8));
+
+	return sad + (uint32_t) _mm_cvtsi128_si32(acc);
+}
+
+/* Blue and red are the even bytes of their rows, green the odd ones and
+ * the other row's even ones. psadbw against zero adds up each of them */
+SSE4 void convert_bggr8_quads_sse4(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums) {
+
+	const __m128i even = _mm_set1_epi16(0xff), two = _mm_set1_epi16(2), zero = _mm_setzero_si128();
+	__m128i r = zero, g = zero, b = zero;
+	int i, k;
+
+	for(i = 0; i + 16 <= quads; i += 16) {
+		__m128i q[2];
+
+		for(k = 0; k < 2; k++) {
+			__m128i a = _mm_loadu_si128((const __m128i *) (s0 + i * 2 + k * 16));
+			__m128i c = _mm_loadu_si128((const __m128i *) (s1 + i * 2 + k * 16));
+			__m128i qb = _mm_and_si128(a, even), qg0 = _mm_srli_epi16(a, 8);
+			__m128i qg1 = _mm_and_si128(c, even), qr = _mm_srli_epi16(c, 8);
+
+			b = _mm_add_epi64(b, _mm_sad_epu8(qb, zero));
+			g = _mm_add_epi64(g, _mm_add_epi64(_mm_sad_epu8(qg0, zero), _mm_sad_epu8(qg1, zero)));
+			r = _mm_add_epi64(r, _mm_sad_epu8(qr, zero));
+
+			q[k] = _mm_add_epi16(_mm_add_epi16(qb, qg0), _mm_add_epi16(qg1, qr));
+			q[k] = _mm_srli_epi16(_mm_add_epi16(q[k], two), 2);
+		}
+
+		_mm_storeu_si128((__m128i *) (luma + i), _mm_packus_epi16(q[0], q[1]));
+	}
+
+	if(i < quads)
+		convert_bggr8_quads_c(s0 + i * 2, s1 + i * 2, luma + i, quads - i, sums);
+
+	sums[0] += (uint32_t) _mm_cvtsi128_si32(_mm_add_epi64(r, _mm_srli_si128(r, 8)));
+	sums[1] += (uint32_t) _mm_cvtsi128_si32(_mm_add_epi64(g, _mm_srli_si128(g, 8)));
+	sums[2] += (uint32_t) _mm_cvtsi128_si32(_mm_add_epi64(b, _mm_srli_si128(b, 8)));
+}
+
+AVX2 static inline __m256i rgb565_avx2(__m256i c) {
+
+	__m256i r = _mm256_slli_epi32(_mm256_srli_epi32(c, 11), 19);
+	__m256i g = _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(c, 5), _mm256_set1_epi32(0x3f)), 10);
+	__m256i b = _mm256_slli_epi32(_mm256_and_si256(c, _mm256_set1_epi32(0x1f)), 3);
+
+	return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+AVX2 void convert_rgb565_avx2(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height) {
+
+	int x, y;
+
+	for(y = 0; y < height; y++) {
+		const uint16_t *s = (const uint16_t *) (src + (size_t) y * src_stride);
+		uint32_t *p = (uint32_t *) ((uint8_t *) dst + (size_t) y * dst_stride);
+
+		for(x = 0; x + 16 <= width; x += 16) {
+			__m128i lo = _mm_loadu_si128((const __m128i *) (s + x));
+			__m128i hi = _mm_loadu_si128((const __m128i *) (s + x + 8));
+
+			_mm256_storeu_si256((__m256i *) (p + x), rgb565_avx2(_mm256_cvtepu16_epi32(lo)));
+			_mm256_storeu_si256((__m256i *) (p + x + 8), rgb565_avx2(_mm256_cvtepu16_epi32(hi)));
+		}
+
+		if(x < width)
+			convert_rgb565_c((const uint8_t *) (s + x), 0, p + x, 0, width - x, 1);
+	}
+}
+
+AVX2 void convert_422_avx2(const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride, int width, int height,
+	int uyvy) {
+
+	int y0 = uyvy, u0 = !uyvy, y1 = 2 + uyvy, v0 = 3 - uyvy;
+	/* Both lanes hold the same four pairs, the low lane converts the first two */
+	const __m256i ymask = _mm256_setr_epi8(y0, -1, -1, -1, y1, -1, -1, -1, 4 + y0, -1, -1, -1, 4 + y1, -1, -1, -1,
+		8 + y0, -1, -1, -1, 8 + y1, -1, -1, -1, 12 + y0, -1, -1, -1, 12 + y1, -1, -1, -1);
+	const __m256i umask = _mm256_setr_epi8(u0, -1, -1, -1, u0, -1, -1, -1, 4 + u0, -1, -1, -1, 4 + u0, -1, -1, -1,
+		8 + u0, -1, -1, -1, 8 + u0, -1, -1, -1, 12 + u0, -1, -1, -1, 12 + u0, -1, -1, -1);
+	const __m256i vmask = _mm256_setr_epi8(v0, -1, -1, -1, v0, -1, -1, -1, 4 + v0, -1, -1, -1, 4 + v0, -1, -1, -1,
+		8 + v0, -1, -1, -1, 8 + v0, -1, -1, -1, 12 + v0, -1, -1, -1, 12 + v0, -1, -1, -1);
+	const __m256i order = _mm256_setr_epi8(XRGB_ORDER, XRGB_ORDER);
+	const __m256i c16 = _mm256_set1_epi32(16), c128 = _mm256_set1_epi32(128);
+	const __m256i k298 = _mm256_set1_epi32(298), k409 = _mm256_set1_epi32(409), k100 = _mm256_set1_epi32(100);
+	const __m256i k208 = _mm256_set1_epi32(208), k516 = _mm256_set1_epi32(516);
+	int x, y;
+
+	width &= ~1;
+
+	for(y = 0; y < height; y++) {
+		const uint8_t *s = src + (size_t) y * src_stride;
+		uint32_t *p = (uint32_t *) ((uint8_t *) dst + (size_t) y * dst_stride);
+
+		for(x = 0; x + 8 <= width; x += 8) {
+			__m256i in = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (s + x * 2)));
+			__m256i l = _mm256_mullo_epi32(_mm256_sub_epi32(_mm256_shuffle_epi8(in, ymask), c16), k298);
+			__m256i u = _mm256_sub_epi32(_mm256_shuffle_epi8(in, umask), c128);
+			__m256i v = _mm256_sub_epi32(_mm256_shuffle_epi8(in, vmask), c128);
+			__m256i r, g, b;
+
+			r = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(l, _mm256_mullo_epi32(v, k409)), c128), 8);
+			g = _mm256_srai_epi32(_mm256_sub_epi32(l, _mm256_sub_epi32(_mm256_add_epi32(_mm256_mullo_epi32(u, k100),
+				_mm256_mullo_epi32(v, k208)), c128)), 8);
+			b = _mm256_srai_epi32(_mm256_add_epi32(l, _mm256_mullo_epi32(u, k516)), 8);
+
+			r = _mm256_packus_epi16(_mm256_packs_epi32(b, _mm256_setzero_si256()), _mm256_packs_epi32(r, g));
+			_mm256_storeu_si256((__m256i *) (p + x), _mm256_shuffle_epi8(r, order));
+		}
+
+		if(x < width)
+			convert_422_c(s + x * 2, 0, p + x, 0, width - x, 1, uyvy);
+	}
+}
+
+AVX2 void convert_blit_avx2(void *dst, int dst_stride, const void *src, int src_stride, int width, int height) {
+
+	int y;
+
+	for(y = 0; y < height; y++) {
+		uint8_t *d = (uint8_t *) dst + (size_t) y * dst_stride;
+		const uint8_t *s = (const uint8_t *) src + (size_t) y * src_stride;
+		size_t n = width, head = -(uintptr_t) d & 63;
+
+		if(head > n)
+			head = n;
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		n -= head;
+
+		for(; n >= 64; n -= 64, d += 64, s += 64) {
+			__m256i a = _mm256_loadu_si256((const __m256i *) s);
+			__m256i b = _mm256_loadu_si256((const __m256i *) (s + 32));
+
+			_mm256_stream_si256((__m256i *) d, a);
+			_mm256_stream_si256((__m256i *) (d + 32), b);
+		}
+
+		memcpy(d, s, n);
+	}
+
+	_mm_sfence();
+}
+
+AVX2 uint32_t convert_sad_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height) {
+
+	__m256i acc = _mm256_setzero_si256();
+	__m128i sum;
+	uint32_t sad = 0;
+	int x, y;
+
+	for(y = 0; y < height; y++) {
+		const uint8_t *p = a + (size_t) y * a_stride, *q = b + (size_t) y * b_stride;
+
+		for(x = 0; x + 32 <= width; x += 32)
+			acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *) (p + x)),
+				_mm256_loadu_si256((const __m256i *) (q + x))));
+
+		/* Half a vector, for 16 byte wide blocks */
+		if(x + 16 <= width) {
+			acc = _mm256_add_epi64(acc, _mm256_inserti128_si256(_mm256_setzero_si256(), _mm_sad_epu8(
+				_mm_loadu_si128((const __m128i *) (p + x)), _mm_loadu_si128((const __m128i *) (q + x))), 0));
+			x += 16;
+		}
+
+		if(x < width)
+			sad += convert_sad_c(p + x, 0, q + x, 0, width - x, 1);
+	}
+
+	sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+
+	return sad + (uint32_t) _mm_cvtsi128_si32(sum);
+}
+
+AVX2 static inline uint32_t sum64_avx2(__m256i v) {
+
+	__m128i sum = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+
+	return (uint32_t) _mm_cvtsi128_si32(_mm_add_epi64(sum, _mm_srli_si128(sum, 8)));
+}
+
+/* As the SSE4.1 kernel, packus works per 128 bit lane so its result is
+ * put back in order */
+AVX2 void convert_bggr8_quads_avx2(const uint8_t *s0, const uint8_t *s1, uint8_t *luma, int quads, uint32_t *sums) {
+
+	const __m256i even = _mm256_set1_epi16(0xff), two = _mm256_set1_epi16(2), zero = _mm256_setzero_si256();
+	__m256i r = zero, g = zero, b = zero;
+	int i, k;
+
+	for(i = 0; i + 32 <= quads; i += 32) {
+		__m256i q[2];
+
+		for(k = 0; k < 2; k++) {
+			__m256i a = _mm256_loadu_si256((const __m256i *) (s0 + i * 2 + k * 32));
+			__m256i c = _mm256_loadu_si256((const __m256i *) (s1 + i * 2 + k * 32));
+			__m256i qb = _mm256_and_si256(a, even), qg0 = _mm256_srli_epi16(a, 8);
+			__m256i qg1 = _mm256_and_si256(c, even), qr = _mm256_srli_epi16(c, 8);
+
+			b = _mm256_add_epi64(b, _mm256_sad_epu8(qb, zero));
+			g = _mm256_add_epi64(g, _mm256_add_epi64(_mm256_sad_epu8(qg0, zero), _mm256_sad_epu8(qg1, zero)));
+			r = _mm256_add_epi64(r, _mm256_sad_epu8(qr, zero));
+
+			q[k] = _mm256_add_epi16(_mm256_add_epi16(qb, qg0), _mm256_add_epi16(qg1, qr));
+			q[k] = _mm256_srli_epi16(_mm256_add_epi16(q[k], two), 2);
+		}
+
+		_mm256_storeu_si256((__m256i *) (luma + i),
+			_mm256_permute4x64_epi64(_mm256_packus_epi16(q[0], q[1]), 0xd8));
+	}
+
+	if(i < quads)
+		convert_bggr8_quads_sse4(s0 + i * 2, s1 + i * 2, luma + i, quads - i, sums);
+
+	sums[0] += sum64_avx2(r);
+	sums[1] += sum64_avx2(g);
+	sums[2] += sum64_avx2(b);
+}
+
+#endif
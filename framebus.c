@@ -0,0 +1,390 @@
+/*
+ *      framebus.c  --  shared memory frame bus, publisher and client
+ *
+ *      Slots are guarded like a seqlock: the publisher clears slot->frame,
+ *      copies the data and then stores the frame number, a reader checks
+ *      the number before and after using the data.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include <linux/memfd.h>
+
+#include "framebus.h"
+#include "rtsched.h"
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		1033
+#define F_SEAL_SHRINK		0x0002
+#define F_SEAL_GROW		0x0004
+#endif
+
+#define FRAMEBUS_PAGE		4096
+#define FRAMEBUS_ROUND(x)	(((x) + FRAMEBUS_PAGE - 1) & ~(FRAMEBUS_PAGE - 1))
+
+struct framebus {
+	int fd;
+	size_t size;
+	struct framebus_header *hdr;
+	struct framebus_slot *slots;
+	unsigned char *base;
+	uint32_t frame;
+
+	char path[108];
+	int sock;
+	pthread_t thread;
+
+	unsigned int clients;
+	unsigned long long too_big;
+};
+
+static int framebus_futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout) {
+
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+
+/* Publisher */
+
+static int framebus_send_fd(int sock, int fd, uint64_t size) {
+
+	struct msghdr msg;
+	struct iovec iov = { &size, sizeof(size) };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct cmsghdr *c;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&cmsg, 0, sizeof(cmsg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(c), &fd, sizeof(int));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(size) ? 0 : -1;
+}
+
+/* Hands the memfd to every client, clients need nothing else from us */
+static void *framebus_thread(void *arg) {
+
+	struct framebus *bus = (struct framebus *) arg;
+
+	rt_thread("io");
+
+	for(;;) {
+		int s = accept(bus->sock, NULL, NULL);
+
+		if(s < 0) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		if(framebus_send_fd(s, bus->fd, bus->size) == 0)
+			bus->clients++;
+
+		close(s);
+	}
+
+	return NULL;
+}
+
+struct framebus *framebus_create(const char *socket_path, unsigned int nslots, unsigned int slot_size,
+	uint32_t fourcc, uint32_t width, uint32_t height, uint32_t bytesperline) {
+
+	struct framebus *bus;
+	struct sockaddr_un addr;
+	size_t data_offset;
+
+	if(nslots < 2)
+		nslots = FRAMEBUS_SLOTS;
+	slot_size = FRAMEBUS_ROUND(slot_size);
+	data_offset = FRAMEBUS_ROUND(sizeof(struct framebus_header) + nslots * sizeof(struct framebus_slot));
+
+	bus = (struct framebus *) calloc(1, sizeof(*bus));
+	if(!bus)
+		return NULL;
+
+	bus->sock = -1;
+	bus->size = data_offset + (size_t) nslots * slot_size;
+
+	bus->fd = syscall(SYS_memfd_create, "framebus", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(bus->fd < 0 || ftruncate(bus->fd, bus->size) < 0) {
+		printf("framebus: cannot create %zu bytes memfd: %s\n", bus->size, strerror(errno));
+		goto fail;
+	}
+
+	/* Clients can rely on the mapping never shrinking under them */
+	fcntl(bus->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+
+	bus->base = (unsigned char *) mmap(NULL, bus->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, bus->fd, 0);
+	if(bus->base == MAP_FAILED) {
+		printf("framebus: mmap failed: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	bus->hdr = (struct framebus_header *) bus->base;
+	bus->slots = (struct framebus_slot *) (bus->base + sizeof(struct framebus_header));
+
+	bus->hdr->magic = FRAMEBUS_MAGIC;
+	bus->hdr->version = FRAMEBUS_VERSION;
+	bus->hdr->nslots = nslots;
+	bus->hdr->slot_size = slot_size;
+	bus->hdr->data_offset = data_offset;
+	bus->hdr->fourcc = fourcc;
+	bus->hdr->width = width;
+	bus->hdr->height = height;
+	bus->hdr->bytesperline = bytesperline;
+
+	bus->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(bus->sock < 0) {
+		printf("framebus: socket failed: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(bus->path, sizeof(bus->path), "%s", socket_path);
+	memcpy(addr.sun_path, bus->path, sizeof(addr.sun_path) - 1);
+
+	unlink(bus->path);
+	if(bind(bus->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(bus->sock, 8) < 0) {
+		printf("framebus: cannot listen on %s: %s\n", bus->path, strerror(errno));
+		goto fail;
+	}
+
+	if(pthread_create(&bus->thread, NULL, framebus_thread, bus)) {
+		printf("framebus: cannot start thread\n");
+		unlink(bus->path);
+		goto fail;
+	}
+
+	printf("framebus: %s, %u slots of %u KB (%.1f MB shared)\n", bus->path, nslots,
+		slot_size >> 10, bus->size / 1048576.0);
+
+	return bus;
+
+fail:
+	if(bus->sock >= 0)
+		close(bus->sock);
+	if(bus->base && bus->base != MAP_FAILED)
+		munmap(bus->base, bus->size);
+	if(bus->fd >= 0)
+		close(bus->fd);
+	free(bus);
+	return NULL;
+}
+
+int framebus_publish(struct framebus *bus, const struct iovec *iov, int iovcnt,
+	uint32_t sequence, uint32_t flags, const struct timeval *timestamp) {
+
+	struct framebus_slot *s;
+	unsigned char *p;
+	size_t len = 0;
+	int i;
+
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if(len > bus->hdr->slot_size) {
+		bus->too_big++;
+		return 0;
+	}
+
+	if(++bus->frame == 0)
+		bus->frame = 1;
+
+	s = &bus->slots[bus->frame % bus->hdr->nslots];
+	p = bus->base + bus->hdr->data_offset + (size_t) (bus->frame % bus->hdr->nslots) * bus->hdr->slot_size;
+
+	/* Readers of the old frame in this slot see it invalidated first */
+	__atomic_store_n(&s->frame, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for(i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	s->bytesused = len;
+	s->sequence = sequence;
+	s->flags = flags;
+	s->timestamp = timestamp->tv_sec * 1000000ULL + timestamp->tv_usec;
+
+	__atomic_store_n(&s->frame, bus->frame, __ATOMIC_RELEASE);
+	__atomic_store_n(&bus->hdr->latest, bus->frame, __ATOMIC_RELEASE);
+
+	/* One syscall per frame, however many clients are waiting */
+	__atomic_add_fetch(&bus->hdr->futex, 1, __ATOMIC_RELEASE);
+	framebus_futex(&bus->hdr->futex, FUTEX_WAKE, INT_MAX, NULL);
+
+	return 1;
+}
+
+void framebus_close(struct framebus *bus) {
+
+	/* Wakes accept() in the thread */
+	shutdown(bus->sock, SHUT_RDWR);
+	pthread_join(bus->thread, NULL);
+	close(bus->sock);
+	unlink(bus->path);
+
+	printf("framebus: %u frames published, %u clients attached, %llu frames too big\n",
+		bus->frame, bus->clients, bus->too_big);
+
+	munmap(bus->base, bus->size);
+	close(bus->fd);
+	free(bus);
+}
+
+
+/* Client */
+
+int framebus_attach(struct framebus_client *c, const char *socket_path) {
+
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	uint64_t size;
+	struct iovec iov = { &size, sizeof(size) };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct cmsghdr *cm;
+	void *map;
+	int s;
+
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(s < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+	if(connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "framebus: cannot connect to %s: %s\n", socket_path, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+
+	if(recvmsg(s, &msg, MSG_CMSG_CLOEXEC) != sizeof(size) || !(cm = CMSG_FIRSTHDR(&msg)) ||
+	   cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "framebus: no memfd from %s\n", socket_path);
+		close(s);
+		return -1;
+	}
+
+	memcpy(&c->fd, CMSG_DATA(cm), sizeof(int));
+	close(s);
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, c->fd, 0);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "framebus: mmap failed: %s\n", strerror(errno));
+		close(c->fd);
+		return -1;
+	}
+
+	c->size = size;
+	c->base = (const unsigned char *) map;
+	c->hdr = (const struct framebus_header *) map;
+	c->slots = (const struct framebus_slot *) (c->base + sizeof(struct framebus_header));
+
+	if(c->hdr->magic != FRAMEBUS_MAGIC || c->hdr->version != FRAMEBUS_VERSION) {
+		fprintf(stderr, "framebus: bad header\n");
+		framebus_detach(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+int framebus_wait(struct framebus_client *c, struct framebus_frame *f, int timeout_ms) {
+
+	struct timespec ts, *tp = NULL;
+
+	if(timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		tp = &ts;
+	}
+
+	for(;;) {
+		uint32_t futex = __atomic_load_n(&c->hdr->futex, __ATOMIC_ACQUIRE);
+		uint32_t latest = __atomic_load_n(&c->hdr->latest, __ATOMIC_ACQUIRE);
+
+		if(latest && latest != c->last) {
+			const struct framebus_slot *s = &c->slots[latest % c->hdr->nslots];
+
+			if(__atomic_load_n(&s->frame, __ATOMIC_ACQUIRE) == latest) {
+				f->frame = latest;
+				f->data = c->base + c->hdr->data_offset + (size_t) (latest % c->hdr->nslots) * c->hdr->slot_size;
+				f->bytesused = s->bytesused;
+				f->sequence = s->sequence;
+				f->flags = s->flags;
+				f->timestamp = s->timestamp;
+				c->last = latest;
+				return 1;
+			}
+
+			/* Being rewritten already, a newer frame follows shortly */
+		}
+
+		/* Sleeps only if no frame was published since futex was read */
+		if(framebus_futex((uint32_t *) &c->hdr->futex, FUTEX_WAIT, futex, tp) < 0) {
+			if(errno == ETIMEDOUT)
+				return 0;
+			if(errno != EAGAIN && errno != EINTR)
+				return -1;
+		}
+	}
+}
+
+int framebus_release(struct framebus_client *c, struct framebus_frame *f) {
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&c->slots[f->frame % c->hdr->nslots].frame, __ATOMIC_RELAXED) == f->frame;
+}
+
+void framebus_detach(struct framebus_client *c) {
+
+	if(c->base)
+		munmap((void *) c->base, c->size);
+	if(c->fd >= 0)
+		close(c->fd);
+
+	c->base = NULL;
+	c->fd = -1;
+}
@@ -0,0 +1,93 @@
+#ifndef _FRAMEBUS_H_
+#define _FRAMEBUS_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+/*
+ * Shared memory frame bus. The publisher keeps a ring of frame slots in a
+ * memfd and hands the fd to every client connecting to its unix socket.
+ * Clients map it read only and use the newest frame in place. Each
+ * published frame bumps a shared futex word, and clients sleep on that
+ * word. The producer never waits for them; a client that is too slow sees
+ * its frame overwritten, and framebus_release() reports that.
+ *
+ * Memory layout: framebus_header, framebus_slot[nslots], then slot data at
+ * data_offset + n * slot_size.
+ */
+
+#define FRAMEBUS_MAGIC		0x53554246	/* "FBUS" */
+#define FRAMEBUS_VERSION	1
+#define FRAMEBUS_SLOTS		4
+
+struct framebus_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t slot_size;
+	uint32_t data_offset;
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint32_t bytesperline;
+	uint32_t latest;		/* number of newest frame, 0 before the first */
+	uint32_t futex;			/* bumped on every frame */
+	uint32_t reserved[5];
+};
+
+struct framebus_slot {
+	uint32_t frame;			/* frame number in the slot, 0 while rewritten */
+	uint32_t bytesused;
+	uint32_t sequence;
+	uint32_t flags;
+	uint64_t timestamp;		/* usec */
+};
+
+
+/* Publisher */
+
+struct framebus;
+
+struct framebus *framebus_create(const char *socket_path, unsigned int nslots, unsigned int slot_size,
+	uint32_t fourcc, uint32_t width, uint32_t height, uint32_t bytesperline);
+
+/* Copy a frame into the next slot and wake clients. Returns 1, 0 if too big */
+int framebus_publish(struct framebus *bus, const struct iovec *iov, int iovcnt,
+	uint32_t sequence, uint32_t flags, const struct timeval *timestamp);
+
+void framebus_close(struct framebus *bus);
+
+
+/* Client */
+
+struct framebus_client {
+	int fd;
+	size_t size;
+	const struct framebus_header *hdr;
+	const struct framebus_slot *slots;
+	const unsigned char *base;
+	uint32_t last;			/* last frame returned by framebus_wait() */
+};
+
+struct framebus_frame {
+	const unsigned char *data;	/* in the shared mapping, read only */
+	uint32_t bytesused;
+	uint32_t sequence;
+	uint32_t flags;
+	uint64_t timestamp;
+	uint32_t frame;
+};
+
+int framebus_attach(struct framebus_client *c, const char *socket_path);
+
+/* Wait for a frame newer than the last one returned.
+ * Returns 1 with f filled in, 0 on timeout (timeout_ms < 0 waits forever), -1 on error */
+int framebus_wait(struct framebus_client *c, struct framebus_frame *f, int timeout_ms);
+
+/* Done with f; returns 1 if it stayed intact, 0 if the producer overwrote it meanwhile */
+int framebus_release(struct framebus_client *c, struct framebus_frame *f);
+
+void framebus_detach(struct framebus_client *c);
+
+#endif // _FRAMEBUS_H_
@@ -0,0 +1,689 @@
+/*
+ *      httpd.c  --  MJPEG preview over HTTP, single epoll thread
+ *
+ *      Frame data is never copied on the way out as long as clients keep
+ *      up: each client writes the parts of the DHT-fixed frame_ref with
+ *      sendmsg() from the mmapped capture buffer. vmsplice() would save
+ *      the copy into the socket buffer too, but the pages stay referenced
+ *      from the socket after the buffer goes back to the driver, which then
+ *      overwrites frames still in flight.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+#include "rtsched.h"
+
+#define HTTPD_REQUEST_MAX	1024
+#define HTTPD_HEAD_MAX		512
+#define HTTPD_BOUNDARY		"frame"
+
+#define HTTPD_LISTEN		HTTPD_MAX_CLIENTS
+#define HTTPD_WAKE		(HTTPD_MAX_CLIENTS + 1)
+
+enum {
+	CLIENT_FREE = 0,
+	CLIENT_REQUEST,			/* reading the request */
+	CLIENT_STREAM,
+	CLIENT_SNAPSHOT,
+};
+
+struct httpd_client {
+	int fd;
+	int state;
+	int started;			/* response header sent */
+	int writing;			/* waiting for EPOLLOUT */
+
+	char req[HTTPD_REQUEST_MAX];
+	int req_len;
+
+	struct frame_ref *ref;		/* frame being sent, NULL once copied or done */
+	unsigned int frame;		/* number of that frame */
+	char head[HTTPD_HEAD_MAX];	/* response and part header */
+	struct iovec iov[5];		/* head, up to 3 frame parts, trailer */
+	int iov_first, niov;
+	size_t left;
+
+	unsigned char *copy;		/* unsent tail of a frame given back early */
+	size_t copy_size;
+};
+
+struct httpd {
+	int sock;
+	int wake;
+	int epfd;
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	struct frame_ref *incoming;	/* published, not picked up by the thread yet */
+	int stop;
+
+	/* Thread only */
+	struct frame_ref *latest;	/* held while a busy client still has to send it */
+	unsigned int frame;
+	struct httpd_client clients[HTTPD_MAX_CLIENTS];
+
+	struct httpd_stats stats;
+};
+
+static const char httpd_trailer[] = "\r\n";
+
+
+static void httpd_watch(struct httpd *h, struct httpd_client *c, int writing) {
+
+	struct epoll_event ev;
+
+	if(c->writing == writing)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+	ev.data.u32 = c - h->clients;
+	epoll_ctl(h->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->writing = writing;
+}
+
+static void httpd_drop(struct httpd *h, struct httpd_client *c) {
+
+	epoll_ctl(h->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+
+	if(c->ref)
+		frame_ref_put(c->ref);
+
+	free(c->copy);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+/* Plain response for errors, best effort */
+static void httpd_reply(struct httpd *h, struct httpd_client *c, const char *status) {
+
+	char buf[256];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "HTTP/1.0 %s\r\nContent-Type: text/plain\r\n"
+		"Connection: close\r\n\r\n%s\r\n", status, status);
+	if(send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+		/* Closing anyway */
+	}
+
+	httpd_drop(h, c);
+}
+
+static int httpd_frame_len(struct frame_ref *ref) {
+
+	size_t len = 0;
+	int i;
+
+	for(i = 0; i < ref->niov; i++)
+		len += ref->iov[i].iov_len;
+
+	return len;
+}
+
+/* Returns 0 if done with the frame, 1 if waiting for the socket, -1 on error */
+static int httpd_send(struct httpd *h, struct httpd_client *c) {
+
+	struct msghdr msg;
+	ssize_t n;
+
+	while(c->left) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &c->iov[c->iov_first];
+		msg.msg_iovlen = c->niov - c->iov_first;
+
+		n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				httpd_watch(h, c, 1);
+				return 1;
+			}
+			return -1;
+		}
+
+		c->left -= n;
+		h->stats.bytes += n;
+
+		while(n > 0) {
+			struct iovec *v = &c->iov[c->iov_first];
+
+			if((size_t) n < v->iov_len) {
+				v->iov_base = (char *) v->iov_base + n;
+				v->iov_len -= n;
+				break;
+			}
+
+			n -= v->iov_len;
+			c->iov_first++;
+		}
+	}
+
+	httpd_watch(h, c, 0);
+
+	if(c->ref) {
+		frame_ref_put(c->ref);
+		c->ref = NULL;
+	}
+
+	h->stats.sent++;
+
+	return 0;
+}
+
+static int httpd_start(struct httpd *h, struct httpd_client *c, struct frame_ref *ref, unsigned int frame) {
+
+	int len = httpd_frame_len(ref), head = 0, i;
+
+	if(c->started && c->frame && frame - c->frame > 1)
+		h->stats.skipped += frame - c->frame - 1;
+
+	if(c->state == CLIENT_SNAPSHOT) {
+		head = snprintf(c->head, sizeof(c->head), "HTTP/1.0 200 OK\r\nContent-Type: image/jpeg\r\n"
+			"Content-Length: %d\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n", len);
+	} else {
+		if(!c->started)
+			head = snprintf(c->head, sizeof(c->head), "HTTP/1.0 200 OK\r\n"
+				"Content-Type: multipart/x-mixed-replace; boundary=" HTTPD_BOUNDARY "\r\n"
+				"Cache-Control: no-cache\r\nConnection: close\r\n\r\n");
+
+		head += snprintf(c->head + head, sizeof(c->head) - head, "--" HTTPD_BOUNDARY "\r\n"
+			"Content-Type: image/jpeg\r\nContent-Length: %d\r\nX-Sequence: %u\r\n\r\n",
+			len, ref->frame.sequence);
+	}
+
+	frame_ref_get(ref);
+	c->ref = ref;
+	c->frame = frame;
+	c->started = 1;
+
+	c->iov[0].iov_base = c->head;
+	c->iov[0].iov_len = head;
+	for(i = 0; i < ref->niov; i++)
+		c->iov[i + 1] = ref->iov[i];
+	c->niov = ref->niov + 1;
+	if(c->state == CLIENT_STREAM) {
+		c->iov[c->niov].iov_base = (void *) httpd_trailer;
+		c->iov[c->niov].iov_len = sizeof(httpd_trailer) - 1;
+		c->niov++;
+	}
+	c->iov_first = 0;
+	c->left = head + len + (c->state == CLIENT_STREAM ? sizeof(httpd_trailer) - 1 : 0);
+
+	return httpd_send(h, c);
+}
+
+/* Give the buffer back, keeping only what the client has yet to receive */
+static int httpd_copy_tail(struct httpd *h, struct httpd_client *c) {
+
+	unsigned char *p;
+	int i;
+
+	if(c->left > c->copy_size) {
+		p = (unsigned char *) realloc(c->copy, c->left);
+		if(!p)
+			return -1;
+		c->copy = p;
+		c->copy_size = c->left;
+	}
+
+	p = c->copy;
+	for(i = c->iov_first; i < c->niov; i++) {
+		memcpy(p, c->iov[i].iov_base, c->iov[i].iov_len);
+		p += c->iov[i].iov_len;
+	}
+
+	c->iov[0].iov_base = c->copy;
+	c->iov[0].iov_len = c->left;
+	c->iov_first = 0;
+	c->niov = 1;
+
+	frame_ref_put(c->ref);
+	c->ref = NULL;
+	h->stats.copied++;
+
+	return 0;
+}
+
+/* Called when a client is done with a frame */
+static void httpd_next(struct httpd *h, struct httpd_client *c) {
+
+	if(c->state == CLIENT_SNAPSHOT) {
+		httpd_drop(h, c);
+		return;
+	}
+
+	/* A newer frame came in while this one was being sent */
+	while(h->latest && c->frame != h->frame) {
+		int rc = httpd_start(h, c, h->latest, h->frame);
+
+		if(rc < 0) {
+			httpd_drop(h, c);
+			return;
+		}
+		if(rc > 0)
+			break;
+	}
+}
+
+/* Drop the latest frame once no busy client is still going to need it */
+static void httpd_trim(struct httpd *h) {
+
+	int i;
+
+	if(!h->latest)
+		return;
+
+	for(i = 0; i < HTTPD_MAX_CLIENTS; i++) {
+		struct httpd_client *c = &h->clients[i];
+
+		if((c->state == CLIENT_STREAM || c->state == CLIENT_SNAPSHOT) && c->frame != h->frame)
+			return;
+	}
+
+	frame_ref_put(h->latest);
+	h->latest = NULL;
+}
+
+static void httpd_new_frame(struct httpd *h, struct frame_ref *ref) {
+
+	int i, rc;
+
+	if(h->latest)
+		frame_ref_put(h->latest);
+
+	/* Server reference taken in httpd_publish() */
+	h->latest = ref;
+	if(++h->frame == 0)
+		h->frame = 1;
+
+	for(i = 0; i < HTTPD_MAX_CLIENTS; i++) {
+		struct httpd_client *c = &h->clients[i];
+
+		if(c->state != CLIENT_STREAM && c->state != CLIENT_SNAPSHOT)
+			continue;
+
+		if(c->left) {
+			/* Busy with an older frame, it gets this one when done */
+			if(c->ref && httpd_copy_tail(h, c) < 0)
+				httpd_drop(h, c);
+			continue;
+		}
+
+		rc = httpd_start(h, c, ref, h->frame);
+		if(rc < 0)
+			httpd_drop(h, c);
+		else if(rc == 0)
+			httpd_next(h, c);
+	}
+
+	httpd_trim(h);
+}
+
+static void httpd_request(struct httpd *h, struct httpd_client *c) {
+
+	char method[8], path[256], discard[256];
+	ssize_t n;
+
+	/* Clients being served have nothing more to say, only notice them closing */
+	if(c->state != CLIENT_REQUEST)
+		n = recv(c->fd, discard, sizeof(discard), MSG_DONTWAIT);
+	else
+		n = recv(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len, MSG_DONTWAIT);
+
+	if(n <= 0) {
+		if(n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		httpd_drop(h, c);
+		return;
+	}
+
+	if(c->state != CLIENT_REQUEST)
+		return;
+
+	c->req_len += n;
+	c->req[c->req_len] = '\0';
+
+	if(!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n")) {
+		if(c->req_len == sizeof(c->req) - 1)
+			httpd_reply(h, c, "400 Bad Request");
+		return;
+	}
+
+	if(sscanf(c->req, "%7s %255s", method, path) != 2) {
+		httpd_reply(h, c, "400 Bad Request");
+		return;
+	}
+
+	if(strcmp(method, "GET")) {
+		httpd_reply(h, c, "405 Method Not Allowed");
+		return;
+	}
+
+	if(!strcmp(path, "/") || !strcmp(path, "/stream") || !strcmp(path, "/stream.mjpg"))
+		c->state = CLIENT_STREAM;
+	else if(!strcmp(path, "/snapshot") || !strcmp(path, "/snapshot.jpg"))
+		c->state = CLIENT_SNAPSHOT;
+	else {
+		httpd_reply(h, c, "404 Not Found");
+		return;
+	}
+
+	/* Frames start with the next one published */
+	c->frame = h->frame;
+}
+
+static void httpd_accept(struct httpd *h) {
+
+	struct httpd_client *c = NULL;
+	struct epoll_event ev;
+	int s, i, one = 1;
+
+	s = accept4(h->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(s < 0)
+		return;
+
+	for(i = 0; i < HTTPD_MAX_CLIENTS; i++)
+		if(h->clients[i].state == CLIENT_FREE) {
+			c = &h->clients[i];
+			break;
+		}
+
+	if(!c) {
+		static const char busy[] = "HTTP/1.0 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+
+		if(send(s, busy, sizeof(busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+			/* Closing anyway */
+		}
+		close(s);
+		h->stats.rejected++;
+		return;
+	}
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	memset(c, 0, sizeof(*c));
+	c->fd = s;
+	c->state = CLIENT_REQUEST;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = i;
+	if(epoll_ctl(h->epfd, EPOLL_CTL_ADD, s, &ev) < 0) {
+		close(s);
+		c->state = CLIENT_FREE;
+		return;
+	}
+
+	h->stats.clients++;
+}
+
+static void *httpd_thread(void *arg) {
+
+	struct httpd *h = (struct httpd *) arg;
+	struct epoll_event ev[HTTPD_MAX_CLIENTS + 2];
+	int n, i;
+
+	rt_thread("io");
+
+	for(;;) {
+		n = epoll_wait(h->epfd, ev, HTTPD_MAX_CLIENTS + 2, -1);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			printf("httpd: epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+
+		for(i = 0; i < n; i++) {
+			uint32_t id = ev[i].data.u32;
+			struct httpd_client *c;
+
+			if(id == HTTPD_WAKE) {
+				struct frame_ref *ref;
+				uint64_t v;
+				int stop;
+
+				if(read(h->wake, &v, sizeof(v)) < 0) {
+					/* Counter is reset either way */
+				}
+
+				pthread_mutex_lock(&h->lock);
+				ref = h->incoming;
+				h->incoming = NULL;
+				stop = h->stop;
+				pthread_mutex_unlock(&h->lock);
+
+				if(ref)
+					httpd_new_frame(h, ref);
+				if(stop)
+					return NULL;
+				continue;
+			}
+
+			if(id == HTTPD_LISTEN) {
+				httpd_accept(h);
+				continue;
+			}
+
+			c = &h->clients[id];
+			if(c->state == CLIENT_FREE)
+				continue;
+
+			if(ev[i].events & (EPOLLERR | EPOLLHUP)) {
+				httpd_drop(h, c);
+				continue;
+			}
+
+			if(ev[i].events & EPOLLIN) {
+				httpd_request(h, c);
+				if(c->state == CLIENT_FREE)
+					continue;
+			}
+
+			if((ev[i].events & EPOLLOUT) && c->left) {
+				int rc = httpd_send(h, c);
+
+				if(rc < 0)
+					httpd_drop(h, c);
+				else if(rc == 0)
+					httpd_next(h, c);
+			}
+		}
+
+		httpd_trim(h);
+	}
+
+	return NULL;
+}
+
+static int httpd_listen(struct httpd *h, const char *addr) {
+
+	struct addrinfo hints, *res;
+	char host[256];
+	const char *port;
+	int one = 1, rc;
+
+	port = strrchr(addr, ':');
+	if(port) {
+		snprintf(host, sizeof(host), "%.*s", (int) (port - addr), addr);
+		port++;
+	} else {
+		host[0] = '\0';
+		port = addr;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+	if(rc) {
+		printf("httpd: cannot resolve %s: %s\n", addr, gai_strerror(rc));
+		return -1;
+	}
+
+	h->sock = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(h->sock < 0) {
+		printf("httpd: socket failed: %s\n", strerror(errno));
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	setsockopt(h->sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if(bind(h->sock, res->ai_addr, res->ai_addrlen) < 0 || listen(h->sock, 8) < 0) {
+		printf("httpd: cannot listen on %s: %s\n", addr, strerror(errno));
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+struct httpd *httpd_create(const char *addr) {
+
+	struct httpd *h;
+	struct epoll_event ev;
+	int i;
+
+	h = (struct httpd *) calloc(1, sizeof(*h));
+	if(!h)
+		return NULL;
+
+	h->sock = h->wake = h->epfd = -1;
+	for(i = 0; i < HTTPD_MAX_CLIENTS; i++)
+		h->clients[i].fd = -1;
+
+	pthread_mutex_init(&h->lock, NULL);
+
+	if(httpd_listen(h, addr) < 0)
+		goto fail;
+
+	h->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	h->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(h->wake < 0 || h->epfd < 0) {
+		printf("httpd: cannot create epoll: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = HTTPD_LISTEN;
+	epoll_ctl(h->epfd, EPOLL_CTL_ADD, h->sock, &ev);
+	ev.data.u32 = HTTPD_WAKE;
+	epoll_ctl(h->epfd, EPOLL_CTL_ADD, h->wake, &ev);
+
+	if(pthread_create(&h->thread, NULL, httpd_thread, h)) {
+		printf("httpd: cannot start thread\n");
+		goto fail;
+	}
+
+	printf("httpd: serving MJPEG on http://%s%s/\n", strchr(addr, ':') ? "" : "localhost:", addr);
+
+	return h;
+
+fail:
+	if(h->sock >= 0)
+		close(h->sock);
+	if(h->wake >= 0)
+		close(h->wake);
+	if(h->epfd >= 0)
+		close(h->epfd);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+	return NULL;
+}
+
+void httpd_publish(struct httpd *h, struct frame_ref *ref) {
+
+	struct frame_ref *old;
+	uint64_t one = 1;
+
+	if(ref->niov <= 0)
+		return;
+
+	frame_ref_get(ref);
+
+	pthread_mutex_lock(&h->lock);
+	old = h->incoming;
+	h->incoming = ref;
+	h->stats.frames++;
+	pthread_mutex_unlock(&h->lock);
+
+	/* Thread hasn't picked up the previous one, nobody saw it */
+	if(old)
+		frame_ref_put(old);
+
+	if(write(h->wake, &one, sizeof(one)) < 0) {
+		/* Already signalled */
+	}
+}
+
+void httpd_close(struct httpd *h) {
+
+	uint64_t one = 1;
+	int i;
+
+	pthread_mutex_lock(&h->lock);
+	h->stop = 1;
+	pthread_mutex_unlock(&h->lock);
+
+	if(write(h->wake, &one, sizeof(one)) < 0) {
+		/* Already signalled */
+	}
+
+	pthread_join(h->thread, NULL);
+
+	for(i = 0; i < HTTPD_MAX_CLIENTS; i++)
+		if(h->clients[i].state != CLIENT_FREE)
+			httpd_drop(h, &h->clients[i]);
+
+	if(h->incoming)
+		frame_ref_put(h->incoming);
+	if(h->latest)
+		frame_ref_put(h->latest);
+
+	close(h->sock);
+	close(h->wake);
+	close(h->epfd);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+void httpd_get_stats(struct httpd *h, struct httpd_stats *stats) {
+
+	pthread_mutex_lock(&h->lock);
+	*stats = h->stats;
+	pthread_mutex_unlock(&h->lock);
+}
+
+void httpd_print_stats(struct httpd *h, FILE *fp) {
+
+	struct httpd_stats st;
+
+	httpd_get_stats(h, &st);
+
+	fprintf(fp, "httpd: %llu clients (%llu rejected), %llu frames in, %llu sent, %llu skipped, "
+		"%llu tails copied, %.1f MB out\n",
+		st.clients, st.rejected, st.frames, st.sent, st.skipped, st.copied, st.bytes / 1048576.0);
+}
@@ -0,0 +1,48 @@
+#ifndef _HTTPD_H_
+#define _HTTPD_H_
+
+#include <stdio.h>
+
+#include "sink.h"
+
+/*
+ * MJPEG preview over HTTP. One thread runs an epoll loop over the
+ * listening socket and all clients and writes frames straight from the
+ * capture buffers with writev(). Each client is sent the newest frame once
+ * it has finished the previous one, frames arriving meanwhile are skipped.
+ * A client still writing an old frame when a new one arrives copies what
+ * it has left, so at most one capture buffer is held for the server.
+ *
+ *	/		multipart/x-mixed-replace stream
+ *	/snapshot.jpg	the next frame, then close
+ *
+ * curl -o - http://localhost:8080/ | ...
+ */
+
+#define HTTPD_MAX_CLIENTS	16
+
+struct httpd_stats {
+	unsigned long long clients;
+	unsigned long long frames;		/* handed to the server */
+	unsigned long long sent;		/* frames completely sent, all clients */
+	unsigned long long skipped;		/* frames a busy client never saw */
+	unsigned long long copied;		/* unsent tails copied off a buffer */
+	unsigned long long bytes;
+	unsigned long long rejected;
+};
+
+struct httpd;
+
+/* addr is "port" or "host:port" */
+struct httpd *httpd_create(const char *addr);
+
+/* Hand a frame to the server, which takes its own reference. Never blocks on clients */
+void httpd_publish(struct httpd *h, struct frame_ref *ref);
+
+/* Disconnects all clients and drops their references */
+void httpd_close(struct httpd *h);
+
+void httpd_get_stats(struct httpd *h, struct httpd_stats *stats);
+void httpd_print_stats(struct httpd *h, FILE *fp);
+
+#endif // _HTTPD_H_
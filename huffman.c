@@ -1,6 +1,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include "huffman.h"
 
 char huffman_table[] = 
 	"\xFF\xC4\x01\xA2\x00\x00\x01\x05\x01\x01\x01\x01"
@@ -56,7 +57,6 @@ char jpg_hdr[] =
 
 
 
-#define DHT_SIZE     420
 #define HEADERFRAME1 0xaf
 static unsigned char dht_data[DHT_SIZE] = {
   0xff, 0xc4, 0x01, 0xa2, 0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01,
@@ -207,6 +207,176 @@ int insert_huffman4(unsigned char* from, int fromLen, unsigned char *to, int *to
 }
 
 
+/*
+ * Walk JPEG header segments starting right after SOI. Returns offset of the
+ * SOS marker, or -1 if the header is broken or longer than MJPEG_HEADER_MAX.
+ */
+static int mjpeg_scan_header(const unsigned char *from, int fromLen, int *has_dht) {
+
+	int off = 2;
+
+	*has_dht = 0;
+
+	if(fromLen < 4 || from[0] != 0xff || from[1] != 0xd8)
+		return -1;
+
+	while(off + 4 <= fromLen && off < MJPEG_HEADER_MAX) {
+
+		if(from[off] != 0xff)
+			return -1;
+
+		if(from[off + 1] == 0xff) { // fill byte
+			off++;
+			continue;
+		}
+
+		if(from[off + 1] == 0xda)
+			return off;
+
+		if(from[off + 1] == 0xc4)
+			*has_dht = 1;
+
+		off += 2 + ((from[off + 2] << 8) | from[off + 3]);
+	}
+
+	return -1;
+}
+
+/* APP0 ID is patched to "JFIF" in the prefix, compare header past it */
+static int mjpeg_header_skip(const unsigned char *from, int header_len) {
+
+	return (from[2] == 0xff && from[3] == 0xe0 && header_len >= 10) ? 10 : 2;
+}
+
+static void mjpeg_stream_learn(struct mjpeg_stream *s, unsigned char *from, int header_len, int has_dht) {
+
+	int skip = mjpeg_header_skip(from, header_len);
+
+	if(s->frames_seen == 0) {
+
+		memcpy(s->prefix, from, header_len);
+		if(skip == 10)
+			memcpy(s->prefix + 6, "JFIF", 4);
+		s->prefix_len = header_len;
+
+		if(!has_dht) {
+			memcpy(s->prefix + s->prefix_len, dht_data, DHT_SIZE);
+			s->prefix_len += DHT_SIZE;
+		}
+
+		s->header_len = header_len;
+		s->has_dht = has_dht;
+		s->state = MJPEG_STREAM_LEARNING;
+
+	} else if(s->state == MJPEG_STREAM_LEARNING) {
+
+		if(header_len != s->header_len || has_dht != s->has_dht ||
+		   memcmp(from + skip, s->prefix + skip, header_len - skip))
+			s->state = MJPEG_STREAM_LAYOUT;
+	}
+
+	s->frames_seen++;
+
+	if(s->frames_seen >= MJPEG_LEARN_FRAMES && s->state == MJPEG_STREAM_LEARNING)
+		s->state = MJPEG_STREAM_PREFIX;
+}
+
+void mjpeg_stream_init(struct mjpeg_stream *s) {
+
+	memset(s, 0, sizeof(*s));
+	s->state = MJPEG_STREAM_LEARNING;
+}
+
+int mjpeg_stream_iov(struct mjpeg_stream *s, unsigned char *from, int fromLen, struct iovec *iov) {
+
+	int header_len = s->header_len;
+
+	/* Fast path: bounds check only, header layout is already known */
+
+	if(s->state == MJPEG_STREAM_LEARNING || fromLen <= header_len + 2 ||
+	   from[0] != 0xff || from[1] != 0xd8 ||
+	   from[header_len] != 0xff || from[header_len + 1] != 0xda) {
+
+		int has_dht;
+
+		header_len = mjpeg_scan_header(from, fromLen, &has_dht);
+
+		if(header_len < 0) {
+			s->errors++;
+			return -1;
+		}
+
+		if(s->state != MJPEG_STREAM_LEARNING) {
+			/* Camera changed its header layout, start over */
+			s->relearns++;
+			s->frames_seen = 0;
+		}
+
+		mjpeg_stream_learn(s, from, header_len, has_dht);
+	}
+
+	/* Some cameras change quantization tables on the fly while keeping the
+	 * layout, so cached header still has to match. This is a plain memcmp
+	 * of a few hundred bytes, no marker walk. */
+
+	if(s->state == MJPEG_STREAM_PREFIX) {
+		int skip = mjpeg_header_skip(from, header_len);
+
+		if(memcmp(from + skip, s->prefix + skip, header_len - skip)) {
+			s->relearns++;
+			s->state = MJPEG_STREAM_LAYOUT;
+		}
+	}
+
+	s->frames_fixed++;
+
+	/* The prefix is not compared against any more, it holds this frame's
+	 * header, patched like a learned one so the bytes written do not
+	 * depend on what was learned */
+	if(s->state == MJPEG_STREAM_LAYOUT) {
+		memcpy(s->prefix, from, header_len);
+		if(mjpeg_header_skip(from, header_len) == 10)
+			memcpy(s->prefix + 6, "JFIF", 4);
+		s->prefix_len = header_len;
+
+		if(!s->has_dht) {
+			memcpy(s->prefix + s->prefix_len, dht_data, DHT_SIZE);
+			s->prefix_len += DHT_SIZE;
+		}
+	}
+
+	iov[0].iov_base = s->prefix;
+	iov[0].iov_len = s->prefix_len;
+	iov[1].iov_base = from + header_len;
+	iov[1].iov_len = fromLen - header_len;
+
+	return 2;
+}
+
+int mjpeg_stream_fix(struct mjpeg_stream *s, unsigned char *from, int fromLen, unsigned char *to, int toSize, int *toLen) {
+
+	struct iovec iov[3];
+	int i, n;
+
+	*toLen = 0;
+
+	n = mjpeg_stream_iov(s, from, fromLen, iov);
+	if(n < 0)
+		return -1;
+
+	for(i = 0; i < n; i++) {
+		if(*toLen + iov[i].iov_len > toSize) {
+			*toLen = 0;
+			return -2;
+		}
+		memcpy(to + *toLen, iov[i].iov_base, iov[i].iov_len);
+		*toLen += iov[i].iov_len;
+	}
+
+	return 1;
+}
+
+
 /*
 int main(void) {
 
@@ -0,0 +1,57 @@
+#ifndef _HUFFMAN_H_
+#define _HUFFMAN_H_
+
+#include <sys/uio.h>
+
+/* Legacy fixed-layout helpers, kept for existing callers */
+
+void insert_huffman(unsigned char* from, int fromLen, unsigned char *to, int *toLen);
+int insert_huffman2(unsigned char* from, int fromLen, unsigned char *to, int *toLen);
+int insert_huffman3(unsigned char* from, int fromLen, unsigned char *to, int *toLen);
+int insert_huffman4(unsigned char* from, int fromLen, unsigned char *to, int *toLen);
+
+
+/*
+ * Stream level MJPEG fixer. The first MJPEG_LEARN_FRAMES frames of a stream
+ * are walked marker by marker to learn where the header ends (offset of SOS),
+ * whether the camera sends its own DHT and whether the header bytes stay the
+ * same from frame to frame. After that every frame is fixed by a bounds check
+ * and a splice of the cached prefix in front of the entropy coded data.
+ */
+
+#define MJPEG_LEARN_FRAMES	8
+#define MJPEG_HEADER_MAX	2048
+#define DHT_SIZE		420	/* the standard tables, spliced in without a DHT */
+#define MJPEG_PREFIX_MAX	(MJPEG_HEADER_MAX + DHT_SIZE)
+
+enum mjpeg_stream_state {
+	MJPEG_STREAM_LEARNING = 0,
+	MJPEG_STREAM_PREFIX,		/* header constant, cached prefix is spliced */
+	MJPEG_STREAM_LAYOUT,		/* header varies, copied into the prefix per frame */
+};
+
+struct mjpeg_stream {
+	int state;
+	int frames_seen;
+	int has_dht;			/* camera provides its own DHT */
+	int header_len;			/* offset of SOS in source frames */
+	int prefix_len;
+	unsigned char prefix[MJPEG_PREFIX_MAX];
+
+	unsigned int frames_fixed;
+	unsigned int relearns;		/* frames not matching learned layout */
+	unsigned int errors;		/* frames rejected as broken */
+};
+
+void mjpeg_stream_init(struct mjpeg_stream *s);
+
+/* Fill iov with prefix + entropy coded data of the frame, the data is not
+ * copied. APP0 is always patched to "JFIF". Returns number of iovecs used,
+ * 2, or -1 if the frame is not a valid JPEG. */
+int mjpeg_stream_iov(struct mjpeg_stream *s, unsigned char *from, int fromLen, struct iovec *iov);
+
+/* Same as above but gathers result into to[toSize]. Returns 1 on success,
+ * -1 on broken frame, -2 if the result does not fit. */
+int mjpeg_stream_fix(struct mjpeg_stream *s, unsigned char *from, int fromLen, unsigned char *to, int toSize, int *toLen);
+
+#endif // _HUFFMAN_H_
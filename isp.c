@@ -0,0 +1,338 @@
+/*
+ *      isp.c  --  exposure and white balance from sparse frame statistics
+ *
+ *      At 720p the statistics read 90 pairs of rows, 57600 quads, through
+ *      convert_bggr8_quads(); only the histogram is counted in a plain
+ *      loop. Controls go out in one VIDIOC_S_EXT_CTRLS call, so exposure
+ *      and gain change on the same frame.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "isp.h"
+
+struct isp_ctrl {
+	unsigned int id;		/* 0 if the sensor has none */
+	long min, max, step, value;
+};
+
+struct isp_stats {
+	uint32_t hist[ISP_BINS];
+	uint64_t sum[3];		/* red, green, blue; two greens per quad */
+	unsigned int quads;
+};
+
+struct isp {
+	struct isp_config cfg;
+	int fd;
+	int stride, width, height;	/* quads per row, pairs of rows */
+	uint8_t *luma;
+	struct isp_stats stats;
+
+	/* Exposure, off if the sensor has no control for it */
+	int ae, wait, mean;
+	struct isp_ctrl exposure, gain;
+
+	/* White balance: estimate, and what frames are shown with */
+	int wb_r, wb_b;
+	struct convert_gains gains;
+
+	unsigned long long frames, updates;
+};
+
+/* The first of ids the driver has */
+static void isp_find(struct isp *isp, const unsigned int *ids, int n, struct isp_ctrl *c) {
+
+	struct v4l2_queryctrl query;
+	struct v4l2_control ctrl;
+	int i;
+
+	memset(c, 0, sizeof(*c));
+
+	for(i = 0; i < n; i++) {
+		memset(&query, 0, sizeof(query));
+		query.id = ids[i];
+		if(ioctl(isp->fd, VIDIOC_QUERYCTRL, &query) < 0 || (query.flags & V4L2_CTRL_FLAG_DISABLED))
+			continue;
+
+		memset(&ctrl, 0, sizeof(ctrl));
+		ctrl.id = ids[i];
+		if(ioctl(isp->fd, VIDIOC_G_CTRL, &ctrl) < 0)
+			continue;
+
+		c->id = ids[i];
+		c->min = query.minimum;
+		c->max = query.maximum;
+		c->step = query.step > 0 ? query.step : 1;
+		c->value = ctrl.value;
+		return;
+	}
+}
+
+static int isp_set(struct isp *isp, struct v4l2_ext_control *ctrls, int n) {
+
+	struct v4l2_ext_controls ext;
+
+	if(n == 0)
+		return 0;
+
+	/* Exposure and gain may be in different classes, which class 0 allows */
+	memset(&ext, 0, sizeof(ext));
+	ext.count = n;
+	ext.controls = ctrls;
+
+	return ioctl(isp->fd, VIDIOC_S_EXT_CTRLS, &ext);
+}
+
+struct isp *isp_create(int fd, unsigned int pixelformat, int width, int height, int bytesperline,
+	const struct isp_config *cfg) {
+
+	static const unsigned int exposure[] = { V4L2_CID_EXPOSURE, V4L2_CID_EXPOSURE_ABSOLUTE };
+	static const unsigned int gain[] = { V4L2_CID_ANALOGUE_GAIN, V4L2_CID_GAIN };
+	struct v4l2_ext_control manual[2];
+	struct isp *isp;
+
+	if(pixelformat != V4L2_PIX_FMT_SBGGR8) {
+		printf("Exposure and white balance need BA81 frames\n");
+		return NULL;
+	}
+
+	isp = (struct isp *) calloc(1, sizeof(*isp));
+	if(!isp)
+		return NULL;
+
+	isp->cfg = *cfg;
+	isp->fd = fd;
+	isp->stride = bytesperline ? bytesperline : width;
+	isp->width = width / 2;
+	isp->height = height / 2;
+	isp->wb_r = 256;
+	isp->wb_b = 256;
+
+	isp->luma = (uint8_t *) malloc(isp->width);
+	if(!isp->luma) {
+		printf("Out of memory for frame statistics\n");
+		free(isp);
+		return NULL;
+	}
+
+	if(fd < 0 || cfg->target <= 0)
+		return isp;
+
+	isp_find(isp, exposure, 2, &isp->exposure);
+	isp_find(isp, gain, 2, &isp->gain);
+	if(!isp->exposure.id && !isp->gain.id) {
+		printf("Sensor has no exposure or gain control, exposure stays as it is\n");
+		return isp;
+	}
+
+	/* The driver's own loops would fight this one. One at a time, as a
+	 * control the driver lacks fails the whole call; most raw sensors
+	 * have neither */
+	memset(manual, 0, sizeof(manual));
+	manual[0].id = V4L2_CID_EXPOSURE_AUTO;
+	manual[0].value = V4L2_EXPOSURE_MANUAL;
+	manual[1].id = V4L2_CID_AUTOGAIN;
+	manual[1].value = 0;
+	isp_set(isp, manual, 1);
+	isp_set(isp, manual + 1, 1);
+
+	isp->ae = 1;
+	printf("Auto exposure to level %d: exposure %ld (%ld-%ld), gain %ld (%ld-%ld)\n", cfg->target,
+		isp->exposure.value, isp->exposure.min, isp->exposure.max,
+		isp->gain.value, isp->gain.min, isp->gain.max);
+
+	return isp;
+}
+
+static void isp_gather(struct isp *isp, const uint8_t *data) {
+
+	struct isp_stats *s = &isp->stats;
+	int x, y;
+
+	memset(s, 0, sizeof(*s));
+
+	for(y = 0; y < isp->height; y += ISP_STEP) {
+		const uint8_t *s0 = data + (size_t) y * 2 * isp->stride;
+		uint32_t sums[3] = { 0, 0, 0 };
+
+		convert_bggr8_quads(s0, s0 + isp->stride, isp->luma, isp->width, sums);
+
+		for(x = 0; x < isp->width; x++)
+			s->hist[isp->luma[x]]++;
+
+		s->sum[0] += sums[0];
+		s->sum[1] += sums[1];
+		s->sum[2] += sums[2];
+		s->quads += isp->width;
+	}
+}
+
+/* Scale c by factor, within its range and steps; what is left to scale */
+static double isp_scale(struct isp_ctrl *c, double factor) {
+
+	double from = c->value > 0 ? c->value : 1, left;
+	long v;
+
+	if(!c->id)
+		return factor;
+
+	v = (long) (from * factor + 0.5);
+	v = c->min + (v - c->min) / c->step * c->step;
+
+	/* Small values move by at least a step */
+	if(factor > 1 && v <= c->value)
+		v = c->value + c->step;
+	if(factor < 1 && v >= c->value)
+		v = c->value - c->step;
+
+	if(v < c->min)
+		v = c->min;
+	if(v > c->max)
+		v = c->max;
+
+	c->value = v;
+	left = factor * from / (v > 0 ? v : 1);
+
+	/* A step too far is not taken back by the other control */
+	if((factor > 1 && left < 1) || (factor < 1 && left > 1))
+		left = 1;
+
+	return left;
+}
+
+static void isp_expose(struct isp *isp, double factor) {
+
+	struct isp_ctrl *first = &isp->exposure, *second = &isp->gain;
+	struct isp_ctrl old_exposure = isp->exposure, old_gain = isp->gain;
+	struct v4l2_ext_control ctrls[2];
+	int n = 0;
+
+	/* Brighter with exposure before gain, darker with gain first: least noise */
+	if(factor < 1) {
+		first = &isp->gain;
+		second = &isp->exposure;
+	}
+
+	isp_scale(second, isp_scale(first, factor));
+
+	memset(ctrls, 0, sizeof(ctrls));
+	if(isp->exposure.value != old_exposure.value) {
+		ctrls[n].id = isp->exposure.id;
+		ctrls[n++].value = isp->exposure.value;
+	}
+	if(isp->gain.value != old_gain.value) {
+		ctrls[n].id = isp->gain.id;
+		ctrls[n++].value = isp->gain.value;
+	}
+
+	/* At the limits of both */
+	if(n == 0)
+		return;
+
+	if(isp_set(isp, ctrls, n) < 0) {
+		printf("Cannot set exposure: %s, auto exposure off\n", strerror(errno));
+		isp->exposure = old_exposure;
+		isp->gain = old_gain;
+		isp->ae = 0;
+		return;
+	}
+
+	isp->wait = 0;
+	isp->updates++;
+}
+
+static void isp_exposure(struct isp *isp) {
+
+	struct isp_stats *s = &isp->stats;
+	int target = isp->cfg.target, i;
+	unsigned long long sum = 0, clipped = 0;
+	double factor;
+
+	/* What was set last has to be in the frames first */
+	if(++isp->wait < ISP_INTERVAL || s->quads == 0)
+		return;
+
+	for(i = 0; i < ISP_BINS; i++)
+		sum += (unsigned long long) i * s->hist[i];
+	for(i = 250; i < ISP_BINS; i++)
+		clipped += s->hist[i];
+	isp->mean = sum / s->quads;
+
+	if(abs(isp->mean - target) <= target / 16)
+		return;
+
+	factor = isp->mean > 0 ? (double) target / isp->mean : ISP_MAX_STEP;
+
+	/* Dark on average with burnt out highlights, leave it */
+	if(factor > 1 && clipped > s->quads / 32)
+		return;
+
+	if(factor > ISP_MAX_STEP)
+		factor = ISP_MAX_STEP;
+	if(factor < 1 / ISP_MAX_STEP)
+		factor = 1 / ISP_MAX_STEP;
+
+	isp_expose(isp, factor);
+}
+
+static int isp_clamp_gain(uint64_t green, uint64_t c) {
+
+	uint64_t g = green * 256 / c;
+
+	return g < 128 ? 128 : (g > 1024 ? 1024 : (int) g);
+}
+
+/* Gray world: red and blue gains that make their means the green one */
+static void isp_white_balance(struct isp *isp) {
+
+	struct isp_stats *s = &isp->stats;
+
+	/* Too dark to tell */
+	if(s->sum[0] < (uint64_t) s->quads * 4 || s->sum[2] < (uint64_t) s->quads * 4)
+		return;
+
+	isp->wb_r += (isp_clamp_gain(s->sum[1] / 2, s->sum[0]) - isp->wb_r) / 4;
+	isp->wb_b += (isp_clamp_gain(s->sum[1] / 2, s->sum[2]) - isp->wb_b) / 4;
+
+	/* Small moves are held back, each change redraws the whole picture */
+	if(!isp->gains.r || abs(isp->wb_r - (int) isp->gains.r) >= 4 || abs(isp->wb_b - (int) isp->gains.b) >= 4) {
+		isp->gains.r = isp->wb_r;
+		isp->gains.g = 256;
+		isp->gains.b = isp->wb_b;
+	}
+}
+
+void isp_frame(struct isp *isp, const uint8_t *data, struct convert_gains *gains) {
+
+	isp_gather(isp, data);
+
+	if(isp->ae)
+		isp_exposure(isp);
+	if(isp->cfg.awb)
+		isp_white_balance(isp);
+
+	isp->frames++;
+	*gains = isp->gains;
+}
+
+void isp_print_stats(struct isp *isp, FILE *fp) {
+
+	if(isp->ae)
+		fprintf(fp, "Exposure: %llu changes in %llu frames, exposure %ld, gain %ld, level %d\n",
+			isp->updates, isp->frames, isp->exposure.value, isp->gain.value, isp->mean);
+	if(isp->cfg.awb)
+		fprintf(fp, "White balance: red %.2f, blue %.2f\n", isp->gains.r / 256.0, isp->gains.b / 256.0);
+}
+
+void isp_destroy(struct isp *isp) {
+
+	free(isp->luma);
+	free(isp);
+}
@@ -0,0 +1,45 @@
+#ifndef _ISP_H_
+#define _ISP_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "convert.h"
+
+/*
+ * Exposure and white balance for raw Bayer sensors, which have no ISP of
+ * their own. Every ISP_STEP-th pair of rows gives the statistics: a
+ * histogram of the mean of each 2x2 quad and the sums of red, green and
+ * blue. Exposure, then gain, are moved towards a target mean level by at
+ * most ISP_MAX_STEP at a time, every ISP_INTERVAL frames so the sensor
+ * has applied the last change before it is judged. White balance follows
+ * the gray world; the gains are applied by the demosaic.
+ */
+
+#define ISP_STEP		8
+#define ISP_INTERVAL		4
+#define ISP_MAX_STEP		1.25
+#define ISP_BINS		256
+
+struct isp_config {
+	int target;			/* mean level, 0 for no exposure control */
+	int awb;
+};
+
+struct isp;
+
+/* NULL for formats other than BA81. Without a device, fd < 0, only white
+ * balance is done */
+struct isp *isp_create(int fd, unsigned int pixelformat, int width, int height, int bytesperline,
+	const struct isp_config *cfg);
+
+/* Statistics of a frame, and new controls if it is time; on the capture
+ * thread, between frames. gains is what to show the frame with, r is 0
+ * for no white balance */
+void isp_frame(struct isp *isp, const uint8_t *data, struct convert_gains *gains);
+
+void isp_print_stats(struct isp *isp, FILE *fp);
+
+void isp_destroy(struct isp *isp);
+
+#endif // _ISP_H_
@@ -120,17 +120,16 @@ int jpeg_decompress(char *from, int fromLen, char *to, int *width, int *height)
 	unsigned int *to_ptr = (unsigned int*) to;
 
         for(y = 0; y < *height; y++){
+		JSAMPROW row = buffer[y];
+
                 for(x = 0; x < *width; x++) {
-                        //*(to_ptr++) = (buffer[y][x * 3] << 16) | (buffer[y][x * 3 + 1] << 8) | (buffer[y][x * 3 + 2]);
-                        *(to_ptr++) = 
-				(((int)*(buffer++)) << 16) | 
-				(((int)*(buffer++)) << 8) | 
-				(((int)*(buffer++)));
+                        *(to_ptr++) = (row[x * 3] << 16) | (row[x * 3 + 1] << 8) | (row[x * 3 + 2]);
                 }
         }
 
 
 	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
 
+	return 0;
 }
-
@@ -0,0 +1,169 @@
+/*
+ *      latency.c  --  capture to screen latency, per stage percentiles
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <linux/videodev2.h>
+
+#include "latency.h"
+#include "metrics.h"
+
+#ifndef V4L2_BUF_FLAG_TIMESTAMP_MASK
+#define V4L2_BUF_FLAG_TIMESTAMP_MASK		0x0000e000
+#define V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC	0x00002000
+#endif
+#ifndef V4L2_BUF_FLAG_TSTAMP_SRC_MASK
+#define V4L2_BUF_FLAG_TSTAMP_SRC_MASK		0x00070000
+#define V4L2_BUF_FLAG_TSTAMP_SRC_SOE		0x00010000
+#endif
+
+struct latency_samples {
+	const char *name;
+	uint32_t *usec;
+	unsigned int n;
+	unsigned long long total;		/* recorded, also past the array */
+	struct metric *metric;
+};
+
+static struct latency_samples stages[LATENCY_STAGES] = {
+	{ .name = "capture to dequeue" },
+	{ .name = "dequeue to render" },
+	{ .name = "render to present" },
+	{ .name = "capture to present" },
+};
+
+static unsigned long long frames_soe, frames_eof, frames_other_clock;
+
+int latency_init(void) {
+
+	int i;
+
+	for(i = 0; i < LATENCY_STAGES; i++) {
+		stages[i].usec = (uint32_t *) malloc(LATENCY_SAMPLES * sizeof(uint32_t));
+		if(!stages[i].usec) {
+			printf("latency: out of memory\n");
+			return -1;
+		}
+		stages[i].metric = metric_histogram(stages[i].name);
+	}
+
+	return 0;
+}
+
+uint64_t latency_frame_time(uint32_t flags, const struct timeval *timestamp) {
+
+	if((flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+		frames_other_clock++;
+		return 0;
+	}
+
+	if((flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) == V4L2_BUF_FLAG_TSTAMP_SRC_SOE)
+		frames_soe++;
+	else
+		frames_eof++;
+
+	return timestamp->tv_sec * 1000000ULL + timestamp->tv_usec;
+}
+
+void latency_record(int stage, uint64_t usec) {
+
+	struct latency_samples *s = &stages[stage];
+
+	if(!s->usec)
+		return;
+
+	/* Once full, keep replacing so the end of a long run is represented too */
+	if(s->n < LATENCY_SAMPLES)
+		s->usec[s->n++] = usec;
+	else
+		s->usec[s->total % LATENCY_SAMPLES] = usec;
+	s->total++;
+
+	metric_observe(s->metric, usec);
+}
+
+static int latency_cmp(const void *a, const void *b) {
+
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+void latency_print(FILE *fp) {
+
+	int i;
+
+	if(!stages[0].usec)
+		return;
+
+	fprintf(fp, "Latency, capture time is %s:\n",
+		frames_soe && !frames_eof ? "start of exposure" : frames_eof && !frames_soe ? "end of frame" :
+		frames_soe ? "mixed start of exposure/end of frame" : "unknown");
+
+	if(frames_other_clock)
+		fprintf(fp, "  %llu frames not stamped from CLOCK_MONOTONIC, capture stages left out\n",
+			frames_other_clock);
+
+	for(i = 0; i < LATENCY_STAGES; i++) {
+		struct latency_samples *s = &stages[i];
+		uint32_t *v = s->usec;
+		unsigned int n = s->n;
+
+		if(!n) {
+			fprintf(fp, "  %-20s no samples\n", s->name);
+			continue;
+		}
+
+		qsort(v, n, sizeof(uint32_t), latency_cmp);
+
+		fprintf(fp, "  %-20s %8llu  p50 %7.2f ms  p90 %7.2f ms  p99 %7.2f ms  max %7.2f ms\n",
+			s->name, s->total, v[n / 2] / 1000.0, v[n * 9 / 10] / 1000.0,
+			v[n * 99 / 100] / 1000.0, v[n - 1] / 1000.0);
+	}
+}
+
+
+/* 3x5 digits, one row per 3 bits */
+static const uint16_t latency_font[10] = {
+	075557, 022222, 071747, 071717, 055711, 074717, 074757, 071111, 075757, 075717,
+};
+
+#define TIMECODE_SCALE		12
+#define TIMECODE_DIGITS		6
+
+void latency_draw_timecode(uint32_t *fb, int stride, int width, int height, int x, int y, uint64_t ms) {
+
+	int d, row, col, w = (TIMECODE_DIGITS * 4 + 1) * TIMECODE_SCALE, h = 7 * TIMECODE_SCALE;
+	int i, j;
+
+	if(x + w > width || y + h > height)
+		return;
+
+	/* Black box so the digits read against any picture */
+	for(i = 0; i < h; i++)
+		memset((uint8_t *) fb + (size_t) (y + i) * stride + x * 4, 0, w * 4);
+
+	for(d = 0; d < TIMECODE_DIGITS; d++) {
+		unsigned int digit = ms % 10;
+		int dx = x + ((TIMECODE_DIGITS - 1 - d) * 4 + 1) * TIMECODE_SCALE;
+
+		ms /= 10;
+
+		for(row = 0; row < 5; row++)
+			for(col = 0; col < 3; col++) {
+				if(!(latency_font[digit] >> ((4 - row) * 3 + (2 - col)) & 1))
+					continue;
+
+				for(i = 0; i < TIMECODE_SCALE; i++) {
+					uint32_t *p = (uint32_t *) ((uint8_t *) fb + (size_t) (y + (row + 1) * TIMECODE_SCALE + i) * stride)
+						+ dx + col * TIMECODE_SCALE;
+
+					for(j = 0; j < TIMECODE_SCALE; j++)
+						p[j] = 0xffffffff;
+				}
+			}
+	}
+}
@@ -0,0 +1,48 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/*
+ * Per frame latency between capture and the screen. Every stage keeps its
+ * samples, up to LATENCY_SAMPLES, and prints exact percentiles at the end;
+ * the samples also go to a metrics histogram for periodic summaries.
+ * A stage must only be recorded from one thread.
+ *
+ * The capture time is the V4L2 buffer timestamp, usable only when the
+ * driver stamps buffers from CLOCK_MONOTONIC. Depending on
+ * V4L2_BUF_FLAG_TSTAMP_SRC_* it is the start of exposure or the end of
+ * the frame.
+ *
+ * A frame is presented when the refresh after it was written starts, as
+ * FBIO_WAITFORVSYNC tells. Framebuffers without it have no such moment,
+ * there render to present only covers drawing the timecode.
+ */
+
+#define LATENCY_SAMPLES		65536
+
+enum latency_stage {
+	LATENCY_CAPTURE_DEQUEUE = 0,		/* buffer timestamp to DQBUF returning */
+	LATENCY_DEQUEUE_RENDER,			/* DQBUF to converted onto the framebuffer */
+	LATENCY_RENDER_PRESENT,			/* converted to the next vertical sync */
+	LATENCY_CAPTURE_PRESENT,		/* the whole way */
+	LATENCY_STAGES,
+};
+
+int latency_init(void);
+
+/* Buffer timestamp in CLOCK_MONOTONIC usec, 0 if the flags say it is on another clock */
+uint64_t latency_frame_time(uint32_t flags, const struct timeval *timestamp);
+
+void latency_record(int stage, uint64_t usec);
+
+void latency_print(FILE *fp);
+
+/* Draw ms as six big digits at (x, y) of an XRGB8888 surface, for a
+ * camera filming the screen: the timecode seen in the picture against
+ * the one drawn over it is the glass to glass latency */
+void latency_draw_timecode(uint32_t *fb, int stride, int width, int height, int x, int y, uint64_t ms);
+
+#endif // _LATENCY_H_
@@ -0,0 +1,254 @@
+/*
+ *      metrics.c  --  lock-free counters and latency histograms
+ *
+ *      Updates are relaxed atomic adds on preregistered metrics. The
+ *      reporter reads them without stopping writers, so a summary may be
+ *      off by the frames in flight, which is fine for monitoring.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "metrics.h"
+
+static struct metric metrics[METRICS_MAX];
+static int nmetrics;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int metrics_pipe[2] = { -1, -1 };
+static pthread_t metrics_thread_id;
+static FILE *metrics_fp;
+static int metrics_interval;
+static volatile int metrics_stopping;
+static unsigned long long metrics_last;
+
+unsigned long long metrics_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static struct metric *metric_register(const char *name, int type) {
+
+	struct metric *m = NULL;
+	int i;
+
+	pthread_mutex_lock(&metrics_lock);
+
+	for(i = 0; i < nmetrics; i++)
+		if(!strcmp(metrics[i].name, name)) {
+			m = &metrics[i];
+			break;
+		}
+
+	if(!m && nmetrics < METRICS_MAX) {
+		m = &metrics[nmetrics];
+		snprintf(m->name, sizeof(m->name), "%s", name);
+		m->type = type;
+		/* Reporter sees the slot only once it is set up */
+		__atomic_store_n(&nmetrics, nmetrics + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&metrics_lock);
+
+	if(!m)
+		printf("metrics: no room for %s\n", name);
+
+	return m;
+}
+
+struct metric *metric_counter(const char *name) {
+
+	return metric_register(name, METRIC_COUNTER);
+}
+
+struct metric *metric_histogram(const char *name) {
+
+	return metric_register(name, METRIC_HISTOGRAM);
+}
+
+void metric_add(struct metric *m, unsigned long long n) {
+
+	if(m)
+		__atomic_add_fetch(&m->value, n, __ATOMIC_RELAXED);
+}
+
+void metric_observe(struct metric *m, unsigned long long usec) {
+
+	unsigned long long max;
+	int b;
+
+	if(!m)
+		return;
+
+	b = usec ? 64 - __builtin_clzll(usec) : 0;
+	if(b >= METRICS_BUCKETS)
+		b = METRICS_BUCKETS - 1;
+
+	__atomic_add_fetch(&m->buckets[b], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->sum, usec, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->value, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&m->max, __ATOMIC_RELAXED);
+	while(usec > max && !__atomic_compare_exchange_n(&m->max, &max, usec, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Upper bound of the bucket holding the given fraction of samples, in ms, at most max */
+static double metric_percentile(const unsigned long long *buckets, unsigned long long count, double fraction,
+	unsigned long long max) {
+
+	unsigned long long seen = 0, want = count * fraction;
+	int b;
+
+	for(b = 0; b < METRICS_BUCKETS; b++) {
+		seen += buckets[b];
+		if(seen > want)
+			break;
+	}
+
+	if(b >= METRICS_BUCKETS - 1)
+		b = METRICS_BUCKETS - 1;
+
+	return ((1ULL << b) < max ? (1ULL << b) : max) / 1000.0;
+}
+
+void metrics_print(FILE *fp) {
+
+	unsigned long long now = metrics_now(), value, sum, max, buckets[METRICS_BUCKETS], delta[METRICS_BUCKETS];
+	double secs;
+	int i, b, n;
+
+	n = __atomic_load_n(&nmetrics, __ATOMIC_ACQUIRE);
+
+	if(!metrics_last)
+		metrics_last = now;
+	secs = (now - metrics_last) / 1000000.0;
+
+	fprintf(fp, "Metrics, last %.1f s:\n", secs);
+
+	for(i = 0; i < n; i++) {
+		struct metric *m = &metrics[i];
+
+		value = __atomic_load_n(&m->value, __ATOMIC_RELAXED);
+
+		if(m->type == METRIC_COUNTER) {
+			fprintf(fp, "  %-20s %10llu  %8.1f/s  (%llu total)\n", m->name,
+				value - m->last_value, secs > 0 ? (value - m->last_value) / secs : 0.0, value);
+			m->last_value = value;
+			continue;
+		}
+
+		sum = __atomic_load_n(&m->sum, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&m->max, __ATOMIC_RELAXED);
+		for(b = 0; b < METRICS_BUCKETS; b++) {
+			buckets[b] = __atomic_load_n(&m->buckets[b], __ATOMIC_RELAXED);
+			delta[b] = buckets[b] - m->last_buckets[b];
+		}
+
+		if(value == m->last_value) {
+			fprintf(fp, "  %-20s %10u\n", m->name, 0);
+		} else {
+			fprintf(fp, "  %-20s %10llu  avg %7.3f ms  p50 <%.3f ms  p99 <%.3f ms  max %.3f ms\n",
+				m->name, value - m->last_value,
+				(sum - m->last_sum) / 1000.0 / (value - m->last_value),
+				metric_percentile(delta, value - m->last_value, 0.5, max),
+				metric_percentile(delta, value - m->last_value, 0.99, max),
+				max / 1000.0);
+		}
+
+		m->last_value = value;
+		m->last_sum = sum;
+		memcpy(m->last_buckets, buckets, sizeof(buckets));
+	}
+
+	metrics_last = now;
+	fflush(fp);
+}
+
+static void *metrics_thread(void *arg) {
+
+	struct pollfd pfd;
+	char buf[16];
+	int ret;
+
+	pfd.fd = metrics_pipe[0];
+	pfd.events = POLLIN;
+
+	while(!metrics_stopping) {
+		ret = poll(&pfd, 1, metrics_interval > 0 ? metrics_interval : -1);
+		if(ret < 0 && errno != EINTR)
+			break;
+
+		if(ret > 0)
+			while(read(metrics_pipe[0], buf, sizeof(buf)) > 0)
+				;
+
+		if(metrics_stopping)
+			break;
+
+		if(ret != 0 || metrics_interval > 0)
+			metrics_print(metrics_fp);
+	}
+
+	return NULL;
+}
+
+int metrics_start(FILE *fp, int interval_ms) {
+
+	metrics_fp = fp;
+	metrics_interval = interval_ms;
+	metrics_last = metrics_now();
+
+	if(pipe2(metrics_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		printf("metrics: pipe failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if(pthread_create(&metrics_thread_id, NULL, metrics_thread, NULL)) {
+		printf("metrics: cannot start thread\n");
+		close(metrics_pipe[0]);
+		close(metrics_pipe[1]);
+		metrics_pipe[0] = metrics_pipe[1] = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void metrics_request(void) {
+
+	char c = 0;
+
+	if(metrics_pipe[1] >= 0 && write(metrics_pipe[1], &c, 1) < 0) {
+		/* A request is pending already */
+	}
+}
+
+void metrics_stop(void) {
+
+	if(metrics_pipe[1] < 0)
+		return;
+
+	metrics_stopping = 1;
+	metrics_request();
+	pthread_join(metrics_thread_id, NULL);
+
+	close(metrics_pipe[0]);
+	close(metrics_pipe[1]);
+	metrics_pipe[0] = metrics_pipe[1] = -1;
+
+	metrics_print(metrics_fp);
+}
@@ -0,0 +1,61 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+
+/*
+ * Process wide counters and latency histograms. Metrics are registered at
+ * startup and updated with atomic adds from any thread, nothing is
+ * printed on the frame path. A reporter thread prints a summary every
+ * interval and whenever metrics_request() is called, e.g. from SIGUSR2.
+ *
+ * Histograms have power of two buckets in microseconds: bucket 0 counts
+ * values below 1 us, bucket n values in [2^(n-1), 2^n).
+ */
+
+#define METRICS_MAX		64
+#define METRICS_NAME_MAX	32
+#define METRICS_BUCKETS		24	/* last one is everything from 2^22 us, ~4 s */
+
+enum metric_type {
+	METRIC_COUNTER = 0,
+	METRIC_HISTOGRAM,
+};
+
+struct metric {
+	char name[METRICS_NAME_MAX];
+	int type;
+
+	unsigned long long value;		/* counter, or number of samples */
+	unsigned long long sum;			/* usec */
+	unsigned long long max;
+	unsigned long long buckets[METRICS_BUCKETS];
+
+	/* Reporter only: totals at the last summary */
+	unsigned long long last_value;
+	unsigned long long last_sum;
+	unsigned long long last_buckets[METRICS_BUCKETS];
+};
+
+/* Register, or find an already registered metric. NULL if the registry is full */
+struct metric *metric_counter(const char *name);
+struct metric *metric_histogram(const char *name);
+
+void metric_add(struct metric *m, unsigned long long n);
+void metric_observe(struct metric *m, unsigned long long usec);
+
+/* Monotonic clock in usec */
+unsigned long long metrics_now(void);
+
+/* Print a summary every interval_ms (0: only on request) until metrics_stop() */
+int metrics_start(FILE *fp, int interval_ms);
+
+/* Ask for a summary now. Async-signal-safe */
+void metrics_request(void);
+
+/* Prints a final summary */
+void metrics_stop(void);
+
+void metrics_print(FILE *fp);
+
+#endif // _METRICS_H_
@@ -0,0 +1,163 @@
+/*
+ *      motion.c  --  block SAD motion detection on subsampled luma
+ *
+ *      At 720p the luma image is 320x180 samples, a quarter of the rows
+ *      is read. Block SADs go through convert_sad(), the SIMD variant the
+ *      CPU has; gathering and the background update are plain loops.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <linux/videodev2.h>
+
+#include "motion.h"
+#include "convert.h"
+
+struct motion {
+	struct motion_config cfg;
+	int stride, offset, step;	/* bytes: row, first sample, between samples */
+	int width, height;		/* samples */
+	uint8_t *luma, *bg;
+	uint16_t *bg16;			/* 8.8 fixed point */
+	int primed, quiet;
+	enum motion_state state;
+
+	unsigned long long frames, active, events;
+	int max_blocks;
+};
+
+struct motion *motion_create(unsigned int pixelformat, int width, int height, int bytesperline,
+	const struct motion_config *cfg) {
+
+	struct motion *m;
+	size_t n;
+
+	m = (struct motion *) calloc(1, sizeof(*m));
+	if(!m)
+		return NULL;
+
+	switch(pixelformat) {
+	case V4L2_PIX_FMT_YUYV:
+		m->offset = 0;
+		m->step = MOTION_STEP * 2;
+		break;
+	case V4L2_PIX_FMT_UYVY:
+		m->offset = 1;
+		m->step = MOTION_STEP * 2;
+		break;
+	case V4L2_PIX_FMT_NV12:
+		m->offset = 0;
+		m->step = MOTION_STEP;
+		break;
+	case V4L2_PIX_FMT_SBGGR8:
+		/* Even rows are B G B G */
+		m->offset = 1;
+		m->step = MOTION_STEP;
+		break;
+	default:
+		printf("Motion detection needs YUYV, UYVY, NV12 or BA81 frames\n");
+		free(m);
+		return NULL;
+	}
+
+	m->cfg = *cfg;
+	m->stride = bytesperline ? bytesperline : width * (m->step / MOTION_STEP);
+	m->width = width / MOTION_STEP;
+	m->height = height / MOTION_STEP;
+
+	n = (size_t) m->width * m->height;
+	m->luma = (uint8_t *) malloc(n);
+	m->bg = (uint8_t *) malloc(n);
+	m->bg16 = (uint16_t *) malloc(n * sizeof(uint16_t));
+	if(!m->luma || !m->bg || !m->bg16) {
+		printf("Out of memory for motion detection\n");
+		motion_destroy(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+static int motion_blocks(struct motion *m) {
+
+	uint32_t limit = (uint32_t) m->cfg.threshold * MOTION_BLOCK_W * MOTION_BLOCK_H;
+	int bx, by, n = 0;
+
+	for(by = 0; by + MOTION_BLOCK_H <= m->height; by += MOTION_BLOCK_H)
+		for(bx = 0; bx + MOTION_BLOCK_W <= m->width; bx += MOTION_BLOCK_W) {
+			size_t o = (size_t) by * m->width + bx;
+
+			if(convert_sad(m->luma + o, m->width, m->bg + o, m->width, MOTION_BLOCK_W, MOTION_BLOCK_H) > limit)
+				n++;
+		}
+
+	return n;
+}
+
+enum motion_state motion_frame(struct motion *m, const uint8_t *data) {
+
+	size_t n = (size_t) m->width * m->height, i;
+	int x, y, blocks;
+
+	for(y = 0; y < m->height; y++) {
+		const uint8_t *s = data + (size_t) y * MOTION_STEP * m->stride + m->offset;
+		uint8_t *l = m->luma + (size_t) y * m->width;
+
+		for(x = 0; x < m->width; x++)
+			l[x] = s[x * m->step];
+	}
+
+	/* The first frame is the background */
+	if(!m->primed) {
+		for(i = 0; i < n; i++)
+			m->bg16[i] = m->luma[i] << 8;
+		memcpy(m->bg, m->luma, n);
+		m->primed = 1;
+	}
+
+	blocks = motion_blocks(m);
+	if(blocks > m->max_blocks)
+		m->max_blocks = blocks;
+
+	for(i = 0; i < n; i++) {
+		m->bg16[i] += ((int) (m->luma[i] << 8) - (int) m->bg16[i]) >> MOTION_RATE;
+		m->bg[i] = m->bg16[i] >> 8;
+	}
+
+	m->frames++;
+
+	if(blocks >= m->cfg.blocks) {
+		m->quiet = 0;
+		if(m->state == MOTION_IDLE || m->state == MOTION_STOP) {
+			m->events++;
+			m->state = MOTION_START;
+		} else {
+			m->state = MOTION_ACTIVE;
+		}
+	} else if(m->state == MOTION_START || m->state == MOTION_ACTIVE) {
+		m->state = ++m->quiet > m->cfg.hold ? MOTION_STOP : MOTION_ACTIVE;
+	} else {
+		m->state = MOTION_IDLE;
+	}
+
+	if(m->state == MOTION_START || m->state == MOTION_ACTIVE)
+		m->active++;
+
+	return m->state;
+}
+
+void motion_print_stats(struct motion *m, FILE *fp) {
+
+	fprintf(fp, "Motion: %llu events, %llu of %llu frames with motion, at most %d changed blocks\n",
+		m->events, m->active, m->frames, m->max_blocks);
+}
+
+void motion_destroy(struct motion *m) {
+
+	free(m->luma);
+	free(m->bg);
+	free(m->bg16);
+	free(m);
+}
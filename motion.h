@@ -0,0 +1,47 @@
+#ifndef _MOTION_H_
+#define _MOTION_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Motion detection on the capture thread. Every MOTION_STEP-th pixel of
+ * every MOTION_STEP-th row gives a small luma image: Y of YUYV, UYVY and
+ * NV12, green of Bayer. It is compared in blocks of MOTION_BLOCK_W x
+ * MOTION_BLOCK_H samples against a background that follows the scene
+ * with a time constant of 2^MOTION_RATE frames, so lighting changes and
+ * things that stop moving fade in. Enough changed blocks is motion; it
+ * lasts until hold frames went by without any.
+ */
+
+#define MOTION_STEP		4
+#define MOTION_BLOCK_W		16
+#define MOTION_BLOCK_H		8
+#define MOTION_RATE		5
+
+enum motion_state {
+	MOTION_IDLE = 0,
+	MOTION_START,			/* first frame with motion */
+	MOTION_ACTIVE,
+	MOTION_STOP,			/* first frame after the hold ran out */
+};
+
+struct motion_config {
+	int threshold;			/* mean difference per sample in a block */
+	int blocks;			/* changed blocks that are motion */
+	int hold;			/* frames */
+};
+
+struct motion;
+
+/* NULL if the format has no luma to use */
+struct motion *motion_create(unsigned int pixelformat, int width, int height, int bytesperline,
+	const struct motion_config *cfg);
+
+enum motion_state motion_frame(struct motion *m, const uint8_t *data);
+
+void motion_print_stats(struct motion *m, FILE *fp);
+
+void motion_destroy(struct motion *m);
+
+#endif // _MOTION_H_
@@ -0,0 +1,349 @@
+/*
+ *      perfctr.c  --  perf_event_open counter groups per thread
+ *
+ *      Each thread has one group read with a single read(), so all
+ *      counters of a stage cover the same instructions. If the kernel
+ *      multiplexes the group, values are scaled by enabled/running time.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfctr.h"
+
+#define PERF_THREADS		64
+#define PERF_NAME_MAX		32
+
+struct perf_group {
+	int fd[PERF_COUNTERS];
+	int slot[PERF_COUNTERS];		/* index in the group read, -1 if not open */
+	int n;
+};
+
+struct perf_read {
+	uint64_t nr;
+	uint64_t enabled;
+	uint64_t running;
+	uint64_t values[PERF_COUNTERS];
+};
+
+struct perf_stage {
+	char name[PERF_NAME_MAX];
+	struct perf_group *g;			/* of the thread recording it */
+	struct perf_read start;
+
+	double sum[PERF_COUNTERS];
+	unsigned long long runs;
+	unsigned long long pixels;		/* of counted runs, as sum */
+	unsigned long long unscheduled;		/* runs the group wasn't counting */
+};
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} perf_events[PERF_COUNTERS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "L1D misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ "LLC misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ "branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int perf_available;
+static int perf_max = PERF_COUNTERS;		/* counters that fit the PMU at once */
+
+static struct perf_group *groups[PERF_THREADS];
+static int ngroups;
+static struct perf_stage stages[PERF_STAGES];
+static int nstages;
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct perf_group *perf_tls;
+
+static int perf_open(uint32_t type, uint64_t config, int group_fd) {
+
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+		PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void perf_group_close(struct perf_group *g) {
+
+	int i;
+
+	for(i = PERF_COUNTERS - 1; i >= 0; i--)
+		if(g->fd[i] >= 0)
+			close(g->fd[i]);
+	free(g);
+}
+
+/* Group of the calling thread with up to max counters, NULL and errno set if none opens */
+static struct perf_group *perf_group_open(int max) {
+
+	struct perf_group *g;
+	int i, leader = -1, err = 0;
+
+	g = (struct perf_group *) calloc(1, sizeof(*g));
+	if(!g)
+		return NULL;
+
+	for(i = 0; i < PERF_COUNTERS; i++) {
+		g->fd[i] = -1;
+		g->slot[i] = -1;
+
+		if(g->n >= max)
+			continue;
+
+		g->fd[i] = perf_open(perf_events[i].type, perf_events[i].config, leader);
+		if(g->fd[i] < 0) {
+			if(!err)
+				err = errno;
+			continue;
+		}
+
+		if(leader < 0)
+			leader = g->fd[i];
+		g->slot[i] = g->n++;
+	}
+
+	if(!g->n) {
+		free(g);
+		errno = err;
+		return NULL;
+	}
+
+	return g;
+}
+
+static int perf_group_read(struct perf_group *g, struct perf_read *r) {
+
+	int i;
+
+	for(i = 0; i < PERF_COUNTERS; i++)
+		if(g->slot[i] == 0)
+			return read(g->fd[i], r, sizeof(*r)) > 0 ? 0 : -1;
+
+	return -1;
+}
+
+static struct perf_group *perf_thread_group(void) {
+
+	struct perf_group *g = perf_tls;
+
+	if(g)
+		return g == (struct perf_group *) -1 ? NULL : g;
+
+	g = perf_group_open(perf_max);
+
+	pthread_mutex_lock(&perf_lock);
+	if(g && ngroups < PERF_THREADS) {
+		groups[ngroups++] = g;
+	} else if(g) {
+		perf_group_close(g);
+		g = NULL;
+	}
+	pthread_mutex_unlock(&perf_lock);
+
+	/* Don't retry on every stage */
+	perf_tls = g ? g : (struct perf_group *) -1;
+
+	return g;
+}
+
+int perf_init(void) {
+
+	struct perf_group *g;
+	struct perf_read r;
+	volatile unsigned int spin;
+	int i;
+
+	g = perf_group_open(PERF_COUNTERS);
+	if(!g) {
+		printf("perf: no hardware counters: %s%s\n", strerror(errno),
+			errno == EACCES || errno == EPERM ?
+			", see /proc/sys/kernel/perf_event_paranoid and CAP_PERFMON" :
+			errno == ENOENT || errno == ENOSYS ? ", no PMU in this kernel, VM or container" : "");
+		return -1;
+	}
+
+	/* A group larger than the PMU never gets scheduled, shrink until it does */
+	for(;;) {
+		for(spin = 0; spin < 100000; spin++)
+			;
+
+		if(perf_group_read(g, &r) == 0 && r.running > 0)
+			break;
+
+		perf_max = g->n - 1;
+		perf_group_close(g);
+
+		if(perf_max < 1 || !(g = perf_group_open(perf_max))) {
+			printf("perf: counters open but never count, giving up\n");
+			return -1;
+		}
+	}
+
+	printf("perf: counting");
+	for(i = 0; i < PERF_COUNTERS; i++)
+		if(g->slot[i] >= 0)
+			printf(" %s", perf_events[i].name);
+	printf("\n");
+
+	perf_group_close(g);
+	perf_available = 1;
+
+	return 0;
+}
+
+struct perf_stage *perf_stage(const char *name) {
+
+	struct perf_stage *s = NULL;
+
+	if(!perf_available)
+		return NULL;
+
+	pthread_mutex_lock(&perf_lock);
+	if(nstages < PERF_STAGES) {
+		s = &stages[nstages++];
+		snprintf(s->name, sizeof(s->name), "%s", name);
+	}
+	pthread_mutex_unlock(&perf_lock);
+
+	if(!s)
+		printf("perf: no room for stage %s\n", name);
+
+	return s;
+}
+
+void perf_begin(struct perf_stage *s) {
+
+	if(!s)
+		return;
+
+	if(!s->g)
+		s->g = perf_thread_group();
+
+	if(s->g && perf_group_read(s->g, &s->start) < 0)
+		s->start.nr = 0;
+}
+
+void perf_end(struct perf_stage *s, unsigned long pixels) {
+
+	struct perf_read r;
+	uint64_t enabled, running;
+	double scale;
+	int i;
+
+	if(!s || !s->g || !s->start.nr || perf_group_read(s->g, &r) < 0)
+		return;
+
+	enabled = r.enabled - s->start.enabled;
+	running = r.running - s->start.running;
+
+	s->runs++;
+
+	if(!running) {
+		s->unscheduled++;
+		return;
+	}
+
+	s->pixels += pixels;
+
+	scale = (double) enabled / running;
+
+	for(i = 0; i < PERF_COUNTERS; i++)
+		if(s->g->slot[i] >= 0)
+			s->sum[i] += (r.values[s->g->slot[i]] - s->start.values[s->g->slot[i]]) * scale;
+}
+
+static void perf_print_row(FILE *fp, const char *label, const char *unit, struct perf_stage *s,
+		double div, const char *f) {
+
+	int i;
+
+	fprintf(fp, "  %-10s %-9s", label, unit);
+
+	for(i = 0; i < PERF_COUNTERS; i++) {
+		if(s->g->slot[i] < 0)
+			fprintf(fp, " %12s", "-");
+		else
+			fprintf(fp, f, s->sum[i] / div);
+	}
+
+	if(s->g->slot[PERF_CYCLES] >= 0 && s->g->slot[PERF_INSTRUCTIONS] >= 0 && s->sum[PERF_CYCLES] > 0)
+		fprintf(fp, " %5.2f", s->sum[PERF_INSTRUCTIONS] / s->sum[PERF_CYCLES]);
+
+	fprintf(fp, "\n");
+}
+
+void perf_print(FILE *fp) {
+
+	int i;
+
+	if(!nstages)
+		return;
+
+	fprintf(fp, "Hardware counters, user space:\n");
+	fprintf(fp, "  %-10s %-9s", "stage", "");
+	for(i = 0; i < PERF_COUNTERS; i++)
+		fprintf(fp, " %12s", perf_events[i].name);
+	fprintf(fp, " %5s\n", "IPC");
+
+	for(i = 0; i < nstages; i++) {
+		struct perf_stage *s = &stages[i];
+
+		if(!s->g || !s->runs) {
+			fprintf(fp, "  %-10s no samples\n", s->name);
+			continue;
+		}
+
+		/* Runs the PMU was busy for add nothing to the sums */
+		if(s->runs > s->unscheduled)
+			perf_print_row(fp, s->name, "per frame", s, s->runs - s->unscheduled, " %12.0f");
+		else
+			fprintf(fp, "  %-10s no samples\n", s->name);
+		if(s->pixels)
+			perf_print_row(fp, "", "per pixel", s, s->pixels, " %12.3f");
+
+		if(s->unscheduled)
+			fprintf(fp, "  %-10s %llu of %llu runs not counted, PMU busy\n", "",
+				s->unscheduled, s->runs);
+	}
+}
+
+void perf_stop(void) {
+
+	int i, j;
+
+	/* Stages keep pointing at their groups for perf_print(), only the fds go */
+	pthread_mutex_lock(&perf_lock);
+	for(i = 0; i < ngroups; i++)
+		for(j = PERF_COUNTERS - 1; j >= 0; j--)
+			if(groups[i]->fd[j] >= 0) {
+				close(groups[i]->fd[j]);
+				groups[i]->fd[j] = -1;
+			}
+	pthread_mutex_unlock(&perf_lock);
+
+	perf_available = 0;
+}
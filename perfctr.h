@@ -0,0 +1,46 @@
+#ifndef _PERFCTR_H_
+#define _PERFCTR_H_
+
+#include <stdio.h>
+
+/*
+ * Hardware counters per pipeline stage, through perf_event_open. Every
+ * thread that records a stage gets its own counter group, opened on its
+ * first perf_begin(); a stage must only be recorded from one thread.
+ * Counters are user space only, so they work with perf_event_paranoid 2.
+ *
+ * When the kernel or container gives no counters, perf_init() says why
+ * and everything else does nothing.
+ */
+
+enum perf_counter {
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_COUNTERS,
+};
+
+#define PERF_STAGES		16
+
+struct perf_stage;
+
+/* Probe the counters, -1 if none can be opened */
+int perf_init(void);
+
+/* Register a stage, NULL if counters are off or there is no room */
+struct perf_stage *perf_stage(const char *name);
+
+void perf_begin(struct perf_stage *s);
+
+/* End of one run of the stage over pixels (0 if it has no pixels) */
+void perf_end(struct perf_stage *s, unsigned long pixels);
+
+/* Per frame and per pixel figures of every stage */
+void perf_print(FILE *fp);
+
+/* Close the counters of all threads */
+void perf_stop(void);
+
+#endif // _PERFCTR_H_
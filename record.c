@@ -0,0 +1,445 @@
+/*
+ *      record.c  --  persistent asynchronous frame writer
+ *
+ *      One file descriptor is kept open for the whole recording. Frames are
+ *      copied into page aligned chunks owned by the capture thread; full
+ *      chunks are handed to a writer thread which does the blocking write().
+ *      Only one producer thread is supported.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "record.h"
+#include "rtsched.h"
+
+struct record_writer {
+	int fd;
+	int flags;
+	int direct;				/* O_DIRECT currently active on fd */
+
+	size_t chunk_size;
+	int nchunks;
+	unsigned char **chunk;
+	size_t *chunk_len;
+
+	int *queue;				/* full chunks, FIFO */
+	int q_head, q_count;
+	int *free_list;
+	int n_free;
+
+	int cur;				/* chunk being filled by producer, -1 if none */
+	long long offset;
+
+	int busy;				/* writer thread is inside write() */
+	int stop;
+	int error;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond_full;
+	pthread_cond_t cond_free;
+
+	struct record_stats stats;
+};
+
+static unsigned long long record_usec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int record_write_all(struct record_writer *w, const unsigned char *data, size_t len) {
+
+	while(len > 0) {
+		ssize_t rc = write(w->fd, data, len);
+
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		data += rc;
+		len -= rc;
+	}
+
+	return 0;
+}
+
+static int record_write_chunk(struct record_writer *w, const unsigned char *data, size_t len) {
+
+	size_t tail = w->direct ? len % RECORD_ALIGN : 0;
+
+	if(record_write_all(w, data, len - tail) < 0)
+		return -1;
+
+	if(tail) {
+		/* Unaligned tail (flush of a partial chunk), O_DIRECT can't do
+		 * it and the file offset won't be aligned anymore either */
+		fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+		w->direct = 0;
+
+		if(record_write_all(w, data + len - tail, tail) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void *record_thread(void *arg) {
+
+	struct record_writer *w = (struct record_writer *) arg;
+
+	rt_thread("io");
+
+	pthread_mutex_lock(&w->lock);
+
+	for(;;) {
+		int idx;
+		unsigned long long t;
+
+		while(w->q_count == 0 && !w->stop)
+			pthread_cond_wait(&w->cond_full, &w->lock);
+
+		if(w->q_count == 0)
+			break;
+
+		idx = w->queue[w->q_head];
+		w->q_head = (w->q_head + 1) % w->nchunks;
+		w->q_count--;
+		w->busy = 1;
+
+		pthread_mutex_unlock(&w->lock);
+
+		t = record_usec();
+
+		if(!w->error && record_write_chunk(w, w->chunk[idx], w->chunk_len[idx]) < 0) {
+			w->error = errno;
+			printf("record: write error: %s\n", strerror(errno));
+		}
+
+		t = record_usec() - t;
+
+		pthread_mutex_lock(&w->lock);
+
+		w->stats.writes++;
+		w->stats.write_usec += t;
+		w->chunk_len[idx] = 0;
+		w->free_list[w->n_free++] = idx;
+		w->busy = 0;
+
+		pthread_cond_broadcast(&w->cond_free);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+/* Hand current chunk to the writer thread, lock must be held */
+static void record_submit(struct record_writer *w) {
+
+	if(w->cur < 0)
+		return;
+
+	if(w->chunk_len[w->cur] == 0) {
+		w->free_list[w->n_free++] = w->cur;
+	} else {
+		w->queue[(w->q_head + w->q_count) % w->nchunks] = w->cur;
+		w->q_count++;
+
+		if(w->q_count > w->stats.max_queued)
+			w->stats.max_queued = w->q_count;
+
+		pthread_cond_signal(&w->cond_full);
+	}
+
+	w->cur = -1;
+}
+
+/* Take a free chunk for the producer, waits if there is none, lock must be held */
+static void record_take(struct record_writer *w) {
+
+	if(w->n_free == 0) {
+		unsigned long long t = record_usec();
+
+		w->stats.stalls++;
+
+		while(w->n_free == 0)
+			pthread_cond_wait(&w->cond_free, &w->lock);
+
+		w->stats.stall_usec += record_usec() - t;
+	}
+
+	w->cur = w->free_list[--w->n_free];
+	w->chunk_len[w->cur] = 0;
+}
+
+struct record_writer *record_open(const char *path, int flags, size_t chunk_size, int nchunks) {
+
+	struct record_writer *w;
+	struct stat st;
+	int i;
+
+	if(chunk_size == 0)
+		chunk_size = RECORD_CHUNK_SIZE;
+
+	if(nchunks < 2)
+		nchunks = RECORD_CHUNKS;
+
+	chunk_size = (chunk_size + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+
+	w = (struct record_writer *) calloc(1, sizeof(*w));
+	if(!w)
+		return NULL;
+
+	w->flags = flags;
+	w->chunk_size = chunk_size;
+	w->nchunks = nchunks;
+	w->cur = -1;
+
+	w->fd = open(path, O_WRONLY | O_CREAT | ((flags & RECORD_APPEND) ? O_APPEND : O_TRUNC), 0644);
+	if(w->fd < 0) {
+		printf("record: cannot open %s: %s\n", path, strerror(errno));
+		free(w);
+		return NULL;
+	}
+
+	if(fstat(w->fd, &st) == 0)
+		w->offset = (flags & RECORD_APPEND) ? st.st_size : 0;
+
+	if(flags & RECORD_DIRECT) {
+		if(w->offset % RECORD_ALIGN) {
+			printf("record: %s size is not %d aligned, not using O_DIRECT\n", path, RECORD_ALIGN);
+		} else if(fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_DIRECT) < 0) {
+			printf("record: O_DIRECT not supported on %s: %s\n", path, strerror(errno));
+		} else {
+			w->direct = 1;
+		}
+	}
+
+	w->chunk = (unsigned char **) calloc(nchunks, sizeof(*w->chunk));
+	w->chunk_len = (size_t *) calloc(nchunks, sizeof(*w->chunk_len));
+	w->queue = (int *) calloc(nchunks, sizeof(int));
+	w->free_list = (int *) calloc(nchunks, sizeof(int));
+
+	if(!w->chunk || !w->chunk_len || !w->queue || !w->free_list)
+		goto fail;
+
+	for(i = 0; i < nchunks; i++) {
+		if(posix_memalign((void **) &w->chunk[i], RECORD_ALIGN, chunk_size)) {
+			w->chunk[i] = NULL;
+			goto fail;
+		}
+		w->free_list[w->n_free++] = i;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond_full, NULL);
+	pthread_cond_init(&w->cond_free, NULL);
+
+	if(pthread_create(&w->thread, NULL, record_thread, w)) {
+		printf("record: failed to start writer thread\n");
+		goto fail;
+	}
+
+	printf("record: writing to %s, %d x %zu KB buffers%s\n", path, nchunks, chunk_size / 1024,
+		w->direct ? ", O_DIRECT" : "");
+
+	return w;
+
+fail:
+	printf("record: failed to allocate %d x %zu bytes of buffers\n", nchunks, chunk_size);
+	for(i = 0; w->chunk && i < nchunks; i++)
+		free(w->chunk[i]);
+	free(w->chunk);
+	free(w->chunk_len);
+	free(w->queue);
+	free(w->free_list);
+	close(w->fd);
+	free(w);
+	return NULL;
+}
+
+int record_write(struct record_writer *w, const void *data, size_t len) {
+
+	const unsigned char *p = (const unsigned char *) data;
+
+	if(w->error)
+		return -1;
+
+	while(len > 0) {
+		size_t n;
+
+		if(w->cur < 0) {
+			pthread_mutex_lock(&w->lock);
+			record_take(w);
+			pthread_mutex_unlock(&w->lock);
+		}
+
+		/* Current chunk belongs to producer, copy without the lock */
+
+		n = w->chunk_size - w->chunk_len[w->cur];
+		if(n > len)
+			n = len;
+
+		memcpy(w->chunk[w->cur] + w->chunk_len[w->cur], p, n);
+		w->chunk_len[w->cur] += n;
+		w->offset += n;
+		w->stats.bytes += n;
+		p += n;
+		len -= n;
+
+		if(w->chunk_len[w->cur] == w->chunk_size) {
+			pthread_mutex_lock(&w->lock);
+			record_submit(w);
+			pthread_mutex_unlock(&w->lock);
+		}
+	}
+
+	return 0;
+}
+
+int record_framev(struct record_writer *w, const struct iovec *iov, int iovcnt) {
+
+	size_t len = 0;
+	int i;
+
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if(w->flags & RECORD_NONBLOCK) {
+		size_t avail;
+
+		pthread_mutex_lock(&w->lock);
+		avail = w->n_free * w->chunk_size;
+		if(w->cur >= 0)
+			avail += w->chunk_size - w->chunk_len[w->cur];
+		pthread_mutex_unlock(&w->lock);
+
+		if(avail < len) {
+			w->stats.dropped++;
+			return 0;
+		}
+	}
+
+	for(i = 0; i < iovcnt; i++)
+		if(record_write(w, iov[i].iov_base, iov[i].iov_len) < 0)
+			return -1;
+
+	w->stats.frames++;
+
+	return 1;
+}
+
+int record_frame(struct record_writer *w, const void *data, size_t len) {
+
+	struct iovec iov;
+
+	iov.iov_base = (void *) data;
+	iov.iov_len = len;
+
+	return record_framev(w, &iov, 1);
+}
+
+long long record_offset(struct record_writer *w) {
+
+	return w->offset;
+}
+
+int record_flush(struct record_writer *w) {
+
+	pthread_mutex_lock(&w->lock);
+
+	record_submit(w);
+
+	while(w->q_count > 0 || w->busy)
+		pthread_cond_wait(&w->cond_free, &w->lock);
+
+	pthread_mutex_unlock(&w->lock);
+
+	return w->error ? -1 : 0;
+}
+
+int record_pwrite(struct record_writer *w, const void *data, size_t len, off_t offset) {
+
+	if(record_flush(w) < 0)
+		return -1;
+
+	if(w->direct) {
+		fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+		w->direct = 0;
+	}
+
+	if(pwrite(w->fd, data, len, offset) != (ssize_t) len) {
+		printf("record: pwrite error: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int record_close(struct record_writer *w) {
+
+	int i, rc;
+
+	rc = record_flush(w);
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->cond_full);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_join(w->thread, NULL);
+
+	if(close(w->fd) < 0)
+		rc = -1;
+
+	for(i = 0; i < w->nchunks; i++)
+		free(w->chunk[i]);
+	free(w->chunk);
+	free(w->chunk_len);
+	free(w->queue);
+	free(w->free_list);
+
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond_full);
+	pthread_cond_destroy(&w->cond_free);
+
+	free(w);
+
+	return rc;
+}
+
+void record_get_stats(struct record_writer *w, struct record_stats *stats) {
+
+	pthread_mutex_lock(&w->lock);
+	*stats = w->stats;
+	pthread_mutex_unlock(&w->lock);
+}
+
+void record_print_stats(struct record_writer *w, FILE *fp) {
+
+	struct record_stats s;
+
+	record_get_stats(w, &s);
+
+	fprintf(fp, "record: %llu frames, %llu MB, %llu writes (%.1f MB/s while writing), "
+		"stalls: %llu (%.3f s), dropped: %llu, max queued: %u/%d\n",
+		s.frames, s.bytes >> 20, s.writes,
+		s.write_usec ? (double) s.bytes / s.write_usec : 0.0,
+		s.stalls, s.stall_usec / 1000000.0, s.dropped, s.max_queued, w->nchunks);
+}
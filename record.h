@@ -0,0 +1,60 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Persistent recording writer. The file is opened once, frames are copied
+ * into large page aligned chunks and a writer thread pushes full chunks to
+ * the file, so the capture thread never waits on the filesystem unless all
+ * chunks are in flight (backpressure).
+ */
+
+#define RECORD_APPEND		0x01	/* append to existing file */
+#define RECORD_DIRECT		0x02	/* O_DIRECT, bypass page cache */
+#define RECORD_NONBLOCK		0x04	/* drop frames instead of waiting for a free chunk */
+
+#define RECORD_CHUNK_SIZE	(4 * 1024 * 1024)
+#define RECORD_CHUNKS		8
+#define RECORD_ALIGN		4096
+
+struct record_stats {
+	unsigned long long frames;
+	unsigned long long bytes;
+	unsigned long long writes;		/* write() calls issued by writer thread */
+	unsigned long long write_usec;		/* time spent in write() */
+	unsigned long long stalls;		/* producer waited for a free chunk */
+	unsigned long long stall_usec;
+	unsigned long long dropped;		/* frames dropped in RECORD_NONBLOCK mode */
+	unsigned int max_queued;		/* highest number of full chunks waiting */
+};
+
+struct record_writer;
+
+struct record_writer *record_open(const char *path, int flags, size_t chunk_size, int nchunks);
+
+/* Append len bytes to the stream. Data is copied, caller may reuse it on return */
+int record_write(struct record_writer *w, const void *data, size_t len);
+
+/* Same as record_write() but accounted as one frame, may drop in RECORD_NONBLOCK mode.
+ * Returns 1 if written, 0 if dropped, -1 on error. */
+int record_frame(struct record_writer *w, const void *data, size_t len);
+int record_framev(struct record_writer *w, const struct iovec *iov, int iovcnt);
+
+/* Logical file offset of the next byte passed to record_write() */
+long long record_offset(struct record_writer *w);
+
+/* Wait until everything written so far is on its way to the file */
+int record_flush(struct record_writer *w);
+
+/* Flush and overwrite already written data, e.g. to patch a file header */
+int record_pwrite(struct record_writer *w, const void *data, size_t len, off_t offset);
+
+int record_close(struct record_writer *w);
+
+void record_get_stats(struct record_writer *w, struct record_stats *stats);
+void record_print_stats(struct record_writer *w, FILE *fp);
+
+#endif // _RECORD_H_
@@ -0,0 +1,460 @@
+/*
+ *      render.c  --  frame conversion into the framebuffer
+ *
+ *      The caller is worker 0 and takes the first band; helpers wait on a
+ *      job generation and take the others. Each worker has its own staging
+ *      buffers, a stripe of source rows and a tile of converted rows with
+ *      the frame's width as stride, small enough to stay in cache between
+ *      conversion and copy.
+ *
+ *      For change detection the source of every tile that was shown is
+ *      kept. On a static scene a frame costs reading the source and that
+ *      copy, nothing is converted and the screen is not written.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/videodev2.h>
+
+#include "render.h"
+#include "convert.h"
+#include "rtsched.h"
+#include "trace.h"
+
+struct render_worker {
+	struct render *r;
+	int index;
+	pthread_t thread;
+	uint8_t *in, *out;
+	size_t in_size, out_size;
+	unsigned long long converted, skipped;
+};
+
+struct render {
+	struct render_params p;
+	uint8_t *fb;
+	int fb_stride;
+	unsigned int pixelformat;
+	struct convert_gains gains;	/* Bayer white balance */
+	int wb;
+
+	/* Change detection */
+	int noise, refresh, refresh_now;
+	int no_ref;			/* the copy could not be allocated, stays off */
+	unsigned long frames;
+	uint8_t *ref;
+	size_t ref_size;
+	int ref_stride, ref_width, ref_height;
+
+	struct render_worker workers[RENDER_THREADS];
+	int nworkers;			/* helper threads started */
+	pthread_mutex_t lock;
+	pthread_cond_t cond, done;
+	unsigned long long job;
+	int pending, stop;
+
+	/* Current frame */
+	const uint8_t *src;
+	int src_stride, width, height, bands, tile;
+};
+
+int render_supported(unsigned int pixelformat) {
+
+	return pixelformat == V4L2_PIX_FMT_RGB565 || pixelformat == V4L2_PIX_FMT_UYVY ||
+		pixelformat == V4L2_PIX_FMT_YUYV || pixelformat == V4L2_PIX_FMT_SBGGR8;
+}
+
+void render_defaults(unsigned int pixelformat, struct render_params *p) {
+
+	memset(p, 0, sizeof(*p));
+	p->isa = convert_isa();
+	p->stage_out = pixelformat == V4L2_PIX_FMT_YUYV || pixelformat == V4L2_PIX_FMT_SBGGR8;
+	p->copy = RENDER_COPY_DEFAULT;
+	p->prefetch = 4;
+	p->threads = 1;
+}
+
+static void render_copy(struct render *r, void *dst, const void *src, size_t len) {
+
+	switch(r->p.copy) {
+	case RENDER_COPY_LIBC:
+		memcpy(dst, src, len);
+		break;
+	case RENDER_COPY_PREFETCH:
+		convert_copy_prefetch(dst, src, len, r->p.prefetch);
+		break;
+	default:
+		convert_copy(dst, src, len);
+		break;
+	}
+}
+
+/* Columns x to x + width of a tile to the same columns of the screen rows
+ * at dst. The tile holds whole rows of the frame, src_stride apart */
+static void render_blit(struct render *r, uint8_t *dst, const uint8_t *src, int src_stride, int x, int width,
+	int rows) {
+
+	int len = width * 4, y;
+
+	if(r->p.copy == RENDER_COPY_STREAM) {
+		convert_blit_rect((uint32_t *) dst, r->fb_stride, (const uint32_t *) src, src_stride, x, 0, width, rows);
+		return;
+	}
+
+	dst += x * 4;
+	src += x * 4;
+	if(len == r->fb_stride && len == src_stride) {
+		render_copy(r, dst, src, (size_t) rows * len);
+	} else {
+		for(y = 0; y < rows; y++)
+			render_copy(r, dst + (size_t) y * r->fb_stride, src + (size_t) y * src_stride, len);
+	}
+}
+
+static void render_rows(struct render *r, const uint8_t *src, int src_stride, uint32_t *dst, int dst_stride,
+	int width, int rows) {
+
+	switch(r->pixelformat) {
+	case V4L2_PIX_FMT_RGB565:
+		convert_rgb565(src, src_stride, dst, dst_stride, width, rows);
+		break;
+	case V4L2_PIX_FMT_UYVY:
+		convert_uyvy(src, src_stride, dst, dst_stride, width, rows);
+		break;
+	case V4L2_PIX_FMT_YUYV:
+		convert_yuyv(src, src_stride, dst, dst_stride, width, rows);
+		break;
+	case V4L2_PIX_FMT_SBGGR8:
+		convert_sbggr8_blocks(src, src_stride, dst, dst_stride, width, rows, r->wb ? &r->gains : NULL);
+		break;
+	}
+}
+
+static int render_bytes_per_pixel(struct render *r) {
+
+	return r->pixelformat == V4L2_PIX_FMT_SBGGR8 ? 1 : 2;
+}
+
+static int render_grow(uint8_t **buf, size_t *size, size_t want) {
+
+	uint8_t *p;
+
+	if(want <= *size)
+		return 0;
+
+	p = (uint8_t *) realloc(*buf, want);
+	if(!p)
+		return -1;
+
+	*buf = p;
+	*size = want;
+
+	return 0;
+}
+
+/* Pixels x to x + width of rows y to y + n changed: remember and show them */
+static void render_span(struct render_worker *w, int x, int width, int y, int n) {
+
+	struct render *r = w->r;
+	int bpp = render_bytes_per_pixel(r), i;
+	const uint8_t *s = r->src + (size_t) y * r->src_stride + x * bpp;
+	uint8_t *ref = r->ref + (size_t) y * r->ref_stride + x * bpp;
+	uint8_t *d = r->fb + (size_t) y * r->fb_stride;
+
+	for(i = 0; i < n; i++)
+		memcpy(ref + (size_t) i * r->ref_stride, s + (size_t) i * r->src_stride, width * bpp);
+
+	/* The span sits at the same columns of the staged rows as on the screen */
+	if(r->p.stage_out) {
+		render_rows(r, s, r->src_stride, (uint32_t *) w->out + x, r->width * 4, width, n);
+		render_blit(r, d, w->out, r->width * 4, x, width, n);
+	} else {
+		render_rows(r, s, r->src_stride, (uint32_t *) d + x, r->fb_stride, width, n);
+	}
+}
+
+/* Runs of changed tiles in a row of tiles are converted in one go */
+static void render_band_dirty(struct render_worker *w, int y0, int y1) {
+
+	struct render *r = w->r;
+	int bpp = render_bytes_per_pixel(r);
+	int x, y, n, tw, start;
+	uint32_t limit;
+
+	if(r->p.stage_out && render_grow(&w->out, &w->out_size, (size_t) RENDER_DIRTY_ROWS * r->width * 4) < 0)
+		return;
+
+	for(y = y0; y < y1; y += RENDER_DIRTY_ROWS) {
+		const uint8_t *s = r->src + (size_t) y * r->src_stride;
+		const uint8_t *ref = r->ref + (size_t) y * r->ref_stride;
+
+		n = y1 - y < RENDER_DIRTY_ROWS ? y1 - y : RENDER_DIRTY_ROWS;
+		start = -1;
+
+		for(x = 0; x < r->width; x += RENDER_DIRTY_WIDTH) {
+			tw = r->width - x < RENDER_DIRTY_WIDTH ? r->width - x : RENDER_DIRTY_WIDTH;
+			limit = (uint32_t) r->noise * tw * bpp * n;
+
+			if(r->refresh_now || convert_sad(s + x * bpp, r->src_stride, ref + x * bpp, r->ref_stride,
+				tw * bpp, n) > limit) {
+				if(start < 0)
+					start = x;
+				w->converted++;
+				continue;
+			}
+
+			w->skipped++;
+			if(start >= 0) {
+				render_span(w, start, x - start, y, n);
+				start = -1;
+			}
+		}
+
+		if(start >= 0)
+			render_span(w, start, r->width - start, y, n);
+	}
+}
+
+static void render_band(struct render_worker *w) {
+
+	struct render *r = w->r;
+	int rows = (r->height / r->bands) & ~1;
+	int y0 = w->index * rows, y1 = w->index == r->bands - 1 ? r->height : y0 + rows;
+	int step = r->p.stripe >= 2 ? r->p.stripe & ~1 : (r->p.stage_out ? r->tile : y1 - y0);
+	int tile_stride = r->width * 4;
+	int y, n;
+
+	if(y1 <= y0)
+		return;
+
+	if(r->noise >= 0) {
+		render_band_dirty(w, y0, y1);
+		return;
+	}
+
+	if(r->p.stage_in && render_grow(&w->in, &w->in_size, (size_t) step * r->src_stride) < 0)
+		return;
+	if(r->p.stage_out && render_grow(&w->out, &w->out_size, (size_t) step * tile_stride) < 0)
+		return;
+
+	for(y = y0; y < y1; y += step) {
+		const uint8_t *s = r->src + (size_t) y * r->src_stride;
+		uint8_t *d = r->fb + (size_t) y * r->fb_stride;
+
+		n = y1 - y < step ? y1 - y : step;
+
+		if(r->p.stage_in) {
+			render_copy(r, w->in, s, (size_t) n * r->src_stride);
+			s = w->in;
+		}
+
+		/* Each tile reaches the screen while it is still in cache */
+		if(r->p.stage_out) {
+			render_rows(r, s, r->src_stride, (uint32_t *) w->out, tile_stride, r->width, n);
+			render_blit(r, d, w->out, tile_stride, 0, r->width, n);
+		} else {
+			render_rows(r, s, r->src_stride, (uint32_t *) d, r->fb_stride, r->width, n);
+		}
+	}
+}
+
+static void *render_thread(void *arg) {
+
+	struct render_worker *w = (struct render_worker *) arg;
+	struct render *r = w->r;
+	unsigned long long seen = 0;
+
+	rt_thread("display");
+	trace_thread_name("render");
+
+	pthread_mutex_lock(&r->lock);
+
+	for(;;) {
+		while(!r->stop && r->job == seen)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if(r->stop)
+			break;
+		seen = r->job;
+
+		if(w->index >= r->bands)
+			continue;
+
+		pthread_mutex_unlock(&r->lock);
+		render_band(w);
+		pthread_mutex_lock(&r->lock);
+
+		if(--r->pending == 0)
+			pthread_cond_signal(&r->done);
+	}
+
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+struct render *render_create(uint8_t *fb, int fb_stride, unsigned int pixelformat, int threads) {
+
+	struct render_worker *w;
+	struct render *r;
+	int i;
+
+	r = (struct render *) calloc(1, sizeof(*r));
+	if(!r)
+		return NULL;
+
+	r->fb = fb;
+	r->fb_stride = fb_stride;
+	r->pixelformat = pixelformat;
+	r->noise = -1;
+	render_defaults(pixelformat, &r->p);
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	pthread_cond_init(&r->done, NULL);
+
+	for(i = 0; i < RENDER_THREADS; i++) {
+		r->workers[i].r = r;
+		r->workers[i].index = i;
+	}
+
+	/* Helpers sleep until a frame is split between them. All of them now:
+	 * a deadline task, as the display thread may be by the first frame,
+	 * cannot create threads */
+	while(r->nworkers + 1 < threads && r->nworkers + 1 < RENDER_THREADS) {
+		w = &r->workers[r->nworkers + 1];
+		if(pthread_create(&w->thread, NULL, render_thread, w)) {
+			printf("render: cannot start helper thread, using %d\n", r->nworkers + 1);
+			break;
+		}
+		r->nworkers++;
+	}
+
+	return r;
+}
+
+int render_threads(struct render *r) {
+
+	return r->nworkers + 1;
+}
+
+void render_set(struct render *r, const struct render_params *p) {
+
+	if(!memcmp(&r->p, p, sizeof(*p)))
+		return;
+
+	r->p = *p;
+	convert_use(r->p.isa);
+}
+
+void render_convert(struct render *r, const uint8_t *src, int src_stride, int width, int height) {
+
+	r->src = src;
+	r->src_stride = src_stride;
+	r->width = width;
+	r->height = height;
+	r->bands = r->p.threads < r->nworkers + 1 ? r->p.threads : r->nworkers + 1;
+	if(r->bands < 1 || height < 4 * r->bands)
+		r->bands = 1;
+	r->tile = (RENDER_TILE_BYTES / (width * 4 + 1)) & ~1;
+	if(r->tile < 2)
+		r->tile = 2;
+
+	/* What was shown is unknown after a change of layout or memory */
+	if(r->noise >= 0) {
+		r->refresh_now = r->refresh > 0 && r->frames % r->refresh == 0;
+		if(src_stride != r->ref_stride || width != r->ref_width || height != r->ref_height) {
+			if(render_grow(&r->ref, &r->ref_size, (size_t) src_stride * height) < 0) {
+				printf("render: no memory for change detection, converting every frame\n");
+				r->noise = -1;
+				r->no_ref = 1;
+			}
+			r->ref_stride = src_stride;
+			r->ref_width = width;
+			r->ref_height = height;
+			r->refresh_now = 1;
+		}
+		r->frames++;
+	}
+
+	if(r->bands > 1) {
+		pthread_mutex_lock(&r->lock);
+		r->pending = r->bands - 1;
+		r->job++;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	render_band(&r->workers[0]);
+
+	if(r->bands > 1) {
+		pthread_mutex_lock(&r->lock);
+		while(r->pending > 0)
+			pthread_cond_wait(&r->done, &r->lock);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+void render_gains(struct render *r, const struct convert_gains *gains) {
+
+	if(!gains == !r->wb && (!gains || !memcmp(&r->gains, gains, sizeof(*gains))))
+		return;
+
+	r->wb = gains != NULL;
+	if(gains)
+		r->gains = *gains;
+
+	/* Unchanged tiles were shown with the old gains */
+	r->ref_stride = 0;
+}
+
+void render_dirty(struct render *r, int noise, int refresh) {
+
+	if(r->no_ref)
+		return;
+
+	/* Tiles skipped while it was off may have changed since */
+	if(noise >= 0 && r->noise < 0)
+		r->ref_stride = 0;
+
+	r->noise = noise;
+	r->refresh = refresh;
+}
+
+void render_dirty_stats(struct render *r, unsigned long long *converted, unsigned long long *skipped) {
+
+	int i;
+
+	*converted = 0;
+	*skipped = 0;
+	for(i = 0; i < RENDER_THREADS; i++) {
+		*converted += r->workers[i].converted;
+		*skipped += r->workers[i].skipped;
+	}
+}
+
+void render_destroy(struct render *r) {
+
+	int i;
+
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	for(i = 1; i <= r->nworkers; i++)
+		pthread_join(r->workers[i].thread, NULL);
+
+	for(i = 0; i < RENDER_THREADS; i++) {
+		free(r->workers[i].in);
+		free(r->workers[i].out);
+	}
+	free(r->ref);
+
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	pthread_cond_destroy(&r->done);
+	free(r);
+}
@@ -0,0 +1,75 @@
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include <stdint.h>
+
+#include "convert.h"
+
+/*
+ * Frames to the framebuffer. Conversion goes straight into the screen or
+ * through a cached tile of rows that is copied out as soon as it is done,
+ * optionally spread over threads that each take a band of rows. Only the
+ * rows and columns the frame covers are written. How is set by
+ * render_params, which tune.c picks per device.
+ */
+
+#define RENDER_THREADS		4
+
+/* Staged output tiles default to this: the L1 of most cores, L2 of all */
+#define RENDER_TILE_BYTES	(32 * 1024)
+
+/* Change detection works on tiles of this many pixels and rows */
+#define RENDER_DIRTY_WIDTH	64
+#define RENDER_DIRTY_ROWS	16
+
+enum render_copy {
+	RENDER_COPY_DEFAULT = 0,	/* convert_copy(), memcpy_neon on ARM */
+	RENDER_COPY_LIBC,
+	RENDER_COPY_PREFETCH,		/* prefetching prefetch cache lines ahead */
+	RENDER_COPY_STREAM,		/* convert_blit() of the picture to the screen */
+};
+
+struct render_params {
+	int isa;			/* enum convert_isa */
+	int stage_in;			/* copy source rows to cached memory first */
+	int stage_out;			/* convert into a cached tile, then copy */
+	int copy;			/* enum render_copy, for staged rows */
+	int prefetch;
+	int stripe;			/* rows at a time, 0 for a tile or all */
+	int threads;
+};
+
+struct render;
+
+/* Nonzero if there is a kernel for pixelformat */
+int render_supported(unsigned int pixelformat);
+
+/* YUYV and Bayer through tiles, the rest straight to the screen */
+void render_defaults(unsigned int pixelformat, struct render_params *p);
+
+/* Up to threads workers: the caller and helper threads started here, as
+ * render_set() may run on a real-time thread that cannot start any */
+struct render *render_create(uint8_t *fb, int fb_stride, unsigned int pixelformat, int threads);
+
+/* Workers that did start, the most render_params.threads can use */
+int render_threads(struct render *r);
+
+void render_set(struct render *r, const struct render_params *p);
+
+void render_convert(struct render *r, const uint8_t *src, int src_stride, int width, int height);
+
+/* White balance for Bayer frames from the next frame on, NULL for none */
+void render_gains(struct render *r, const struct convert_gains *gains);
+
+/* Only convert tiles whose source differs from when they were last shown
+ * by more than noise per byte on average, and all of them every refresh
+ * frames (0 for never). Negative noise converts every frame whole again.
+ * Without memory for the copy of what was shown it stays off for good */
+void render_dirty(struct render *r, int noise, int refresh);
+
+/* Tiles converted and skipped as unchanged so far */
+void render_dirty_stats(struct render *r, unsigned long long *converted, unsigned long long *skipped);
+
+void render_destroy(struct render *r);
+
+#endif // _RENDER_H_
@@ -0,0 +1,458 @@
+/*
+ *      ring.c  --  in-memory pre-trigger recorder
+ *
+ *      Frames are stored back to back in a byte arena, their metadata in a
+ *      slot table; both are used as rings. Only the capture thread pushes.
+ *      The ring thread waits for triggers and writes dumps; slots from
+ *      r->pin on are not reused until the dump has written them.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/videodev2.h>
+
+#include "ring.h"
+#include "record.h"
+#include "capfile.h"
+#include "avi.h"
+#include "rtsched.h"
+
+#define RING_POLL_MSEC		250
+#define RING_DUMP_CHUNKS	2	/* record writer chunks used by a dump */
+
+struct ring_slot {
+	size_t offset;
+	uint32_t len;
+	uint32_t sequence;
+	uint32_t flags;
+	unsigned long long timestamp;	/* usec */
+};
+
+struct ring_recorder {
+	struct ring_config cfg;
+	char prefix[256];
+	char control_socket[108];
+	char trigger_file[256];
+
+	unsigned char *arena;
+	size_t arena_size;
+	struct ring_slot *slots;
+	unsigned int nslots;
+
+	/* Slot counters, slot n lives in slots[n % nslots] */
+	unsigned long long head;	/* next slot to fill, written by producer only */
+	unsigned long long tail;	/* oldest valid slot */
+	unsigned long long pin;		/* first slot not dumped yet, if pinned */
+	int pinned;
+	size_t wpos;			/* arena offset of next frame */
+
+	int pipe[2];			/* trigger/stop notifications */
+	int sock;
+	volatile int stop;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+
+	struct ring_stats stats;
+};
+
+static unsigned long long ring_usec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static size_t ring_frame_size(const struct ring_config *cfg) {
+
+	switch(cfg->fourcc) {
+	case V4L2_PIX_FMT_MJPEG:
+		return cfg->width * cfg->height;	/* 8 bpp, generous for MJPEG */
+	case V4L2_PIX_FMT_NV12:
+		return cfg->width * cfg->height * 3 / 2;
+	default:
+		if(cfg->bytesperline)
+			return cfg->bytesperline * cfg->height;
+		return cfg->width * cfg->height * 2;
+	}
+}
+
+int ring_push(struct ring_recorder *r, const struct iovec *iov, int iovcnt,
+	uint32_t sequence, uint32_t flags, const struct timeval *timestamp) {
+
+	struct ring_slot *s;
+	size_t len = 0, off;
+	unsigned char *p;
+	int i, wrap;
+
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if(len > r->arena_size) {
+		r->stats.too_big++;
+		return 0;
+	}
+
+	pthread_mutex_lock(&r->lock);
+
+	off = r->wpos;
+	wrap = off + len > r->arena_size;
+	if(wrap)
+		off = 0;
+
+	/* Evict oldest frames in the way, never the ones a dump still needs.
+	 * After a wrap that is first every frame past wpos: they are older
+	 * than the ones at the start that the new frame may cover */
+	while(r->tail < r->head) {
+		s = &r->slots[r->tail % r->nslots];
+
+		if(r->head - r->tail < r->nslots && !(wrap && s->offset + s->len > r->wpos) &&
+			(s->offset >= off + len || s->offset + s->len <= off))
+			break;
+
+		if(r->pinned && r->tail >= r->pin) {
+			r->stats.dropped++;
+			pthread_mutex_unlock(&r->lock);
+			return 0;
+		}
+
+		r->tail++;
+		r->stats.evicted++;
+	}
+
+	pthread_mutex_unlock(&r->lock);
+
+	/* Region is neither published nor pinned, copy without the lock */
+	p = r->arena + off;
+	for(i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	s = &r->slots[r->head % r->nslots];
+	s->offset = off;
+	s->len = len;
+	s->sequence = sequence;
+	s->flags = flags;
+	s->timestamp = timestamp->tv_sec * 1000000ULL + timestamp->tv_usec;
+
+	pthread_mutex_lock(&r->lock);
+	r->wpos = off + len;
+	r->head++;
+	r->stats.frames++;
+	pthread_mutex_unlock(&r->lock);
+
+	return 1;
+}
+
+void ring_trigger(struct ring_recorder *r) {
+
+	char c = 'd';
+
+	if(write(r->pipe[1], &c, 1) < 0) {
+		/* Pipe full, a dump is pending anyway */
+	}
+}
+
+static void ring_dump(struct ring_recorder *r) {
+
+	struct capfile_writer *cf = NULL;
+	struct avi_writer *avi = NULL;
+	unsigned long long first, last, n, t0, usec, bytes = 0;
+	char path[512], stamp[32];
+	time_t now = time(NULL);
+	int ret = 0;
+
+	pthread_mutex_lock(&r->lock);
+
+	if(r->head == r->tail) {
+		pthread_mutex_unlock(&r->lock);
+		printf("ring: trigger with empty ring\n");
+		return;
+	}
+
+	/* Last cfg.seconds before the newest frame */
+	last = r->head;
+	first = last - 1;
+	while(first > r->tail && r->slots[(first - 1) % r->nslots].timestamp +
+			r->cfg.seconds * 1000000ULL >= r->slots[(last - 1) % r->nslots].timestamp)
+		first--;
+
+	r->pin = first;
+	r->pinned = 1;
+
+	pthread_mutex_unlock(&r->lock);
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+	snprintf(path, sizeof(path), "%s-%s-%llu.%s", r->prefix, stamp, r->stats.dumps + 1,
+		r->cfg.fourcc == V4L2_PIX_FMT_MJPEG ? "avi" : "vcap");
+
+	t0 = ring_usec();
+
+	if(r->cfg.fourcc == V4L2_PIX_FMT_MJPEG)
+		avi = avi_create(path, r->cfg.width, r->cfg.height, r->cfg.fps,
+			r->cfg.record_flags & ~RECORD_APPEND, RING_DUMP_CHUNKS);
+	else
+		cf = capfile_create(path, r->cfg.fourcc, r->cfg.width, r->cfg.height, r->cfg.bytesperline, 0,
+			r->cfg.record_flags & ~RECORD_APPEND, RING_DUMP_CHUNKS);
+
+	if(!avi && !cf)
+		ret = -1;
+
+	/* Slots in [pin, last) can't change under us, read them unlocked */
+	for(n = first; n < last && ret >= 0; n++) {
+		struct ring_slot *s = &r->slots[n % r->nslots];
+		struct iovec iov = { r->arena + s->offset, s->len };
+		struct timeval ts = { s->timestamp / 1000000, s->timestamp % 1000000 };
+
+		if(avi)
+			ret = avi_append(avi, &iov, 1, &ts);
+		else
+			ret = capfile_append(cf, &iov, 1, s->sequence, s->flags, &ts);
+
+		bytes += s->len;
+
+		pthread_mutex_lock(&r->lock);
+		r->pin = n + 1;
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	if(avi && avi_close(avi) < 0)
+		ret = -1;
+	if(cf && capfile_close(cf) < 0)
+		ret = -1;
+
+	usec = ring_usec() - t0;
+
+	pthread_mutex_lock(&r->lock);
+	r->pinned = 0;
+	r->stats.dumps++;
+	r->stats.dump_frames += last - first;
+	r->stats.dump_bytes += bytes;
+	r->stats.dump_usec += usec;
+	pthread_mutex_unlock(&r->lock);
+
+	if(ret < 0)
+		printf("ring: dump to %s failed\n", path);
+	else
+		printf("ring: dumped %llu frames, %.1f MB to %s in %.3f s (%.1f MB/s)\n",
+			last - first, bytes / 1048576.0, path, usec / 1000000.0,
+			usec ? bytes / 1048576.0 / (usec / 1000000.0) : 0.0);
+}
+
+static void *ring_thread(void *arg) {
+
+	struct ring_recorder *r = (struct ring_recorder *) arg;
+	struct pollfd pfd[2];
+	char buf[64];
+	int npfd, trigger;
+
+	rt_thread("io");
+
+	pfd[0].fd = r->pipe[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = r->sock;
+	pfd[1].events = POLLIN;
+	npfd = r->sock >= 0 ? 2 : 1;
+
+	while(!r->stop) {
+		ssize_t n;
+
+		trigger = 0;
+
+		if(poll(pfd, npfd, RING_POLL_MSEC) < 0 && errno != EINTR)
+			break;
+
+		while((n = read(r->pipe[0], buf, sizeof(buf))) > 0)
+			if(memchr(buf, 'd', n))
+				trigger = 1;
+
+		while(r->sock >= 0 && (n = recv(r->sock, buf, sizeof(buf) - 1, 0)) > 0) {
+			buf[n] = '\0';
+			if(!strncmp(buf, "dump", 4) || !strncmp(buf, "trigger", 7))
+				trigger = 1;
+			else
+				printf("ring: unknown control command '%s'\n", buf);
+		}
+
+		if(r->trigger_file[0] && access(r->trigger_file, F_OK) == 0) {
+			unlink(r->trigger_file);
+			trigger = 1;
+		}
+
+		if(trigger)
+			ring_dump(r);
+	}
+
+	return NULL;
+}
+
+static int ring_listen(struct ring_recorder *r) {
+
+	struct sockaddr_un addr;
+
+	r->sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(r->sock < 0) {
+		printf("ring: socket failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, r->control_socket, sizeof(addr.sun_path) - 1);
+
+	unlink(r->control_socket);
+	if(bind(r->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		printf("ring: cannot bind %s: %s\n", r->control_socket, strerror(errno));
+		close(r->sock);
+		r->sock = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+struct ring_recorder *ring_create(const struct ring_config *cfg) {
+
+	struct ring_recorder *r;
+	int fps = cfg->fps > 0 ? cfg->fps : 30;
+
+	r = (struct ring_recorder *) calloc(1, sizeof(*r));
+	if(!r) {
+		printf("ring: out of memory\n");
+		return NULL;
+	}
+
+	r->cfg = *cfg;
+	r->cfg.fps = fps;
+	r->sock = -1;
+	r->pipe[0] = r->pipe[1] = -1;
+	r->arena = MAP_FAILED;
+
+	snprintf(r->prefix, sizeof(r->prefix), "%s", cfg->prefix ? cfg->prefix : "/tmp/event");
+	if(cfg->control_socket)
+		snprintf(r->control_socket, sizeof(r->control_socket), "%s", cfg->control_socket);
+	if(cfg->trigger_file)
+		snprintf(r->trigger_file, sizeof(r->trigger_file), "%s", cfg->trigger_file);
+
+	r->arena_size = cfg->arena_size;
+	if(!r->arena_size)
+		r->arena_size = ring_frame_size(cfg) * fps * cfg->seconds;
+
+	/* Twice the nominal frame count, small frames pack denser than the estimate */
+	r->nslots = fps * cfg->seconds * 2 + 2;
+
+	/* Fault in the whole arena now so pushes never take page faults */
+	r->arena = (unsigned char *) mmap(NULL, r->arena_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	r->slots = (struct ring_slot *) calloc(r->nslots, sizeof(struct ring_slot));
+	if(r->arena == MAP_FAILED || !r->slots) {
+		printf("ring: cannot allocate %zu bytes arena\n", r->arena_size);
+		goto fail;
+	}
+
+	if(pipe2(r->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		printf("ring: pipe failed: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	if(r->control_socket[0] && ring_listen(r) < 0)
+		goto fail;
+
+	pthread_mutex_init(&r->lock, NULL);
+
+	if(pthread_create(&r->thread, NULL, ring_thread, r)) {
+		printf("ring: cannot start ring thread\n");
+		pthread_mutex_destroy(&r->lock);
+		goto fail;
+	}
+
+	printf("ring: %d s pre-trigger, arena %.1f MB, %u slots (%.1f KB)\n",
+		cfg->seconds, r->arena_size / 1048576.0, r->nslots,
+		r->nslots * sizeof(struct ring_slot) / 1024.0);
+
+	return r;
+
+fail:
+	if(r->sock >= 0) {
+		close(r->sock);
+		unlink(r->control_socket);
+	}
+	if(r->pipe[0] >= 0) {
+		close(r->pipe[0]);
+		close(r->pipe[1]);
+	}
+	if(r->arena != MAP_FAILED)
+		munmap(r->arena, r->arena_size);
+	free(r->slots);
+	free(r);
+	return NULL;
+}
+
+void ring_close(struct ring_recorder *r) {
+
+	char c = 'q';
+
+	r->stop = 1;
+	if(write(r->pipe[1], &c, 1) < 0) {
+		/* Thread notices stop at the next poll timeout */
+	}
+	pthread_join(r->thread, NULL);
+
+	if(r->sock >= 0) {
+		close(r->sock);
+		unlink(r->control_socket);
+	}
+	close(r->pipe[0]);
+	close(r->pipe[1]);
+
+	pthread_mutex_destroy(&r->lock);
+	munmap(r->arena, r->arena_size);
+	free(r->slots);
+	free(r);
+}
+
+void ring_get_stats(struct ring_recorder *r, struct ring_stats *stats) {
+
+	pthread_mutex_lock(&r->lock);
+	*stats = r->stats;
+	pthread_mutex_unlock(&r->lock);
+}
+
+void ring_print_stats(struct ring_recorder *r, FILE *fp) {
+
+	struct ring_stats st;
+	unsigned long long held, span = 0;
+
+	pthread_mutex_lock(&r->lock);
+	st = r->stats;
+	held = r->head - r->tail;
+	if(held > 1)
+		span = r->slots[(r->head - 1) % r->nslots].timestamp - r->slots[r->tail % r->nslots].timestamp;
+	pthread_mutex_unlock(&r->lock);
+
+	fprintf(fp, "Ring: %.1f MB arena + %.1f KB slots, holding %llu frames (%.2f s), "
+		"%llu pushed, %llu evicted, %llu dropped, %llu too big\n",
+		r->arena_size / 1048576.0, r->nslots * sizeof(struct ring_slot) / 1024.0,
+		held, span / 1000000.0, st.frames, st.evicted, st.dropped, st.too_big);
+
+	if(st.dumps)
+		fprintf(fp, "Ring dumps: %llu, %llu frames, %.1f MB in %.3f s (%.1f MB/s)\n",
+			st.dumps, st.dump_frames, st.dump_bytes / 1048576.0, st.dump_usec / 1000000.0,
+			st.dump_usec ? st.dump_bytes / 1048576.0 / (st.dump_usec / 1000000.0) : 0.0);
+}
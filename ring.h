@@ -0,0 +1,65 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+/*
+ * Pre-trigger recorder. The most recent frames are kept in one arena that
+ * is allocated and faulted in up front; frames are copied in back to back
+ * and the oldest ones are overwritten, so nothing is allocated per frame.
+ *
+ * A trigger (ring_trigger(), a "dump" datagram on the control socket or
+ * creating the trigger file) makes the ring thread write the last
+ * ring_config.seconds of frames to <prefix>-<date>-<time>-<n>.vcap (.avi
+ * for MJPEG) while capture goes on. Frames still waiting to be written are
+ * pinned; if the producer catches up with them, new frames are dropped
+ * instead of the capture thread being blocked.
+ */
+
+struct ring_config {
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint32_t bytesperline;
+	int fps;
+	int seconds;			/* kept before a trigger */
+	size_t arena_size;		/* 0: max frame size * fps * seconds */
+	const char *prefix;		/* dump file name prefix, default /tmp/event */
+	const char *control_socket;	/* unix datagram socket path or NULL */
+	const char *trigger_file;	/* polled, removed when seen; or NULL */
+	int record_flags;		/* for the dump writer */
+};
+
+struct ring_stats {
+	unsigned long long frames;	/* pushed into the ring */
+	unsigned long long evicted;
+	unsigned long long dropped;	/* overwrite would have hit a pinned frame */
+	unsigned long long too_big;	/* frame larger than the arena */
+	unsigned long long dumps;
+	unsigned long long dump_frames;
+	unsigned long long dump_bytes;
+	unsigned long long dump_usec;
+};
+
+struct ring_recorder;
+
+struct ring_recorder *ring_create(const struct ring_config *cfg);
+
+/* Copy one frame into the ring. Returns 1 if stored, 0 if dropped, -1 on error */
+int ring_push(struct ring_recorder *r, const struct iovec *iov, int iovcnt,
+	uint32_t sequence, uint32_t flags, const struct timeval *timestamp);
+
+/* Request a dump. Async-signal-safe, may be called from a signal handler */
+void ring_trigger(struct ring_recorder *r);
+
+/* Finishes a dump in progress */
+void ring_close(struct ring_recorder *r);
+
+void ring_get_stats(struct ring_recorder *r, struct ring_stats *stats);
+void ring_print_stats(struct ring_recorder *r, FILE *fp);
+
+#endif // _RING_H_
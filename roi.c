@@ -0,0 +1,167 @@
+/*
+ *      roi.c  --  region of interest, cropped by the sensor or in place
+ *
+ *      A 1280x200 band of a 720p YUYV stream is 512 KB a frame instead of
+ *      1.8 MB when the sensor crops. Drivers from before the selection API
+ *      are tried with VIDIOC_S_CROP.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "roi.h"
+
+int roi_parse(const char *arg, struct roi *roi) {
+
+	int n;
+
+	memset(roi, 0, sizeof(*roi));
+
+	n = sscanf(arg, "%dx%d+%d+%d", &roi->width, &roi->height, &roi->left, &roi->top);
+	if((n != 2 && n != 4) || roi->width <= 0 || roi->height <= 0 || roi->left < 0 || roi->top < 0) {
+		printf("Bad region %s, expected WxH+X+Y\n", arg);
+		return -1;
+	}
+
+	roi->left &= ~1;
+	roi->top &= ~1;
+	roi->width &= ~1;
+	roi->height &= ~1;
+	if(roi->width == 0 || roi->height == 0) {
+		printf("Region %s is too small\n", arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+void roi_reset(int fd, unsigned int type) {
+
+	struct v4l2_selection sel;
+	struct v4l2_cropcap cropcap;
+	struct v4l2_crop crop;
+
+	memset(&sel, 0, sizeof(sel));
+	sel.type = type;
+	sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+	if(ioctl(fd, VIDIOC_G_SELECTION, &sel) == 0) {
+		sel.target = V4L2_SEL_TGT_CROP;
+		ioctl(fd, VIDIOC_S_SELECTION, &sel);
+		return;
+	}
+
+	memset(&cropcap, 0, sizeof(cropcap));
+	cropcap.type = type;
+	if(ioctl(fd, VIDIOC_CROPCAP, &cropcap) == 0) {
+		memset(&crop, 0, sizeof(crop));
+		crop.type = type;
+		crop.c = cropcap.defrect;
+		ioctl(fd, VIDIOC_S_CROP, &crop);
+	}
+}
+
+int roi_select(int fd, unsigned int type, struct roi *roi) {
+
+	struct v4l2_selection sel;
+	struct v4l2_crop crop;
+
+	memset(&sel, 0, sizeof(sel));
+	sel.type = type;
+	sel.target = V4L2_SEL_TGT_CROP;
+	sel.r.left = roi->left;
+	sel.r.top = roi->top;
+	sel.r.width = roi->width;
+	sel.r.height = roi->height;
+
+	if(ioctl(fd, VIDIOC_S_SELECTION, &sel) == 0) {
+		roi->left = sel.r.left;
+		roi->top = sel.r.top;
+		roi->width = sel.r.width;
+		roi->height = sel.r.height;
+
+		/* Drivers with a scaler compose into the buffer, 1:1 is wanted.
+		 * The others have no compose target */
+		memset(&sel, 0, sizeof(sel));
+		sel.type = type;
+		sel.target = V4L2_SEL_TGT_COMPOSE;
+		sel.r.width = roi->width;
+		sel.r.height = roi->height;
+		ioctl(fd, VIDIOC_S_SELECTION, &sel);
+
+		return 1;
+	}
+
+	if(errno != ENOTTY)
+		return 0;
+
+	memset(&crop, 0, sizeof(crop));
+	crop.type = type;
+	crop.c.left = roi->left;
+	crop.c.top = roi->top;
+	crop.c.width = roi->width;
+	crop.c.height = roi->height;
+
+	/* S_CROP does not say what it picked */
+	if(ioctl(fd, VIDIOC_S_CROP, &crop) < 0 || ioctl(fd, VIDIOC_G_CROP, &crop) < 0)
+		return 0;
+
+	roi->left = crop.c.left;
+	roi->top = crop.c.top;
+	roi->width = crop.c.width;
+	roi->height = crop.c.height;
+
+	return 1;
+}
+
+static int roi_pixel_bytes(unsigned int pixelformat) {
+
+	switch(pixelformat) {
+	case V4L2_PIX_FMT_SBGGR8:
+	case V4L2_PIX_FMT_SGBRG8:
+	case V4L2_PIX_FMT_SGRBG8:
+	case V4L2_PIX_FMT_SRGGB8:
+	case V4L2_PIX_FMT_GREY:
+	/* Luma plane only, the chroma plane after it is not cut */
+	case V4L2_PIX_FMT_NV12:
+		return 1;
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_RGB565:
+	case V4L2_PIX_FMT_SBGGR16:
+		return 2;
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+		return 3;
+	case V4L2_PIX_FMT_RGB32:
+	case V4L2_PIX_FMT_BGR32:
+		return 4;
+	default:
+		return -1;
+	}
+}
+
+long roi_offset(struct roi *roi, unsigned int pixelformat, unsigned int width, unsigned int height,
+	unsigned int *bytesperline) {
+
+	int bpp = roi_pixel_bytes(pixelformat);
+
+	if(bpp < 0)
+		return -1;
+
+	if(!*bytesperline)
+		*bytesperline = width * bpp;
+
+	if(roi->left > (int) width - 2)
+		roi->left = (width - 2) & ~1;
+	if(roi->top > (int) height - 2)
+		roi->top = (height - 2) & ~1;
+	if(roi->width > (int) width - roi->left)
+		roi->width = (width - roi->left) & ~1;
+	if(roi->height > (int) height - roi->top)
+		roi->height = (height - roi->top) & ~1;
+
+	return (long) roi->top * *bytesperline + (long) roi->left * bpp;
+}
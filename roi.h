@@ -0,0 +1,36 @@
+#ifndef _ROI_H_
+#define _ROI_H_
+
+/*
+ * Region of interest. The driver is asked to crop on the sensor side with
+ * VIDIOC_S_SELECTION, so only the band that is used crosses the bus and
+ * lands in memory. Drivers that cannot crop still deliver whole frames;
+ * the region is then cut out of them in place: the view starts some bytes
+ * into the buffer and keeps its row stride, nothing is copied.
+ */
+
+struct roi {
+	int left, top;
+	int width, height;
+};
+
+/* "WxH+X+Y", or "WxH" at the origin. Everything is rounded down to even,
+ * so 4:2:2 pairs and Bayer quads stay whole */
+int roi_parse(const char *arg, struct roi *roi);
+
+/* Back to the driver's default crop, errors ignored */
+void roi_reset(int fd, unsigned int type);
+
+/* Sensor side crop, as close to roi as the driver gets, with the compose
+ * rectangle set to the same size so nothing is scaled. roi is updated to
+ * the rectangle the driver picked. 0 when it has no cropping, then roi is
+ * left alone. The format has to be set again afterwards, at roi's size */
+int roi_select(int fd, unsigned int type, struct roi *roi);
+
+/* Application side crop of frames of width x height: roi is clamped to
+ * them, bytesperline filled in when 0. Returns the byte offset of the
+ * first pixel of roi, or -1 for formats without a fixed pixel size */
+long roi_offset(struct roi *roi, unsigned int pixelformat, unsigned int width, unsigned int height,
+	unsigned int *bytesperline);
+
+#endif // _ROI_H_
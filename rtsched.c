@@ -0,0 +1,313 @@
+/*
+ *      rtsched.c  --  real-time policy, CPU pinning, locked memory
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "rtsched.h"
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE		6
+#endif
+
+#define RT_NAME_MAX		16
+
+enum rt_policy {
+	RT_NONE = 0,
+	RT_FIFO,
+	RT_DEADLINE,
+};
+
+/* Not in older libc headers */
+struct rt_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;		/* ns */
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+static int rt_policy;
+static int rt_prio;
+static unsigned long long rt_runtime, rt_period;	/* usec */
+
+static struct {
+	char role[RT_NAME_MAX];
+	cpu_set_t cpus;
+} rt_roles[RT_ROLES];
+static int rt_nroles;
+
+static struct rusage rt_usage0, rt_usage1;
+
+static pthread_t rt_probe_thread;
+static volatile int rt_probe_stopping;
+static int rt_probe_period;
+static unsigned long long rt_probe_n, rt_probe_sum, rt_probe_min = ~0ULL, rt_probe_max, rt_probe_overruns;
+
+int rt_parse_policy(const char *arg) {
+
+	char *end;
+
+	if(!strncmp(arg, "deadline:", 9)) {
+		rt_runtime = strtoul(arg + 9, &end, 10);
+		if(*end != ':' || !rt_runtime)
+			goto bad;
+		rt_period = strtoul(end + 1, &end, 10);
+		if(*end || rt_period < rt_runtime)
+			goto bad;
+		rt_policy = RT_DEADLINE;
+		return 0;
+	}
+
+	if(!strncmp(arg, "fifo:", 5))
+		arg += 5;
+
+	rt_prio = strtol(arg, &end, 10);
+	if(*end || rt_prio < 1 || rt_prio > sched_get_priority_max(SCHED_FIFO))
+		goto bad;
+	rt_policy = RT_FIFO;
+
+	return 0;
+
+bad:
+	printf("Bad scheduling policy %s, expected [fifo:]prio or deadline:runtime:period\n", arg);
+	return -1;
+}
+
+int rt_parse_cpus(const char *arg) {
+
+	char *spec = strdup(arg), *tok, *save, *eq, *end;
+	int first, last, cpu;
+
+	if(!spec)
+		return -1;
+
+	for(tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		if(!eq || eq == tok || rt_nroles >= RT_ROLES)
+			goto bad;
+		*eq = 0;
+
+		first = strtol(eq + 1, &end, 10);
+		last = first;
+		if(*end == '-')
+			last = strtol(end + 1, &end, 10);
+		if(*end || first < 0 || last < first || last >= CPU_SETSIZE)
+			goto bad;
+
+		snprintf(rt_roles[rt_nroles].role, RT_NAME_MAX, "%s", tok);
+		CPU_ZERO(&rt_roles[rt_nroles].cpus);
+		for(cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, &rt_roles[rt_nroles].cpus);
+		rt_nroles++;
+	}
+
+	free(spec);
+	return 0;
+
+bad:
+	printf("Bad CPU list %s, expected role=cpu[-cpu],...\n", arg);
+	free(spec);
+	return -1;
+}
+
+static cpu_set_t *rt_role_cpus(const char *role) {
+
+	int i;
+
+	for(i = 0; i < rt_nroles; i++)
+		if(!strcmp(rt_roles[i].role, role))
+			return &rt_roles[i].cpus;
+
+	return NULL;
+}
+
+void rt_thread(const char *role) {
+
+	int frame_path = !strcmp(role, "capture") || !strcmp(role, "display") || !strcmp(role, "probe");
+	cpu_set_t *cpus = rt_role_cpus(role);
+	struct sched_param param;
+	struct rt_sched_attr attr;
+
+	/* The probe measures what capture sees, so it shares its CPUs */
+	if(!cpus && !strcmp(role, "probe"))
+		cpus = rt_role_cpus("capture");
+
+	/* Deadline tasks must be free to migrate in their root domain */
+	if(cpus && frame_path && rt_policy == RT_DEADLINE) {
+		printf("rt: %s is a deadline task, not pinned\n", role);
+		cpus = NULL;
+	}
+
+	if(cpus && sched_setaffinity(0, sizeof(*cpus), cpus) < 0)
+		printf("rt: cannot pin %s: %s\n", role, strerror(errno));
+
+	if(!frame_path || rt_policy == RT_NONE)
+		return;
+
+	if(rt_policy == RT_DEADLINE) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.sched_policy = SCHED_DEADLINE;
+		attr.sched_runtime = rt_runtime * 1000;
+		attr.sched_deadline = rt_period * 1000;
+		attr.sched_period = rt_period * 1000;
+
+#ifdef SYS_sched_setattr
+		if(syscall(SYS_sched_setattr, 0, &attr, 0) < 0)
+			printf("rt: cannot make %s a deadline task: %s\n", role, strerror(errno));
+#else
+		printf("rt: no SCHED_DEADLINE in these headers, %s unchanged\n", role);
+#endif
+		return;
+	}
+
+	/* Display runs just below capture, so a slow frame never delays dequeueing */
+	param.sched_priority = rt_prio;
+	if(!strcmp(role, "display") && rt_prio > 1)
+		param.sched_priority--;
+
+	if(sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+		printf("rt: cannot set SCHED_FIFO %d for %s: %s\n", param.sched_priority, role, strerror(errno));
+}
+
+int rt_lock_memory(void) {
+
+	/* Freed memory stays in the heap and locked instead of going back to the kernel */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+#ifdef MCL_ONFAULT
+	/* Thread stacks are megabytes, lock only the pages in use; buffers
+	 * the frame path touches are faulted in with rt_prefault() */
+	if(mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == 0)
+		return 0;
+#endif
+
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		printf("rt: mlockall failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void rt_prefault(void *p, size_t len, int write) {
+
+	volatile uint8_t *b = (volatile uint8_t *) p;
+	long page = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	if(!p)
+		return;
+
+	for(i = 0; i < len; i += page) {
+		if(write)
+			b[i] = b[i];
+		else
+			(void) b[i];
+	}
+}
+
+static unsigned long long rt_ns(const struct timespec *ts) {
+
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void *rt_probe(void *arg) {
+
+	struct timespec next, now;
+	unsigned long long late;
+
+	rt_thread("probe");
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while(!rt_probe_stopping) {
+		next.tv_nsec += rt_probe_period * 1000;
+		while(next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		late = (rt_ns(&now) - rt_ns(&next)) / 1000;
+
+		rt_probe_n++;
+		rt_probe_sum += late;
+		if(late < rt_probe_min)
+			rt_probe_min = late;
+		if(late > rt_probe_max)
+			rt_probe_max = late;
+
+		/* Woke up after the next deadline, start again from now */
+		if(late >= (unsigned long long) rt_probe_period) {
+			rt_probe_overruns++;
+			next = now;
+		}
+	}
+
+	return NULL;
+}
+
+int rt_start(int probe_us) {
+
+	getrusage(RUSAGE_SELF, &rt_usage0);
+
+	if(probe_us <= 0)
+		return 0;
+
+	rt_probe_period = probe_us;
+
+	if(pthread_create(&rt_probe_thread, NULL, rt_probe, NULL)) {
+		printf("rt: cannot start latency probe\n");
+		rt_probe_period = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void rt_stop(void) {
+
+	getrusage(RUSAGE_SELF, &rt_usage1);
+
+	if(!rt_probe_period)
+		return;
+
+	rt_probe_stopping = 1;
+	pthread_join(rt_probe_thread, NULL);
+}
+
+void rt_print(FILE *fp) {
+
+	fprintf(fp, "Scheduling: %ld minor and %ld major page faults, %ld involuntary context switches\n",
+		rt_usage1.ru_minflt - rt_usage0.ru_minflt, rt_usage1.ru_majflt - rt_usage0.ru_majflt,
+		rt_usage1.ru_nivcsw - rt_usage0.ru_nivcsw);
+
+	if(!rt_probe_n)
+		return;
+
+	fprintf(fp, "  wakeup latency every %d us: %llu wakeups, min %llu us, avg %llu us, max %llu us, %llu late by a period\n",
+		rt_probe_period, rt_probe_n, rt_probe_min, rt_probe_sum / rt_probe_n, rt_probe_max, rt_probe_overruns);
+}
@@ -0,0 +1,44 @@
+#ifndef _RTSCHED_H_
+#define _RTSCHED_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Deployment profile for real-time capture: scheduling policy, CPU
+ * pinning and locked memory.
+ *
+ * Threads apply the profile to themselves with rt_thread(role) when they
+ * start. The frame path, "capture" and "display", gets the real-time
+ * policy; every role can be pinned, including "io" for the record,
+ * compress, ring, bus and HTTP threads and sinks by name. Failures are
+ * reported and the thread runs on unchanged.
+ */
+
+#define RT_ROLES		16
+
+/* "fifo:prio", "prio" or "deadline:runtime:period" in usec */
+int rt_parse_policy(const char *arg);
+
+/* "role=cpu[-cpu],role=..." */
+int rt_parse_cpus(const char *arg);
+
+/* Apply the profile of role to the calling thread */
+void rt_thread(const char *role);
+
+/* Lock all memory; pages not yet touched are locked when first faulted in */
+int rt_lock_memory(void);
+
+/* Fault in every page of a buffer, writing if it is ours to write */
+void rt_prefault(void *p, size_t len, int write);
+
+/* Start counting page faults and context switches. With probe_us, also a
+ * "probe" thread on the frame path policy and CPUs that sleeps to absolute
+ * deadlines every probe_us and measures how late it wakes up */
+int rt_start(int probe_us);
+void rt_stop(void);
+
+/* Scheduling latency, page faults and context switches between rt_start() and rt_stop() */
+void rt_print(FILE *fp);
+
+#endif // _RTSCHED_H_
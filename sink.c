@@ -0,0 +1,388 @@
+/*
+ *      sink.c  --  reference counted frame fan-out to sink threads
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sink.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rtsched.h"
+
+#define SINK_CACHE_LINE		64
+
+struct sink {
+	char name[32];
+	int policy;
+	int depth;
+	sink_fn fn;
+	void *priv;
+
+	struct frame_ref *queue[SINK_QUEUE_MAX];
+	int q_head, q_count;
+	int busy;
+	int stop;
+	int error;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct sink_stats stats;
+	struct metric *m_busy, *m_wait, *m_dropped;
+	const char *trace_name;		/* outlives the sink, for trace dumps */
+};
+
+static unsigned long long sink_usec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+/* Buffers */
+
+int frame_pool_init(struct frame_pool *pool, struct frame_source *src) {
+
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->src = src;
+	pool->nrefs = src->type == FRAME_SOURCE_V4L2 ? src->nbufs : 1;
+
+	pool->refs = (struct frame_ref *) calloc(pool->nrefs, sizeof(struct frame_ref));
+	if(!pool->refs) {
+		printf("sink: out of memory\n");
+		return -1;
+	}
+
+	for(i = 0; i < pool->nrefs; i++)
+		pool->refs[i].pool = pool;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	pool->m_requeue = metric_histogram("requeue");
+
+	return 0;
+}
+
+int frame_pool_dequeue(struct frame_pool *pool, struct frame_ref **ref) {
+
+	struct frame frame;
+	struct frame_ref *r;
+	int ret;
+
+	/* A file source reuses its single buffer, wait until sinks are done with it */
+	pthread_mutex_lock(&pool->lock);
+	while(pool->inflight >= pool->nrefs)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	ret = source_dequeue(pool->src, &frame);
+	if(ret <= 0)
+		return ret;
+
+	r = &pool->refs[frame.index < (unsigned int) pool->nrefs ? frame.index : 0];
+	r->frame = frame;
+	r->iov[0].iov_base = frame.data;
+	r->iov[0].iov_len = frame.bytesused;
+	r->niov = 1;
+	r->refs = 1;
+	r->dispatched = sink_usec();
+	r->captured = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->inflight++;
+	pthread_mutex_unlock(&pool->lock);
+
+	*ref = r;
+
+	return 1;
+}
+
+void frame_ref_get(struct frame_ref *ref) {
+
+	__atomic_add_fetch(&ref->refs, 1, __ATOMIC_RELAXED);
+}
+
+void frame_ref_put(struct frame_ref *ref) {
+
+	struct frame_pool *pool = ref->pool;
+	unsigned long long t;
+	uint64_t tr;
+
+	if(__atomic_sub_fetch(&ref->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	/* Last reference, the buffer goes back to the driver */
+	t = sink_usec();
+	tr = trace_begin("requeue");
+	source_queue(pool->src, &ref->frame);
+	trace_end("requeue", tr, ref->frame.sequence);
+	metric_observe(pool->m_requeue, sink_usec() - t);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->inflight--;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void frame_pool_drain(struct frame_pool *pool) {
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->inflight > 0)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void frame_pool_destroy(struct frame_pool *pool) {
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->refs);
+}
+
+
+/* Sinks */
+
+static void *sink_thread(void *arg) {
+
+	struct sink *s = (struct sink *) arg;
+
+	trace_thread_name(s->trace_name);
+	rt_thread(s->name);
+
+	pthread_mutex_lock(&s->lock);
+
+	for(;;) {
+		struct frame_ref *ref;
+		unsigned long long t0, t, dispatched;
+		uint64_t tr;
+		int rc;
+
+		while(!s->stop && !s->q_count)
+			pthread_cond_wait(&s->cond, &s->lock);
+
+		if(!s->q_count)
+			break;
+
+		ref = s->queue[s->q_head];
+		s->q_head = (s->q_head + 1) % SINK_QUEUE_MAX;
+		s->q_count--;
+		s->busy = 1;
+
+		pthread_mutex_unlock(&s->lock);
+
+		t0 = sink_usec();
+		tr = trace_begin(s->trace_name);
+		rc = s->error ? 0 : s->fn(s, ref, s->priv);
+		trace_end(s->trace_name, tr, ref->frame.sequence);
+		t = sink_usec();
+		dispatched = ref->dispatched;
+
+		frame_ref_put(ref);
+
+		pthread_mutex_lock(&s->lock);
+
+		if(rc < 0) {
+			printf("sink %s: failed, stopping\n", s->name);
+			s->error = 1;
+		}
+
+		metric_observe(s->m_busy, t - t0);
+		metric_observe(s->m_wait, t0 - dispatched);
+
+		s->stats.frames++;
+		s->stats.busy_usec += t - t0;
+		s->stats.wait_usec += t0 - dispatched;
+		if(t - t0 > s->stats.max_usec)
+			s->stats.max_usec = t - t0;
+
+		s->busy = 0;
+		pthread_cond_broadcast(&s->cond);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+struct sink *sink_create(const char *name, int policy, int depth, sink_fn fn, void *priv) {
+
+	struct sink *s;
+	char mname[METRICS_NAME_MAX];
+
+	s = (struct sink *) calloc(1, sizeof(*s));
+	if(!s)
+		return NULL;
+
+	snprintf(s->name, sizeof(s->name), "%s", name);
+	s->policy = policy;
+	s->depth = depth < 1 ? 1 : depth > SINK_QUEUE_MAX ? SINK_QUEUE_MAX : depth;
+	s->fn = fn;
+	s->priv = priv;
+	s->trace_name = trace_intern(name);
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	snprintf(mname, sizeof(mname), "%s", name);
+	s->m_busy = metric_histogram(mname);
+	snprintf(mname, sizeof(mname), "%s queue wait", name);
+	s->m_wait = metric_histogram(mname);
+	snprintf(mname, sizeof(mname), "%s dropped", name);
+	s->m_dropped = metric_counter(mname);
+
+	if(pthread_create(&s->thread, NULL, sink_thread, s)) {
+		printf("sink %s: cannot start thread\n", name);
+		pthread_mutex_destroy(&s->lock);
+		pthread_cond_destroy(&s->cond);
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+static int sink_null_frame(struct sink *s, struct frame_ref *ref, void *priv) {
+
+	return 0;
+}
+
+static int sink_touch_frame(struct sink *s, struct frame_ref *ref, void *priv) {
+
+	volatile unsigned int *sum = (volatile unsigned int *) priv;
+	unsigned int acc = 0;
+	size_t off;
+	int i;
+
+	for(i = 0; i < ref->niov; i++) {
+		const unsigned char *p = (const unsigned char *) ref->iov[i].iov_base;
+
+		for(off = 0; off < ref->iov[i].iov_len; off += SINK_CACHE_LINE)
+			acc += p[off];
+	}
+
+	*sum += acc;
+
+	return 0;
+}
+
+struct sink *sink_null_create(int touch) {
+
+	static unsigned int touch_sum;
+
+	if(touch)
+		return sink_create("null-touch", SINK_LATEST, 1, sink_touch_frame, &touch_sum);
+
+	return sink_create("null", SINK_LATEST, 1, sink_null_frame, NULL);
+}
+
+int sink_push(struct sink *s, struct frame_ref *ref) {
+
+	struct frame_ref *old = NULL;
+
+	pthread_mutex_lock(&s->lock);
+
+	if(s->error) {
+		pthread_mutex_unlock(&s->lock);
+		return -1;
+	}
+
+	if(s->q_count == s->depth) {
+		s->stats.dropped++;
+		metric_add(s->m_dropped, 1);
+
+		if(s->policy == SINK_ALL) {
+			pthread_mutex_unlock(&s->lock);
+			return 0;
+		}
+
+		/* Latest wins: oldest waiting frame makes room */
+		old = s->queue[s->q_head];
+		s->q_head = (s->q_head + 1) % SINK_QUEUE_MAX;
+		s->q_count--;
+	}
+
+	frame_ref_get(ref);
+	s->queue[(s->q_head + s->q_count) % SINK_QUEUE_MAX] = ref;
+	s->q_count++;
+	pthread_cond_broadcast(&s->cond);
+
+	pthread_mutex_unlock(&s->lock);
+
+	if(old)
+		frame_ref_put(old);
+
+	return 1;
+}
+
+void sink_dispatch(struct sink **sinks, int nsinks, struct frame_ref *ref) {
+
+	int i;
+
+	for(i = 0; i < nsinks; i++)
+		sink_push(sinks[i], ref);
+
+	frame_ref_put(ref);
+}
+
+void sink_flush(struct sink *s) {
+
+	pthread_mutex_lock(&s->lock);
+	while(s->q_count || s->busy)
+		pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+}
+
+int sink_failed(struct sink *s) {
+
+	int error;
+
+	pthread_mutex_lock(&s->lock);
+	error = s->error;
+	pthread_mutex_unlock(&s->lock);
+
+	return error;
+}
+
+void sink_close(struct sink *s) {
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_join(s->thread, NULL);
+
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+}
+
+void sink_get_stats(struct sink *s, struct sink_stats *stats) {
+
+	pthread_mutex_lock(&s->lock);
+	*stats = s->stats;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void sink_print_stats(struct sink *s, FILE *fp) {
+
+	struct sink_stats st;
+
+	sink_get_stats(s, &st);
+
+	fprintf(fp, "Sink %s: %llu frames, %llu dropped, %.3f ms avg, %.3f ms max, %.3f ms avg queue wait\n",
+		s->name, st.frames, st.dropped,
+		st.frames ? st.busy_usec / 1000.0 / st.frames : 0.0, st.max_usec / 1000.0,
+		st.frames ? st.wait_usec / 1000.0 / st.frames : 0.0);
+}
@@ -0,0 +1,110 @@
+#ifndef _SINK_H_
+#define _SINK_H_
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "source.h"
+#include "huffman.h"
+#include "convert.h"
+
+/*
+ * Frame fan-out. A dequeued buffer is wrapped in a reference counted
+ * frame_ref and handed to every sink by reference; the buffer goes back to
+ * the source when the last reference is dropped. Each sink has its own
+ * thread and a small queue:
+ *
+ *	SINK_LATEST	a frame still waiting is replaced by a newer one
+ *			(display, decode, preview)
+ *	SINK_ALL	every frame is queued, dropped only if the queue is
+ *			full (recording)
+ *
+ * so a slow sink drops its own frames but never holds up capture or the
+ * other sinks.
+ */
+
+#define SINK_MAX		8
+#define SINK_QUEUE_MAX		16
+
+enum sink_policy {
+	SINK_LATEST = 0,
+	SINK_ALL,
+};
+
+struct frame_pool;
+struct metric;
+
+struct frame_ref {
+	struct frame frame;
+	struct iovec iov[3];		/* payload to store, MJPEG with DHT spliced in */
+	int niov;			/* < 0 if the frame is broken */
+	unsigned char prefix[MJPEG_PREFIX_MAX];	/* cached MJPEG header for iov[0] */
+	int refs;
+	unsigned long long dispatched;	/* usec, monotonic */
+	unsigned long long captured;	/* buffer timestamp if monotonic, else 0 */
+	int motion;			/* enum motion_state, with detection on */
+	struct convert_gains gains;	/* white balance to show it with, r 0 for none */
+	struct frame_pool *pool;
+};
+
+/* Source buffers not given back yet, a file source has just one */
+struct frame_pool {
+	struct frame_source *src;
+	struct frame_ref *refs;
+	int nrefs;
+	int inflight;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct metric *m_requeue;
+};
+
+int frame_pool_init(struct frame_pool *pool, struct frame_source *src);
+
+/* Waits for a free buffer and dequeues into it, returns 1, 0 at end of stream or -1 */
+int frame_pool_dequeue(struct frame_pool *pool, struct frame_ref **ref);
+
+void frame_ref_get(struct frame_ref *ref);
+void frame_ref_put(struct frame_ref *ref);
+
+/* Wait until all buffers are back */
+void frame_pool_drain(struct frame_pool *pool);
+void frame_pool_destroy(struct frame_pool *pool);
+
+
+struct sink;
+
+/* Called on the sink thread, returning < 0 stops the sink */
+typedef int (*sink_fn)(struct sink *s, struct frame_ref *ref, void *priv);
+
+struct sink_stats {
+	unsigned long long frames;
+	unsigned long long dropped;
+	unsigned long long busy_usec;
+	unsigned long long max_usec;
+	unsigned long long wait_usec;	/* dispatch to start of processing */
+};
+
+struct sink *sink_create(const char *name, int policy, int depth, sink_fn fn, void *priv);
+/* Drops frames; with touch reads one word per cache line first, to
+ * include the cost of pulling uncached capture buffers in */
+struct sink *sink_null_create(int touch);
+
+/* Returns 1 if queued, 0 if dropped, -1 if the sink failed */
+int sink_push(struct sink *s, struct frame_ref *ref);
+
+/* Push to all sinks and drop the caller's reference */
+void sink_dispatch(struct sink **sinks, int nsinks, struct frame_ref *ref);
+
+/* Wait until everything queued so far is processed */
+void sink_flush(struct sink *s);
+
+int sink_failed(struct sink *s);
+
+/* Processes what is queued, then stops the thread */
+void sink_close(struct sink *s);
+
+void sink_get_stats(struct sink *s, struct sink_stats *stats);
+void sink_print_stats(struct sink *s, FILE *fp);
+
+#endif // _SINK_H_
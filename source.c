@@ -0,0 +1,401 @@
+/*
+ *      source.c  --  live V4L2 and recorded file frame sources
+ *
+ *      Recorded files are indexed once when opened and then read through
+ *      the capfile reader's sliding mmap window, so every frame is handed
+ *      out in place, without copying, even for multi-GB files on 32-bit.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "source.h"
+#include "compress.h"
+
+#define SOURCE_INDEX_GROW	4096
+#define SOURCE_SCAN_BLOCK	(1024 * 1024)
+
+static unsigned long long source_usec(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int source_v4l2_init(struct frame_source *src, int dev, unsigned int buf_type, void **mem,
+	struct v4l2_buffer *bufs, unsigned int nbufs, unsigned int pixelformat,
+	unsigned int width, unsigned int height, unsigned int bytesperline) {
+
+	unsigned int i;
+
+	memset(src, 0, sizeof(*src));
+
+	src->type = FRAME_SOURCE_V4L2;
+	src->dev = dev;
+	src->buf_type = buf_type;
+	src->mem = mem;
+	src->bufs = bufs;
+	src->nbufs = nbufs;
+	src->pixelformat = pixelformat;
+	src->width = width;
+	src->height = height;
+	src->bytesperline = bytesperline;
+	src->file.fd = -1;
+
+	for(i = 0; i < nbufs; i++)
+		if(bufs[i].length > src->sizeimage)
+			src->sizeimage = bufs[i].length;
+
+	return 0;
+}
+
+
+/* Recorded files */
+
+static int source_add(struct capfile_reader *r, uint64_t *alloc, uint64_t offset, uint32_t len, uint64_t timestamp) {
+
+	struct capfile_index_entry *e;
+
+	if(r->count == *alloc) {
+		e = (struct capfile_index_entry *) realloc(r->index, (*alloc + SOURCE_INDEX_GROW) * sizeof(*e));
+		if(!e) {
+			printf("source: out of memory for index\n");
+			return -1;
+		}
+		r->index = e;
+		*alloc += SOURCE_INDEX_GROW;
+	}
+
+	e = &r->index[r->count];
+	memset(e, 0, sizeof(*e));
+	e->offset = offset;
+	e->bytesused = len;
+	e->sequence = r->count;
+	e->timestamp = timestamp;
+	r->count++;
+
+	return 0;
+}
+
+static uint32_t get32(const unsigned char *p) {
+
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Collect 00dc/00db chunks of all RIFF segments, nested lists are flattened */
+static int source_scan_avi(struct capfile_reader *r) {
+
+	uint64_t off = 0, alloc = 0;
+	uint32_t usec = 33333;
+	unsigned char h[64];
+
+	while(off + 8 <= r->size && pread(r->fd, h, 8, off) == 8) {
+		uint32_t fcc = get32(h), size = get32(h + 4);
+
+		if(!memcmp(h, "RIFF", 4) || !memcmp(h, "LIST", 4)) {
+			off += 12;
+			continue;
+		}
+
+		if(!memcmp(h, "avih", 4) && pread(r->fd, h, 40, off + 8) == 40) {
+			if(get32(h))
+				usec = get32(h);
+			r->hdr.width = get32(h + 32);
+			r->hdr.height = get32(h + 36);
+		}
+
+		if((fcc & 0xffff0000) == (('d' << 16) | ('c' << 24)) || (fcc & 0xffff0000) == (('d' << 16) | ('b' << 24))) {
+			if(off + 8 + size > r->size)
+				break;
+			if(size && source_add(r, &alloc, off + 8, size, r->count * (uint64_t) usec) < 0)
+				return -1;
+		}
+
+		off += 8 + size + (size & 1);
+	}
+
+	r->hdr.fourcc = V4L2_PIX_FMT_MJPEG;
+
+	return 0;
+}
+
+/* Concatenated JPEG frames, split at EOI. Stuffed entropy data never contains FFD9. */
+static int source_scan_jpeg(struct capfile_reader *r, int fps) {
+
+	unsigned char *blk = (unsigned char *) malloc(SOURCE_SCAN_BLOCK);
+	uint64_t off = 0, start = 0, alloc = 0;
+	int prev = 0, in_frame = 0, rc = 0;
+	uint32_t usec = fps > 0 ? 1000000 / fps : 0;
+
+	if(!blk)
+		return -1;
+
+	while(off < r->size) {
+		ssize_t n = pread(r->fd, blk, SOURCE_SCAN_BLOCK, off);
+		ssize_t i;
+
+		if(n <= 0)
+			break;
+
+		for(i = 0; i < n; i++) {
+			int c = blk[i];
+
+			if(prev == 0xff && c == 0xd8 && !in_frame) {
+				start = off + i - 1;
+				in_frame = 1;
+			} else if(prev == 0xff && c == 0xd9 && in_frame) {
+				if(source_add(r, &alloc, start, off + i + 1 - start, r->count * (uint64_t) usec) < 0) {
+					rc = -1;
+					goto out;
+				}
+				in_frame = 0;
+			}
+
+			prev = c;
+		}
+
+		off += n;
+	}
+
+	r->hdr.fourcc = V4L2_PIX_FMT_MJPEG;
+
+	/* Frame size from SOF of the first frame */
+	if(r->count) {
+		const unsigned char *p = capfile_frame(r, 0, NULL);
+		uint32_t i, len = r->index[0].bytesused;
+
+		for(i = 2; p && i + 9 < len && p[i] == 0xff; i += 2 + ((p[i + 2] << 8) | p[i + 3])) {
+			if(p[i + 1] == 0xc0 || p[i + 1] == 0xc1 || p[i + 1] == 0xc2) {
+				r->hdr.height = (p[i + 5] << 8) | p[i + 6];
+				r->hdr.width = (p[i + 7] << 8) | p[i + 8];
+				break;
+			}
+		}
+	}
+
+out:
+	free(blk);
+	return rc;
+}
+
+/* Headerless raw frames of a format given on command line */
+static int source_scan_raw(struct capfile_reader *r, int fps) {
+
+	uint64_t off, alloc = 0;
+	uint32_t size, usec = fps > 0 ? 1000000 / fps : 0;
+
+	switch(r->hdr.fourcc) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_RGB565:
+		r->hdr.bytesperline = r->hdr.width * 2;
+		size = r->hdr.bytesperline * r->hdr.height;
+		break;
+	case V4L2_PIX_FMT_SBGGR8:
+		r->hdr.bytesperline = r->hdr.width;
+		size = r->hdr.bytesperline * r->hdr.height;
+		break;
+	case V4L2_PIX_FMT_NV12:
+		r->hdr.bytesperline = r->hdr.width;
+		size = r->hdr.width * r->hdr.height * 3 / 2;
+		break;
+	default:
+		printf("source: don't know frame size of format %.4s, record with container instead\n",
+			(char *) &r->hdr.fourcc);
+		return -1;
+	}
+
+	for(off = 0; off + size <= r->size; off += size)
+		if(source_add(r, &alloc, off, size, r->count * (uint64_t) usec) < 0)
+			return -1;
+
+	return 0;
+}
+
+int source_file_open(struct frame_source *src, const char *path, int realtime,
+	unsigned int pixelformat, unsigned int width, unsigned int height, int fps) {
+
+	struct capfile_reader *r = &src->file;
+	unsigned char magic[12];
+	struct stat st;
+	uint64_t i;
+	int rc;
+
+	memset(src, 0, sizeof(*src));
+	src->type = FRAME_SOURCE_FILE;
+	src->realtime = realtime;
+	src->dev = -1;
+
+	r->fd = open(path, O_RDONLY);
+	if(r->fd < 0 || fstat(r->fd, &st) < 0 || pread(r->fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+		printf("source: cannot read %s: %s\n", path, strerror(errno));
+		if(r->fd >= 0)
+			close(r->fd);
+		return -1;
+	}
+
+	if(get32(magic) == CAPFILE_MAGIC) {
+		close(r->fd);
+		rc = capfile_open(r, path);
+	} else {
+		r->size = st.st_size;
+		r->hdr.fourcc = pixelformat;
+		r->hdr.width = width;
+		r->hdr.height = height;
+
+		if(!memcmp(magic, "RIFF", 4) && !memcmp(magic + 8, "AVI ", 4))
+			rc = source_scan_avi(r);
+		else if(magic[0] == 0xff && magic[1] == 0xd8)
+			rc = source_scan_jpeg(r, fps);
+		else
+			rc = source_scan_raw(r, fps);
+
+		if(rc < 0)
+			capfile_close_reader(r);
+	}
+
+	if(rc < 0)
+		return -1;
+
+	src->pixelformat = r->hdr.fourcc;
+	src->width = r->hdr.width;
+	src->height = r->hdr.height;
+	src->bytesperline = r->hdr.bytesperline;
+
+	if(!src->bytesperline)
+		src->bytesperline = src->pixelformat == V4L2_PIX_FMT_SBGGR8 ? src->width : src->width * 2;
+
+	/* Compressed frames are decoded into one buffer, sized by the first frame */
+	if(r->hdr.flags & CAPFILE_COMPRESSED) {
+		const unsigned char *p = r->count ? capfile_frame(r, 0, NULL) : NULL;
+		long raw = p ? compressed_raw_size(p, r->index[0].bytesused) : 0;
+
+		src->sizeimage = raw > 0 ? raw : 0;
+	} else {
+		for(i = 0; i < r->count; i++)
+			if(r->index[i].bytesused > src->sizeimage)
+				src->sizeimage = r->index[i].bytesused;
+	}
+
+	printf("source: replaying %s, %.4s %ux%u, %llu frames%s, %s\n", path, (char *) &src->pixelformat,
+		src->width, src->height, (unsigned long long) r->count,
+		(r->hdr.flags & CAPFILE_COMPRESSED) ? " compressed" : "", realtime ? "real-time" : "max speed");
+
+	return 0;
+}
+
+int source_dequeue(struct frame_source *src, struct frame *f) {
+
+	if(src->type == FRAME_SOURCE_V4L2) {
+		struct v4l2_buffer buf;
+
+		memset(&buf, 0, sizeof(buf));
+		buf.type = src->buf_type;
+		buf.memory = V4L2_MEMORY_MMAP;
+
+		if(ioctl(src->dev, VIDIOC_DQBUF, &buf) < 0) {
+			printf("Unable to dequeue buffer (%d).\n", errno);
+			return -1;
+		}
+
+		src->bufs[buf.index] = buf;
+
+		f->data = (unsigned char *) src->mem[buf.index];
+		f->bytesused = buf.bytesused;
+		f->index = buf.index;
+		f->sequence = buf.sequence;
+		f->flags = buf.flags;
+		f->timestamp = buf.timestamp;
+
+	} else {
+		struct capfile_index_entry e;
+
+		f->data = (unsigned char *) capfile_frame(&src->file, src->next, &e);
+		if(!f->data)
+			return src->next >= src->file.count ? 0 : -1;
+
+		f->bytesused = e.bytesused;
+
+		if(src->file.hdr.flags & CAPFILE_COMPRESSED) {
+			long raw = compressed_raw_size(f->data, e.bytesused);
+
+			if(raw > 0 && (size_t) raw > src->decoded_size) {
+				unsigned char *p = (unsigned char *) realloc(src->decoded, raw);
+				if(!p) {
+					printf("source: out of memory for %ld bytes frame\n", raw);
+					return -1;
+				}
+				src->decoded = p;
+				src->decoded_size = raw;
+				if((unsigned int) raw > src->sizeimage)
+					src->sizeimage = raw;
+			}
+
+			raw = decompress_frame(f->data, e.bytesused, src->decoded, src->decoded_size);
+			if(raw < 0) {
+				printf("source: frame %llu is corrupt\n", (unsigned long long) src->next);
+				return -1;
+			}
+
+			f->data = src->decoded;
+			f->bytesused = raw;
+		}
+
+		f->index = 0;
+		f->sequence = e.sequence;
+		f->flags = e.flags;
+		f->timestamp.tv_sec = e.timestamp / 1000000;
+		f->timestamp.tv_usec = e.timestamp % 1000000;
+
+		if(src->realtime) {
+			unsigned long long now = source_usec();
+
+			if(src->next == 0) {
+				src->clock0 = now;
+				src->ts0 = e.timestamp;
+			} else if(e.timestamp > src->ts0 && src->clock0 + (e.timestamp - src->ts0) > now) {
+				usleep(src->clock0 + (e.timestamp - src->ts0) - now);
+			}
+		}
+
+		src->next++;
+	}
+
+	src->frames++;
+	src->bytes += f->bytesused;
+
+	return 1;
+}
+
+int source_queue(struct frame_source *src, struct frame *f) {
+
+	if(src->type == FRAME_SOURCE_V4L2) {
+
+		// Mark buffer so frames the CSI leaves zeroed can be detected
+		*(unsigned int*)f->data = 0;
+
+		if(ioctl(src->dev, VIDIOC_QBUF, &src->bufs[f->index]) < 0) {
+			printf("Unable to requeue buffer (%d).\n", errno);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void source_close(struct frame_source *src) {
+
+	if(src->type == FRAME_SOURCE_FILE) {
+		capfile_close_reader(&src->file);
+		free(src->decoded);
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef _SOURCE_H_
+#define _SOURCE_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <linux/videodev2.h>
+
+#include "capfile.h"
+
+/*
+ * Frame sources behind one dequeue/queue interface. A live V4L2 device and
+ * recorded files (.vcap, MJPEG .avi, concatenated JPEGs or headerless raw
+ * frames) are read the same way, so conversion, display and recording
+ * don't care where frames come from.
+ */
+
+enum frame_source_type {
+	FRAME_SOURCE_V4L2 = 0,
+	FRAME_SOURCE_FILE,
+};
+
+struct frame {
+	unsigned char *data;
+	unsigned int bytesused;
+	unsigned int index;		/* buffer index, pass back to source_queue() */
+	unsigned int sequence;
+	unsigned int flags;		/* V4L2_BUF_FLAG_* */
+	struct timeval timestamp;
+};
+
+struct frame_source {
+	int type;
+	unsigned int pixelformat;
+	unsigned int width;
+	unsigned int height;
+	unsigned int bytesperline;
+	unsigned int sizeimage;		/* largest frame to expect */
+
+	/* V4L2 device */
+	int dev;
+	unsigned int buf_type;
+	unsigned int nbufs;
+	void **mem;
+	struct v4l2_buffer *bufs;
+
+	/* Recorded file */
+	struct capfile_reader file;
+	uint64_t next;
+	int realtime;			/* pace frames by recorded timestamps */
+	unsigned long long clock0;
+	unsigned long long ts0;
+	unsigned char *decoded;		/* frame of a compressed recording */
+	size_t decoded_size;
+
+	unsigned long long frames;
+	unsigned long long bytes;
+};
+
+int source_v4l2_init(struct frame_source *src, int dev, unsigned int buf_type, void **mem,
+	struct v4l2_buffer *bufs, unsigned int nbufs, unsigned int pixelformat,
+	unsigned int width, unsigned int height, unsigned int bytesperline);
+
+/* pixelformat, width, height and fps are only used for files that don't carry them */
+int source_file_open(struct frame_source *src, const char *path, int realtime,
+	unsigned int pixelformat, unsigned int width, unsigned int height, int fps);
+
+/* Returns 1 if a frame was dequeued, 0 at end of stream, -1 on error */
+int source_dequeue(struct frame_source *src, struct frame *f);
+int source_queue(struct frame_source *src, struct frame *f);
+
+void source_close(struct frame_source *src);
+
+#endif // _SOURCE_H_
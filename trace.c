@@ -0,0 +1,315 @@
+/*
+ *      trace.c  --  per thread event rings, Chrome Trace Event JSON dump
+ *
+ *      A ring is written only by its thread; the dumper reads it while it
+ *      may still be written and skips the oldest TRACE_SLACK events, which
+ *      are the ones that could be overwritten meanwhile.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define TRACE_SLACK		256
+#define TRACE_NAME_MAX		32
+
+struct trace_event {
+	const char *name;
+	uint64_t start;			/* ns, CLOCK_MONOTONIC */
+	uint32_t dur;			/* ns */
+	uint32_t seq;
+};
+
+struct trace_ring {
+	int tid;
+	char name[TRACE_NAME_MAX];
+	unsigned long long head;
+	struct trace_event events[TRACE_EVENTS];
+};
+
+static volatile int trace_enabled;
+static int trace_marker_fd = -1;
+static char trace_path[256];
+static int trace_pid;
+
+static struct trace_ring *rings[TRACE_THREADS];
+static int nrings;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_ring *trace_tls;
+
+static int trace_pipe[2] = { -1, -1 };
+static pthread_t trace_thread_id;
+static volatile int trace_stopping;
+
+static uint64_t trace_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct trace_ring *trace_ring_get(void) {
+
+	struct trace_ring *r = trace_tls;
+
+	if(r)
+		return r;
+
+	r = (struct trace_ring *) calloc(1, sizeof(*r));
+	if(!r)
+		return NULL;
+
+	r->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&trace_lock);
+	if(nrings < TRACE_THREADS) {
+		rings[nrings] = r;
+		__atomic_store_n(&nrings, nrings + 1, __ATOMIC_RELEASE);
+	} else {
+		free(r);
+		r = NULL;
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	/* Too many threads: this one goes untraced, don't try again */
+	trace_tls = r ? r : (struct trace_ring *) -1;
+
+	return r;
+}
+
+static void trace_marker(const char *buf, int len) {
+
+	if(write(trace_marker_fd, buf, len) < 0) {
+		/* Tracing off in the kernel, nothing to do */
+	}
+}
+
+uint64_t trace_begin(const char *name) {
+
+	char buf[64];
+	int len;
+
+	if(!trace_enabled)
+		return 0;
+
+	if(trace_marker_fd >= 0) {
+		len = snprintf(buf, sizeof(buf), "B|%d|%s", trace_pid, name);
+		trace_marker(buf, len);
+	}
+
+	return trace_now();
+}
+
+void trace_end(const char *name, uint64_t t0, uint32_t seq) {
+
+	struct trace_ring *r;
+	struct trace_event *e;
+	uint64_t t;
+	char buf[32];
+	int len;
+
+	if(!t0 || !trace_enabled)
+		return;
+
+	t = trace_now();
+
+	if(trace_marker_fd >= 0) {
+		len = snprintf(buf, sizeof(buf), "E|%d", trace_pid);
+		trace_marker(buf, len);
+	}
+
+	r = trace_ring_get();
+	if(!r || r == (struct trace_ring *) -1)
+		return;
+
+	e = &r->events[r->head & (TRACE_EVENTS - 1)];
+	e->name = name;
+	e->start = t0;
+	e->dur = t - t0 > 0xffffffffULL ? 0xffffffff : t - t0;
+	e->seq = seq;
+
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_thread_name(const char *name) {
+
+	struct trace_ring *r;
+
+	if(!trace_enabled)
+		return;
+
+	r = trace_ring_get();
+	if(r && r != (struct trace_ring *) -1)
+		snprintf(r->name, sizeof(r->name), "%s", name);
+}
+
+const char *trace_intern(const char *name) {
+
+	static char names[TRACE_THREADS][TRACE_NAME_MAX];
+	static int nnames;
+	const char *p = NULL;
+	int i;
+
+	pthread_mutex_lock(&trace_lock);
+
+	for(i = 0; i < nnames; i++)
+		if(!strcmp(names[i], name))
+			p = names[i];
+
+	if(!p && nnames < TRACE_THREADS) {
+		snprintf(names[nnames], TRACE_NAME_MAX, "%s", name);
+		p = names[nnames++];
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+
+	return p ? p : "?";
+}
+
+int trace_dump(const char *path) {
+
+	unsigned long long head, first, i;
+	FILE *fp;
+	int n, k, events = 0;
+
+	fp = fopen(path, "w");
+	if(!fp) {
+		printf("trace: cannot create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		trace_pid, trace_pid, program_invocation_short_name);
+
+	n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+
+	for(k = 0; k < n; k++) {
+		struct trace_ring *r = rings[k];
+
+		if(r->name[0])
+			fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				trace_pid, r->tid, r->name);
+
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		first = head > TRACE_EVENTS - TRACE_SLACK ? head - (TRACE_EVENTS - TRACE_SLACK) : 0;
+
+		for(i = first; i < head; i++) {
+			struct trace_event e = r->events[i & (TRACE_EVENTS - 1)];
+
+			if(!e.name)
+				continue;
+
+			fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"seq\":%u}}",
+				e.name, trace_pid, r->tid, e.start / 1000.0, e.dur / 1000.0, e.seq);
+			events++;
+		}
+	}
+
+	fprintf(fp, "\n]}\n");
+
+	if(fclose(fp) != 0) {
+		printf("trace: write to %s failed\n", path);
+		return -1;
+	}
+
+	printf("trace: %d events from %d threads written to %s\n", events, n, path);
+
+	return 0;
+}
+
+static void *trace_thread(void *arg) {
+
+	struct pollfd pfd;
+	char buf[16];
+
+	pfd.fd = trace_pipe[0];
+	pfd.events = POLLIN;
+
+	while(!trace_stopping) {
+		if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+
+		while(read(trace_pipe[0], buf, sizeof(buf)) > 0)
+			;
+
+		if(!trace_stopping)
+			trace_dump(trace_path);
+	}
+
+	return NULL;
+}
+
+int trace_init(const char *path, int markers) {
+
+	snprintf(trace_path, sizeof(trace_path), "%s", path);
+	trace_pid = getpid();
+
+	if(markers) {
+		trace_marker_fd = open("/sys/kernel/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+		if(trace_marker_fd < 0)
+			trace_marker_fd = open("/sys/kernel/debug/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+		if(trace_marker_fd < 0)
+			printf("trace: no trace_marker, ftrace markers off: %s\n", strerror(errno));
+	}
+
+	if(pipe2(trace_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		printf("trace: pipe failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if(pthread_create(&trace_thread_id, NULL, trace_thread, NULL)) {
+		printf("trace: cannot start thread\n");
+		close(trace_pipe[0]);
+		close(trace_pipe[1]);
+		trace_pipe[0] = trace_pipe[1] = -1;
+		return -1;
+	}
+
+	trace_enabled = 1;
+
+	return 0;
+}
+
+void trace_request(void) {
+
+	char c = 0;
+
+	if(trace_pipe[1] >= 0 && write(trace_pipe[1], &c, 1) < 0) {
+		/* A dump is pending already */
+	}
+}
+
+void trace_stop(void) {
+
+	if(trace_pipe[1] < 0)
+		return;
+
+	trace_stopping = 1;
+	trace_request();
+	pthread_join(trace_thread_id, NULL);
+
+	close(trace_pipe[0]);
+	close(trace_pipe[1]);
+	trace_pipe[0] = trace_pipe[1] = -1;
+
+	trace_dump(trace_path);
+	trace_enabled = 0;
+
+	if(trace_marker_fd >= 0)
+		close(trace_marker_fd);
+	trace_marker_fd = -1;
+}
@@ -0,0 +1,43 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Stage tracer. Every thread records complete events (name, start,
+ * duration, frame sequence) into its own ring of TRACE_EVENTS, so
+ * recording takes no locks. trace_dump() writes all rings as Chrome Trace
+ * Event JSON, which chrome://tracing and ui.perfetto.dev both open.
+ * With markers on, stages are also written to the ftrace trace_marker as
+ * B|pid|name / E|pid so they line up with kernel events.
+ *
+ * Event names are kept by pointer: string literals, or trace_intern().
+ */
+
+#define TRACE_EVENTS		16384	/* per thread, power of two */
+#define TRACE_THREADS		64
+
+/* Start recording; dump to path at trace_stop() and on trace_request() */
+int trace_init(const char *path, int markers);
+
+/* Start of a stage, returns its timestamp or 0 when tracing is off */
+uint64_t trace_begin(const char *name);
+
+/* End of the stage begun at t0 */
+void trace_end(const char *name, uint64_t t0, uint32_t seq);
+
+/* Name the calling thread in the trace */
+void trace_thread_name(const char *name);
+
+/* Copy a name that must outlive its owner */
+const char *trace_intern(const char *name);
+
+/* Dump now, from the tracer thread. Async-signal-safe */
+void trace_request(void);
+
+int trace_dump(const char *path);
+
+/* Final dump */
+void trace_stop(void);
+
+#endif // _TRACE_H_
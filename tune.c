@@ -0,0 +1,319 @@
+/*
+ *      tune.c  --  calibrate the display path on live frames
+ *
+ *      Coordinate descent: every dimension is searched with the others at
+ *      their best so far, in an order where the earlier choices matter
+ *      most. A whole search is about twenty candidates, a second or two
+ *      of frames. The cache is a text file, one line per key:
+ *
+ *      key isa stage_in stage_out copy prefetch stripe threads usec
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/videodev2.h>
+
+#include "tune.h"
+#include "convert.h"
+
+#define TUNE_CANDIDATES		8
+
+enum tune_dim {
+	TUNE_ISA = 0,
+	TUNE_STAGE_IN,
+	TUNE_STAGE_OUT,
+	TUNE_COPY,
+	TUNE_STRIPE,
+	TUNE_THREADS,
+	TUNE_DIMS,
+};
+
+struct tune {
+	char *path;
+	char key[TUNE_KEY_MAX];
+	int height, max_threads, fixed_isa, simd;
+
+	struct render_params best;
+	unsigned long long best_usec;
+
+	/* Search state, done once best is final */
+	int done, dim, cand, ncands, runs, frames;
+	struct render_params cands[TUNE_CANDIDATES];
+	unsigned long long usec;
+};
+
+static int tune_load(struct tune *t) {
+
+	char line[512], key[TUNE_KEY_MAX];
+	struct render_params p;
+	unsigned long long usec;
+	FILE *fp;
+	int found = 0;
+
+	fp = fopen(t->path, "r");
+	if(!fp)
+		return 0;
+
+	while(fgets(line, sizeof(line), fp)) {
+		if(sscanf(line, "%255s %d %d %d %d %d %d %d %llu", key, &p.isa, &p.stage_in, &p.stage_out, &p.copy,
+			&p.prefetch, &p.stripe, &p.threads, &usec) != 9 || strcmp(key, t->key))
+			continue;
+
+		/* A line from another build or a hand edit */
+		if(p.isa < 0 || p.isa >= CONVERT_ISAS || !(convert_isas() & (1 << p.isa)) ||
+			p.threads < 1 || p.threads > RENDER_THREADS || p.stripe < 0)
+			continue;
+
+		/* Picked when more helper threads started than did now */
+		if(p.threads > t->max_threads)
+			continue;
+
+		t->best = p;
+		t->best_usec = usec;
+		found = 1;
+	}
+
+	fclose(fp);
+
+	return found;
+}
+
+static int tune_save(struct tune *t) {
+
+	char line[512], tmp[PATH_MAX], *slash;
+	size_t len = strlen(t->key);
+	FILE *in, *out;
+
+	/* Usually ~/.cache, which a fresh system may not have yet */
+	snprintf(tmp, sizeof(tmp), "%s", t->path);
+	slash = strrchr(tmp, '/');
+	if(slash && slash != tmp) {
+		*slash = 0;
+		if(mkdir(tmp, 0755) < 0 && errno != EEXIST) {
+			printf("Cannot create %s: %s\n", tmp, strerror(errno));
+			return -1;
+		}
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", t->path);
+	out = fopen(tmp, "w");
+	if(!out) {
+		printf("Cannot write %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+
+	/* Other devices and formats are kept */
+	in = fopen(t->path, "r");
+	if(in) {
+		while(fgets(line, sizeof(line), in))
+			if(strncmp(line, t->key, len) || line[len] != ' ')
+				fputs(line, out);
+		fclose(in);
+	}
+
+	fprintf(out, "%s %d %d %d %d %d %d %d %llu\n", t->key, t->best.isa, t->best.stage_in, t->best.stage_out,
+		t->best.copy, t->best.prefetch, t->best.stripe, t->best.threads, t->best_usec);
+
+	if(fclose(out) != 0 || rename(tmp, t->path) < 0) {
+		printf("Cannot write %s: %s\n", t->path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void tune_print(struct tune *t, const char *how) {
+
+	const struct render_params *p = &t->best;
+
+	printf("Display %s: %s kernels, %s reads, %s output", how, convert_isa_name(p->isa),
+		p->stage_in ? "staged" : "direct", p->stage_out ? "staged" : "direct");
+	if(p->stage_in || p->stage_out) {
+		if(p->copy == RENDER_COPY_PREFETCH)
+			printf(", copy prefetching %d lines", p->prefetch);
+		else if(p->copy == RENDER_COPY_STREAM)
+			printf(", streaming blit");
+		else
+			printf(", %s copy", p->copy == RENDER_COPY_LIBC ? "libc" : "default");
+	}
+	if(p->stripe)
+		printf(", %d row stripes", p->stripe);
+	else if(p->stage_out)
+		printf(", %d KB tiles", RENDER_TILE_BYTES / 1024);
+	printf(", %d thread%s, %.2f ms\n", p->threads, p->threads > 1 ? "s" : "", t->best_usec / 1000.0);
+}
+
+/* Candidates for the current dimension, the best so far first */
+static void tune_dimension(struct tune *t) {
+
+	static const int stripes[] = { 16, 64, 256 };
+	static const int prefetch[] = { 2, 4, 8, 16 };
+	struct render_params *c = t->cands;
+	int i, n = 0;
+
+	c[n++] = t->best;
+
+	switch(t->dim) {
+	case TUNE_ISA:
+		if(t->fixed_isa || !t->simd)
+			break;
+		for(i = 0; i < CONVERT_ISAS; i++) {
+			if(i == t->best.isa || !(convert_isas() & (1 << i)))
+				continue;
+			c[n] = t->best;
+			c[n++].isa = i;
+		}
+		break;
+
+	case TUNE_STAGE_IN:
+	case TUNE_STAGE_OUT:
+		c[n] = t->best;
+		if(t->dim == TUNE_STAGE_IN)
+			c[n].stage_in = !c[n].stage_in;
+		else
+			c[n].stage_out = !c[n].stage_out;
+		n++;
+		break;
+
+	case TUNE_COPY:
+		/* Only staged rows are copied */
+		if(!t->best.stage_in && !t->best.stage_out)
+			break;
+#if defined(__arm__) || defined(__aarch64__)
+		/* Elsewhere the default copy is libc already */
+		c[n] = t->best;
+		c[n++].copy = t->best.copy == RENDER_COPY_LIBC ? RENDER_COPY_DEFAULT : RENDER_COPY_LIBC;
+#endif
+		for(i = 0; i < (int) (sizeof(prefetch) / sizeof(prefetch[0])); i++) {
+			if(t->best.copy == RENDER_COPY_PREFETCH && t->best.prefetch == prefetch[i])
+				continue;
+			c[n] = t->best;
+			c[n].copy = RENDER_COPY_PREFETCH;
+			c[n++].prefetch = prefetch[i];
+		}
+		if(t->best.stage_out && t->best.copy != RENDER_COPY_STREAM) {
+			c[n] = t->best;
+			c[n++].copy = RENDER_COPY_STREAM;
+		}
+		break;
+
+	case TUNE_STRIPE:
+		for(i = 0; i < (int) (sizeof(stripes) / sizeof(stripes[0])); i++) {
+			if(stripes[i] == t->best.stripe || stripes[i] >= t->height)
+				continue;
+			c[n] = t->best;
+			c[n++].stripe = stripes[i];
+		}
+		break;
+
+	case TUNE_THREADS:
+		for(i = 2; i <= t->max_threads && i <= RENDER_THREADS; i *= 2) {
+			if(i == t->best.threads)
+				continue;
+			c[n] = t->best;
+			c[n++].threads = i;
+		}
+		break;
+	}
+
+	t->ncands = n;
+	t->cand = 0;
+	t->runs = 0;
+	t->usec = ~0ULL;
+}
+
+struct tune *tune_create(int mode, const char *path, const char *key, unsigned int pixelformat,
+	int height, int max_threads, int fixed_isa) {
+
+	struct tune *t;
+
+	if(mode == TUNE_OFF || !render_supported(pixelformat))
+		return NULL;
+
+	t = (struct tune *) calloc(1, sizeof(*t));
+	if(!t)
+		return NULL;
+
+	t->path = path ? strdup(path) : NULL;
+	snprintf(t->key, sizeof(t->key), "%s", key);
+	t->height = height;
+	t->max_threads = max_threads;
+	t->fixed_isa = fixed_isa;
+	/* The Bayer kernel is scalar on every ISA */
+	t->simd = pixelformat != V4L2_PIX_FMT_SBGGR8;
+
+	render_defaults(pixelformat, &t->best);
+	t->best_usec = ~0ULL;
+
+	if(mode == TUNE_AUTO && t->path && tune_load(t)) {
+		if(fixed_isa)
+			t->best.isa = convert_isa();
+		t->done = 1;
+		tune_print(t, "settings cached");
+		return t;
+	}
+
+	printf("Calibrating display on the first frames\n");
+	tune_dimension(t);
+
+	return t;
+}
+
+const struct render_params *tune_next(struct tune *t) {
+
+	return t->done ? &t->best : &t->cands[t->cand];
+}
+
+int tune_done(struct tune *t) {
+
+	return t->done;
+}
+
+void tune_record(struct tune *t, unsigned long long usec) {
+
+	if(t->done)
+		return;
+
+	t->frames++;
+	if(usec < t->usec)
+		t->usec = usec;
+	if(++t->runs < TUNE_RUNS)
+		return;
+
+	/* The incumbent is timed again, caches and clocks have settled since */
+	if(t->cand == 0 || t->usec < t->best_usec) {
+		t->best = t->cands[t->cand];
+		t->best_usec = t->usec;
+	}
+
+	t->runs = 0;
+	t->usec = ~0ULL;
+	if(++t->cand < t->ncands)
+		return;
+
+	/* Dimensions with nothing to try are skipped */
+	while(++t->dim < TUNE_DIMS) {
+		tune_dimension(t);
+		if(t->ncands > 1)
+			return;
+	}
+
+	t->done = 1;
+	printf("Calibrated in %d frames\n", t->frames);
+	tune_print(t, "settings");
+
+	if(t->path && tune_save(t) == 0)
+		printf("Saved to %s\n", t->path);
+}
+
+void tune_destroy(struct tune *t) {
+
+	free(t->path);
+	free(t);
+}
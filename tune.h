@@ -0,0 +1,43 @@
+#ifndef _TUNE_H_
+#define _TUNE_H_
+
+#include "render.h"
+
+/*
+ * Startup calibration of the display path. The first frames are rendered
+ * with candidate render_params, one dimension at a time: kernel ISA,
+ * staged source reads, staged output, copy routine and prefetch distance,
+ * stripe height and thread count. Each candidate keeps the best of
+ * TUNE_RUNS frames and the fastest stays. The choice is cached per key,
+ * which names the device, format and sizes, so later starts skip it.
+ */
+
+#define TUNE_RUNS		3
+#define TUNE_KEY_MAX		256
+
+enum tune_mode {
+	TUNE_OFF = 0,
+	TUNE_AUTO,			/* calibrate unless the cache has the key */
+	TUNE_FORCE,			/* calibrate and replace the cached result */
+};
+
+struct tune;
+
+/* fixed_isa keeps the current kernels, as picked with --simd. max_threads
+ * is render_threads(), only what did start is tried. NULL path, no cache.
+ * Returns NULL when not tuning */
+struct tune *tune_create(int mode, const char *path, const char *key, unsigned int pixelformat,
+	int height, int max_threads, int fixed_isa);
+
+/* What to render the next frame with */
+const struct render_params *tune_next(struct tune *t);
+
+/* Nonzero once the choice is final */
+int tune_done(struct tune *t);
+
+/* Time the frame took with what tune_next() returned, in usec */
+void tune_record(struct tune *t, unsigned long long usec);
+
+void tune_destroy(struct tune *t);
+
+#endif // _TUNE_H_
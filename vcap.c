@@ -0,0 +1,121 @@
+/*
+ *      vcap.c  --  inspect and extract frames from .vcap capture files
+ *
+ *      vcap info file.vcap
+ *      vcap list file.vcap
+ *      vcap extract file.vcap first [count] > frames.raw
+ *
+ *      Compressed recordings are decompressed on extract.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "capfile.h"
+#include "compress.h"
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s info|list file.vcap\n", argv0);
+	printf("       %s extract file.vcap first [count] > out\n", argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct capfile_reader r;
+	struct capfile_index_entry e;
+	uint64_t i, first = 0, count = 1;
+	unsigned char *raw = NULL;
+	size_t raw_size = 0;
+
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (capfile_open(&r, argv[2]) < 0)
+		return 1;
+
+	if (strcmp(argv[1], "info") == 0) {
+
+		printf("format: %.4s, %ux%u, bytesperline: %u, frames: %llu, index: %s\n",
+			(char *) &r.hdr.fourcc, r.hdr.width, r.hdr.height, r.hdr.bytesperline,
+			(unsigned long long) r.count, r.index_mapped ? "yes" : "rebuilt");
+
+		if (r.count > 1) {
+			double span = (r.index[r.count - 1].timestamp - r.index[0].timestamp) / 1000000.0;
+			printf("duration: %.3f s, %.2f fps, sequence %u..%u (%llu dropped by driver)\n",
+				span, span > 0 ? (r.count - 1) / span : 0.0,
+				r.index[0].sequence, r.index[r.count - 1].sequence,
+				(unsigned long long) (r.index[r.count - 1].sequence - r.index[0].sequence + 1 - r.count));
+		}
+
+		if (r.hdr.flags & CAPFILE_COMPRESSED) {
+			unsigned long long in = 0, out = 0;
+
+			for (i = 0; i < r.count; i++) {
+				const unsigned char *p = capfile_frame(&r, i, &e);
+				long n = p ? compressed_raw_size(p, e.bytesused) : -1;
+
+				if (n > 0) {
+					in += n;
+					out += e.bytesused;
+				}
+			}
+
+			printf("compressed: %.1f MB -> %.1f MB, ratio %.2f\n",
+				in / 1048576.0, out / 1048576.0, out ? (double) in / out : 0.0);
+		}
+
+	} else if (strcmp(argv[1], "list") == 0) {
+
+		for (i = 0; i < r.count; i++)
+			printf("%llu: offset %llu, bytesused %u, sequence %u, ts %llu.%06llu, flags 0x%08x\n",
+				(unsigned long long) i, (unsigned long long) r.index[i].offset,
+				r.index[i].bytesused, r.index[i].sequence,
+				(unsigned long long) r.index[i].timestamp / 1000000,
+				(unsigned long long) r.index[i].timestamp % 1000000, r.index[i].flags);
+
+	} else if (strcmp(argv[1], "extract") == 0 && argc > 3) {
+
+		first = strtoull(argv[3], NULL, 10);
+		if (argc > 4)
+			count = strtoull(argv[4], NULL, 10);
+
+		for (i = first; i < first + count && i < r.count; i++) {
+			const unsigned char *p = capfile_frame(&r, i, &e);
+			long len = p ? e.bytesused : -1;
+
+			if (p && (r.hdr.flags & CAPFILE_COMPRESSED)) {
+				len = compressed_raw_size(p, e.bytesused);
+				if (len > 0 && (size_t) len > raw_size) {
+					free(raw);
+					raw_size = len;
+					raw = (unsigned char *) malloc(raw_size);
+				}
+				if (len > 0)
+					len = raw ? decompress_frame(p, e.bytesused, raw, raw_size) : -1;
+				p = raw;
+			}
+
+			if (len < 0 || write(1, p, len) != len) {
+				fprintf(stderr, "Failed to extract frame %llu\n", (unsigned long long) i);
+				free(raw);
+				capfile_close_reader(&r);
+				return 1;
+			}
+		}
+
+	} else {
+		usage(argv[0]);
+		capfile_close_reader(&r);
+		return 1;
+	}
+
+	free(raw);
+	capfile_close_reader(&r);
+
+	return 0;
+}
@@ -26,7 +26,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <getopt.h>
+#include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/select.h>
@@ -34,15 +36,30 @@
 #include <jpeglib.h>
 #include <linux/fb.h>
 #include <linux/videodev2.h>
-#include "memcpy_neon.h"
+#include "huffman.h"
+#include "record.h"
+#include "capfile.h"
+#include "avi.h"
+#include "source.h"
+#include "ring.h"
+#include "compress.h"
+#include "framebus.h"
+#include "sink.h"
+#include "httpd.h"
+#include "metrics.h"
+#include "convert.h"
+#include "latency.h"
+#include "trace.h"
+#include "perfctr.h"
+#include "rtsched.h"
+#include "render.h"
+#include "tune.h"
+#include "motion.h"
+#include "roi.h"
+#include "isp.h"
 
 #define SATURATE8(x) ((unsigned int) x <= 255 ? x : (x < 0 ? 0: 255))
 
-int insert_huffman(unsigned char* from, int fromLen, unsigned char *to, int *toLen);
-int insert_huffman2(unsigned char* from, int fromLen, unsigned char *to, int *toLen);
-int insert_huffman3(unsigned char* from, int fromLen, unsigned char *to, int *toLen);
-int insert_huffman4(unsigned char* from, int fromLen, unsigned char *to, int *toLen);
-
 #define FB_FILE "/dev/fb0"
 
 char *buf_types[] = { 
@@ -68,6 +85,91 @@ char *fb_file = FB_FILE;
 
 int same_file = 0;
 
+char *record_file = NULL;
+int record_flags = RECORD_APPEND;
+int record_chunks = RECORD_CHUNKS;
+int record_plain = 0;
+int compress_threads = 0;
+
+char *replay_file = NULL;
+int replay_realtime = 1;
+
+int ring_seconds = 0;
+int ring_mb = 0;
+char *ring_prefix = NULL;
+char *control_socket = NULL;
+char *trigger_file = NULL;
+struct ring_recorder *ring = NULL;
+
+char *bus_path = NULL;
+
+int null_sink = 0;
+int null_touch = 0;
+int headless = 0;
+
+char *http_addr = NULL;
+
+int verbose = 0;
+int latency_mode = 0;
+int timecode = 0;
+int stats_interval = 0;
+
+char *trace_file = NULL;
+int trace_markers = 0;
+
+int perf_mode = 0;
+
+char *simd = NULL;
+
+int tune_mode = TUNE_AUTO;
+char *tune_cache = NULL;
+
+int dirty_noise = -1;
+int dirty_refresh = 100;
+
+struct motion *motion = NULL;
+struct motion_config motion_cfg = { 12, 2, 0 };
+int motion_mode = 0;
+double motion_hold = 3;
+
+/* Exposure and white balance of raw Bayer sensors */
+struct isp *isp = NULL;
+struct isp_config isp_cfg = { 0, 0 };
+
+/* Region of interest; the part of the frames that is displayed and watched
+ * for motion, view_offset bytes into the buffers */
+int roi_mode = 0;
+struct roi roi;
+long view_offset = 0;
+
+/* Names the device in the tuning cache */
+char video_card[32] = "file";
+char video_bus[32] = "";
+
+int rt_profile = 0;
+int lock_memory = 0;
+int sched_probe = 0;
+struct perf_stage *p_dequeue, *p_dispatch, *p_convert, *p_motion, *p_isp;
+
+struct metric *m_frames, *m_skipped, *m_zero, *m_broken;
+struct metric *m_dequeue, *m_dispatch, *m_convert, *m_motion, *m_motion_events, *m_isp;
+
+static void ring_signal(int sig)
+{
+	if (ring)
+		ring_trigger(ring);
+}
+
+static void metrics_signal(int sig)
+{
+	metrics_request();
+}
+
+static void trace_signal(int sig)
+{
+	trace_request();
+}
+
 int MIN(int A, int B)
 {
 	if(A < B)
@@ -132,7 +234,7 @@ int open_framebuffer(char *ptr,fb_v41 *vd)
 	screensize = vd->vinfo.xres * vd->vinfo.yres * vd->vinfo.bits_per_pixel / 8;
 
 	vd->fbp = (char *)mmap(0,vd->finfo.smem_len,PROT_READ|PROT_WRITE,MAP_SHARED,fbfd,0);
-	if ((int)vd->fbp == -1) {
+	if (vd->fbp == MAP_FAILED) {
 		printf("Error: failed to map framebuffer device to memory.\n");
 		return 0;
 	}
@@ -169,6 +271,8 @@ static int video_open(const char *devname)
 	}
 
 	printf("Device %s opened, card: %s.\n", devname, cap.card);
+	snprintf(video_card, sizeof(video_card), "%s", (char *) cap.card);
+	snprintf(video_bus, sizeof(video_bus), "%s", (char *) cap.bus_info);
 	return dev;
 }
 
@@ -189,7 +293,7 @@ static int uvc_set_control(int dev, unsigned int id, int value)
 }
 
 
-static int video_set_format(int dev, unsigned int *w, unsigned int *h, unsigned int format, unsigned int type)
+static int video_set_format(int dev, unsigned int *w, unsigned int *h, unsigned int *bpl, unsigned int format, unsigned int type)
 {
 	struct v4l2_format fmt;
 	int ret;
@@ -214,6 +318,7 @@ static int video_set_format(int dev, unsigned int *w, unsigned int *h, unsigned
 
 	*w = fmt.fmt.pix.width;
 	*h = fmt.fmt.pix.height;
+	*bpl = fmt.fmt.pix.bytesperline;
 
 	return 0;
 }
@@ -520,9 +625,315 @@ static int video_set_input(int dev, unsigned int input)
 #define V4L_BUFFERS_DEFAULT	4	
 #define V4L_BUFFERS_MAX		32
 
+/* Sinks, each runs on its own thread */
+
+struct display {
+	fb_v41 vd;
+	unsigned int pixelformat;
+	unsigned int width;
+	unsigned int height;
+	unsigned int bytesperline;
+	struct render *render;
+	struct tune *tune;
+	int idle, idle_refresh;		/* frames without motion, shown every idle_refresh */
+	int vsync;			/* FBIO_WAITFORVSYNC works, for latency */
+};
+
+/* Without detection every frame counts as moving */
+static int frame_moving(struct frame_ref *ref)
+{
+	return !motion || ref->motion == MOTION_START || ref->motion == MOTION_ACTIVE;
+}
+
+static int display_frame(struct sink *s, struct frame_ref *ref, void *priv)
+{
+	struct display *d = (struct display *) priv;
+	const uint8_t *src = (const uint8_t *) ref->frame.data + view_offset;
+	int width = MIN(d->vd.vinfo.xres, d->width);
+	int height = MIN(d->vd.vinfo.yres, d->height);
+	int fb_stride = d->vd.finfo.line_length;
+	int stride = d->bytesperline;
+	unsigned long long t0 = metrics_now(), t1, t2;
+	uint32_t crtc = 0;
+	uint64_t tr;
+
+	/* Formats without a kernel are not shown */
+	if (!d->render)
+		return 0;
+
+	/* A still scene is refreshed now and then, for the timecode and drift */
+	if (frame_moving(ref))
+		d->idle = 0;
+	else if (d->idle++ % d->idle_refresh)
+		return 0;
+
+	if (!stride)
+		stride = d->pixelformat == V4L2_PIX_FMT_SBGGR8 ? d->width : d->width * 2;
+
+	/* Candidates while calibrating, then the winner */
+	if (d->tune)
+		render_set(d->render, tune_next(d->tune));
+
+	if (isp)
+		render_gains(d->render, ref->gains.r ? &ref->gains : NULL);
+
+	/* Calibration times whole frames, unchanged tiles are skipped after */
+	if (dirty_noise >= 0 && (!d->tune || tune_done(d->tune)))
+		render_dirty(d->render, dirty_noise, dirty_refresh);
+
+	tr = trace_begin("convert");
+	perf_begin(p_convert);
+
+	/* Converted and on the screen, tile by tile for YUYV and Bayer */
+	render_convert(d->render, src, stride, width, height);
+
+	t1 = metrics_now();
+	perf_end(p_convert, width * height);
+	metric_observe(m_convert, t1 - t0);
+	trace_end("convert", tr, ref->frame.sequence);
+
+	if (timecode)
+		latency_draw_timecode((uint32_t *) d->vd.fbp, fb_stride, d->vd.vinfo.xres, d->vd.vinfo.yres, 16, 16, t1 / 1000);
+
+	/* On the glass once the next refresh scans it out. Waiting holds the
+	 * display thread to the refresh rate, which only latency runs pay */
+	if (latency_mode && d->vsync && ioctl(d->vd.fbfd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+		printf("No vertical sync on the framebuffer: %s, presented is when written\n", strerror(errno));
+		d->vsync = 0;
+	}
+
+	t2 = metrics_now();
+
+	if (d->tune)
+		tune_record(d->tune, t1 - t0);
+
+	if (latency_mode) {
+		latency_record(LATENCY_DEQUEUE_RENDER, t1 - ref->dispatched);
+		latency_record(LATENCY_RENDER_PRESENT, t2 - t1);
+		if (ref->captured)
+			latency_record(LATENCY_CAPTURE_PRESENT, t2 - ref->captured);
+	}
+
+	return 0;
+}
+
+struct recording {
+	struct record_writer *recorder;
+	struct avi_writer *avi;
+	struct capfile_writer *capfile;
+	struct compressor *compressor;
+	char *file;
+};
+
+static int record_sink_frame(struct sink *s, struct frame_ref *ref, void *priv)
+{
+	struct recording *r = (struct recording *) priv;
+	struct frame *frame = &ref->frame;
+	FILE *file;
+	int i, ret = 0;
+
+	/* Recording starts and stops with motion */
+	if (!frame_moving(ref))
+		return 0;
+
+	if (ref->niov < 0) {
+		metric_add(m_broken, 1);
+		if (verbose)
+			printf("Broken MJPEG frame, len = %d\n", frame->bytesused);
+		return 0;
+	}
+
+	if (r->avi)
+		ret = avi_append(r->avi, ref->iov, ref->niov, &frame->timestamp);
+	else if (r->compressor)
+		ret = compressor_submit(r->compressor, frame->data, frame->bytesused, frame->sequence, frame->flags, &frame->timestamp);
+	else if (r->capfile)
+		ret = capfile_append(r->capfile, ref->iov, ref->niov, frame->sequence, frame->flags, &frame->timestamp);
+	else if (r->recorder)
+		ret = record_framev(r->recorder, ref->iov, ref->niov);
+	else {
+		/* Snapshot, file always holds the latest frame */
+		file = fopen(r->file, "wb");
+		if (file != NULL) {
+			for (i = 0; i < ref->niov; i++)
+				fwrite(ref->iov[i].iov_base, ref->iov[i].iov_len, 1, file);
+			printf("Written frame %u to %s\n", frame->sequence, r->file);
+			fclose(file);
+		}
+	}
+
+	if (ret < 0) {
+		printf("Recording to %s failed\n", r->file);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* libjpeg source reading the frame iovec in place */
+struct jpeg_iov_src {
+	struct jpeg_source_mgr pub;
+	const struct iovec *iov;
+	int niov;
+	int next;
+};
+
+static void jpeg_iov_init(j_decompress_ptr cinfo)
+{
+}
+
+static boolean jpeg_iov_fill(j_decompress_ptr cinfo)
+{
+	struct jpeg_iov_src *src = (struct jpeg_iov_src *) cinfo->src;
+	static const JOCTET eoi[2] = { 0xff, JPEG_EOI };
+
+	if (src->next < src->niov) {
+		src->pub.next_input_byte = (const JOCTET *) src->iov[src->next].iov_base;
+		src->pub.bytes_in_buffer = src->iov[src->next].iov_len;
+		src->next++;
+	} else {
+		/* Truncated frame, let libjpeg finish with a warning */
+		src->pub.next_input_byte = eoi;
+		src->pub.bytes_in_buffer = 2;
+	}
+
+	return TRUE;
+}
+
+static void jpeg_iov_skip(j_decompress_ptr cinfo, long num_bytes)
+{
+	struct jpeg_iov_src *src = (struct jpeg_iov_src *) cinfo->src;
+
+	while (num_bytes > (long) src->pub.bytes_in_buffer) {
+		num_bytes -= src->pub.bytes_in_buffer;
+		jpeg_iov_fill(cinfo);
+	}
+
+	if (num_bytes > 0) {
+		src->pub.next_input_byte += num_bytes;
+		src->pub.bytes_in_buffer -= num_bytes;
+	}
+}
+
+static void jpeg_iov_term(j_decompress_ptr cinfo)
+{
+}
+
+struct decoder {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_iov_src src;
+};
+
+static int decode_sink_frame(struct sink *s, struct frame_ref *ref, void *priv)
+{
+	struct decoder *dec = (struct decoder *) priv;
+	struct jpeg_decompress_struct *cinfo = &dec->cinfo;
+	JSAMPARRAY buffer;
+	int row_stride, rowsRead = 0;
+
+	if (ref->niov < 0)
+		return 0;
+
+	dec->src.pub.init_source = jpeg_iov_init;
+	dec->src.pub.fill_input_buffer = jpeg_iov_fill;
+	dec->src.pub.skip_input_data = jpeg_iov_skip;
+	dec->src.pub.resync_to_restart = jpeg_resync_to_restart;
+	dec->src.pub.term_source = jpeg_iov_term;
+	dec->src.pub.bytes_in_buffer = 0;
+	dec->src.pub.next_input_byte = NULL;
+	dec->src.iov = ref->iov;
+	dec->src.niov = ref->niov;
+	dec->src.next = 0;
+	cinfo->src = &dec->src.pub;
+
+	(void) jpeg_read_header(cinfo, TRUE);
+
+	jpeg_start_decompress(cinfo);
+
+	row_stride = cinfo->output_width * cinfo->output_components;
+
+	buffer = (*cinfo->mem->alloc_sarray)
+		((j_common_ptr) cinfo, JPOOL_IMAGE, row_stride, cinfo->output_height);
+
+	while (cinfo->output_scanline < cinfo->output_height)
+		rowsRead += jpeg_read_scanlines(cinfo, &buffer[rowsRead], cinfo->output_height - rowsRead);
+
+	(void) jpeg_finish_decompress(cinfo);
+
+	return 0;
+}
+
+static int ring_sink_frame(struct sink *s, struct frame_ref *ref, void *priv)
+{
+	if (ref->niov > 0)
+		ring_push((struct ring_recorder *) priv, ref->iov, ref->niov,
+			ref->frame.sequence, ref->frame.flags, &ref->frame.timestamp);
+
+	return 0;
+}
+
+static int bus_sink_frame(struct sink *s, struct frame_ref *ref, void *priv)
+{
+	if (ref->niov > 0)
+		framebus_publish((struct framebus *) priv, ref->iov, ref->niov,
+			ref->frame.sequence, ref->frame.flags, &ref->frame.timestamp);
+
+	return 0;
+}
+
+static int http_sink_frame(struct sink *s, struct frame_ref *ref, void *priv)
+{
+	/* Clients take their own references, nothing waits for them here */
+	httpd_publish((struct httpd *) priv, ref);
+
+	return 0;
+}
+
+/* Calibration is per device, format, frame and screen size, and CPU */
+static struct tune *display_tune(unsigned int pixelformat, unsigned int width, unsigned int height, fb_v41 *vd,
+	int threads)
+{
+	char key[TUNE_KEY_MAX], path[PATH_MAX], *home, *c;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (tune_mode == TUNE_OFF)
+		return NULL;
+
+	snprintf(key, sizeof(key), "%s@%s:%.4s:%ux%u:fb%ux%u:cpu%ld:isa%x%s%s", video_card, video_bus,
+		(char *) &pixelformat, width, height, vd->vinfo.xres, vd->vinfo.yres, cpus,
+		convert_isas(), simd ? "=" : "", simd ? simd : "");
+	for (c = key; *c; c++)
+		if (*c == ' ')
+			*c = '_';
+
+	if (!tune_cache) {
+		home = getenv("HOME");
+		if (home)
+			snprintf(path, sizeof(path), "%s/.cache/video_echo.tune", home);
+		else
+			snprintf(path, sizeof(path), "/tmp/video_echo.tune");
+		tune_cache = strdup(path);
+	}
+
+	return tune_create(tune_mode, tune_cache, key, pixelformat, MIN(vd->vinfo.yres, height),
+		threads, simd != NULL);
+}
+
+static int add_sink(struct sink **sinks, int *nsinks, struct sink *s)
+{
+	if (!s || *nsinks == SINK_MAX)
+		return -1;
+
+	sinks[(*nsinks)++] = s;
+
+	return 0;
+}
+
 static void usage(const char *argv0)
 {
 	printf("Usage: %s [options] device\n", argv0);
+	printf("       %s [options] --replay file\n", argv0);
 	printf("Supported options:\n");
 	printf("-c, --capture[nframes] 	Capture frames\n");
 	printf("-d, --delay             Delay (in ms) before requeuing buffers\n");
@@ -534,16 +945,100 @@ static void usage(const char *argv0)
 	printf("-m			Use multi-plane formate instead (default is single-plane)\n");
 	printf("-n, --nbufs n		Set the number of video buffers\n");
 	printf("-s, --size WxH		Set the frame size\n");
+	printf("-v, --verbose		Print every frame\n");
 	printf("-S, --stream		Stream capturing mode\n");
 	printf("-x, --stream		Store frames to same file\n");
+	printf("    --output file	Recording file for -x (default /tmp/capture.vcap or .avi)\n");
+	printf("    --plain		Record -x frames back to back without container (.raw or .jpg)\n");
+	printf("    --compress[=n]	Compress raw -x recording losslessly on n threads (default: all CPUs)\n");
+	printf("    --record-direct	Write recording with O_DIRECT\n");
+	printf("    --record-buffers n	Number of %d MB recording buffers (default %d)\n", RECORD_CHUNK_SIZE >> 20, RECORD_CHUNKS);
 	printf("-E			Exposure\n");
 	printf("-r			Framerate (denominator)\n");
+	printf("    --replay file	Read frames from recorded file instead of device\n");
+	printf("    --replay-max	Replay as fast as possible (default: recorded timestamps)\n");
+	printf("    --ring seconds	Keep the last seconds in memory, dump them on SIGUSR1\n");
+	printf("    --ring-size MB	Ring memory (default: frame size * fps * seconds)\n");
+	printf("    --ring-output prefix	Dump file prefix (default /tmp/event)\n");
+	printf("    --control path	Unix datagram socket accepting \"dump\"\n");
+	printf("    --trigger-file path	Dump when path is created\n");
+	printf("    --bus path		Publish frames to other processes through shared memory\n");
+	printf("    --http [host:]port	Serve an MJPEG preview over HTTP\n");
+	printf("    --null[=touch]	Add a sink that drops frames, to measure fan-out overhead,\n");
+	printf("			reading every cache line of the frame with touch\n");
+	printf("    --headless		Don't open the framebuffer, no display\n");
+	printf("    --latency[=timecode]	Measure capture to screen latency, optionally drawing\n");
+	printf("			a timecode to film with the camera\n");
+	printf("    --trace file	Record per stage trace events, written to file as Chrome\n");
+	printf("			trace JSON at exit and on SIGRTMIN\n");
+	printf("    --trace-markers	Also write stages to the ftrace trace_marker\n");
+	printf("    --perf		Count cycles, instructions, cache and branch misses per stage\n");
+	printf("    --rt policy		Real-time capture and display threads, [fifo:]prio or\n");
+	printf("			deadline:runtime:period in usec\n");
+	printf("    --cpus role=cpu,...	Pin threads: capture, display, io, other sinks by name,\n");
+	printf("			cpu can be a range first-last\n");
+	printf("    --mlock		Lock memory and prefault all frame buffers\n");
+	printf("    --sched-probe[=usec]	Measure wakeup latency on the capture policy and CPUs,\n");
+	printf("			every usec (1000)\n");
+	printf("    --simd isa		Conversion kernels: auto (default), scalar, neon, sse4, avx2\n");
+	printf("    --tune mode		Calibrate the display on the first frames: off, auto (default,\n");
+	printf("			unless cached) or force\n");
+	printf("    --tune-cache path	Calibration cache (default ~/.cache/video_echo.tune)\n");
+	printf("    --dirty[=noise]	Only redraw parts of the picture that changed by more than\n");
+	printf("			noise per byte on average (2)\n");
+	printf("    --dirty-refresh n	Redraw all of it every n frames anyway (100, 0 for never)\n");
+	printf("    --motion[=level]	Record, and refresh the display, only while something moves:\n");
+	printf("			luma blocks differ from the background by level on average (12).\n");
+	printf("			Motion starting also triggers the --ring dump\n");
+	printf("    --motion-blocks n	Changed blocks of 64x32 pixels that are motion (2)\n");
+	printf("    --motion-hold sec	Keep recording this long after motion stops (3)\n");
+	printf("    --ae[=level]	Auto exposure of raw Bayer sensors, to a mean level (100)\n");
+	printf("    --awb		White balance raw Bayer frames on the display\n");
+	printf("    --roi WxH+X+Y	Only capture this region, cropped by the sensor when the driver\n");
+	printf("			can, else displayed and watched for motion from whole frames\n");
+	printf("    --stats seconds	Print stage metrics every seconds (always on SIGUSR2 and at exit)\n");
 	printf("    --enum-inputs	Enumerate inputs\n");
 	printf("    --skip n		Skip the first n frames\n");
 }
 
 #define OPT_ENUM_INPUTS		256
 #define OPT_SKIP_FRAMES		257
+#define OPT_OUTPUT		258
+#define OPT_RECORD_DIRECT	259
+#define OPT_RECORD_BUFFERS	260
+#define OPT_RECORD_PLAIN	261
+#define OPT_REPLAY		262
+#define OPT_REPLAY_MAX		263
+#define OPT_RING		264
+#define OPT_RING_SIZE		265
+#define OPT_RING_OUTPUT		266
+#define OPT_CONTROL		267
+#define OPT_TRIGGER_FILE	268
+#define OPT_COMPRESS		269
+#define OPT_BUS			270
+#define OPT_NULL_SINK		271
+#define OPT_HTTP		272
+#define OPT_HEADLESS		273
+#define OPT_STATS		274
+#define OPT_LATENCY		275
+#define OPT_TRACE		276
+#define OPT_TRACE_MARKERS	277
+#define OPT_PERF		278
+#define OPT_RT			279
+#define OPT_CPUS		280
+#define OPT_MLOCK		281
+#define OPT_SCHED_PROBE		282
+#define OPT_SIMD		283
+#define OPT_TUNE		284
+#define OPT_TUNE_CACHE		285
+#define OPT_DIRTY		286
+#define OPT_DIRTY_REFRESH	287
+#define OPT_MOTION		288
+#define OPT_MOTION_BLOCKS	289
+#define OPT_MOTION_HOLD		290
+#define OPT_ROI			291
+#define OPT_AE			292
+#define OPT_AWB			293
 
 static struct option opts[] = {
 	{"capture", 2, 0, 'c'},
@@ -557,12 +1052,48 @@ static struct option opts[] = {
 	{"stream", 0, 0, 'S'},
 	{"size", 1, 0, 's'},
 	{"skip", 1, 0, OPT_SKIP_FRAMES},
+	{"output", 1, 0, OPT_OUTPUT},
+	{"record-direct", 0, 0, OPT_RECORD_DIRECT},
+	{"record-buffers", 1, 0, OPT_RECORD_BUFFERS},
+	{"plain", 0, 0, OPT_RECORD_PLAIN},
+	{"replay", 1, 0, OPT_REPLAY},
+	{"replay-max", 0, 0, OPT_REPLAY_MAX},
+	{"ring", 1, 0, OPT_RING},
+	{"ring-size", 1, 0, OPT_RING_SIZE},
+	{"ring-output", 1, 0, OPT_RING_OUTPUT},
+	{"control", 1, 0, OPT_CONTROL},
+	{"trigger-file", 1, 0, OPT_TRIGGER_FILE},
+	{"compress", 2, 0, OPT_COMPRESS},
+	{"bus", 1, 0, OPT_BUS},
+	{"null", 2, 0, OPT_NULL_SINK},
+	{"http", 1, 0, OPT_HTTP},
+	{"headless", 0, 0, OPT_HEADLESS},
+	{"stats", 1, 0, OPT_STATS},
+	{"latency", 2, 0, OPT_LATENCY},
+	{"trace", 1, 0, OPT_TRACE},
+	{"trace-markers", 0, 0, OPT_TRACE_MARKERS},
+	{"perf", 0, 0, OPT_PERF},
+	{"rt", 1, 0, OPT_RT},
+	{"cpus", 1, 0, OPT_CPUS},
+	{"mlock", 0, 0, OPT_MLOCK},
+	{"sched-probe", 2, 0, OPT_SCHED_PROBE},
+	{"simd", 1, 0, OPT_SIMD},
+	{"tune", 1, 0, OPT_TUNE},
+	{"tune-cache", 1, 0, OPT_TUNE_CACHE},
+	{"dirty", 2, 0, OPT_DIRTY},
+	{"dirty-refresh", 1, 0, OPT_DIRTY_REFRESH},
+	{"motion", 2, 0, OPT_MOTION},
+	{"motion-blocks", 1, 0, OPT_MOTION_BLOCKS},
+	{"motion-hold", 1, 0, OPT_MOTION_HOLD},
+	{"roi", 1, 0, OPT_ROI},
+	{"ae", 2, 0, OPT_AE},
+	{"awb", 0, 0, OPT_AWB},
+	{"verbose", 0, 0, 'v'},
 	{0, 0, 0, 0}
 };
 
 int main(int argc, char *argv[])
 {
-	char filename[] = "quickcam-0000.jpg";
 	int dev, ret;
 	int buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
@@ -577,29 +1108,44 @@ int main(int argc, char *argv[])
 	unsigned int pixelformat = V4L2_PIX_FMT_RGB565;
 	unsigned int width = 640;
 	unsigned int height = 480;
+	unsigned int bytesperline = 0;
+	unsigned int view_width, view_height, view_stride;
 	unsigned int nbufs = V4L_BUFFERS_DEFAULT;
 	unsigned int input = 0;
 	unsigned int skip = 0;
 
 	/* Capture loop */
-	struct timeval start, end, ts, ts2, ts3, ts4, ts5, ts6;
+	struct timeval start, end, ts;
+	unsigned long long t0, t1, t2, t3;
+	uint64_t tr;
 	unsigned int delay = 0, nframes = (unsigned int)-1;
-	FILE *file;
+	struct record_writer *recorder = NULL;
+	struct capfile_writer *capfile = NULL;
+	struct avi_writer *avi = NULL;
+	struct compressor *compressor = NULL;
+	struct framebus *bus = NULL;
+	struct httpd *httpd = NULL;
 	double fps;
 
 	struct v4l2_buffer bufs[V4L_BUFFERS_MAX], *buf;
+	struct frame_source src;
+	struct frame frame;
+	struct frame_pool pool;
+	struct frame_ref *ref;
+	struct sink *sinks[SINK_MAX], *rec_sink = NULL;
+	int nsinks = 0, failed = 0, n;
+	struct display display;
+	struct recording recording;
+	struct decoder decoder;
 	unsigned int i;
 	/* add by lfc */
 	unsigned int count;
-        struct jpeg_decompress_struct cinfo;
-        struct jpeg_error_mgr jerr;
-        JSAMPARRAY buffer;
-        int row_stride;
 	fb_v41 vd;
 	/* end add */
+	struct mjpeg_stream mjpeg;
 
 	opterr = 0;
-	while ((c = getopt_long(argc, argv, "F:c:d:f:hi:lLn:s:SxW:B:E:r:m", opts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "F:c:d:f:hi:lLn:s:SvxW:B:E:r:m", opts, NULL)) != -1) {
 
 		switch (c) {
 		case 'c':
@@ -698,6 +1244,164 @@ int main(int argc, char *argv[])
 		case OPT_SKIP_FRAMES:
 			skip = atoi(optarg);
 			break;
+		case OPT_OUTPUT:
+			record_file = optarg;
+			break;
+		case OPT_RECORD_DIRECT:
+			record_flags |= RECORD_DIRECT;
+			break;
+		case OPT_RECORD_BUFFERS:
+			record_chunks = atoi(optarg);
+			break;
+		case OPT_RECORD_PLAIN:
+			record_plain = 1;
+			break;
+		case OPT_REPLAY:
+			replay_file = optarg;
+			break;
+		case OPT_REPLAY_MAX:
+			replay_realtime = 0;
+			break;
+		case OPT_RING:
+			ring_seconds = atoi(optarg);
+			break;
+		case OPT_RING_SIZE:
+			ring_mb = atoi(optarg);
+			break;
+		case OPT_RING_OUTPUT:
+			ring_prefix = optarg;
+			break;
+		case OPT_CONTROL:
+			control_socket = optarg;
+			break;
+		case OPT_TRIGGER_FILE:
+			trigger_file = optarg;
+			break;
+		case OPT_BUS:
+			bus_path = optarg;
+			break;
+		case OPT_NULL_SINK:
+			null_sink = 1;
+			if (optarg && !strcmp(optarg, "touch"))
+				null_touch = 1;
+			else if (optarg) {
+				printf("Unknown null sink mode %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_HEADLESS:
+			headless = 1;
+			break;
+		case OPT_STATS:
+			stats_interval = atof(optarg) * 1000;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case OPT_LATENCY:
+			latency_mode = 1;
+			if (optarg && !strcmp(optarg, "timecode"))
+				timecode = 1;
+			else if (optarg) {
+				printf("Unknown latency mode %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_TRACE:
+			trace_file = optarg;
+			break;
+		case OPT_TRACE_MARKERS:
+			trace_markers = 1;
+			break;
+		case OPT_PERF:
+			perf_mode = 1;
+			break;
+		case OPT_SIMD:
+			simd = optarg;
+			break;
+		case OPT_TUNE:
+			if (!strcmp(optarg, "off"))
+				tune_mode = TUNE_OFF;
+			else if (!strcmp(optarg, "auto"))
+				tune_mode = TUNE_AUTO;
+			else if (!strcmp(optarg, "force"))
+				tune_mode = TUNE_FORCE;
+			else {
+				printf("Unknown tune mode %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_TUNE_CACHE:
+			tune_cache = optarg;
+			break;
+		case OPT_DIRTY:
+			dirty_noise = optarg ? atoi(optarg) : 2;
+			if (dirty_noise < 0) {
+				printf("Bad noise threshold %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_DIRTY_REFRESH:
+			dirty_refresh = atoi(optarg);
+			break;
+		case OPT_MOTION:
+			motion_mode = 1;
+			if (optarg)
+				motion_cfg.threshold = atoi(optarg);
+			break;
+		case OPT_MOTION_BLOCKS:
+			motion_cfg.blocks = atoi(optarg);
+			if (motion_cfg.blocks < 1)
+				motion_cfg.blocks = 1;
+			break;
+		case OPT_MOTION_HOLD:
+			motion_hold = atof(optarg);
+			break;
+		case OPT_ROI:
+			if (roi_parse(optarg, &roi) < 0)
+				return 1;
+			roi_mode = 1;
+			break;
+		case OPT_AE:
+			isp_cfg.target = optarg ? atoi(optarg) : 100;
+			if (isp_cfg.target < 16 || isp_cfg.target > 240) {
+				printf("Bad exposure level %s, 16 to 240\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_AWB:
+			isp_cfg.awb = 1;
+			break;
+		case OPT_RT:
+			if (rt_parse_policy(optarg) < 0)
+				return 1;
+			rt_profile = 1;
+			break;
+		case OPT_CPUS:
+			if (rt_parse_cpus(optarg) < 0)
+				return 1;
+			rt_profile = 1;
+			break;
+		case OPT_MLOCK:
+			lock_memory = 1;
+			rt_profile = 1;
+			break;
+		case OPT_SCHED_PROBE:
+			sched_probe = optarg ? atoi(optarg) : 1000;
+			if (sched_probe <= 0) {
+				printf("Bad probe period %s\n", optarg);
+				return 1;
+			}
+			rt_profile = 1;
+			break;
+		case OPT_HTTP:
+			http_addr = optarg;
+			break;
+		case OPT_COMPRESS:
+			compress_threads = optarg ? atoi(optarg) : sysconf(_SC_NPROCESSORS_ONLN);
+			if (compress_threads < 1)
+				compress_threads = 1;
+			break;
 		default:
 			printf("Invalid option -%c\n", c);
 			printf("Run %s -h for help.\n", argv[0]);
@@ -705,508 +1409,689 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (optind >= argc) {
+	if (optind >= argc && !replay_file) {
 		usage(argv[0]);
 		return 1;
 	}
 
-	/* Open the video device. */
-	dev = video_open(argv[optind]);
-	if (dev < 0)
+	if (convert_init(simd) < 0)
 		return 1;
+	printf("Conversion kernels: %s\n", convert_isa_name(convert_isa()));
 
-	if (do_list_controls){
-		video_list_controls(dev);
-		return 0;
-	}	
-
-	if (do_list_formats){
-		video_list_formats(dev);
-		return 0;
-	}
-
-	if (do_enum_inputs)
-		video_enum_inputs(dev);
+	if (replay_file) {
+		if (source_file_open(&src, replay_file, replay_realtime, pixelformat, width, height, do_framerate) < 0)
+			return 1;
 
-	if (do_set_input)
-		video_set_input(dev, input);
+		pixelformat = src.pixelformat;
+		width = src.width;
+		height = src.height;
+		bytesperline = src.bytesperline;
+		dev = -1;
+	} else {
+		/* Open the video device. */
+		dev = video_open(argv[optind]);
+		if (dev < 0)
+			return 1;
 
-	ret = video_get_input(dev);
-	printf("Input %d selected\n", ret);
+		if (do_list_controls){
+			video_list_controls(dev);
+			return 0;
+		}	
 
-	ret = open_framebuffer(fb_file, &vd);
-	if (ret == 0){
-		printf("open framebuffer error!\n");
-		return 0;	
-	} 
+		if (do_list_formats){
+			video_list_formats(dev);
+			return 0;
+		}
 
+		if (do_enum_inputs)
+			video_enum_inputs(dev);
 
-	/* Allocate Z buffer */
-	int z_buffer_size = vd.vinfo.xres * vd.vinfo.yres * vd.vinfo.bits_per_pixel / 8;
-	char *z_buffer = (char*) malloc(z_buffer_size);
+		if (do_set_input)
+			video_set_input(dev, input);
 
-	if(!z_buffer) {
-		printf("Failed to allocate Z buffer, size of %d (%d x %d x % d)\n", z_buffer_size, vd.vinfo.xres , vd.vinfo.yres);
+		ret = video_get_input(dev);
+		printf("Input %d selected\n", ret);
 	}
 
-	printf("Setting video format of buf type %s\n", buf_types[buf_type]);
-
-	/* Set the video format. */
-	if (video_set_format(dev, &width, &height, pixelformat, buf_type) < 0) {
-		close(dev);
-		return 1;
+	/* Boards without a display still capture, record and serve frames */
+	if (!headless && open_framebuffer(fb_file, &vd) == 0) {
+		printf("open framebuffer error, running headless\n");
+		headless = 1;
 	}
 
-	printf("Format set ok\n");
+	if (!replay_file) {
+		printf("Setting video format of buf type %s\n", buf_types[buf_type]);
 
-	/* Set the frame rate. */
-	if (video_set_framerate(dev, do_framerate, buf_type) < 0) {
-		close(dev);
-		return 1;
-	}
+		/* A crop from an earlier run stays with the device */
+		roi_reset(dev, buf_type);
 
-	if(do_white_balance > -1) {
-		int rc = uvc_set_control(dev, V4L2_CID_DO_WHITE_BALANCE, do_white_balance);
-		if(rc < 0) {
-			printf("White balance set error: %s\n", strerror(errno));
-		} else {
-			printf("White balance set to: %d\n", do_white_balance);
+		/* Set the video format. */
+		if (video_set_format(dev, &width, &height, &bytesperline, pixelformat, buf_type) < 0) {
+			close(dev);
+			return 1;
 		}
-	}
 
-	if(do_brightness > -5) {
-		int rc = uvc_set_control(dev, V4L2_CID_BRIGHTNESS, do_brightness);
-		if(rc < 0) {
-			printf("Brightness set error: %s\n", strerror(errno));
-		} else {
-			printf("Brighness set to: %d\n", do_brightness);
-		}
-	}
+		/* Cropped by the sensor, the frames shrink to the region */
+		if (roi_mode) {
+			struct roi sel = roi;
 
-	if(do_exposure > -5) {
-		int rc = uvc_set_control(dev, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL);
-		rc += uvc_set_control(dev, V4L2_CID_EXPOSURE, do_exposure);
-		if(rc < 0) {
-			printf("Exposure set terror: %s\n", strerror(errno));
-		} else {
-			printf("Exposure set to: %d\n", do_exposure);
-		}
-	}
+			if (roi_select(dev, buf_type, &sel)) {
+				printf("Sensor crops %dx%d+%d+%d\n", sel.width, sel.height, sel.left, sel.top);
 
-	/* Allocate buffers. */
-	if ((int)(nbufs = video_reqbufs(dev, nbufs, buf_type)) < 0) {
-		close(dev);
-		return 1;
-	}
+				width = sel.width;
+				height = sel.height;
+				if (video_set_format(dev, &width, &height, &bytesperline, pixelformat, buf_type) < 0) {
+					close(dev);
+					return 1;
+				}
 
-	/* Map the buffers. */
-	for (i = 0; i < nbufs; i++) {
-		buf = &bufs[i];
-		memset(buf, 0, sizeof(*buf));
-		buf->index = i;
-		buf->type = buf_type;
-		buf->memory = V4L2_MEMORY_MMAP;
+				/* The rest of it, if the driver rounded */
+				roi.left = roi.left > sel.left ? roi.left - sel.left : 0;
+				roi.top = roi.top > sel.top ? roi.top - sel.top : 0;
+			} else {
+				printf("Driver can't crop, cutting the region out of whole frames\n");
+			}
+		}
 
-		printf("Querying buffer %d using ioctl(VIDIOC_QUERYBUF)\n", i);
+		printf("Format set ok\n");
 
-		ret = ioctl(dev, VIDIOC_QUERYBUF, buf);
-		if (ret < 0) {
-			printf("Unable to query buffer %d: %s\n", i, strerror(errno));
+		/* Set the frame rate. */
+		if (video_set_framerate(dev, do_framerate, buf_type) < 0) {
 			close(dev);
 			return 1;
 		}
 
-
-		if(buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
-			mem[i] = mmap(0, buf->length, PROT_READ|PROT_WRITE, MAP_SHARED, dev, buf->m.offset);
-			if (mem[i] == MAP_FAILED) {
-				printf("Unable to map buffer i = %d: %s\n", i, strerror(errno));
-				close(dev);
-				return 1;
+		if(do_white_balance > -1) {
+			int rc = uvc_set_control(dev, V4L2_CID_DO_WHITE_BALANCE, do_white_balance);
+			if(rc < 0) {
+				printf("White balance set error: %s\n", strerror(errno));
+			} else {
+				printf("White balance set to: %d\n", do_white_balance);
 			}
-			printf("Buffer i = %d mapped at address = %p, ", i, mem[i]);
-			printf("width: %d, height: %d, length: %d offset: %d\n", width, height, buf->length, buf->m.offset);
+		}
 
-		} else if(buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
-			printf("Multi-plane formats are not currently supported!\n");
-			return 1;
-		} else {
-			printf("Format of buffer type %s is not suppored!\n", buf_types[buf_type]);
-			return 1;
+		if(do_brightness > -5) {
+			int rc = uvc_set_control(dev, V4L2_CID_BRIGHTNESS, do_brightness);
+			if(rc < 0) {
+				printf("Brightness set error: %s\n", strerror(errno));
+			} else {
+				printf("Brighness set to: %d\n", do_brightness);
+			}
 		}
-	}
 
+		if(do_exposure > -5) {
+			int rc = uvc_set_control(dev, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL);
+			rc += uvc_set_control(dev, V4L2_CID_EXPOSURE, do_exposure);
+			if(rc < 0) {
+				printf("Exposure set terror: %s\n", strerror(errno));
+			} else {
+				printf("Exposure set to: %d\n", do_exposure);
+			}
+		}
 
-	/* Queue the buffers. */
-	for (i = 0; i < nbufs; i++) {
-		buf = &bufs[i];
-		ret = ioctl(dev, VIDIOC_QBUF, buf);
-		if (ret < 0) {
-			printf("Unable to queue buffer (%d).\n", errno);
+		/* Allocate buffers. */
+		if ((int)(nbufs = video_reqbufs(dev, nbufs, buf_type)) < 0) {
 			close(dev);
 			return 1;
 		}
 
-		printf("Buffer i = %d queued\n", i);
-	}
+		/* Map the buffers. */
+		for (i = 0; i < nbufs; i++) {
+			buf = &bufs[i];
+			memset(buf, 0, sizeof(*buf));
+			buf->index = i;
+			buf->type = buf_type;
+			buf->memory = V4L2_MEMORY_MMAP;
 
-	/* Start streaming. */
-	video_enable(dev, 1, buf_type);
+			printf("Querying buffer %d using ioctl(VIDIOC_QUERYBUF)\n", i);
 
-	printf("Video enabled\n");
+			ret = ioctl(dev, VIDIOC_QUERYBUF, buf);
+			if (ret < 0) {
+				printf("Unable to query buffer %d: %s\n", i, strerror(errno));
+				close(dev);
+				return 1;
+			}
 
-        cinfo.err = jpeg_std_error(&jerr);
-        jpeg_create_decompress(&cinfo);
 
-	int buf_idx = 0;
+			if(buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+				mem[i] = mmap(0, buf->length, PROT_READ|PROT_WRITE, MAP_SHARED, dev, buf->m.offset);
+				if (mem[i] == MAP_FAILED) {
+					printf("Unable to map buffer i = %d: %s\n", i, strerror(errno));
+					close(dev);
+					return 1;
+				}
+				printf("Buffer i = %d mapped at address = %p, ", i, mem[i]);
+				printf("width: %d, height: %d, length: %d offset: %d\n", width, height, buf->length, buf->m.offset);
 
-	i = 0;
-	
-	while(nframes) {
+			} else if(buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+				printf("Multi-plane formats are not currently supported!\n");
+				return 1;
+			} else {
+				printf("Format of buffer type %s is not suppored!\n", buf_types[buf_type]);
+				return 1;
+			}
+		}
 
-		buf = &bufs[buf_idx];
 
-		memset(buf, 0, sizeof(*buf));
-		buf->index = buf_idx;
-		buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf->memory = V4L2_MEMORY_MMAP;
+		/* Queue the buffers. */
+		for (i = 0; i < nbufs; i++) {
+			buf = &bufs[i];
+			ret = ioctl(dev, VIDIOC_QBUF, buf);
+			if (ret < 0) {
+				printf("Unable to queue buffer (%d).\n", errno);
+				close(dev);
+				return 1;
+			}
 
-		printf("Dequeuing frame = %d, buf_idx = %d, index = %d, memory = %p\n", i, buf_idx, buf->index, buf->memory);
+			printf("Buffer i = %d queued\n", i);
+		}
 
-		buf_idx = (buf_idx + 1) % nbufs;
+		/* Start streaming. */
+		video_enable(dev, 1, buf_type);
 
-		gettimeofday(&ts, NULL);
+		printf("Video enabled\n");
 
-		ret = ioctl(dev, VIDIOC_DQBUF, buf);
-		if (ret < 0) {
-			printf("Unable to dequeue buffer (%d).\n", errno);
+		source_v4l2_init(&src, dev, buf_type, mem, bufs, nbufs, pixelformat, width, height, bytesperline);
+	}
+
+	mjpeg_stream_init(&mjpeg);
+
+	if (frame_pool_init(&pool, &src) < 0) {
+		close(dev);
+		return 1;
+	}
+
+	/* Display and motion detection see the region, in place */
+	view_width = width;
+	view_height = height;
+	view_stride = bytesperline;
+	if (roi_mode) {
+		view_offset = roi_offset(&roi, pixelformat, width, height, &view_stride);
+		if (view_offset < 0) {
+			printf("Can't cut a region out of %.4s frames\n", (char *) &pixelformat);
 			close(dev);
 			return 1;
 		}
+		view_width = roi.width;
+		view_height = roi.height;
+		if (view_width != width || view_height != height)
+			printf("Region %ux%u+%d+%d of %ux%u frames\n", view_width, view_height,
+				roi.left, roi.top, width, height);
+	}
 
-		gettimeofday(&ts2, NULL);
-
-		if (i == 0)
-			start = ts;
-
-		// HACK: if CSI returned data is zeroed, skip this fpame 
-		if(*(unsigned int*)mem[buf->index] == 0x00000000) {
-			printf("CSI returned zeros! Skipping!\n");
-			goto skip_one_frame;
+	if (motion_mode) {
+		motion_cfg.hold = motion_hold * do_framerate;
+		motion = motion_create(pixelformat, view_width, view_height, view_stride, &motion_cfg);
+		if (!motion) {
+			close(dev);
+			return 1;
 		}
+	}
 
-		if(skip)
-			goto skip_one_frame;
+	if (isp_cfg.target || isp_cfg.awb) {
+		isp = isp_create(dev, pixelformat, view_width, view_height, view_stride, &isp_cfg);
+		if (!isp) {
+			close(dev);
+			return 1;
+		}
+	}
 
-		if (do_capture) {
-
-			if(pixelformat == V4L2_PIX_FMT_MJPEG)
-				sprintf(filename, "/tmp/capture.jpg");
-			else
-				sprintf(filename, "/tmp/capture.raw", i);
-			if(same_file)
-				file = fopen(filename, "ab");
-			else
-				file = fopen(filename, "wb");
-
-			if (file != NULL) {
-
-				if(pixelformat == V4L2_PIX_FMT_MJPEG) {
-					char tmp[200*1024];
-					int tmp_len = 0;
-					int rc = insert_huffman2(mem[buf->index], buf->bytesused, tmp, &tmp_len);
-					printf("Adding huffman header: len before = %d, len after = %d, rc = %d\n", buf->bytesused, tmp_len, rc);
-					printf("Written bytes: %d/%d to %s\n", fwrite(tmp, tmp_len, 1, file), tmp_len, filename);
-				} else {
-					printf("Written bytes: %d/%d to %s\n", fwrite(mem[buf->index], buf->bytesused, 1, file), buf->bytesused, filename);
+	/* Continuous recording goes through persistent asynchronous writer */
+	if (do_capture && same_file) {
+		if (pixelformat == V4L2_PIX_FMT_MJPEG && !record_plain) {
+			if (!record_file)
+				record_file = "/tmp/capture.avi";
+
+			avi = avi_create(record_file, width, height, do_framerate, record_flags, record_chunks);
+			if (avi)
+				recorder = avi_recorder(avi);
+		} else if (pixelformat != V4L2_PIX_FMT_MJPEG && !record_plain) {
+			if (!record_file)
+				record_file = "/tmp/capture.vcap";
+
+			capfile = capfile_create(record_file, pixelformat, width, height, bytesperline,
+						compress_threads ? CAPFILE_COMPRESSED : 0, record_flags, record_chunks);
+			if (capfile)
+				recorder = capfile_recorder(capfile);
+
+			if (capfile && compress_threads) {
+				compressor = compressor_create(capfile, pixelformat, src.sizeimage, compress_threads);
+				if (!compressor) {
+					capfile_close(capfile);
+					close(dev);
+					return 1;
 				}
-				fclose(file);
 			}
+		} else {
+			if (!record_file)
+				record_file = (pixelformat == V4L2_PIX_FMT_MJPEG) ? "/tmp/capture.jpg" : "/tmp/capture.raw";
 
-			nframes--;
+			recorder = record_open(record_file, record_flags, RECORD_CHUNK_SIZE, record_chunks);
 		}
 
-		if (do_stream){
-        		file = fopen(filename, "rb");
-	        	if(file == NULL){
-        	        	printf("Open file error!\n");
-                		return 0;
-	        	}
-
-		        jpeg_stdio_src(&cinfo, file);
-	
-		        (void) jpeg_read_header(&cinfo, TRUE);
+		if (!recorder) {
+			close(dev);
+			return 1;
+		}
+	}
 
-	        	jpeg_start_decompress(&cinfo);			
+	if (ring_seconds > 0) {
+		struct ring_config rc;
+
+		memset(&rc, 0, sizeof(rc));
+		rc.fourcc = pixelformat;
+		rc.width = width;
+		rc.height = height;
+		rc.bytesperline = bytesperline;
+		rc.fps = do_framerate;
+		rc.seconds = ring_seconds;
+		rc.arena_size = (size_t) ring_mb << 20;
+		rc.prefix = ring_prefix;
+		rc.control_socket = control_socket;
+		rc.trigger_file = trigger_file;
+		rc.record_flags = record_flags;
+
+		ring = ring_create(&rc);
+		if (!ring) {
+			close(dev);
+			return 1;
+		}
 
-	        	row_stride = cinfo.output_width * cinfo.output_components;
+		signal(SIGUSR1, ring_signal);
+	}
 
-	        	buffer = (*cinfo.mem->alloc_sarray)
-        	        	((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, cinfo.output_height);
+	if (bus_path) {
+		/* Room for a DHT inserted into MJPEG frames */
+		bus = framebus_create(bus_path, FRAMEBUS_SLOTS, src.sizeimage + MJPEG_PREFIX_MAX,
+				pixelformat, width, height, bytesperline);
+		if (!bus) {
+			close(dev);
+			return 1;
+		}
+	}
 
-			int rowsRead = 0;
-	        	while (cinfo.output_scanline < cinfo.output_height){
-				
-	                	rowsRead += jpeg_read_scanlines(&cinfo, &buffer[rowsRead], cinfo.output_height - rowsRead);	
-			}
+	if (http_addr) {
+		if (pixelformat != V4L2_PIX_FMT_MJPEG) {
+			printf("HTTP preview needs MJPEG frames\n");
+			close(dev);
+			return 1;
+		}
 
-			//rgb_to_framebuffer(&vd, cinfo.output_width, cinfo.output_height, 0, 0, buffer);
+		httpd = httpd_create(http_addr);
+		if (!httpd) {
+			close(dev);
+			return 1;
+		}
+	}
 
-		        (void) jpeg_finish_decompress(&cinfo);
+	if (do_capture && !same_file && !record_file)
+		record_file = (pixelformat == V4L2_PIX_FMT_MJPEG) ? "/tmp/capture.jpg" : "/tmp/capture.raw";
+
+	/* Stages of the capture loop, sinks add their own */
+	m_frames = metric_counter("frames");
+	m_skipped = metric_counter("skipped");
+	m_zero = metric_counter("zeroed frames");
+	m_broken = metric_counter("broken frames");
+	m_dequeue = metric_histogram("dequeue wait");
+	m_dispatch = metric_histogram("dispatch");
+	m_convert = metric_histogram("convert");
+	m_motion = metric_histogram("motion");
+	m_motion_events = metric_counter("motion events");
+	m_isp = metric_histogram("isp");
+
+	if (latency_mode && latency_init() < 0) {
+		close(dev);
+		return 1;
+	}
 
-		        fclose(file);		
-		}	
+	/* Counters are a diagnostic, run without them if there are none */
+	if (perf_mode && perf_init() == 0) {
+		p_dequeue = perf_stage("dequeue");
+		p_dispatch = perf_stage("dispatch");
+		p_convert = perf_stage("convert");
+		p_motion = perf_stage("motion");
+		p_isp = perf_stage("isp");
+	}
 
-		// Draw to LCD
-
-		if(pixelformat == V4L2_PIX_FMT_RGB565) {
-			//mem[buf->index], buf->bytesused;
-			//screensize = vd->vinfo.xres * vd->vinfo.yres * vd->vinfo.bits_per_pixel / 8;
-        		//vd->fbp = (char *)
-			unsigned int *lcd_frame = (unsigned int*) vd.fbp;
-			unsigned short *capture_frame = (unsigned short*) mem[buf->index];
-			int x,y,i,j;
-			unsigned int R, G, B, C;
-			//for(y = 0; y < MIN(vd.vinfo.yres, height); y++) {
-			for(y = 0; y < height; y++) {
-				//j = (height - vd.vinfo.yres) / 2;
-				unsigned int *p = lcd_frame;
-				for(x = 0; x < MIN(vd.vinfo.xres, width); x++) {
-					//i = (width - vd.vinfo.xres) / 2;
-					C = capture_frame[(y) * width + (x)];
-					R = (C >> 11) << 3;
-					G = ((C & 0b11111100000) >> 5) << 2;
-					B = (C & 0b11111) << 3;
-					//lcd_frame[y * vd.vinfo.xres + x] = 0xffff;
-					//lcd_frame[y * vd.vinfo.xres + x] = (0b11101 << 11);
-					//lcd_frame[y * vd.vinfo.xres + x] = (0b111111 << 5);
-					//lcd_frame[y * vd.vinfo.xres + x] = (0b11111 << 0);
-					*p++ = ((R << 16) | (G << 8) | B);
-					//lcd_frame[y * vd.finfo.line_length / 4 + x] =
-						//capture_frame[(y+j) * width + (x+i)]; // & 0b1110111111111111;
-					//	((R << 16) | (G << 8) | B);
-				}
-				lcd_frame += vd.finfo.line_length / 4;
-			}
+	signal(SIGUSR2, metrics_signal);
+	metrics_start(stdout, stats_interval);
 
+	/* Before the sinks, so their threads are traced from the start */
+	if (trace_file) {
+		if (trace_init(trace_file, trace_markers) < 0) {
+			close(dev);
+			return 1;
 		}
+		signal(SIGRTMIN, trace_signal);
+		trace_thread_name("capture");
+	}
 
+	/* Everything a frame goes to */
+	ret = 0;
+
+	if (!headless) {
+		display.vd = vd;
+		display.pixelformat = pixelformat;
+		display.width = view_width;
+		display.height = view_height;
+		display.bytesperline = view_stride;
+		display.render = NULL;
+		display.tune = NULL;
+		display.idle = 0;
+		display.idle_refresh = do_framerate > 0 ? do_framerate : 1;
+		display.vsync = 1;
+
+		if (render_supported(pixelformat)) {
+			/* Only calibration ever asks for more than one thread */
+			display.render = render_create((uint8_t *) vd.fbp, vd.finfo.line_length, pixelformat,
+				tune_mode == TUNE_OFF ? 1 : MIN(sysconf(_SC_NPROCESSORS_ONLN), RENDER_THREADS));
+			if (!display.render) {
+				close(dev);
+				return 1;
+			}
+			display.tune = display_tune(pixelformat, view_width, view_height, &vd,
+				render_threads(display.render));
+		}
 
-		if(pixelformat == V4L2_PIX_FMT_UYVY) { // Chroma goes first !!!
-			unsigned int *lcd_frame = (unsigned int*) vd.fbp;
-			unsigned char *capture_frame = (unsigned char*) mem[buf->index];
-			int i,j;
-        		unsigned  y_start, u_start = 0, v_start = 0;
-        		int r,g,b, r_prod, g_prod, b_prod;
-		        int y,u,v;
-
-			for(i = 0; i < height; i++) {
-				unsigned int *p = lcd_frame;
-				unsigned char *yuv = capture_frame+(i*width*2);
-				for(j = 0; j < MIN(vd.vinfo.xres, width); j++) {
+		ret = add_sink(sinks, &nsinks, sink_create("display", SINK_LATEST, 1, display_frame, &display));
+	}
 
+	if (ret == 0 && do_capture) {
+		recording.recorder = recorder;
+		recording.avi = avi;
+		recording.capfile = capfile;
+		recording.compressor = compressor;
+		recording.file = record_file;
+
+		/* Recording keeps every frame, but leaves a buffer to the driver */
+		rec_sink = sink_create("record", recorder ? SINK_ALL : SINK_LATEST,
+				recorder && pool.nrefs > 1 ? pool.nrefs - 1 : 1, record_sink_frame, &recording);
+		ret = add_sink(sinks, &nsinks, rec_sink);
+	}
 
-					if(j%2)
-						v_start = *yuv++;
-					else
-						u_start = *yuv++;
+	if (ret == 0 && do_stream && pixelformat == V4L2_PIX_FMT_MJPEG) {
+		decoder.cinfo.err = jpeg_std_error(&decoder.jerr);
+		jpeg_create_decompress(&decoder.cinfo);
+		ret = add_sink(sinks, &nsinks, sink_create("decode", SINK_LATEST, 1, decode_sink_frame, &decoder));
+	}
 
-					y_start = *yuv++;
+	if (ret == 0 && ring)
+		ret = add_sink(sinks, &nsinks, sink_create("ring", SINK_ALL, 2, ring_sink_frame, ring));
 
-					y = (y_start - 16)*298;
-					u = u_start - 128;
-					v = v_start - 128;
+	if (ret == 0 && bus)
+		ret = add_sink(sinks, &nsinks, sink_create("bus", SINK_ALL, 2, bus_sink_frame, bus));
 
-					r_prod = 409*v + 128;
-					g_prod = 100*u + 208*v - 128;
-					b_prod = 516*u;
+	if (ret == 0 && httpd)
+		ret = add_sink(sinks, &nsinks, sink_create("http", SINK_LATEST, 1, http_sink_frame, httpd));
 
-					r =(y + r_prod)>>8;
-					g =(y - g_prod)>>8;
-					b =(y + b_prod)>>8;
+	if (ret == 0 && null_sink)
+		ret = add_sink(sinks, &nsinks, sink_null_create(null_touch));
 
-                		        *p++ = (SATURATE8(r) << 16) | (SATURATE8(g) << 8) | SATURATE8(b);
+	if (ret < 0) {
+		printf("Failed to start sinks\n");
+		close(dev);
+		return 1;
+	}
 
-				}
-				lcd_frame += vd.finfo.line_length / 4;
-			}
-			
+	/* All threads are running, the capture loop is next */
+	if (rt_profile) {
+		if (lock_memory && rt_lock_memory() == 0) {
+			if (!headless)
+				rt_prefault(vd.fbp, vd.finfo.smem_len, 1);
+			if (src.type == FRAME_SOURCE_V4L2)
+				for (n = 0; n < src.nbufs; n++)
+					rt_prefault(src.mem[n], src.bufs[n].length, 0);
 		}
 
-		if(pixelformat == V4L2_PIX_FMT_YUYV) { // Luma goes first !!!
-
-			unsigned int *lcd_frame = (unsigned int*) z_buffer;
-			unsigned char *capture_frame = (unsigned char*) mem[buf->index];
-			int i,j;
-        		unsigned  y_start, u_start = 0, v_start = 0;
-        		int r,g,b, r_prod, g_prod, b_prod;
-		        int y,u,v;
-			int height_min  = MIN(vd.vinfo.yres, height);
-
-			for(i = 0; i < height_min; i++) {
-				unsigned int *p = lcd_frame;
-				unsigned int *yuv = (unsigned int*) (capture_frame+(i*width*2));
-				int width_min = MIN(vd.vinfo.xres, width);
+		/* Deadline tasks can't create threads, so the probe goes first */
+		rt_start(sched_probe);
+		rt_thread("capture");
+	}
 
-				for(j = 0; j < width_min/2; j++) {
+	i = 0;
+	
+	while(nframes) {
 
-					unsigned int YUV = *yuv++;
+		if (verbose)
+			printf("Dequeuing frame = %d\n", i);
 
-					// Odd pixel: Parse Y-U
+		gettimeofday(&ts, NULL);
+		t0 = metrics_now();
+		tr = trace_begin("dequeue");
+		perf_begin(p_dequeue);
 
-					y_start = (YUV >> 0) & 0xff;
-					u_start = (YUV >> 8) & 0xff;
-	
-					y = (y_start - 16)*298;
-					u = u_start - 128;
-					//v = v_start - 128;
+		ret = frame_pool_dequeue(&pool, &ref);
+		if (ret < 0) {
+			failed = 1;
+			break;
+		}
 
-					//r_prod = 409*v + 128;
-					g_prod = 100*u + 208*v - 128;
-					b_prod = 516*u;
+		if (ret == 0) // end of replayed file
+			break;
 
-					r =(y + r_prod)>>8;
-					g =(y - g_prod)>>8;
-					b =(y + b_prod)>>8;
+		frame = ref->frame;
 
-              	 		       	*p++ = (SATURATE8(r) << 16) | (SATURATE8(g) << 8) | SATURATE8(b);
+		t1 = metrics_now();
+		perf_end(p_dequeue, 0);
+		metric_observe(m_dequeue, t1 - t0);
+		trace_end("dequeue", tr, frame.sequence);
 
+		/* Replayed timestamps are from the recording, not this clock */
+		if (latency_mode && src.type == FRAME_SOURCE_V4L2) {
+			ref->captured = latency_frame_time(frame.flags, &frame.timestamp);
+			if (ref->captured)
+				latency_record(LATENCY_CAPTURE_DEQUEUE, ref->dispatched - ref->captured);
+		}
 
-					// Even pixel: Parse Y-V
+		if (i == 0)
+			start = ts;
 
-					y_start = (YUV >> 16) & 0xff;
-					v_start = (YUV >> 24) & 0xff;
+		// HACK: if CSI returned data is zeroed, skip this fpame 
+		if(src.type == FRAME_SOURCE_V4L2 && *(unsigned int*)frame.data == 0x00000000) {
+			if (verbose)
+				printf("CSI returned zeros! Skipping!\n");
+			metric_add(m_zero, 1);
+			frame_ref_put(ref);
+			goto skip_one_frame;
+		}
 
-					y = (y_start - 16)*298;
-					//u = u_start - 128;
-					v = v_start - 128;
+		if(skip) {
+			metric_add(m_skipped, 1);
+			frame_ref_put(ref);
+			goto skip_one_frame;
+		}
 
-					r_prod = 409*v + 128;
-					g_prod = 100*u + 208*v - 128;
-					//b_prod = 516*u;
+		if (motion) {
+			unsigned long long t = metrics_now();
+
+			tr = trace_begin("motion");
+			perf_begin(p_motion);
+			ref->motion = motion_frame(motion, frame.data + view_offset);
+			perf_end(p_motion, view_width * view_height / (MOTION_STEP * MOTION_STEP));
+			trace_end("motion", tr, frame.sequence);
+			metric_observe(m_motion, metrics_now() - t);
+
+			if (ref->motion == MOTION_START) {
+				metric_add(m_motion_events, 1);
+				printf("Motion at frame %u\n", frame.sequence);
+				/* The ring holds what led up to it */
+				if (ring)
+					ring_trigger(ring);
+			} else if (ref->motion == MOTION_STOP) {
+				printf("Motion over at frame %u\n", frame.sequence);
+			}
+		}
 
-					r =(y + r_prod)>>8;
-					g =(y - g_prod)>>8;
-					b =(y + b_prod)>>8;
+		/* Between two frames, what is set now is in one of the next */
+		if (isp) {
+			unsigned long long t = metrics_now();
 
-               		       		*p++ = (SATURATE8(r) << 16) | (SATURATE8(g) << 8) | SATURATE8(b);
+			tr = trace_begin("isp");
+			perf_begin(p_isp);
+			isp_frame(isp, frame.data + view_offset, &ref->gains);
+			perf_end(p_isp, view_width * view_height / ISP_STEP);
+			trace_end("isp", tr, frame.sequence);
+			metric_observe(m_isp, metrics_now() - t);
+		}
 
-				}
+		tr = trace_begin("dispatch");
+		perf_begin(p_dispatch);
 
+		/* MJPEG gets its DHT spliced in once for all sinks */
+		if (pixelformat == V4L2_PIX_FMT_MJPEG) {
+			ref->niov = mjpeg_stream_iov(&mjpeg, frame.data, frame.bytesused, ref->iov);
 
-				lcd_frame += vd.finfo.line_length / 4;
+			/* Cached header can be relearned while sinks still use this frame */
+			if (ref->niov > 0 && ref->iov[0].iov_base == mjpeg.prefix) {
+				memcpy(ref->prefix, mjpeg.prefix, ref->iov[0].iov_len);
+				ref->iov[0].iov_base = ref->prefix;
 			}
-			
-			//memmove(vd.fbp, z_buffer, z_buffer_size); 
-			memcpy_neon(vd.fbp, z_buffer, z_buffer_size); 
 		}
 
-		if(pixelformat == V4L2_PIX_FMT_SBGGR8) { // 
+		sink_dispatch(sinks, nsinks, ref);
+		perf_end(p_dispatch, 0);
+		trace_end("dispatch", tr, frame.sequence);
+		metric_add(m_frames, 1);
 
-			unsigned int *lcd_frame = (unsigned int*) z_buffer;
-			unsigned char *capture_frame = (unsigned char*) mem[buf->index];
-			int i,j;
-        		unsigned  y_start, u_start = 0, v_start = 0;
+		if (rec_sink && sink_failed(rec_sink))
+			break;
 
-			int height_min  = MIN(vd.vinfo.yres, height);
+		if (do_capture)
+			nframes--;
 
-			for(i = 0; i < height_min; i+=2) {
-				unsigned int *p = lcd_frame;
-				int width_min = MIN(vd.vinfo.xres, width);
+		skip_one_frame:
 
-				for(j = 0; j < width_min; j+=2) {
+		t2 = metrics_now();
+		metric_observe(m_dispatch, t2 - t1);
 
-					unsigned int b = capture_frame[i * width + j];
-					unsigned int g = (capture_frame[i * width + j + 1] + 
-							  capture_frame[(i+1) * width + j]) / 2;
-					unsigned int r = capture_frame[(i+1) * width + j + 1];
-					unsigned int c = 0xff000000 | ( r << 16) | (g<<8) | b;
 
-               		       		*p = c;
-               		       		*(p+1) = c;
-               		       		*(p+width_min) = c;
-               		       		*(p+width_min + 1) = c;
 
-					p+=2;
-				}
+                if (skip)
+                        --skip;
 
+                if (delay > 0)
+                        usleep(delay * 1000);
 
-				lcd_frame += (vd.finfo.line_length / 4) * 2;
-			}
-			
-			//memmove(vd.fbp, z_buffer, z_buffer_size); 
-			memcpy_neon(vd.fbp, z_buffer, z_buffer_size); 
+		/* Buffers are requeued by the last sink done with them */
+		t3 = metrics_now();
+
+		/* Per frame output costs milliseconds on a serial console, opt-in only */
+		if (verbose) {
+			printf("Dequeued buffer: index = %u, i = %u, sequence: %u, bytesused: %u, size: %dx%d, ts: %ld.%06ld %ld.%06ld, dequeing time: %.3f, dispatch time: %.3f, total time: %.3f, fps: %0.1f\n\n", frame.index, i, frame.sequence, frame.bytesused, width, height, \
+				frame.timestamp.tv_sec, frame.timestamp.tv_usec, ts.tv_sec, ts.tv_usec, 
+				(t1 - t0) / 1000000.0,
+				(t2 - t1) / 1000000.0,
+				(t3 - t0) / 1000000.0,
+				1000000.0 / (t3 - t0 + 1)
+				);
+
+			fflush(stdout);
 		}
 
+		i++;
+	}
 
-		skip_one_frame:
+	gettimeofday(&end, NULL);
 
-		gettimeofday(&ts4, NULL);
+	if (rt_profile)
+		rt_stop();
 
+	/* Sinks finish what is queued and give all buffers back */
+	for (n = 0; n < nsinks; n++) {
+		sink_flush(sinks[n]);
+		sink_print_stats(sinks[n], stdout);
+		sink_close(sinks[n]);
+	}
 
+	if (!headless && display.render) {
+		if (dirty_noise >= 0) {
+			unsigned long long converted, skipped;
 
-                if (skip)
-                        --skip;
+			render_dirty_stats(display.render, &converted, &skipped);
+			printf("Display tiles: %llu converted, %llu unchanged (%.1f%%)\n", converted, skipped,
+				converted + skipped ? 100.0 * skipped / (converted + skipped) : 0.0);
+		}
+		render_destroy(display.render);
+	}
+	if (!headless && display.tune)
+		tune_destroy(display.tune);
 
-                if (delay > 0)
-                        usleep(delay * 1000);
+	/* Clients still hold buffers */
+	if (httpd) {
+		httpd_print_stats(httpd, stdout);
+		httpd_close(httpd);
+	}
 
-		/* Requeue the buffer. */
-		gettimeofday(&ts5, NULL);
+	frame_pool_drain(&pool);
+	frame_pool_destroy(&pool);
 
-		//memset(mem[buf->index], 0, buf->bytesused);
-		*(unsigned int*)mem[buf->index] = 0;
+	metrics_stop();
 
-		ret = ioctl(dev, VIDIOC_QBUF, buf);
-		if (ret < 0) {
-			printf("Unable to requeue buffer (%d).\n", errno);
-			close(dev);
-			return 1;
-		}
+	if (trace_file)
+		trace_stop();
 
-		gettimeofday(&ts6, NULL);
+	if (perf_mode) {
+		perf_stop();
+		perf_print(stdout);
+	}
 
+	if (rt_profile)
+		rt_print(stdout);
 
-		printf("Dequeued buffer: index = %u, i = %u, buf.memory: %p, bytesused: %u, length: %u, size: %dx%d, ts: %ld.%06ld %ld.%06ld, dequeing time: %.3f, drawing time: %.3f, requeing time: %.3f, total time: %.3f, fps: %0.1f\n\n", buf->index, i, buf->memory, buf->bytesused, buf->length, width, height, \
-			buf->timestamp.tv_sec, buf->timestamp.tv_usec, ts.tv_sec, ts.tv_usec, 
-			((ts2.tv_sec * 1000000LL + ts2.tv_usec)-(ts.tv_sec * 1000000LL + ts.tv_usec))/1000000.0,
-			((ts4.tv_sec * 1000000LL + ts4.tv_usec)-(ts2.tv_sec * 1000000LL + ts2.tv_usec))/1000000.0,
-			((ts6.tv_sec * 1000000LL + ts6.tv_usec)-(ts5.tv_sec * 1000000LL + ts5.tv_usec))/1000000.0,
-			((ts6.tv_sec * 1000000LL + ts6.tv_usec)-(ts.tv_sec * 1000000LL + ts.tv_usec))/1000000.0,
-			1.0 / (((ts6.tv_sec * 1000000LL + ts6.tv_usec)-(ts.tv_sec * 1000000LL + ts.tv_usec))/1000000.0)
-			);
+	if (latency_mode)
+		latency_print(stdout);
 
-		fflush(stdout);
+	if (motion) {
+		motion_print_stats(motion, stdout);
+		motion_destroy(motion);
+	}
 
-/*
-		if(i % 10 == 0) {
-			int rc;
+	if (isp) {
+		isp_print_stats(isp, stdout);
+		isp_destroy(isp);
+	}
 
-			rc = uvc_set_control(dev, V4L2_CID_DO_WHITE_BALANCE, 4);
-			if(rc < 0) {
-				printf("White balance set error: %s\n", strerror(errno));
-			} else {
-				printf("White balance set to: %d\n", 4);
-			}
+	if (do_stream && pixelformat == V4L2_PIX_FMT_MJPEG)
+		jpeg_destroy_decompress(&decoder.cinfo);
 
-			rc = uvc_set_control(dev, V4L2_CID_DO_WHITE_BALANCE, 0);
-			if(rc < 0) {
-				printf("White balance set error: %s\n", strerror(errno));
-			} else {
-				printf("White balance set to: %d\n", 0);
-			}
-		}
-*/
+	if (compressor) {
+		compressor_flush(compressor);
+		compressor_print_stats(compressor, stdout);
+		if (compressor_close(compressor) < 0)
+			printf("Compressed recording to %s failed\n", record_file);
+	}
 
-		i++;
+	if (recorder) {
+		record_print_stats(recorder, stdout);
+		if (avi)
+			ret = avi_close(avi);
+		else if (capfile)
+			ret = capfile_close(capfile);
+		else
+			ret = record_close(recorder);
+
+		if (ret < 0)
+			printf("Failed to finish recording to %s\n", record_file);
 	}
 
-	gettimeofday(&end, NULL);
+	if (bus)
+		framebus_close(bus);
+
+	if (ring) {
+		ring_print_stats(ring, stdout);
+		ring_close(ring);
+		ring = NULL;
+	}
 
-	jpeg_destroy_decompress(&cinfo);
+	if(pixelformat == V4L2_PIX_FMT_MJPEG)
+		printf("MJPEG stream: header %d bytes, %s DHT, %s, %u frames fixed, %u relearns, %u errors\n",
+			mjpeg.header_len, mjpeg.has_dht ? "own" : "inserted",
+			mjpeg.state == MJPEG_STREAM_PREFIX ? "cached prefix" : "per-frame header",
+			mjpeg.frames_fixed, mjpeg.relearns, mjpeg.errors);
 
 	/* Stop streaming. */
-	video_enable(dev, 0, buf_type);
+	if (src.type == FRAME_SOURCE_V4L2)
+		video_enable(dev, 0, buf_type);
 
 	end.tv_sec -= start.tv_sec;
 	end.tv_usec -= start.tv_usec;
@@ -1219,7 +2104,20 @@ int main(int argc, char *argv[])
 	printf("Captured %u frames in %lu.%06lu seconds (%f fps).\n",
 		i-1, end.tv_sec, end.tv_usec, fps);
 
-	close(dev);
-	return 0;
+	if (src.type == FRAME_SOURCE_FILE) {
+		double secs = end.tv_sec + end.tv_usec / 1000000.0;
+
+		printf("Replay throughput: %llu frames, %.1f MB in %.3f s, %.1f fps, %.1f MB/s, %.1f MPix/s\n",
+			src.frames, src.bytes / 1048576.0, secs,
+			secs > 0 ? src.frames / secs : 0.0,
+			secs > 0 ? src.bytes / 1048576.0 / secs : 0.0,
+			secs > 0 ? (double) src.frames * width * height / 1000000.0 / secs : 0.0);
+
+		source_close(&src);
+	} else {
+		close(dev);
+	}
+
+	return failed ? 1 : 0;
 }
 